@@ -20,6 +20,10 @@
 #endif
 
 #include <string>
+#include <string_view>
+#include <tuple>
+
+#include "NSudoCore.h"
 
 DWORD M2RegSetStringValue(
     _In_ HKEY hKey,
@@ -53,54 +57,171 @@ DWORD M2RegCreateKey(
         nullptr);
 }
 
+#include <ktmw32.h>
+#pragma comment(lib, "KtmW32.lib")
+
+DWORD M2RegCreateKeyTransacted(
+    _In_ HKEY hKey,
+    _In_ LPCWSTR lpSubKey,
+    _In_ REGSAM samDesired,
+    _In_ HANDLE hTransaction,
+    _Out_ PHKEY phkResult,
+    _Inout_ bool& Changed)
+{
+    DWORD Disposition = 0;
+
+    DWORD dwError = RegCreateKeyTransactedW(
+        hKey,
+        lpSubKey,
+        0,
+        nullptr,
+        REG_OPTION_NON_VOLATILE,
+        samDesired,
+        nullptr,
+        phkResult,
+        &Disposition,
+        hTransaction,
+        nullptr);
+    if (ERROR_SUCCESS == dwError && REG_CREATED_NEW_KEY == Disposition)
+    {
+        Changed = true;
+    }
+
+    return dwError;
+}
+
+DWORD M2RegQueryStringValue(
+    _In_ HKEY hKey,
+    _In_opt_ LPCWSTR lpValueName,
+    _Out_ std::wstring& ValueData)
+{
+    ValueData.clear();
+
+    DWORD cbData = 0;
+    DWORD dwError = RegGetValueW(
+        hKey,
+        nullptr,
+        lpValueName,
+        RRF_RT_REG_SZ,
+        nullptr,
+        nullptr,
+        &cbData);
+    if (ERROR_SUCCESS != dwError)
+        return dwError;
+
+    ValueData.resize(cbData / sizeof(wchar_t));
+
+    dwError = RegGetValueW(
+        hKey,
+        nullptr,
+        lpValueName,
+        RRF_RT_REG_SZ,
+        nullptr,
+        &ValueData[0],
+        &cbData);
+    if (ERROR_SUCCESS != dwError)
+    {
+        ValueData.clear();
+        return dwError;
+    }
+
+    ValueData.resize(wcslen(ValueData.c_str()));
+
+    return dwError;
+}
+
+// 只在注册表中的值与lpValueData不同时写入，写入时Changed被设为true
+DWORD M2RegUpdateStringValue(
+    _In_ HKEY hKey,
+    _In_opt_ LPCWSTR lpValueName,
+    _In_ LPCWSTR lpValueData,
+    _Inout_ bool& Changed)
+{
+    std::wstring CurrentValueData;
+    if (ERROR_SUCCESS == M2RegQueryStringValue(
+        hKey, lpValueName, CurrentValueData))
+    {
+        if (0 == wcscmp(CurrentValueData.c_str(), lpValueData))
+        {
+            return ERROR_SUCCESS;
+        }
+    }
+
+    Changed = true;
+
+    return M2RegSetStringValue(hKey, lpValueName, lpValueData);
+}
+
+// 在事务中创建或者更新CommandStore中的项，只写入与现有值不同的部分
 DWORD CreateCommandStoreItem(
     _In_ HKEY CommandStoreRoot,
     _In_ LPCWSTR ItemName,
     _In_ LPCWSTR ItemDescription,
     _In_ LPCWSTR ItemCommand,
-    _In_ bool HasLUAShield)
+    _In_ bool HasLUAShield,
+    _In_ HANDLE hTransaction,
+    _Inout_ bool& Changed)
 {
     DWORD dwError = ERROR_SUCCESS;
     M2::CHKey hCommandStoreItem;
     M2::CHKey hCommandStoreItemCommand;
 
-    dwError = M2RegCreateKey(
+    dwError = M2RegCreateKeyTransacted(
         CommandStoreRoot,
         ItemName,
         KEY_ALL_ACCESS | KEY_WOW64_64KEY,
-        &hCommandStoreItem);
+        hTransaction,
+        &hCommandStoreItem,
+        Changed);
     if (ERROR_SUCCESS != dwError)
         return dwError;
 
-    dwError = M2RegSetStringValue(
+    dwError = M2RegUpdateStringValue(
         hCommandStoreItem,
         L"",
-        ItemDescription);
+        ItemDescription,
+        Changed);
     if (ERROR_SUCCESS != dwError)
         return dwError;
 
     if (HasLUAShield)
     {
-        dwError = M2RegSetStringValue(
+        dwError = M2RegUpdateStringValue(
             hCommandStoreItem,
             L"HasLUAShield",
-            L"");
+            L"",
+            Changed);
         if (ERROR_SUCCESS != dwError)
             return dwError;
     }
+    else
+    {
+        dwError = RegDeleteValueW(hCommandStoreItem, L"HasLUAShield");
+        if (ERROR_SUCCESS == dwError)
+        {
+            Changed = true;
+        }
+        else if (ERROR_FILE_NOT_FOUND != dwError)
+        {
+            return dwError;
+        }
+    }
 
-    dwError = M2RegCreateKey(
+    dwError = M2RegCreateKeyTransacted(
         hCommandStoreItem,
         L"command",
         KEY_ALL_ACCESS | KEY_WOW64_64KEY,
-        &hCommandStoreItemCommand);
+        hTransaction,
+        &hCommandStoreItemCommand,
+        Changed);
     if (ERROR_SUCCESS != dwError)
         return dwError;
 
-    dwError = M2RegSetStringValue(
+    dwError = M2RegUpdateStringValue(
         hCommandStoreItemCommand,
         L"",
-        ItemCommand);
+        ItemCommand,
+        Changed);
     if (ERROR_SUCCESS != dwError)
         return dwError;
 
@@ -108,828 +229,785 @@ DWORD CreateCommandStoreItem(
     return dwError;
 }
 
-std::wstring NSudoExpandEnvironmentStrings(
-    const std::wstring& String)
+// 在事务中删除注册表项及其所有子项
+DWORD M2RegDeleteTreeTransacted(
+    _In_ HKEY hKey,
+    _In_ LPCWSTR lpSubKey,
+    _In_ HANDLE hTransaction)
 {
-    std::wstring ExpandedString;
+    M2::CHKey hSubKey;
 
-    ExpandedString.resize(static_cast<size_t>(ExpandEnvironmentStringsW(
-        String.c_str(),
-        nullptr,
-        0) - 1));
+    DWORD dwError = RegOpenKeyTransactedW(
+        hKey,
+        lpSubKey,
+        0,
+        KEY_ALL_ACCESS | KEY_WOW64_64KEY,
+        &hSubKey,
+        hTransaction,
+        nullptr);
+    if (ERROR_SUCCESS != dwError)
+        return dwError;
 
-    ExpandEnvironmentStringsW(
-        String.c_str(),
-        &ExpandedString[0],
-        static_cast<DWORD>(ExpandedString.size() + 1));
+    // 删除子项后其他子项的索引会变化，所以总是删除第一个子项
+    for (;;)
+    {
+        // 注册表项名最长为255个字符
+        wchar_t Name[256];
+        DWORD cchName = _countof(Name);
 
-    return ExpandedString;
-}
+        dwError = RegEnumKeyExW(
+            hSubKey,
+            0,
+            Name,
+            &cchName,
+            nullptr,
+            nullptr,
+            nullptr,
+            nullptr);
+        if (ERROR_NO_MORE_ITEMS == dwError)
+            break;
+        if (ERROR_SUCCESS != dwError)
+            return dwError;
 
-/*
-   访问令牌特权定义
-   The definitions of the Token Privileges
-   */
-typedef enum _TOKEN_PRIVILEGES_LIST
-{
-    SeMinWellKnownPrivilege = 2,
-    SeCreateTokenPrivilege = 2,
-    SeAssignPrimaryTokenPrivilege,
-    SeLockMemoryPrivilege,
-    SeIncreaseQuotaPrivilege,
-    SeMachineAccountPrivilege,
-    SeTcbPrivilege,
-    SeSecurityPrivilege,
-    SeTakeOwnershipPrivilege,
-    SeLoadDriverPrivilege,
-    SeSystemProfilePrivilege,
-    SeSystemtimePrivilege,
-    SeProfileSingleProcessPrivilege,
-    SeIncreaseBasePriorityPrivilege,
-    SeCreatePagefilePrivilege,
-    SeCreatePermanentPrivilege,
-    SeBackupPrivilege,
-    SeRestorePrivilege,
-    SeShutdownPrivilege,
-    SeDebugPrivilege,
-    SeAuditPrivilege,
-    SeSystemEnvironmentPrivilege,
-    SeChangeNotifyPrivilege,
-    SeRemoteShutdownPrivilege,
-    SeUndockPrivilege,
-    SeSyncAgentPrivilege,
-    SeEnableDelegationPrivilege,
-    SeManageVolumePrivilege,
-    SeImpersonatePrivilege,
-    SeCreateGlobalPrivilege,
-    SeTrustedCredManAccessPrivilege,
-    SeRelabelPrivilege,
-    SeIncreaseWorkingSetPrivilege,
-    SeTimeZonePrivilege,
-    SeCreateSymbolicLinkPrivilege,
-    SeMaxWellKnownPrivilege = SeCreateSymbolicLinkPrivilege
-} TOKEN_PRIVILEGES_LIST, *PTOKEN_PRIVILEGES_LIST;
+        dwError = M2RegDeleteTreeTransacted(hSubKey, Name, hTransaction);
+        if (ERROR_SUCCESS != dwError)
+            return dwError;
+    }
 
-/*
-访问令牌完整性级别定义
-The definitions of the Token Integrity Levels
-*/
-typedef enum _TOKEN_INTEGRITY_LEVELS_LIST
-{
-    // S-1-16-0
-    UntrustedLevel = SECURITY_MANDATORY_UNTRUSTED_RID,
+    hSubKey.Close();
+
+    return RegDeleteKeyTransactedW(
+        hKey,
+        lpSubKey,
+        KEY_WOW64_64KEY,
+        0,
+        hTransaction,
+        nullptr);
+}
 
-    // S-1-16-4096
-    LowLevel = SECURITY_MANDATORY_LOW_RID,
+#pragma comment(lib, "Version.lib")
 
-    // S-1-16-8192
-    MediumLevel = SECURITY_MANDATORY_MEDIUM_RID,
+// 获取文件的VS_FIXEDFILEINFO中的文件版本，文件没有版本信息时返回false
+bool NSudoGetFileVersion(
+    _In_ LPCWSTR lpFileName,
+    _Out_ ULONGLONG& Version)
+{
+    Version = 0;
 
-    // S-1-16-8448
-    MediumPlusLevel = SECURITY_MANDATORY_MEDIUM_PLUS_RID,
+    DWORD dwHandle = 0;
+    DWORD dwSize = GetFileVersionInfoSizeW(lpFileName, &dwHandle);
+    if (0 == dwSize)
+    {
+        return false;
+    }
 
-    // S-1-16-12288
-    HighLevel = SECURITY_MANDATORY_HIGH_RID,
+    std::vector<BYTE> VersionInfo(dwSize);
+    if (!GetFileVersionInfoW(lpFileName, 0, dwSize, VersionInfo.data()))
+    {
+        return false;
+    }
 
-    // S-1-16-16384
-    SystemLevel = SECURITY_MANDATORY_SYSTEM_RID,
+    VS_FIXEDFILEINFO* FixedFileInfo = nullptr;
+    UINT uLength = 0;
+    if (!VerQueryValueW(
+        VersionInfo.data(),
+        L"\\",
+        reinterpret_cast<LPVOID*>(&FixedFileInfo),
+        &uLength) || uLength < sizeof(VS_FIXEDFILEINFO))
+    {
+        return false;
+    }
 
-    // S-1-16-20480
-    ProtectedLevel = SECURITY_MANDATORY_PROTECTED_PROCESS_RID
-} TOKEN_INTEGRITY_LEVELS_LIST, *PTOKEN_INTEGRITY_LEVELS_LIST;
+    Version =
+        (static_cast<ULONGLONG>(FixedFileInfo->dwFileVersionMS) << 32) |
+        FixedFileInfo->dwFileVersionLS;
 
-// SECURITY_NT_AUTHORITY
-SID_IDENTIFIER_AUTHORITY SIA_NT = SECURITY_NT_AUTHORITY;
+    return true;
+}
 
-// SECURITY_MANDATORY_LABEL_AUTHORITY
-SID_IDENTIFIER_AUTHORITY SIA_IL = SECURITY_MANDATORY_LABEL_AUTHORITY;
+// 判断两个文件的内容是否相同。先比较文件大小和文件版本，只有两者都相同时才比较
+// 内容
+bool NSudoIsSameFileContent(
+    _In_ LPCWSTR lpFileName1,
+    _In_ LPCWSTR lpFileName2)
+{
+    M2::CHandle hFile1;
+    M2::CHandle hFile2;
 
-/*
-   NSudoStartService函数通过服务名启动服务并返回服务状态。
-   The NSudoStartService function starts a service and return service status
-   via service name.
-
-   如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-   If the function fails, the return value is NULL. To get extended error
-   information, call GetLastError.
-   */
-BOOL WINAPI NSudoStartService(
-    _In_ LPCWSTR lpServiceName,
-    _Out_ LPSERVICE_STATUS_PROCESS lpServiceStatus)
-{
-    M2::CServiceHandle hSCM;
-    M2::CServiceHandle hService;
-
-    DWORD nBytesNeeded = 0;
-    DWORD nOldCheckPoint = 0;
-    ULONGLONG nCurrentTick = 0;
-    ULONGLONG nLastTick = 0;
-    bool bStartServiceWCalled = false;
-    bool bSleepCalled = false;
-    bool bSucceed = false;
-
-    hSCM = OpenSCManagerW(
+    hFile1 = CreateFileW(
+        lpFileName1,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
         nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+    hFile2 = CreateFileW(
+        lpFileName2,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
         nullptr,
-        SC_MANAGER_CONNECT);
-    if (!hSCM) goto FuncEnd;
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+    if (hFile1.IsInvalid() || hFile2.IsInvalid())
+    {
+        return false;
+    }
 
-    hService = OpenServiceW(
-        hSCM,
-        lpServiceName,
-        SERVICE_QUERY_STATUS | SERVICE_START);
-    if (!hService) goto FuncEnd;
+    LARGE_INTEGER FileSize1;
+    LARGE_INTEGER FileSize2;
+    if (!GetFileSizeEx(hFile1, &FileSize1) ||
+        !GetFileSizeEx(hFile2, &FileSize2) ||
+        FileSize1.QuadPart != FileSize2.QuadPart)
+    {
+        return false;
+    }
+
+    // 版本不同或者只有一个文件有版本信息时不需要读取内容
+    ULONGLONG Version1 = 0;
+    ULONGLONG Version2 = 0;
+    if (NSudoGetFileVersion(lpFileName1, Version1) !=
+        NSudoGetFileVersion(lpFileName2, Version2) ||
+        Version1 != Version2)
+    {
+        return false;
+    }
+
+    std::vector<BYTE> Buffer1(65536);
+    std::vector<BYTE> Buffer2(65536);
 
-    while (QueryServiceStatusEx(
-        hService,
-        SC_STATUS_PROCESS_INFO,
-        (LPBYTE)lpServiceStatus,
-        sizeof(SERVICE_STATUS_PROCESS),
-        &nBytesNeeded))
+    for (;;)
     {
-        if (SERVICE_STOPPED == lpServiceStatus->dwCurrentState)
+        DWORD NumberOfBytesRead1 = 0;
+        DWORD NumberOfBytesRead2 = 0;
+        if (!ReadFile(
+            hFile1,
+            Buffer1.data(),
+            static_cast<DWORD>(Buffer1.size()),
+            &NumberOfBytesRead1,
+            nullptr) ||
+            !ReadFile(
+                hFile2,
+                Buffer2.data(),
+                static_cast<DWORD>(Buffer2.size()),
+                &NumberOfBytesRead2,
+                nullptr))
         {
-            if (bStartServiceWCalled)
-            {
-                break;
-            }
+            return false;
+        }
 
-            bStartServiceWCalled = true;
-            if (!StartServiceW(hService, 0, nullptr))
-            {
-                break;
-            }
+        if (NumberOfBytesRead1 != NumberOfBytesRead2 ||
+            0 != memcmp(Buffer1.data(), Buffer2.data(), NumberOfBytesRead1))
+        {
+            return false;
         }
-        else if (
-            SERVICE_STOP_PENDING == lpServiceStatus->dwCurrentState ||
-            SERVICE_START_PENDING == lpServiceStatus->dwCurrentState)
+
+        if (0 == NumberOfBytesRead1)
         {
-            nCurrentTick = GetTickCount64();
+            return true;
+        }
+    }
+}
 
-            if (!bSleepCalled)
-            {
-                nLastTick = nCurrentTick;
-                nOldCheckPoint = lpServiceStatus->dwCheckPoint;
+// 读取文件的全部内容并从UTF-8转换为UTF-16，会跳过UTF-8 BOM
+// 管道的写入端关闭时视为读取完毕。
+bool NSudoReadTextFile(
+    _In_ HANDLE hFile,
+    _Out_ std::wstring& Content)
+{
+    std::string RawContent;
+    char Buffer[4096];
 
-                bSleepCalled = true;
+    Content.clear();
 
-                // 等待250ms（借鉴.Net服务操作类的实现）
-                SleepEx(250, FALSE);
-            }
-            else
+    for (;;)
+    {
+        DWORD NumberOfBytesRead = 0;
+        if (!ReadFile(
+            hFile,
+            Buffer,
+            sizeof(Buffer),
+            &NumberOfBytesRead,
+            nullptr))
+        {
+            if (ERROR_BROKEN_PIPE != GetLastError())
             {
-                // 如果校验点增加则继续循环，否则检测是否超时
-                if (lpServiceStatus->dwCheckPoint > nOldCheckPoint)
-                {
-                    bSleepCalled = false;
-                }
-                else
-                {
-                    ULONGLONG nDiff = nCurrentTick - nLastTick;
-                    if (nDiff > lpServiceStatus->dwWaitHint)
-                    {
-                        SetLastError(ERROR_TIMEOUT);
-                        break;
-                    }
-                    else
-                    {
-                        // 未超时则继续循环
-                        bSleepCalled = false;
-                    }
-                }
+                return false;
             }
+
+            break;
         }
-        else
+
+        if (0 == NumberOfBytesRead)
         {
-            bSucceed = true;
             break;
         }
+
+        RawContent.append(Buffer, NumberOfBytesRead);
     }
 
-    // 如果服务启动失败则清空状态信息
-    if (!bSucceed)
-        memset(lpServiceStatus, 0, sizeof(SERVICE_STATUS_PROCESS));
+    if (0 == RawContent.compare(0, 3, "\xEF\xBB\xBF"))
+    {
+        RawContent.erase(0, 3);
+    }
 
-FuncEnd:
+    Content = M2MakeUTF16String(RawContent);
 
-    return bSucceed;
+    return true;
 }
 
-/*
-NSudoGetCurrentProcessSessionID获取当前进程的会话ID。
-The NSudoGetCurrentProcessSessionID function obtains the Session ID of the
-current process.
-
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoGetCurrentProcessSessionID(
-    _Out_ PDWORD SessionID)
+bool NSudoReadTextFile(
+    _In_ LPCWSTR lpFileName,
+    _Out_ std::wstring& Content)
 {
-    BOOL result = FALSE;
-    M2::CHandle hToken;
-    DWORD ReturnLength = 0;
-
-    result = OpenProcessToken(
-        GetCurrentProcess(),
-        MAXIMUM_ALLOWED,
-        &hToken);
-    if (result)
+    M2::CHandle hFile = CreateFileW(
+        lpFileName,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (hFile.IsInvalid())
     {
-        result = GetTokenInformation(
-            hToken,
-            TokenSessionId,
-            SessionID,
-            sizeof(DWORD),
-            &ReturnLength);
+        return false;
     }
 
-    return result;
+    return NSudoReadTextFile(hFile, Content);
 }
 
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
+
+#include "NSudoResources.g.h"
+
 /*
-NSudoSetTokenPrivilege函数启用或禁用指定的访问令牌的指定特权。启用或禁用一
-个访问令牌的特权需要TOKEN_ADJUST_PRIVILEGES访问权限。
-The NSudoSetTokenPrivilege function enables or disables the specified
-privilege in the specified access token. Enabling or disabling privileges
-in an access token requires TOKEN_ADJUST_PRIVILEGES access.
-
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
+CNSudoJsonWriter类生成以两个空格缩进的JSON文本。内置的翻译和右键菜单配置已在生成
+时编译为表，运行时只需要写入结构固定的NSudo.json快捷命令列表、-StatsFile和批处理
+的汇总，所以不需要链接通用的JSON库。调用者负责按正确的顺序调用成员函数。
+The CNSudoJsonWriter class generates the JSON text indented with two spaces.
+The embedded translations and context menu configuration are compiled into
+tables at build time, and only the shortcut list of NSudo.json, -StatsFile and
+the summary of the batch mode which have fixed schemas are written at runtime,
+so the general JSON library is not linked. The caller is responsible for
+calling the member functions in the correct order.
 */
-BOOL WINAPI NSudoSetTokenPrivilege(
-    _In_ HANDLE hExistingToken,
-    _In_ TOKEN_PRIVILEGES_LIST Privilege,
-    _In_ bool bEnable)
+class CNSudoJsonWriter
 {
-    TOKEN_PRIVILEGES TP;
+private:
+    typedef struct _CONTAINER
+    {
+        bool IsArray;
+        bool HasMember;
+    } CONTAINER, *PCONTAINER;
 
-    TP.PrivilegeCount = 1;
-    TP.Privileges[0].Luid.LowPart = Privilege;
-    TP.Privileges[0].Attributes = (DWORD)(bEnable ? SE_PRIVILEGE_ENABLED : 0);
+    std::wstring m_Buffer;
+    std::vector<CONTAINER> m_Containers;
+    size_t m_BaseDepth;
 
-    // 设置进程特权
-    AdjustTokenPrivileges(hExistingToken, FALSE, &TP, 0, nullptr, nullptr);
-    return (GetLastError() == ERROR_SUCCESS);
-}
+    // 开始容器中的一个成员：写入分隔符、换行和缩进
+    void BeginMember()
+    {
+        CONTAINER& Container = this->m_Containers.back();
+        if (Container.HasMember)
+        {
+            this->m_Buffer.push_back(L',');
+        }
+        Container.HasMember = true;
 
-/*
-NSudoSetTokenAllPrivileges函数启用或禁用指定的访问令牌的所有特权。启用或禁
-用一个访问令牌的特权需要TOKEN_ADJUST_PRIVILEGES访问权限。
-The NSudoSetTokenAllPrivileges function enables or disables all privileges
-in the specified access token. Enabling or disabling privileges in an
-access token requires TOKEN_ADJUST_PRIVILEGES access.
-
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoSetTokenAllPrivileges(
-    _In_ HANDLE hExistingToken,
-    _In_ bool bEnable)
-{
-    BOOL result = FALSE;
-    M2::CMemory<PTOKEN_PRIVILEGES> pTPs;
-    DWORD Length = 0;
-
-    // 获取特权信息大小
-    GetTokenInformation(
-        hExistingToken, TokenPrivileges, nullptr, 0, &Length);
-    result = (GetLastError() == ERROR_INSUFFICIENT_BUFFER);
-    if (result)
-    {
-        // 分配内存
-        if (pTPs.Alloc(Length))
-        {
-            // 获取特权信息
-            result = GetTokenInformation(
-                hExistingToken, TokenPrivileges, pTPs, Length, &Length);
-            if (result)
-            {
-                // 设置特权信息
-                for (DWORD i = 0; i < pTPs->PrivilegeCount; ++i)
-                    pTPs->Privileges[i].Attributes =
-                    (DWORD)(bEnable ? SE_PRIVILEGE_ENABLED : 0);
+        this->m_Buffer.push_back(L'\n');
+        this->m_Buffer.append(
+            2 * (this->m_BaseDepth + this->m_Containers.size()), L' ');
+    }
 
-                // 设置进程特权
-                AdjustTokenPrivileges(
-                    hExistingToken, FALSE, pTPs, 0, nullptr, nullptr);
-                result = (GetLastError() == ERROR_SUCCESS);
-            }
+    // 数组中的值是数组的成员，对象中的值紧跟在成员名之后
+    void BeginValue()
+    {
+        if (!this->m_Containers.empty() && this->m_Containers.back().IsArray)
+        {
+            this->BeginMember();
         }
-        else SetLastError(ERROR_NOT_ENOUGH_MEMORY);
     }
 
-    return result;
-}
+    void BeginContainer(
+        _In_ bool IsArray)
+    {
+        this->BeginValue();
+        this->m_Buffer.push_back(IsArray ? L'[' : L'{');
+        this->m_Containers.push_back(CONTAINER{ IsArray, false });
+    }
 
-/*
-NSudoSetTokenIntegrityLevel函数为指定的访问令牌设置完整性标签。
-The NSudoSetTokenIntegrityLevel function sets the integrity level for the
-specified access token.
+    void EndContainer()
+    {
+        bool IsArray = this->m_Containers.back().IsArray;
+        bool HasMember = this->m_Containers.back().HasMember;
+        this->m_Containers.pop_back();
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoSetTokenIntegrityLevel(
-    _In_ HANDLE TokenHandle,
-    _In_ TOKEN_INTEGRITY_LEVELS_LIST IL)
-{
-    BOOL result = FALSE;
-    TOKEN_MANDATORY_LABEL TML;
-    M2::CSID Sid;
+        // 空的容器写为 "{}" 或者 "[]"
+        if (HasMember)
+        {
+            this->m_Buffer.push_back(L'\n');
+            this->m_Buffer.append(
+                2 * (this->m_BaseDepth + this->m_Containers.size()), L' ');
+        }
+        this->m_Buffer.push_back(IsArray ? L']' : L'}');
+    }
 
-    // 初始化SID
-    result = AllocateAndInitializeSid(
-        &SIA_IL, 1, IL, 0, 0, 0, 0, 0, 0, 0, &Sid);
-    if (result)
+    void AppendString(
+        _In_ std::wstring_view String)
     {
-        // 初始化TOKEN_MANDATORY_LABEL
-        TML.Label.Attributes = SE_GROUP_INTEGRITY;
-        TML.Label.Sid = Sid;
+        this->m_Buffer.push_back(L'"');
 
-        // 设置令牌对象
-        result = SetTokenInformation(
-            TokenHandle, TokenIntegrityLevel, &TML, sizeof(TML));
-    }
+        for (wchar_t Character : String)
+        {
+            switch (Character)
+            {
+            case L'"':
+                this->m_Buffer.append(L"\\\"");
+                break;
+            case L'\\':
+                this->m_Buffer.append(L"\\\\");
+                break;
+            case L'\b':
+                this->m_Buffer.append(L"\\b");
+                break;
+            case L'\f':
+                this->m_Buffer.append(L"\\f");
+                break;
+            case L'\n':
+                this->m_Buffer.append(L"\\n");
+                break;
+            case L'\r':
+                this->m_Buffer.append(L"\\r");
+                break;
+            case L'\t':
+                this->m_Buffer.append(L"\\t");
+                break;
+            default:
+                if (Character < 0x20)
+                {
+                    wchar_t Escape[7];
+                    swprintf_s(
+                        Escape,
+                        L"\\u%04x",
+                        static_cast<unsigned int>(Character));
+                    this->m_Buffer.append(Escape);
+                }
+                else
+                {
+                    this->m_Buffer.push_back(Character);
+                }
+                break;
+            }
+        }
 
-    return result;
-}
+        this->m_Buffer.push_back(L'"');
+    }
 
-/*
-NSudoCreateLUAToken函数从一个现有的访问令牌创建一个新的LUA访问令牌。
-The NSudoCreateLUAToken function creates a new LUA access token from an
-existing access token.
+public:
+    /*
+    BaseDepth是生成的文本所在的缩进层级，用于把生成的值插入到其他JSON文本中。
+    BaseDepth is the indentation level of the generated text, which is used to
+    insert the generated value into another JSON text.
+    */
+    CNSudoJsonWriter(
+        _In_ size_t BaseDepth = 0) :
+        m_BaseDepth(BaseDepth)
+    {
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoCreateLUAToken(
-    _Out_ PHANDLE TokenHandle,
-    _In_ HANDLE ExistingTokenHandle)
-{
-    BOOL result = FALSE;
-    DWORD Length = 0;
-    BOOL EnableTokenVirtualization = TRUE;
-    TOKEN_OWNER Owner = { 0 };
-    TOKEN_DEFAULT_DACL NewTokenDacl = { 0 };
-    M2::CHandle hToken;
-    M2::CMemory<PTOKEN_USER> pTokenUser;
-    M2::CMemory<PTOKEN_DEFAULT_DACL> pTokenDacl;
-    M2::CSID pAdminSid;
-    M2::CMemory<PACL> NewDefaultDacl;
-    PACCESS_ALLOWED_ACE pTempAce = nullptr;
-
-    //创建受限令牌
-    result = CreateRestrictedToken(
-        ExistingTokenHandle,
-        LUA_TOKEN,
-        0, nullptr,
-        0, nullptr,
-        0, nullptr,
-        &hToken);
-    if (!result) goto FuncEnd;
-
-    // 设置令牌完整性
-    result = NSudoSetTokenIntegrityLevel(
-        hToken, TOKEN_INTEGRITY_LEVELS_LIST::MediumLevel);
-    if (!result) goto FuncEnd;
-
-    // 获取令牌对应的用户账户SID信息大小
-    GetTokenInformation(
-        hToken, TokenUser, nullptr, 0, &Length);
-    result = (GetLastError() == ERROR_INSUFFICIENT_BUFFER);
-    if (!result) goto FuncEnd;
-
-    // 为令牌对应的用户账户SID信息分配内存
-    if (!pTokenUser.Alloc(Length))
-    {
-        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-        goto FuncEnd;
-    }
-
-    // 获取令牌对应的用户账户SID信息
-    result = GetTokenInformation(
-        hToken, TokenUser, pTokenUser, Length, &Length);
-    if (!result) goto FuncEnd;
-
-    // 设置令牌Owner为当前用户
-    Owner.Owner = pTokenUser->User.Sid;
-    result = SetTokenInformation(
-        hToken, TokenOwner, &Owner, sizeof(TOKEN_OWNER));
-    if (!result) goto FuncEnd;
-
-    // 获取令牌的DACL信息大小
-    GetTokenInformation(
-        hToken, TokenDefaultDacl, nullptr, 0, &Length);
-    result = (GetLastError() == ERROR_INSUFFICIENT_BUFFER);
-    if (!result) goto FuncEnd;
-
-    // 为令牌的DACL信息分配内存
-    if (!pTokenDacl.Alloc(Length))
-    {
-        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-        goto FuncEnd;
-    }
-
-    // 获取令牌的DACL信息
-    result = GetTokenInformation(
-        hToken, TokenDefaultDacl, pTokenDacl, Length, &Length);
-    if (!result) goto FuncEnd;
-
-    // 获取管理员组SID
-    result = AllocateAndInitializeSid(
-        &SIA_NT, 2,
-        SECURITY_BUILTIN_DOMAIN_RID, DOMAIN_ALIAS_RID_ADMINS,
-        0, 0, 0, 0, 0, 0, &pAdminSid);
-    if (!result) goto FuncEnd;
-
-    // 计算新ACL大小
-    Length = pTokenDacl->DefaultDacl->AclSize;
-    Length += GetLengthSid(pTokenUser->User.Sid);
-    Length += sizeof(ACCESS_ALLOWED_ACE);
-
-    // 分配ACL结构内存
-    if (!NewDefaultDacl.Alloc(Length))
-    {
-        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-        goto FuncEnd;
-    }
-    NewTokenDacl.DefaultDacl = NewDefaultDacl;
-
-    // 创建ACL
-    result = InitializeAcl(
-        NewTokenDacl.DefaultDacl,
-        Length,
-        pTokenDacl->DefaultDacl->AclRevision);
-    if (!result) goto FuncEnd;
-
-    // 添加ACE
-    result = AddAccessAllowedAce(
-        NewTokenDacl.DefaultDacl,
-        pTokenDacl->DefaultDacl->AclRevision,
-        GENERIC_ALL,
-        pTokenUser->User.Sid);
-    if (!result) goto FuncEnd;
-
-    // 复制ACE
-    for (ULONG i = 0;
-        GetAce(pTokenDacl->DefaultDacl, i, (PVOID*)&pTempAce);
-        ++i)
-    {
-        if (EqualSid(pAdminSid, &pTempAce->SidStart)) continue;
-
-        AddAce(
-            NewTokenDacl.DefaultDacl,
-            pTokenDacl->DefaultDacl->AclRevision,
-            0,
-            pTempAce,
-            pTempAce->Header.AceSize);
     }
 
-    // 设置令牌DACL
-    Length += sizeof(TOKEN_DEFAULT_DACL);
-    result = SetTokenInformation(
-        hToken, TokenDefaultDacl, &NewTokenDacl, Length);
-    if (!result) goto FuncEnd;
+    void BeginObject()
+    {
+        this->BeginContainer(false);
+    }
 
-    // 开启LUA虚拟化
-    result = SetTokenInformation(
-        hToken,
-        TokenVirtualizationEnabled,
-        &EnableTokenVirtualization,
-        sizeof(BOOL));
-    if (!result) goto FuncEnd;
+    void EndObject()
+    {
+        this->EndContainer();
+    }
 
-FuncEnd: // 扫尾
+    void BeginArray()
+    {
+        this->BeginContainer(true);
+    }
 
-    if (result)
+    void EndArray()
     {
-        *TokenHandle = hToken.Detach();
+        this->EndContainer();
     }
 
-    return result;
-}
+    void Key(
+        _In_ std::wstring_view Name)
+    {
+        this->BeginMember();
+        this->AppendString(Name);
+        this->m_Buffer.append(L": ");
+    }
 
-/*
-NSudoDuplicateProcessToken函数根据进程ID获取一个进程令牌的副本。
-The NSudoDuplicateProcessToken function obtains a copy of process token via
-Process ID.
+    void String(
+        _In_ std::wstring_view Value)
+    {
+        this->BeginValue();
+        this->AppendString(Value);
+    }
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoDuplicateProcessToken(
-    _In_ DWORD dwProcessID,
-    _In_ DWORD dwDesiredAccess,
-    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
-    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
-    _In_ TOKEN_TYPE TokenType,
-    _Outptr_ PHANDLE phToken)
-{
-    BOOL result = FALSE;
+    void Number(
+        _In_ ULONGLONG Value)
+    {
+        this->BeginValue();
+        this->m_Buffer.append(std::to_wstring(Value));
+    }
 
-    M2::CHandle hProcess;
-    M2::CHandle hToken;
+    void Boolean(
+        _In_ bool Value)
+    {
+        this->BeginValue();
+        this->m_Buffer.append(Value ? L"true" : L"false");
+    }
 
-    // 打开进程对象
-    hProcess = OpenProcess(MAXIMUM_ALLOWED, FALSE, dwProcessID);
-    if (hProcess)
+    void Null()
     {
-        // 打开进程令牌
-        result = OpenProcessToken(hProcess, MAXIMUM_ALLOWED, &hToken);
-        if (result)
-        {
-            // 复制令牌
-            result = DuplicateTokenEx(
-                hToken,
-                dwDesiredAccess,
-                lpTokenAttributes,
-                ImpersonationLevel,
-                TokenType,
-                phToken);
-        }
+        this->BeginValue();
+        this->m_Buffer.append(L"null");
     }
 
-    return result;
-}
+    const std::wstring& GetText() const
+    {
+        return this->m_Buffer;
+    }
+};
 
 /*
-NSudoDuplicateSystemToken函数获取一个当前会话SYSTEM用户令牌的副本。
-The NSudoDuplicateSystemToken function obtains a copy of current session
-SYSTEM user token.
-
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
+CNSudoJsonReader类按顺序读取JSON文本，只解码字符串，其他值只验证并跳过。它用于
+读取用户可以修改的NSudo.json中的快捷命令列表。
+The CNSudoJsonReader class reads the JSON text sequentially. It only decodes
+the strings, and the other values are validated and skipped. It is used to
+read the shortcut list in the user-editable NSudo.json.
 */
-BOOL WINAPI NSudoDuplicateSystemToken(
-    _In_ DWORD dwDesiredAccess,
-    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
-    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
-    _In_ TOKEN_TYPE TokenType,
-    _Outptr_ PHANDLE phToken)
+class CNSudoJsonReader
 {
-    BOOL result = FALSE;
-    DWORD dwWinLogonPID = (DWORD)-1;
-    DWORD dwSessionID = (DWORD)-1;
-    M2::CWTSMemory<PWTS_PROCESS_INFOW> pProcesses;
-    DWORD dwProcessCount = 0;
+private:
+    // 嵌套层数的上限，避免跳过恶意构造的文本时栈溢出
+    static const size_t MaximumDepth = 512;
 
-    do
-    {
-        // 获取当前进程令牌会话ID
-        result = NSudoGetCurrentProcessSessionID(&dwSessionID);
-        if (!result) break;
+    std::wstring_view m_Text;
+    size_t m_Position;
 
-        // 遍历进程寻找winlogon进程并获取PID
-        if (WTSEnumerateProcessesW(
-            WTS_CURRENT_SERVER_HANDLE,
-            0,
-            1,
-            &pProcesses,
-            &dwProcessCount))
+    bool SkipLiteral(
+        _In_ std::wstring_view Literal)
+    {
+        if (0 != this->m_Text.compare(
+            this->m_Position, Literal.size(), Literal))
         {
-            for (DWORD i = 0; i < dwProcessCount; ++i)
-            {
-                PWTS_PROCESS_INFOW pProcess = &pProcesses[i];
+            return false;
+        }
 
-                if (pProcess->SessionId != dwSessionID) continue;
-                if (pProcess->pProcessName == nullptr) continue;
+        this->m_Position += Literal.size();
+        return true;
+    }
 
-                if (_wcsicmp(L"winlogon.exe", pProcess->pProcessName) == 0)
-                {
-                    dwWinLogonPID = pProcess->ProcessId;
-                    break;
-                }
-            }
+    bool SkipNumber()
+    {
+        size_t Start = this->m_Position;
+
+        if (this->m_Position < this->m_Text.size() &&
+            L'-' == this->m_Text[this->m_Position])
+        {
+            ++this->m_Position;
         }
 
-        // 如果没找到进程，则返回错误
-        if (dwWinLogonPID == -1)
+        size_t DigitCount = 0;
+        while (this->m_Position < this->m_Text.size())
         {
-            SetLastError(ERROR_NOT_FOUND);
-            break;
+            wchar_t Character = this->m_Text[this->m_Position];
+            if (Character >= L'0' && Character <= L'9')
+            {
+                ++DigitCount;
+            }
+            else if (L'.' != Character &&
+                L'e' != Character && L'E' != Character &&
+                L'+' != Character && L'-' != Character)
+            {
+                break;
+            }
+
+            ++this->m_Position;
         }
 
-        // 复制进程令牌
-        result = NSudoDuplicateProcessToken(
-            dwWinLogonPID,
-            dwDesiredAccess,
-            lpTokenAttributes,
-            ImpersonationLevel,
-            TokenType,
-            phToken);
+        return DigitCount && this->m_Position > Start;
+    }
 
-    } while (false);
+    bool SkipValue(
+        _In_ size_t Depth)
+    {
+        this->SkipWhitespace();
+        if (this->m_Position >= this->m_Text.size() || Depth > MaximumDepth)
+        {
+            return false;
+        }
 
-    return result;
-}
+        switch (this->m_Text[this->m_Position])
+        {
+        case L'"':
+        {
+            std::wstring String;
+            return this->ReadString(String);
+        }
+        case L'{':
+        {
+            ++this->m_Position;
 
-/*
-NSudoDuplicateServiceToken函数根据服务名获取一个服务进程令牌的副本。
-The NSudoDuplicateServiceToken function obtains a copy of service process
-token via service name.
+            std::wstring Name;
+            for (bool First = true;; First = false)
+            {
+                bool End = false;
+                if (!this->ReadMemberName(First, Name, End))
+                {
+                    return false;
+                }
+                if (End)
+                {
+                    return true;
+                }
+                if (!this->SkipValue(Depth + 1))
+                {
+                    return false;
+                }
+            }
+        }
+        case L'[':
+        {
+            ++this->m_Position;
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoDuplicateServiceToken(
-    _In_ LPCWSTR lpServiceName,
-    _In_ DWORD dwDesiredAccess,
-    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
-    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
-    _In_ TOKEN_TYPE TokenType,
-    _Outptr_ PHANDLE phToken)
-{
-    BOOL result = FALSE;
-    SERVICE_STATUS_PROCESS ssStatus;
+            if (this->Consume(L']'))
+            {
+                return true;
+            }
 
-    // 启动服务
-    result = NSudoStartService(lpServiceName, &ssStatus);
-    if (result)
-    {
-        // 复制进程令牌
-        result = NSudoDuplicateProcessToken(
-            ssStatus.dwProcessId,
-            dwDesiredAccess,
-            lpTokenAttributes,
-            ImpersonationLevel,
-            TokenType,
-            phToken);
+            for (;;)
+            {
+                if (!this->SkipValue(Depth + 1))
+                {
+                    return false;
+                }
+                if (this->Consume(L']'))
+                {
+                    return true;
+                }
+                if (!this->Consume(L','))
+                {
+                    return false;
+                }
+            }
+        }
+        case L't':
+            return this->SkipLiteral(L"true");
+        case L'f':
+            return this->SkipLiteral(L"false");
+        case L'n':
+            return this->SkipLiteral(L"null");
+        default:
+            return this->SkipNumber();
+        }
     }
 
-    return result;
-}
-
-/*
-NSudoDuplicateSessionToken函数根据会话ID获取一个服务进程令牌的副本。
-The NSudoDuplicateSessionToken function obtains a copy of Session token via
-Session ID.
+public:
+    CNSudoJsonReader(
+        _In_ std::wstring_view Text) :
+        m_Text(Text),
+        m_Position(0)
+    {
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoDuplicateSessionToken(
-    _In_ DWORD dwSessionID,
-    _In_ DWORD dwDesiredAccess,
-    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
-    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
-    _In_ TOKEN_TYPE TokenType,
-    _Outptr_ PHANDLE phToken)
-{
-    BOOL result = FALSE;
-    M2::CHandle hToken;
+    }
 
-    // 打开会话令牌
-    result = WTSQueryUserToken(dwSessionID, &hToken);
-    if (result)
+    size_t GetPosition() const
     {
-        // 复制令牌
-        result = DuplicateTokenEx(
-            hToken,
-            dwDesiredAccess,
-            lpTokenAttributes,
-            ImpersonationLevel,
-            TokenType,
-            phToken);
+        return this->m_Position;
     }
 
-    return result;
-}
-
-/*
-NSudoImpersonateAsSystem函数给当前线程分配一个SYSTEM用户模拟令牌。该函数还
-可以使当前线程停止使用模拟令牌。
-The NSudoImpersonateAsSystem function assigns an SYSTEM user impersonation
-token to the current thread. The function can also cause the current thread
-to stop using an impersonation token.
-
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-BOOL WINAPI NSudoImpersonateAsSystem()
-{
-    BOOL result = FALSE;
-    M2::CHandle hToken;
-
-    // 获取当前会话SYSTEM用户令牌副本
-    result = NSudoDuplicateSystemToken(
-        MAXIMUM_ALLOWED,
-        nullptr,
-        SecurityImpersonation,
-        TokenImpersonation,
-        &hToken);
-    if (result)
+    void SkipWhitespace()
     {
-        // 启用令牌全部特权
-        result = NSudoSetTokenAllPrivileges(hToken, true);
-        if (result)
+        while (this->m_Position < this->m_Text.size())
         {
-            // 模拟令牌
-            result = SetThreadToken(nullptr, hToken);
+            wchar_t Character = this->m_Text[this->m_Position];
+            if (L' ' != Character && L'\t' != Character &&
+                L'\n' != Character && L'\r' != Character)
+            {
+                break;
+            }
+
+            ++this->m_Position;
         }
     }
 
-    return result;
-}
-
-#include <Userenv.h>
-#pragma comment(lib, "Userenv.lib")
-
-/*
-NSudoCreateProcess函数创建一个新进程和对应的主线程
-The NSudoCreateProcess function creates a new process and its primary thread.
+    // 跳过空白后如果下一个字符为Character则读取它
+    bool Consume(
+        _In_ wchar_t Character)
+    {
+        this->SkipWhitespace();
+        if (this->m_Position < this->m_Text.size() &&
+            Character == this->m_Text[this->m_Position])
+        {
+            ++this->m_Position;
+            return true;
+        }
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
-information, call GetLastError.
-*/
-bool NSudoCreateProcess(
-    _In_opt_ HANDLE hToken,
-    _Inout_ LPCWSTR lpCommandLine,
-    _In_opt_ LPCWSTR lpCurrentDirectory,
-    _In_ DWORD WaitInterval,
-    _In_ DWORD ProcessPriority = 0,
-    _In_ DWORD ShowWindowMode = SW_SHOWDEFAULT,
-    _In_ bool CreateNewConsole = true)
-{
-    DWORD dwCreationFlags = CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT;
+        return false;
+    }
 
-    if (CreateNewConsole)
+    // 跳过空白后判断是否已读完文本
+    bool IsEnd()
     {
-        dwCreationFlags |= CREATE_NEW_CONSOLE;
+        this->SkipWhitespace();
+        return this->m_Position >= this->m_Text.size();
     }
 
-    STARTUPINFOW StartupInfo = { 0 };
-    PROCESS_INFORMATION ProcessInfo = { 0 };
-
-    StartupInfo.cb = sizeof(STARTUPINFOW);
-
-    StartupInfo.lpDesktop = const_cast<LPWSTR>(L"WinSta0\\Default");
-
-    StartupInfo.dwFlags |= STARTF_USESHOWWINDOW;
-    StartupInfo.wShowWindow = static_cast<WORD>(ShowWindowMode);
-
-    LPVOID lpEnvironment = nullptr;
+    bool ReadString(
+        _Out_ std::wstring& String)
+    {
+        String.clear();
 
-    BOOL result = FALSE;
+        if (!this->Consume(L'"'))
+        {
+            return false;
+        }
 
-    M2::CHandle hCurrentToken;
-    if (OpenProcessToken(
-        GetCurrentProcess(),
-        MAXIMUM_ALLOWED,
-        &hCurrentToken))
-    {
-        if (CreateEnvironmentBlock(&lpEnvironment, hCurrentToken, TRUE))
+        while (this->m_Position < this->m_Text.size())
         {
-            result = CreateProcessAsUserW(
-                hToken,
-                nullptr,
-                const_cast<LPWSTR>(NSudoExpandEnvironmentStrings(lpCommandLine).c_str()),
-                nullptr,
-                nullptr,
-                FALSE,
-                dwCreationFlags,
-                lpEnvironment,
-                lpCurrentDirectory,
-                &StartupInfo,
-                &ProcessInfo);
+            wchar_t Character = this->m_Text[this->m_Position++];
+            if (L'"' == Character)
+            {
+                return true;
+            }
+            else if (Character < 0x20)
+            {
+                return false;
+            }
+            else if (L'\\' != Character)
+            {
+                String.push_back(Character);
+                continue;
+            }
 
-            if (result)
+            if (this->m_Position >= this->m_Text.size())
             {
-                SetPriorityClass(ProcessInfo.hProcess, ProcessPriority);
+                return false;
+            }
 
-                ResumeThread(ProcessInfo.hThread);
+            switch (this->m_Text[this->m_Position++])
+            {
+            case L'"':
+                String.push_back(L'"');
+                break;
+            case L'\\':
+                String.push_back(L'\\');
+                break;
+            case L'/':
+                String.push_back(L'/');
+                break;
+            case L'b':
+                String.push_back(L'\b');
+                break;
+            case L'f':
+                String.push_back(L'\f');
+                break;
+            case L'n':
+                String.push_back(L'\n');
+                break;
+            case L'r':
+                String.push_back(L'\r');
+                break;
+            case L't':
+                String.push_back(L'\t');
+                break;
+            case L'u':
+            {
+                // 代理项对按两个UTF-16代码单元原样保留
+                wchar_t CodeUnit = 0;
+                for (size_t i = 0; i < 4; ++i)
+                {
+                    if (this->m_Position >= this->m_Text.size())
+                    {
+                        return false;
+                    }
 
-                WaitForSingleObjectEx(
-                    ProcessInfo.hProcess, WaitInterval, FALSE);
+                    wchar_t Digit = this->m_Text[this->m_Position++];
+                    int Value = 0;
+                    if (Digit >= L'0' && Digit <= L'9')
+                    {
+                        Value = Digit - L'0';
+                    }
+                    else if (Digit >= L'a' && Digit <= L'f')
+                    {
+                        Value = Digit - L'a' + 10;
+                    }
+                    else if (Digit >= L'A' && Digit <= L'F')
+                    {
+                        Value = Digit - L'A' + 10;
+                    }
+                    else
+                    {
+                        return false;
+                    }
 
-                CloseHandle(ProcessInfo.hProcess);
-                CloseHandle(ProcessInfo.hThread);
+                    CodeUnit = static_cast<wchar_t>((CodeUnit << 4) | Value);
+                }
+                String.push_back(CodeUnit);
+                break;
+            }
+            default:
+                return false;
             }
-
-            DestroyEnvironmentBlock(lpEnvironment);
         }
+
+        return false;
     }
 
-    //返回结果
-    return result;
-}
+    /*
+    ReadMemberName函数读取对象的下一个成员名和 ":"。First表示是否为对象的第一个
+    成员，调用前需要已读取 "{"。如果对象已结束，则读取 "}" 并把End设为true。
+    The ReadMemberName function reads the name of the next member of the object
+    and the ":". First indicates whether it is the first member of the object,
+    and the "{" needs to be read before the call. If the object ends, the "}"
+    is read and End is set to true.
+    */
+    bool ReadMemberName(
+        _In_ bool First,
+        _Out_ std::wstring& Name,
+        _Out_ bool& End)
+    {
+        End = this->Consume(L'}');
+        if (End)
+        {
+            return true;
+        }
 
-#if _MSC_VER >= 1200
-#pragma warning(pop)
-#endif
+        if (!First && !this->Consume(L','))
+        {
+            return false;
+        }
 
-#include "ThirdParty/json.hpp"
+        return this->ReadString(Name) && this->Consume(L':');
+    }
+
+    bool SkipValue()
+    {
+        return this->SkipValue(0);
+    }
+};
+
+// 获取新进程身份的方式
+// The ways to obtain the identity of the new process.
+enum class NSudoOptionEngineValue
+{
+    // 复制SYSTEM或者TrustedInstaller的令牌，修改令牌的会话后创建进程
+    Token,
+    // 把SYSTEM或者TrustedInstaller的进程指定为父进程，新进程直接继承其令牌
+    ParentProcess
+};
 
 // The NSudo message enum.
 enum NSUDO_MESSAGE
@@ -940,173 +1018,810 @@ enum NSUDO_MESSAGE
     INVALID_TEXTBOX_PARAMETER,
     CREATE_PROCESS_FAILED,
     NEED_TO_SHOW_COMMAND_LINE_HELP,
-    NEED_TO_SHOW_NSUDO_VERSION
+    NEED_TO_SHOW_NSUDO_VERSION,
+    BROKER_START_FAILED,
+    PARENT_PROCESS_SESSION_MISMATCH
 };
 
-const char* NSudoMessageTranslationID[] =
+// 和 NSUDO_MESSAGE 对应的翻译，NSudoTranslationID::Count 表示没有对应的翻译
+// The translations of NSUDO_MESSAGE, NSudoTranslationID::Count means none.
+const NSudoTranslationID NSudoMessageTranslationID[] =
 {
-    "Message.Success",
-    "Message.PrivilegeNotHeld",
-    "Message.InvalidCommandParameter",
-    "Message.InvalidTextBoxParameter",
-    "Message.CreateProcessFailed",
-    "",
-    ""
+    NSudoTranslationID::Message_Success,
+    NSudoTranslationID::Message_PrivilegeNotHeld,
+    NSudoTranslationID::Message_InvalidCommandParameter,
+    NSudoTranslationID::Message_InvalidTextBoxParameter,
+    NSudoTranslationID::Message_CreateProcessFailed,
+    NSudoTranslationID::Count,
+    NSudoTranslationID::Count,
+    NSudoTranslationID::Message_BrokerStartFailed,
+    NSudoTranslationID::Message_ParentProcessSessionMismatch
 };
 
-class CNSudoTranslationAdapter
-{
-private:
-    static std::wstring GetUTF8WithBOMStringResources(
-        _In_ UINT uID)
-    {
-        M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
-            &ResourceInfo,
-            GetModuleHandleW(nullptr),
-            L"String",
-            MAKEINTRESOURCEW(uID))))
-        {
-            std::string RawString(
-                reinterpret_cast<const char*>(ResourceInfo.Pointer),
-                ResourceInfo.Size);
-            // Raw string without the UTF-8 BOM. (0xEF,0xBB,0xBF)	
-            return M2MakeUTF16String(RawString.c_str() + 3);
-        }
+#define NSUDO_VERSION_TEXT L"M2-Team NSudo " NSUDO_VERSION_STRING
 
-        return L"";
-    }
+#define NSUDO_LOGO_TEXT \
+    NSUDO_VERSION_TEXT L"\r\n" \
+    L"© M2-Team. All rights reserved.\r\n" \
+    L"\r\n"
 
+class CNSudoTranslationAdapter
+{
 public:
+    /**
+     * 加载编译时由 NSudo.Resources.targets 生成的翻译表。翻译表中的字符串直接
+     * 指向模块资源，因此无需复制和释放。
+     *
+     * Loads the translation table generated by NSudo.Resources.targets at
+     * build time. The strings point to the module resource directly, so they
+     * need not to be copied and freed.
+     *
+     * @param StringTranslations The translations indexed by
+     *                           NSudoTranslationID. The items will be L"" if
+     *                           the translation table is unavailable.
+     */
     static void Load(
-        std::map<std::string, std::wstring>& StringTranslations)
+        LPCWSTR (&StringTranslations)[
+            static_cast<size_t>(NSudoTranslationID::Count)])
     {
-        StringTranslations.clear();
-
-        StringTranslations.insert(std::make_pair(
-            "NSudo.VersionText",
-            L"M2-Team NSudo " NSUDO_VERSION_STRING));
-
-        StringTranslations.insert(std::make_pair(
-            "NSudo.LogoText",
-            L"M2-Team NSudo " NSUDO_VERSION_STRING L"\r\n"
-            L"© M2-Team. All rights reserved.\r\n"
-            L"\r\n"));
-
-        StringTranslations.insert(std::make_pair(
-            "NSudo.String.Links",
-            CNSudoTranslationAdapter::GetUTF8WithBOMStringResources(
-                IDR_String_Links)));
+        const DWORD Count = static_cast<DWORD>(NSudoTranslationID::Count);
 
-        StringTranslations.insert(std::make_pair(
-            "NSudo.String.CommandLineHelp",
-            CNSudoTranslationAdapter::GetUTF8WithBOMStringResources(
-                IDR_String_CommandLineHelp)));
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            StringTranslations[i] = L"";
+        }
 
         M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
+        if (FAILED(M2LoadResource(
             &ResourceInfo,
             GetModuleHandleW(nullptr),
             L"String",
             MAKEINTRESOURCEW(IDR_String_Translations))))
         {
-            nlohmann::json StringTranslationsJSON =
-                nlohmann::json::parse(std::string(
-                    reinterpret_cast<const char*>(ResourceInfo.Pointer),
-                    ResourceInfo.Size));
+            return;
+        }
+
+        // 翻译表结构：DWORD Count, DWORD Offsets[Count], 以 NULL 结尾的字符串
+        const BYTE* Table = reinterpret_cast<const BYTE*>(
+            ResourceInfo.Pointer);
+        const DWORD* Header = reinterpret_cast<const DWORD*>(Table);
+
+        if (ResourceInfo.Size < sizeof(DWORD) * (Count + 1) ||
+            Header[0] != Count)
+        {
+            return;
+        }
 
-            for (auto& Item : StringTranslationsJSON["Translations"].items())
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            if (Header[i + 1] < ResourceInfo.Size)
             {
-                StringTranslations.insert(std::make_pair(
-                    Item.key(),
-                    M2MakeUTF16String(Item.value())));
+                StringTranslations[i] = reinterpret_cast<LPCWSTR>(
+                    Table + Header[i + 1]);
             }
         }
     }
 };
 
-class CNSudoShortCutAdapter
+#include <memory>
+
+// NSudo.json的快捷命令索引的文件头。文件头之后是按键排序的Count个索引项，然后是以
+// null结尾的UTF-16字符串。偏移量以字节为单位并从文件头开始计算。
+// The header of the shortcut index of NSudo.json. The header is followed by
+// Count entries sorted by key, and then the null-terminated UTF-16 strings. The
+// offsets are in bytes from the beginning of the header.
+typedef struct _NSUDO_SHORTCUT_INDEX_HEADER
 {
-public:
-    static void Read(
-        const std::wstring& ShortCutListPath,
-        std::map<std::wstring, std::wstring>& ShortCutList)
+    DWORD Signature;
+    DWORD Version;
+    // 生成索引时NSudo.json的最后写入时间和大小
+    FILETIME SourceLastWriteTime;
+    ULONGLONG SourceSize;
+    DWORD Count;
+    // 整个索引的大小，以字节为单位
+    DWORD Size;
+} NSUDO_SHORTCUT_INDEX_HEADER, *PNSUDO_SHORTCUT_INDEX_HEADER;
+
+// The entry of the shortcut index. The lengths exclude the terminating null.
+typedef struct _NSUDO_SHORTCUT_INDEX_ENTRY
+{
+    DWORD KeyOffset;
+    DWORD KeyLength;
+    DWORD ValueOffset;
+    DWORD ValueLength;
+} NSUDO_SHORTCUT_INDEX_ENTRY, *PNSUDO_SHORTCUT_INDEX_ENTRY;
+
+// "NIDX"
+#define NSUDO_SHORTCUT_INDEX_SIGNATURE 0x5844494E
+#define NSUDO_SHORTCUT_INDEX_VERSION 1
+
+/*
+CNSudoShortCutList类表示只读的快捷命令索引。索引来自映射到内存的索引文件，或者在
+无法写入索引文件时来自内存中的缓冲区，查找只需在索引内二分查找。
+The CNSudoShortCutList class represents the read-only shortcut index. The index
+comes from the index file mapped into memory, or from a buffer in memory if the
+index file cannot be written, and a lookup only needs a binary search in the
+index.
+*/
+class CNSudoShortCutList
+{
+private:
+    PVOID m_View = nullptr;
+    std::vector<BYTE> m_Buffer;
+
+    const NSUDO_SHORTCUT_INDEX_HEADER* m_Header = nullptr;
+    const NSUDO_SHORTCUT_INDEX_ENTRY* m_Entries = nullptr;
+
+    CNSudoShortCutList(const CNSudoShortCutList&) = delete;
+    CNSudoShortCutList& operator=(const CNSudoShortCutList&) = delete;
+
+    // 在使用前检查索引中的所有偏移量，使查找时无需再检查
+    static bool Validate(
+        _In_ const BYTE* Data,
+        _In_ SIZE_T Size)
     {
-        ShortCutList.clear();
+        if (Size < sizeof(NSUDO_SHORTCUT_INDEX_HEADER))
+        {
+            return false;
+        }
 
-        try
+        const NSUDO_SHORTCUT_INDEX_HEADER* Header =
+            reinterpret_cast<const NSUDO_SHORTCUT_INDEX_HEADER*>(Data);
+        if (NSUDO_SHORTCUT_INDEX_SIGNATURE != Header->Signature ||
+            NSUDO_SHORTCUT_INDEX_VERSION != Header->Version ||
+            Size != Header->Size)
         {
-            std::ifstream FileStream(ShortCutListPath);
-            if (FileStream.is_open())
-            {
-                nlohmann::json ConfigJSON = nlohmann::json::parse(FileStream);
+            return false;
+        }
 
-                for (auto& Item : ConfigJSON["ShortCutList_V2"].items())
-                {
-                    ShortCutList.insert(std::make_pair(
-                        M2MakeUTF16String(Item.key()),
-                        M2MakeUTF16String(Item.value())));
-                }
-            }
+        if (Header->Count > (Size - sizeof(NSUDO_SHORTCUT_INDEX_HEADER)) /
+            sizeof(NSUDO_SHORTCUT_INDEX_ENTRY))
+        {
+            return false;
         }
-        catch (const std::exception&)
+
+        // 字符串必须在索引内，按wchar_t对齐并以null结尾
+        auto IsValidString = [Data, Size](DWORD Offset, DWORD Length) -> bool
         {
+            if (0 != Offset % sizeof(wchar_t) ||
+                Offset > Size ||
+                Length >= (Size - Offset) / sizeof(wchar_t))
+            {
+                return false;
+            }
+
+            return L'\0' == reinterpret_cast<const wchar_t*>(
+                Data + Offset)[Length];
+        };
 
+        const NSUDO_SHORTCUT_INDEX_ENTRY* Entries =
+            reinterpret_cast<const NSUDO_SHORTCUT_INDEX_ENTRY*>(Header + 1);
+        for (DWORD i = 0; i < Header->Count; ++i)
+        {
+            if (!IsValidString(Entries[i].KeyOffset, Entries[i].KeyLength) ||
+                !IsValidString(Entries[i].ValueOffset, Entries[i].ValueLength))
+            {
+                return false;
+            }
         }
+
+        return true;
     }
 
-    static void Write(
-        const std::wstring& ShortCutListPath,
-        const std::map<std::wstring, std::wstring>& ShortCutList)
+    void Attach(
+        _In_ const BYTE* Data)
     {
-        ShortCutListPath;
-        ShortCutList;
+        this->m_Header =
+            reinterpret_cast<const NSUDO_SHORTCUT_INDEX_HEADER*>(Data);
+        this->m_Entries =
+            reinterpret_cast<const NSUDO_SHORTCUT_INDEX_ENTRY*>(
+                this->m_Header + 1);
     }
 
-    static std::wstring Translate(
-        const std::map<std::wstring, std::wstring>& ShortCutList,
-        const std::wstring& CommandLine)
+    std::wstring_view GetString(
+        _In_ DWORD Offset,
+        _In_ DWORD Length) const
     {
-        auto iterator = ShortCutList.find(CommandLine);
+        return std::wstring_view(
+            reinterpret_cast<const wchar_t*>(
+                reinterpret_cast<const BYTE*>(this->m_Header) + Offset),
+            Length);
+    }
+
+public:
+    CNSudoShortCutList() = default;
 
-        if (iterator == ShortCutList.end())
+    ~CNSudoShortCutList()
+    {
+        if (this->m_View)
         {
-            return CommandLine;       
+            UnmapViewOfFile(this->m_View);
         }
-
-        return iterator->second;
     }
-};
 
-class CNSudoResourceManagement
-{
-private:
-    HINSTANCE m_Instance = nullptr;
-    std::wstring m_ExePath;
-    std::wstring m_AppPath;
+    /*
+    Map函数把索引文件映射到内存。如果索引文件无效或者不是由指定版本的NSudo.json
+    生成的，则返回false。
+    The Map function maps the index file into memory. If the index file is
+    invalid or is not generated from the specified version of NSudo.json, the
+    return value is false.
+    */
+    bool Map(
+        _In_ const std::wstring& IndexPath,
+        _In_ const FILETIME& SourceLastWriteTime,
+        _In_ ULONGLONG SourceSize)
+    {
+        // 允许其他NSudo进程在映射期间替换索引文件
+        M2::CHandle hFile;
+        hFile = CreateFileW(
+            IndexPath.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (hFile.IsInvalid())
+        {
+            return false;
+        }
 
-    std::map<std::string, std::wstring> m_StringTranslations;
-    std::map<std::wstring, std::wstring> m_ShortCutList;
+        LARGE_INTEGER FileSize;
+        if (!GetFileSizeEx(hFile, &FileSize) ||
+            FileSize.QuadPart < static_cast<LONGLONG>(
+                sizeof(NSUDO_SHORTCUT_INDEX_HEADER)) ||
+            FileSize.QuadPart > MAXDWORD)
+        {
+            return false;
+        }
 
-    bool m_IsElevated = false;
-    HANDLE m_OriginalCurrentProcessToken;
+        HANDLE hMapping = CreateFileMappingW(
+            hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!hMapping)
+        {
+            return false;
+        }
 
-public:
-    const HINSTANCE& Instance = this->m_Instance;
-    const std::wstring& ExePath = this->m_ExePath;
-    const std::wstring& AppPath = this->m_AppPath;
+        // 视图会保持映射对象和文件，所以可以立即关闭它们的句柄
+        PVOID View = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        if (!View)
+        {
+            return false;
+        }
 
-    const std::map<std::wstring, std::wstring>& ShortCutList =
-        this->m_ShortCutList;
+        const NSUDO_SHORTCUT_INDEX_HEADER* Header =
+            reinterpret_cast<const NSUDO_SHORTCUT_INDEX_HEADER*>(View);
+        if (!CNSudoShortCutList::Validate(
+            reinterpret_cast<const BYTE*>(View),
+            static_cast<SIZE_T>(FileSize.QuadPart)) ||
+            0 != CompareFileTime(
+                &Header->SourceLastWriteTime, &SourceLastWriteTime) ||
+            SourceSize != Header->SourceSize)
+        {
+            UnmapViewOfFile(View);
+            return false;
+        }
 
-    const HANDLE& OriginalCurrentProcessToken =
-        this->m_OriginalCurrentProcessToken;
-    const bool& IsElevated = this->m_IsElevated;
+        this->m_View = View;
+        this->Attach(reinterpret_cast<const BYTE*>(View));
 
-public:
-    CNSudoResourceManagement()
+        return true;
+    }
+
+    // Assign函数使用内存中的索引
+    bool Assign(
+        _Inout_ std::vector<BYTE>&& Buffer)
     {
-        this->m_Instance = GetModuleHandleW(nullptr);
+        if (!CNSudoShortCutList::Validate(Buffer.data(), Buffer.size()))
+        {
+            return false;
+        }
+
+        this->m_Buffer = std::move(Buffer);
+        this->Attach(this->m_Buffer.data());
+
+        return true;
+    }
+
+    // 判断索引是否由指定版本的NSudo.json生成
+    bool IsBuiltFrom(
+        _In_ const FILETIME& SourceLastWriteTime,
+        _In_ ULONGLONG SourceSize) const
+    {
+        return this->m_Header &&
+            0 == CompareFileTime(
+                &this->m_Header->SourceLastWriteTime, &SourceLastWriteTime) &&
+            SourceSize == this->m_Header->SourceSize;
+    }
+
+    size_t Count() const
+    {
+        return this->m_Header ? this->m_Header->Count : 0;
+    }
+
+    // 返回的字符串以null结尾
+    std::wstring_view Key(
+        _In_ size_t Index) const
+    {
+        return this->GetString(
+            this->m_Entries[Index].KeyOffset,
+            this->m_Entries[Index].KeyLength);
+    }
+
+    // 返回的字符串以null结尾
+    std::wstring_view Value(
+        _In_ size_t Index) const
+    {
+        return this->GetString(
+            this->m_Entries[Index].ValueOffset,
+            this->m_Entries[Index].ValueLength);
+    }
+
+    bool Find(
+        _In_ std::wstring_view Name,
+        _Out_ std::wstring_view& CommandLine) const
+    {
+        // 索引项与std::map<std::wstring, std::wstring>的顺序相同
+        size_t First = 0;
+        size_t Last = this->Count();
+        while (First < Last)
+        {
+            size_t Middle = First + (Last - First) / 2;
+
+            int Result = this->Key(Middle).compare(Name);
+            if (0 == Result)
+            {
+                CommandLine = this->Value(Middle);
+                return true;
+            }
+
+            if (Result < 0)
+            {
+                First = Middle + 1;
+            }
+            else
+            {
+                Last = Middle;
+            }
+        }
+
+        return false;
+    }
+};
+
+class CNSudoShortCutAdapter
+{
+private:
+    // 先写入临时文件再替换目标文件，使其他进程不会读到写入了一半的文件
+    static bool WriteFileAtomically(
+        _In_ const std::wstring& FilePath,
+        _In_ const void* Buffer,
+        _In_ DWORD Size)
+    {
+        std::wstring TemporaryPath = FilePath + L".tmp";
+
+        {
+            M2::CHandle hFile;
+            hFile = CreateFileW(
+                TemporaryPath.c_str(),
+                GENERIC_WRITE,
+                0,
+                nullptr,
+                CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+            if (hFile.IsInvalid())
+            {
+                return false;
+            }
+
+            DWORD NumberOfBytesWritten = 0;
+            if (!WriteFile(
+                hFile,
+                Buffer,
+                Size,
+                &NumberOfBytesWritten,
+                nullptr) || Size != NumberOfBytesWritten)
+            {
+                hFile.Close();
+                DeleteFileW(TemporaryPath.c_str());
+                return false;
+            }
+        }
+
+        if (!MoveFileExW(
+            TemporaryPath.c_str(),
+            FilePath.c_str(),
+            MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFileW(TemporaryPath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // NSudo.json中快捷命令列表的值的位置，不存在快捷命令列表时ListEnd为0，顶层
+    // 对象没有成员时LastMemberEnd为0
+    typedef struct _SHORTCUT_LIST_RANGE
+    {
+        size_t ListStart;
+        size_t ListEnd;
+        size_t LastMemberEnd;
+    } SHORTCUT_LIST_RANGE, *PSHORTCUT_LIST_RANGE;
+
+    /*
+    ParseConfig函数解析NSudo.json的顶层对象。如果指定了ShortCutList，则读取快捷
+    命令列表；如果指定了Range，则获取快捷命令列表的位置。
+    The ParseConfig function parses the top-level object of NSudo.json. If
+    ShortCutList is specified, the shortcut list is read. If Range is
+    specified, the position of the shortcut list is obtained.
+    */
+    static bool ParseConfig(
+        CNSudoJsonReader& Reader,
+        std::map<std::wstring, std::wstring>* ShortCutList,
+        PSHORTCUT_LIST_RANGE Range = nullptr)
+    {
+        if (!Reader.Consume(L'{'))
+        {
+            return false;
+        }
+
+        std::wstring Name;
+        for (bool First = true;; First = false)
+        {
+            bool End = false;
+            if (!Reader.ReadMemberName(First, Name, End))
+            {
+                return false;
+            }
+            if (End)
+            {
+                break;
+            }
+
+            bool IsShortCutList = (L"ShortCutList_V2" == Name);
+
+            Reader.SkipWhitespace();
+            size_t ValueStart = Reader.GetPosition();
+
+            if (IsShortCutList && ShortCutList)
+            {
+                // 与重复的成员一样，只使用最后一个快捷命令列表；它不是对象时没
+                // 有快捷命令
+                ShortCutList->clear();
+            }
+
+            if (IsShortCutList && ShortCutList && Reader.Consume(L'{'))
+            {
+                std::wstring Key;
+                std::wstring Value;
+                for (bool FirstItem = true;; FirstItem = false)
+                {
+                    bool ItemEnd = false;
+                    if (!Reader.ReadMemberName(FirstItem, Key, ItemEnd))
+                    {
+                        return false;
+                    }
+                    if (ItemEnd)
+                    {
+                        break;
+                    }
+                    if (!Reader.ReadString(Value))
+                    {
+                        return false;
+                    }
+
+                    (*ShortCutList)[Key] = Value;
+                }
+            }
+            else if (!Reader.SkipValue())
+            {
+                return false;
+            }
+
+            if (Range)
+            {
+                if (IsShortCutList)
+                {
+                    Range->ListStart = ValueStart;
+                    Range->ListEnd = Reader.GetPosition();
+                }
+                Range->LastMemberEnd = Reader.GetPosition();
+            }
+        }
+
+        return Reader.IsEnd();
+    }
+
+public:
+    static void Read(
+        const std::wstring& ShortCutListPath,
+        std::map<std::wstring, std::wstring>& ShortCutList)
+    {
+        ShortCutList.clear();
+
+        std::wstring Content;
+        if (!NSudoReadTextFile(ShortCutListPath.c_str(), Content))
+        {
+            return;
+        }
+
+        // NSudo.json无效时没有快捷命令
+        CNSudoJsonReader Reader(Content);
+        if (!CNSudoShortCutAdapter::ParseConfig(Reader, &ShortCutList))
+        {
+            ShortCutList.clear();
+        }
+    }
+
+    /*
+    Write函数把快捷命令列表写入NSudo.json，NSudo.json中的其他内容会被保留。下次
+    加载时会因为NSudo.json被修改而重新生成索引。
+    The Write function writes the shortcut list to NSudo.json, and the other
+    contents of NSudo.json are kept. The index is regenerated in the next load
+    because NSudo.json is modified.
+    */
+    static bool Write(
+        const std::wstring& ShortCutListPath,
+        const std::map<std::wstring, std::wstring>& ShortCutList)
+    {
+        // 快捷命令列表是顶层对象的成员，所以从第1层缩进开始生成
+        CNSudoJsonWriter Writer(1);
+        Writer.BeginObject();
+        for (auto& Item : ShortCutList)
+        {
+            Writer.Key(Item.first);
+            Writer.String(Item.second);
+        }
+        Writer.EndObject();
+
+        std::wstring Content;
+        if (!NSudoReadTextFile(ShortCutListPath.c_str(), Content))
+        {
+            // 不能覆盖存在但无法读取的NSudo.json
+            DWORD dwError = GetLastError();
+            if (ERROR_FILE_NOT_FOUND != dwError &&
+                ERROR_PATH_NOT_FOUND != dwError)
+            {
+                return false;
+            }
+
+            Content.clear();
+        }
+
+        // 只替换或者插入快捷命令列表，其他内容和格式保持不变。顶层不是对象时
+        // 重新生成NSudo.json，不是有效的JSON时不写入，以免丢失用户的修改
+        std::wstring NewContent;
+        SHORTCUT_LIST_RANGE Range = { 0 };
+        CNSudoJsonReader Reader(Content);
+        if (CNSudoShortCutAdapter::ParseConfig(Reader, nullptr, &Range))
+        {
+            if (Range.ListEnd)
+            {
+                NewContent = Content.substr(0, Range.ListStart);
+                NewContent += Writer.GetText();
+                NewContent += Content.substr(Range.ListEnd);
+            }
+            else if (Range.LastMemberEnd)
+            {
+                NewContent = Content.substr(0, Range.LastMemberEnd);
+                NewContent += L",\n  \"ShortCutList_V2\": ";
+                NewContent += Writer.GetText();
+                NewContent += Content.substr(Range.LastMemberEnd);
+            }
+        }
+        else
+        {
+            CNSudoJsonReader Document(Content);
+            if (!Document.IsEnd() &&
+                !(Document.SkipValue() && Document.IsEnd()))
+            {
+                return false;
+            }
+        }
+
+        if (NewContent.empty())
+        {
+            NewContent = L"{\n  \"ShortCutList_V2\": ";
+            NewContent += Writer.GetText();
+            NewContent += L"\n}\n";
+        }
+
+        // 与随NSudo发布的NSudo.json一样使用UTF-8 BOM
+        std::string Buffer = "\xEF\xBB\xBF" + M2MakeUTF8String(NewContent);
+
+        return CNSudoShortCutAdapter::WriteFileAtomically(
+            ShortCutListPath,
+            Buffer.c_str(),
+            static_cast<DWORD>(Buffer.size()));
+    }
+
+    // 获取NSudo.json的最后写入时间和大小，NSudo.json不存在时均为0
+    static bool GetSourceVersion(
+        _In_ const std::wstring& ShortCutListPath,
+        _Out_ FILETIME& LastWriteTime,
+        _Out_ ULONGLONG& Size)
+    {
+        LastWriteTime = FILETIME();
+        Size = 0;
+
+        WIN32_FILE_ATTRIBUTE_DATA Attributes;
+        if (!GetFileAttributesExW(
+            ShortCutListPath.c_str(),
+            GetFileExInfoStandard,
+            &Attributes))
+        {
+            return false;
+        }
+
+        LastWriteTime = Attributes.ftLastWriteTime;
+        Size = (static_cast<ULONGLONG>(Attributes.nFileSizeHigh) << 32) |
+            Attributes.nFileSizeLow;
+
+        return true;
+    }
+
+    // 根据快捷命令列表生成索引，格式见NSUDO_SHORTCUT_INDEX_HEADER
+    static bool BuildIndex(
+        _In_ const std::map<std::wstring, std::wstring>& ShortCutList,
+        _In_ const FILETIME& SourceLastWriteTime,
+        _In_ ULONGLONG SourceSize,
+        _Out_ std::vector<BYTE>& Index)
+    {
+        Index.clear();
+
+        ULONGLONG Size = sizeof(NSUDO_SHORTCUT_INDEX_HEADER) +
+            ShortCutList.size() * sizeof(NSUDO_SHORTCUT_INDEX_ENTRY);
+        for (auto& Item : ShortCutList)
+        {
+            Size += (Item.first.size() + Item.second.size() + 2) *
+                sizeof(wchar_t);
+        }
+        if (Size > MAXDWORD)
+        {
+            return false;
+        }
+
+        Index.resize(static_cast<size_t>(Size));
+
+        PNSUDO_SHORTCUT_INDEX_HEADER Header =
+            reinterpret_cast<PNSUDO_SHORTCUT_INDEX_HEADER>(Index.data());
+        Header->Signature = NSUDO_SHORTCUT_INDEX_SIGNATURE;
+        Header->Version = NSUDO_SHORTCUT_INDEX_VERSION;
+        Header->SourceLastWriteTime = SourceLastWriteTime;
+        Header->SourceSize = SourceSize;
+        Header->Count = static_cast<DWORD>(ShortCutList.size());
+        Header->Size = static_cast<DWORD>(Size);
+
+        PNSUDO_SHORTCUT_INDEX_ENTRY Entries =
+            reinterpret_cast<PNSUDO_SHORTCUT_INDEX_ENTRY>(Header + 1);
+
+        DWORD Offset = static_cast<DWORD>(
+            sizeof(NSUDO_SHORTCUT_INDEX_HEADER) +
+            ShortCutList.size() * sizeof(NSUDO_SHORTCUT_INDEX_ENTRY));
+        auto AppendString = [&Index, &Offset](
+            const std::wstring& String, DWORD& StringOffset, DWORD& Length)
+        {
+            StringOffset = Offset;
+            Length = static_cast<DWORD>(String.size());
+            memcpy(
+                &Index[Offset],
+                String.c_str(),
+                (String.size() + 1) * sizeof(wchar_t));
+            Offset += static_cast<DWORD>(
+                (String.size() + 1) * sizeof(wchar_t));
+        };
+
+        // std::map已经按键排序
+        for (auto& Item : ShortCutList)
+        {
+            AppendString(Item.first, Entries->KeyOffset, Entries->KeyLength);
+            AppendString(
+                Item.second, Entries->ValueOffset, Entries->ValueLength);
+            ++Entries;
+        }
+
+        return true;
+    }
+
+    /*
+    Load函数加载NSudo.json的快捷命令索引。如果索引文件不存在，或者NSudo.json在生
+    成索引后被修改，则解析NSudo.json并重新生成索引文件；无法写入索引文件时使用内
+    存中的索引。
+    The Load function loads the shortcut index of NSudo.json. If the index file
+    does not exist, or NSudo.json is modified after the index is generated,
+    NSudo.json is parsed and the index file is regenerated. If the index file
+    cannot be written, the index in memory is used.
+    */
+    static std::shared_ptr<const CNSudoShortCutList> Load(
+        _In_ const std::wstring& ShortCutListPath,
+        _In_ const std::wstring& IndexPath)
+    {
+        std::shared_ptr<CNSudoShortCutList> Result =
+            std::make_shared<CNSudoShortCutList>();
+
+        FILETIME LastWriteTime;
+        ULONGLONG Size;
+        bool SourceExists = CNSudoShortCutAdapter::GetSourceVersion(
+            ShortCutListPath, LastWriteTime, Size);
+
+        if (SourceExists && Result->Map(IndexPath, LastWriteTime, Size))
+        {
+            return Result;
+        }
+
+        std::map<std::wstring, std::wstring> ShortCutList;
+        if (SourceExists)
+        {
+            CNSudoShortCutAdapter::Read(ShortCutListPath, ShortCutList);
+        }
+
+        std::vector<BYTE> Index;
+        if (CNSudoShortCutAdapter::BuildIndex(
+            ShortCutList, LastWriteTime, Size, Index))
+        {
+            if (SourceExists)
+            {
+                CNSudoShortCutAdapter::WriteFileAtomically(
+                    IndexPath,
+                    Index.data(),
+                    static_cast<DWORD>(Index.size()));
+            }
+
+            Result->Assign(std::move(Index));
+        }
+
+        return Result;
+    }
+
+    static std::wstring Translate(
+        const CNSudoShortCutList& ShortCutList,
+        const std::wstring& CommandLine)
+    {
+        std::wstring_view Value;
+        if (!ShortCutList.Find(CommandLine, Value))
+        {
+            return CommandLine;
+        }
+
+        return std::wstring(Value);
+    }
+};
+
+class CNSudoResourceManagement
+{
+private:
+    HINSTANCE m_Instance = nullptr;
+    std::wstring m_ExePath;
+    std::wstring m_AppPath;
+
+    // 翻译和快捷命令列表在首次使用时加载，使只创建进程的命令行无需解析它们
+    M2::CCriticalSection m_CriticalSection;
+    bool m_StringTranslationsLoaded = false;
+
+    LPCWSTR m_StringTranslations[
+        static_cast<size_t>(NSudoTranslationID::Count)];
+    // 快捷命令索引在重新加载时被整体替换，调用者持有的旧索引仍然有效
+    std::shared_ptr<const CNSudoShortCutList> m_ShortCutList;
+
+    bool m_IsElevated = false;
+    HANDLE m_OriginalCurrentProcessToken;
+
+public:
+    const HINSTANCE& Instance = this->m_Instance;
+    const std::wstring& ExePath = this->m_ExePath;
+    const std::wstring& AppPath = this->m_AppPath;
+
+    const HANDLE& OriginalCurrentProcessToken =
+        this->m_OriginalCurrentProcessToken;
+    const bool& IsElevated = this->m_IsElevated;
+
+public:
+    CNSudoResourceManagement()
+    {
+        this->m_Instance = GetModuleHandleW(nullptr);
 
         this->m_ExePath = M2GetCurrentProcessModulePath();
 
@@ -1114,11 +1829,6 @@ public:
         wcsrchr(&this->m_AppPath[0], L'\\')[0] = L'\0';
         this->m_AppPath.resize(wcslen(this->m_AppPath.c_str()));
 
-        CNSudoTranslationAdapter::Load(this->m_StringTranslations);
-
-        CNSudoShortCutAdapter::Read(
-            this->AppPath + L"\\NSudo.json", this->m_ShortCutList);
-
         M2::CHandle CurrentProcessToken;
 
         if (OpenProcessToken(
@@ -1150,10 +1860,66 @@ public:
         }
     }
 
-    std::wstring GetTranslation(
-        _In_ std::string Key)
+    LPCWSTR GetTranslation(
+        _In_ NSudoTranslationID ID)
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        if (!this->m_StringTranslationsLoaded)
+        {
+            CNSudoTranslationAdapter::Load(this->m_StringTranslations);
+            this->m_StringTranslationsLoaded = true;
+        }
+
+        if (NSudoTranslationID::Count == ID)
+        {
+            return L"";
+        }
+
+        return this->m_StringTranslations[static_cast<size_t>(ID)];
+    }
+
+    std::shared_ptr<const CNSudoShortCutList> GetShortCutList()
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        if (!this->m_ShortCutList)
+        {
+            this->m_ShortCutList = CNSudoShortCutAdapter::Load(
+                this->AppPath + L"\\NSudo.json",
+                this->AppPath + L"\\NSudo.json.index");
+        }
+
+        return this->m_ShortCutList;
+    }
+
+    /*
+    ReloadShortCutList函数在NSudo.json被修改后重新加载快捷命令索引。
+    The ReloadShortCutList function reloads the shortcut index after
+    NSudo.json is modified.
+    */
+    void ReloadShortCutList()
     {
-        return this->m_StringTranslations[Key];
+        std::wstring ShortCutListPath = this->AppPath + L"\\NSudo.json";
+
+        FILETIME LastWriteTime;
+        ULONGLONG Size;
+        CNSudoShortCutAdapter::GetSourceVersion(
+            ShortCutListPath, LastWriteTime, Size);
+
+        if (this->GetShortCutList()->IsBuiltFrom(LastWriteTime, Size))
+        {
+            return;
+        }
+
+        // 在锁外加载，使查找不会等待解析NSudo.json
+        std::shared_ptr<const CNSudoShortCutList> ShortCutList =
+            CNSudoShortCutAdapter::Load(
+                ShortCutListPath,
+                this->AppPath + L"\\NSudo.json.index");
+
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+        this->m_ShortCutList = ShortCutList;
     }
 
     std::wstring GetMessageString(
@@ -1167,9 +1933,9 @@ CNSudoResourceManagement g_ResourceManagement;
 
 typedef struct _NSUDO_CONTEXT_MENU_ITEM
 {
-    std::wstring ItemName;
-    std::wstring ItemDescription;
-    std::wstring ItemCommandParameters;
+    LPCWSTR ItemName;
+    LPCWSTR ItemDescription;
+    LPCWSTR ItemCommandParameters;
     bool HasLUAShield;
 } NSUDO_CONTEXT_MENU_ITEM, *PNSUDO_CONTEXT_MENU_ITEM;
 
@@ -1179,44 +1945,21 @@ public:
     static void Load(
         std::vector<NSUDO_CONTEXT_MENU_ITEM>& ContextMenuItems)
     {
-        M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
-            &ResourceInfo,
-            GetModuleHandleW(nullptr),
-            L"Config",
-            MAKEINTRESOURCEW(IDR_CONFIG_CONTEXT_MENU))))
+        // NSudoContextMenuItemDefinitions 由 NSudo.Resources.targets 在编译时
+        // 从 NSudoContextMenuManagement.json 生成
+        for (const auto& Definition : NSudoContextMenuItemDefinitions)
         {
-            nlohmann::json ContextMenuJSON =
-                nlohmann::json::parse(std::string(
-                    reinterpret_cast<const char*>(ResourceInfo.Pointer),
-                    ResourceInfo.Size));
-
-            for (auto& Item : ContextMenuJSON["ContextMenu"])
-            {
-                std::string RawItemName =
-                    Item["ItemName"].get<std::string>();
-                std::string RawItemDescriptionID =
-                    Item["ItemDescriptionID"].get<std::string>();
-                std::string RawItemCommandParameters =
-                    Item["ItemCommandParameters"].get<std::string>();
-                bool HasLUAShield =
-                    Item["HasLUAShield"].get<bool>();
-
-                NSUDO_CONTEXT_MENU_ITEM ContextMenuItem;
-
-                ContextMenuItem.ItemName = M2MakeUTF16String(RawItemName);
-
-                ContextMenuItem.ItemDescription =
-                    g_ResourceManagement.GetTranslation(
-                        RawItemDescriptionID);
+            NSUDO_CONTEXT_MENU_ITEM ContextMenuItem;
 
-                ContextMenuItem.ItemCommandParameters = M2MakeUTF16String(
-                    RawItemCommandParameters);
+            ContextMenuItem.ItemName = Definition.ItemName;
+            ContextMenuItem.ItemDescription =
+                g_ResourceManagement.GetTranslation(
+                    Definition.ItemDescriptionID);
+            ContextMenuItem.ItemCommandParameters =
+                Definition.ItemCommandParameters;
+            ContextMenuItem.HasLUAShield = Definition.HasLUAShield;
 
-                ContextMenuItem.HasLUAShield = HasLUAShield;
-
-                ContextMenuItems.push_back(ContextMenuItem);
-            }
+            ContextMenuItems.push_back(ContextMenuItem);
         }
     }
 };
@@ -1253,84 +1996,188 @@ public:
         CNSudoContextMenuAdapter::Load(this->m_ContextMenuItems);
     }
 
+    /*
+    Install函数把NSudo安装到系统。与已安装的NSudo相同的部分会被跳过，已安装的
+    NSudo注册的但当前版本不再使用的CommandStore项会被删除。注册表的修改在同一个
+    事务中完成，失败时不会留下写入了一半的右键菜单。
+    The Install function installs NSudo to the system. The parts which are the
+    same as the installed NSudo are skipped, and the CommandStore items which
+    are registered by the installed NSudo but no longer used by the current
+    version are deleted. The registry changes are made in one transaction, so a
+    failure leaves no half-written context menu.
+    */
     DWORD Install()
     {
         if (ERROR_SUCCESS != this->m_ConstructorError)
             return this->m_ConstructorError;
 
-        CopyFileW(
-            M2GetCurrentProcessModulePath().c_str(),
-            this->m_NSudoPath.c_str(),
-            FALSE);
+        // 只在已安装的NSudo.exe与当前的不同时复制
+        std::wstring CurrentPath = M2GetCurrentProcessModulePath();
+        if (!NSudoIsSameFileContent(
+            CurrentPath.c_str(),
+            this->m_NSudoPath.c_str()))
+        {
+            if (!CopyFileW(
+                CurrentPath.c_str(),
+                this->m_NSudoPath.c_str(),
+                FALSE))
+            {
+                return GetLastError();
+            }
+        }
 
         DWORD dwError = ERROR_SUCCESS;
 
-        std::wstring NSudoPathWithQuotation =
-            std::wstring(L"\"") + this->m_NSudoPath + L"\"";
-
-        M2::CHKey hNSudoItem;
-        std::wstring SubCommands;
+        M2::CHandle hTransaction;
+        hTransaction = CreateTransaction(
+            nullptr,
+            nullptr,
+            0,
+            0,
+            0,
+            0,
+            nullptr);
+        if (hTransaction.IsInvalid())
+            return GetLastError();
+
+        bool Changed = false;
+
+        std::wstring NSudoPathWithQuotation =
+            std::wstring(L"\"") + this->m_NSudoPath + L"\"";
+
+        std::wstring SubCommands;
 
         for (NSUDO_CONTEXT_MENU_ITEM Item : this->m_ContextMenuItems)
         {
             std::wstring GeneratedItemCommand =
                 NSudoPathWithQuotation + L" " +
                 Item.ItemCommandParameters + L" " +
-                L"-ShowWindowMode=Hide" + L" " +
-                L"cmd /c start \"NSudo.ContextMenu.Launcher\" " + L"\"%1\"";
+                L"-Resolve" + L" " +
+                L"\"%1\"";
 
             dwError = CreateCommandStoreItem(
                 this->m_CommandStoreRoot,
-                Item.ItemName.c_str(),
-                Item.ItemDescription.c_str(),
+                Item.ItemName,
+                Item.ItemDescription,
                 GeneratedItemCommand.c_str(),
-                Item.HasLUAShield);
+                Item.HasLUAShield,
+                hTransaction,
+                Changed);
             if (ERROR_SUCCESS != dwError)
                 return dwError;
 
-            SubCommands += Item.ItemName + L";";
+            SubCommands += Item.ItemName;
+            SubCommands += L";";
         }
 
-        dwError = M2RegCreateKey(
-            HKEY_CLASSES_ROOT,
-            L"*\\shell\\NSudo",
-            KEY_ALL_ACCESS | KEY_WOW64_64KEY,
-            &hNSudoItem);
-        if (ERROR_SUCCESS != dwError)
-            return dwError;
-
-        struct
-        {
-            LPCWSTR lpValueName;
-            LPCWSTR lpValueData;
-        } ValueList[] =
         {
-            {
+            M2::CHKey hNSudoItem;
+
+            // HKEY_CLASSES_ROOT是合并的视图，所以直接使用它在HKEY_LOCAL_MACHINE
+            // 中的位置
+            dwError = M2RegCreateKeyTransacted(
+                HKEY_LOCAL_MACHINE,
+                L"SOFTWARE\\Classes\\*\\shell\\NSudo",
+                KEY_ALL_ACCESS | KEY_WOW64_64KEY,
+                hTransaction,
+                &hNSudoItem,
+                Changed);
+            if (ERROR_SUCCESS != dwError)
+                return dwError;
+
+            // 之前安装的NSudo注册的项记录在SubCommands中，删除其中不再使用的项
+            std::wstring InstalledSubCommands;
+            if (ERROR_SUCCESS == M2RegQueryStringValue(
+                hNSudoItem,
                 L"SubCommands",
-                SubCommands.c_str()
-            },{
-                L"MUIVerb",
-                L"NSudo"
-            },{
-                L"Icon",
-                NSudoPathWithQuotation.c_str()
-            },{
-                L"Position",
-                L"1"
+                InstalledSubCommands))
+            {
+                size_t Begin = 0;
+                while (Begin < InstalledSubCommands.size())
+                {
+                    size_t End = InstalledSubCommands.find(L';', Begin);
+                    if (std::wstring::npos == End)
+                    {
+                        End = InstalledSubCommands.size();
+                    }
+
+                    std::wstring ItemName =
+                        InstalledSubCommands.substr(Begin, End - Begin);
+                    Begin = End + 1;
+
+                    // 只删除CommandStore下直接的项
+                    if (ItemName.empty() ||
+                        std::wstring::npos != ItemName.find(L'\\'))
+                        continue;
+
+                    bool IsStale = true;
+                    for (const NSUDO_CONTEXT_MENU_ITEM& Item
+                        : this->m_ContextMenuItems)
+                    {
+                        if (0 == _wcsicmp(ItemName.c_str(), Item.ItemName))
+                        {
+                            IsStale = false;
+                            break;
+                        }
+                    }
+                    if (!IsStale)
+                        continue;
+
+                    dwError = M2RegDeleteTreeTransacted(
+                        this->m_CommandStoreRoot,
+                        ItemName.c_str(),
+                        hTransaction);
+                    if (ERROR_SUCCESS == dwError)
+                    {
+                        Changed = true;
+                    }
+                    else if (ERROR_FILE_NOT_FOUND != dwError)
+                    {
+                        return dwError;
+                    }
+                }
+
+                dwError = ERROR_SUCCESS;
             }
-        };
 
-        for (size_t i = 0; i < sizeof(ValueList) / sizeof(*ValueList); ++i)
-        {
-            dwError = M2RegSetStringValue(
-                hNSudoItem,
-                ValueList[i].lpValueName,
-                ValueList[i].lpValueData);
-            if (ERROR_SUCCESS != dwError)
-                return dwError;
+            struct
+            {
+                LPCWSTR lpValueName;
+                LPCWSTR lpValueData;
+            } ValueList[] =
+            {
+                {
+                    L"SubCommands",
+                    SubCommands.c_str()
+                },{
+                    L"MUIVerb",
+                    L"NSudo"
+                },{
+                    L"Icon",
+                    NSudoPathWithQuotation.c_str()
+                },{
+                    L"Position",
+                    L"1"
+                }
+            };
+
+            for (size_t i = 0; i < sizeof(ValueList) / sizeof(*ValueList); ++i)
+            {
+                dwError = M2RegUpdateStringValue(
+                    hNSudoItem,
+                    ValueList[i].lpValueName,
+                    ValueList[i].lpValueData,
+                    Changed);
+                if (ERROR_SUCCESS != dwError)
+                    return dwError;
 
+            }
         }
 
+        // 没有修改时不提交事务，关闭事务句柄会回滚它
+        if (Changed && !CommitTransaction(hTransaction))
+            return GetLastError();
+
         return dwError;
     }
 
@@ -1358,7 +2205,7 @@ public:
         {
             dwError = RegDeleteTreeW(
                 this->m_CommandStoreRoot,
-                Item.ItemName.c_str());
+                Item.ItemName);
             if (ERROR_SUCCESS != dwError)
                 break;
         }
@@ -1372,1117 +2219,4661 @@ public:
 
 };
 
-// 解析命令行
-NSUDO_MESSAGE NSudoCommandLineParser(
-    _In_ bool bElevated,
-    _In_ bool bEnableContextMenuManagement,
-    _In_ std::wstring& ApplicationName,
-    _In_ std::map<std::wstring, std::wstring>& OptionsAndParameters,
-    _In_ std::wstring& UnresolvedCommandLine)
+// 选项的ID，同一个选项的别名使用相同的ID
+// The option IDs, the aliases of an option use the same ID.
+enum class NSudoOptionID
+{
+    Help,
+    Version,
+    Install,
+    Uninstall,
+    Broker,
+    KeepAlive,
+    Batch,
+    Parallel,
+    User,
+    Privileges,
+    IntegrityLevel,
+    Priority,
+    ShowWindowMode,
+    Wait,
+    CurrentDirectory,
+    UseCurrentConsole,
+    Env,
+    EnvFile,
+    CpuRateLimit,
+    MemoryLimit,
+    MaxWorkingSet,
+    IoRateLimit,
+    ActiveProcessLimit,
+    Affinity,
+    ProcessorGroup,
+    NumaNode,
+    CpuSets,
+    IoPriority,
+    MemoryPriority,
+    EcoQoS,
+    RedirectOutput,
+    Resolve,
+    Engine,
+    Session,
+    Stats,
+    StatsFile,
+
+    Count
+};
+
+// NSUDO_COMMAND_LINE::OptionMask 使用64位的位掩码
+static_assert(
+    static_cast<size_t>(NSudoOptionID::Count) <= 64,
+    "NSudoOptionID::Count must not be greater than 64.");
+
+// 选项的参数类型
+// The parameter types of the options.
+enum class NSudoOptionParameterType
+{
+    // 不接受参数，例如 -Wait
+    None,
+    // 参数可以省略，例如 -Parallel
+    Optional,
+    // 必须指定参数，例如 -CurrentDirectory
+    Required,
+    // 参数必须是选项表中列出的值之一，例如 -U
+    Value
+};
+
+// The value definition of the options which parameter type is Value.
+typedef struct _NSUDO_OPTION_VALUE_DEFINITION
+{
+    LPCWSTR Name;
+    DWORD Value;
+} NSUDO_OPTION_VALUE_DEFINITION, *PNSUDO_OPTION_VALUE_DEFINITION;
+
+// The option definition.
+typedef struct _NSUDO_OPTION_DEFINITION
 {
-    UNREFERENCED_PARAMETER(ApplicationName);
+    LPCWSTR Name;
+    NSudoOptionID ID;
+    NSudoOptionParameterType ParameterType;
+    // 参数在用法中的名称，参数类型为 Value 时使用 Values 列出的值。参数类型为
+    // Value 并且指定了ParameterName时，参数也可以是由选项自己解析的其他值
+    LPCWSTR ParameterName;
+    const NSUDO_OPTION_VALUE_DEFINITION* Values;
+    size_t ValueCount;
+    // 选项名后是否可以带 ":后缀"，例如 -Env:KEY=VALUE
+    bool AllowNameSuffix;
+    // 是否为创建进程的选项，只有这些选项可以用于批处理的每一行和NSudo代理
+    bool IsProcessOption;
+} NSUDO_OPTION_DEFINITION, *PNSUDO_OPTION_DEFINITION;
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoUserOptionValues[] =
+{
+    { L"T", static_cast<DWORD>(NSudoOptionUserValue::TrustedInstaller) },
+    { L"S", static_cast<DWORD>(NSudoOptionUserValue::System) },
+    { L"C", static_cast<DWORD>(NSudoOptionUserValue::CurrentUser) },
+    { L"P", static_cast<DWORD>(NSudoOptionUserValue::CurrentProcess) },
+    { L"D", static_cast<DWORD>(NSudoOptionUserValue::CurrentProcessDropRight) }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoPrivilegesOptionValues[] =
+{
+    { L"E", static_cast<DWORD>(NSudoOptionPrivilegesValue::EnableAllPrivileges) },
+    { L"D", static_cast<DWORD>(NSudoOptionPrivilegesValue::DisableAllPrivileges) }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoIntegrityLevelOptionValues[] =
+{
+    { L"S", static_cast<DWORD>(NSudoOptionIntegrityLevelValue::System) },
+    { L"H", static_cast<DWORD>(NSudoOptionIntegrityLevelValue::High) },
+    { L"M", static_cast<DWORD>(NSudoOptionIntegrityLevelValue::Medium) },
+    { L"L", static_cast<DWORD>(NSudoOptionIntegrityLevelValue::Low) }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoPriorityOptionValues[] =
+{
+    { L"Idle", IDLE_PRIORITY_CLASS },
+    { L"BelowNormal", BELOW_NORMAL_PRIORITY_CLASS },
+    { L"Normal", NORMAL_PRIORITY_CLASS },
+    { L"AboveNormal", ABOVE_NORMAL_PRIORITY_CLASS },
+    { L"High", HIGH_PRIORITY_CLASS },
+    { L"RealTime", REALTIME_PRIORITY_CLASS }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoIoPriorityOptionValues[] =
+{
+    { L"VeryLow", static_cast<DWORD>(NSudoIoPriority::VeryLow) },
+    { L"Low", static_cast<DWORD>(NSudoIoPriority::Low) },
+    { L"Normal", static_cast<DWORD>(NSudoIoPriority::Normal) }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoEngineOptionValues[] =
+{
+    { L"Token", static_cast<DWORD>(NSudoOptionEngineValue::Token) },
+    { L"ParentProcess", static_cast<DWORD>(NSudoOptionEngineValue::ParentProcess) }
+};
+
+const NSUDO_OPTION_VALUE_DEFINITION NSudoShowWindowModeOptionValues[] =
+{
+    { L"Show", SW_SHOW },
+    { L"Hide", SW_HIDE },
+    { L"Maximize", SW_MAXIMIZE },
+    { L"Minimize", SW_MINIMIZE }
+};
 
-    if (1 == OptionsAndParameters.size() && UnresolvedCommandLine.empty())
+#define NSUDO_OPTION_VALUES(Values) nullptr, Values, _countof(Values)
+#define NSUDO_OPTION_PARAMETER(Name) Name, nullptr, 0
+#define NSUDO_OPTION_VALUES_OR_PARAMETER(Values, Name) \
+    Name, Values, _countof(Values)
+
+// NSudo的选项表，选项的解析、验证和用法都由这个表生成
+// The option table of NSudo. The parsing, validation and usage of the options
+// are generated from this table.
+const NSUDO_OPTION_DEFINITION NSudoOptionDefinitions[] =
+{
+    {
+        L"?", NSudoOptionID::Help, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"H", NSudoOptionID::Help, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"Help", NSudoOptionID::Help, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"Version", NSudoOptionID::Version, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"Install", NSudoOptionID::Install, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"Uninstall", NSudoOptionID::Uninstall, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"Broker", NSudoOptionID::Broker, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, false
+    },
+    {
+        L"KeepAlive", NSudoOptionID::KeepAlive, NSudoOptionParameterType::Optional,
+        NSUDO_OPTION_PARAMETER(L"Seconds"), false, false
+    },
+    {
+        L"Batch", NSudoOptionID::Batch, NSudoOptionParameterType::Optional,
+        NSUDO_OPTION_PARAMETER(L"FilePath"), false, false
+    },
+    {
+        L"Parallel", NSudoOptionID::Parallel, NSudoOptionParameterType::Optional,
+        NSUDO_OPTION_PARAMETER(L"Number"), false, false
+    },
     {
-        auto OptionAndParameter = *OptionsAndParameters.begin();
+        L"U", NSudoOptionID::User, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoUserOptionValues), false, true
+    },
+    {
+        L"P", NSudoOptionID::Privileges, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES_OR_PARAMETER(
+            NSudoPrivilegesOptionValues, L"+Privilege,-Privilege"),
+        false, true
+    },
+    {
+        L"M", NSudoOptionID::IntegrityLevel, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoIntegrityLevelOptionValues), false, true
+    },
+    {
+        L"Priority", NSudoOptionID::Priority, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoPriorityOptionValues), false, true
+    },
+    {
+        L"ShowWindowMode", NSudoOptionID::ShowWindowMode, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoShowWindowModeOptionValues), false, true
+    },
+    {
+        L"Wait", NSudoOptionID::Wait, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"CurrentDirectory", NSudoOptionID::CurrentDirectory, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"DirectoryPath"), false, true
+    },
+    {
+        L"UseCurrentConsole", NSudoOptionID::UseCurrentConsole, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"Env", NSudoOptionID::Env, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Name=Value"), true, true
+    },
+    {
+        L"EnvFile", NSudoOptionID::EnvFile, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"FilePath"), false, true
+    },
+    {
+        L"CpuRateLimit", NSudoOptionID::CpuRateLimit, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Percent"), false, true
+    },
+    {
+        L"MemoryLimit", NSudoOptionID::MemoryLimit, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Megabytes"), false, true
+    },
+    {
+        L"MaxWorkingSet", NSudoOptionID::MaxWorkingSet, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Megabytes"), false, true
+    },
+    {
+        L"IoRateLimit", NSudoOptionID::IoRateLimit, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"IOPS"), false, true
+    },
+    {
+        L"ActiveProcessLimit", NSudoOptionID::ActiveProcessLimit, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Number"), false, true
+    },
+    {
+        L"Affinity", NSudoOptionID::Affinity, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Mask"), false, true
+    },
+    {
+        L"ProcessorGroup", NSudoOptionID::ProcessorGroup, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Number"), false, true
+    },
+    {
+        L"NumaNode", NSudoOptionID::NumaNode, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"Number"), false, true
+    },
+    {
+        L"CpuSets", NSudoOptionID::CpuSets, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"ID,ID,..."), false, true
+    },
+    {
+        L"IoPriority", NSudoOptionID::IoPriority, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoIoPriorityOptionValues), false, true
+    },
+    {
+        L"MemoryPriority", NSudoOptionID::MemoryPriority, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"1-5"), false, true
+    },
+    {
+        L"EcoQoS", NSudoOptionID::EcoQoS, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"RedirectOutput", NSudoOptionID::RedirectOutput, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"Resolve", NSudoOptionID::Resolve, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"Engine", NSudoOptionID::Engine, NSudoOptionParameterType::Value,
+        NSUDO_OPTION_VALUES(NSudoEngineOptionValues), false, true
+    },
+    {
+        L"Session", NSudoOptionID::Session, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"All | ID,ID,..."), false, true
+    },
+    {
+        L"Stats", NSudoOptionID::Stats, NSudoOptionParameterType::None,
+        NSUDO_OPTION_PARAMETER(nullptr), false, true
+    },
+    {
+        L"StatsFile", NSudoOptionID::StatsFile, NSudoOptionParameterType::Required,
+        NSUDO_OPTION_PARAMETER(L"path"), false, true
+    }
+};
+
+#undef NSUDO_OPTION_PARAMETER
+#undef NSUDO_OPTION_VALUES
+
+/*
+CNSudoOptionIndex类实现了选项表的大小写不敏感的哈希索引，使查找选项只需计算一次
+哈希并比较一次字符串。槽位数大于选项数的两倍，目前的选项在索引中没有冲突；添加
+选项后如果出现冲突，则使用线性探测。
+The CNSudoOptionIndex class implements the case-insensitive hash index of the
+option table, so looking up an option only needs to compute the hash once and
+compare the string once. The number of slots is more than twice the number of
+options, and the current options have no collision in the index. If there are
+collisions after adding options, linear probing is used.
+*/
+class CNSudoOptionIndex
+{
+private:
+    static const size_t SlotCount = 128;
+
+    // 每个槽位保存选项在选项表中的下标加1，0表示空槽位
+    BYTE m_Slots[SlotCount];
 
+    static_assert(
+        _countof(NSudoOptionDefinitions) < SlotCount,
+        "The option index must have an empty slot.");
 
-        if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"?") ||
-            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"H") ||
-            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Help"))
+    // 大小写不敏感的FNV-1a哈希，选项名只包含ASCII字符
+    static size_t Hash(
+        _In_ std::wstring_view Name)
+    {
+        DWORD Hash = 2166136261;
+
+        for (wchar_t Character : Name)
         {
-            // 如果选项名是 "?", "H" 或 "Help"，则显示帮助。
-            return NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP;
+            DWORD Value = Character;
+            if (Value >= L'a' && Value <= L'z')
+            {
+                Value -= L'a' - L'A';
+            }
+
+            Hash = (Hash ^ Value) * 16777619;
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Version"))
+
+        return Hash & (SlotCount - 1);
+    }
+
+public:
+    CNSudoOptionIndex()
+    {
+        memset(this->m_Slots, 0, sizeof(this->m_Slots));
+
+        for (size_t i = 0; i < _countof(NSudoOptionDefinitions); ++i)
         {
-            // 如果选项名是 "?", "H" 或 "Help"，则显示 NSudo 版本号。
-            return NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION;
+            size_t Slot = CNSudoOptionIndex::Hash(
+                NSudoOptionDefinitions[i].Name);
+
+            while (0 != this->m_Slots[Slot])
+            {
+                Slot = (Slot + 1) & (SlotCount - 1);
+            }
+
+            this->m_Slots[Slot] = static_cast<BYTE>(i + 1);
         }
-        else
+    }
+
+    const NSUDO_OPTION_DEFINITION* Find(
+        _In_ std::wstring_view Name) const
+    {
+        for (size_t Slot = CNSudoOptionIndex::Hash(Name);
+            0 != this->m_Slots[Slot];
+            Slot = (Slot + 1) & (SlotCount - 1))
         {
-            if (bEnableContextMenuManagement)
+            const NSUDO_OPTION_DEFINITION& Definition =
+                NSudoOptionDefinitions[this->m_Slots[Slot] - 1];
+
+            if (Name.size() == wcslen(Definition.Name) &&
+                0 == _wcsnicmp(Name.data(), Definition.Name, Name.size()))
             {
-                CNSudoContextMenuManagement ContextMenuManagement;
+                return &Definition;
+            }
+        }
 
-                if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Install"))
-                {
-                    // 如果参数是 /Install 或 -Install，则安装NSudo到系统
-                    if (ERROR_SUCCESS != ContextMenuManagement.Install())
-                    {
-                        ContextMenuManagement.Uninstall();
-                    }
+        return nullptr;
+    }
+};
 
-                    return NSUDO_MESSAGE::SUCCESS;
+const CNSudoOptionIndex g_OptionIndex;
+
+// 一个命令行中最多可以包含的选项数
+#define NSUDO_MAXIMUM_OPTIONS 64
+
+// The option parsed from the command line.
+typedef struct _NSUDO_COMMAND_LINE_OPTION
+{
+    const NSUDO_OPTION_DEFINITION* Definition;
+    // 选项名的 ":后缀"，例如 -Env:KEY=VALUE 中的 "KEY"
+    std::wstring_view NameSuffix;
+    // 选项的参数，以 NULL 结尾
+    std::wstring_view Parameter;
+    // 参数类型为 Value 时参数对应的值，参数不是 Values 列出的值时为
+    // NSUDO_OPTION_VALUE_PARAMETER
+    DWORD Value;
+} NSUDO_COMMAND_LINE_OPTION, *PNSUDO_COMMAND_LINE_OPTION;
+
+// 参数类型为 Value 的选项的参数由选项自己解析
+#define NSUDO_OPTION_VALUE_PARAMETER static_cast<DWORD>(-1)
+
+/*
+NSUDO_COMMAND_LINE结构保存解析后的命令行。选项按照用户指定的顺序保存在固定大
+小的数组中，选项中的字符串都指向Buffer，所以此结构不可复制。
+The NSUDO_COMMAND_LINE structure contains the parsed command line. The options
+are saved in a fixed-size array in the order specified by the user, and the
+strings in the options point to Buffer, so this structure is not copyable.
+*/
+typedef struct _NSUDO_COMMAND_LINE : M2::CDisableObjectCopying
+{
+    std::wstring_view ApplicationName;
+    std::wstring UnresolvedCommandLine;
+
+    size_t OptionCount = 0;
+    NSUDO_COMMAND_LINE_OPTION Options[NSUDO_MAXIMUM_OPTIONS];
+
+    // 包含的选项ID的位掩码
+    ULONGLONG OptionMask = 0;
+
+    // 命令行中的选项是否都有效，无效时InvalidArgument为第一个无效的参数，
+    // InvalidOption为它对应的选项定义（选项名无效时为nullptr）
+    bool IsValid = true;
+    std::wstring_view InvalidArgument;
+    const NSUDO_OPTION_DEFINITION* InvalidOption = nullptr;
+
+    // 去掉引号和转义后的各个参数，以 NULL 分隔
+    std::wstring Buffer;
+} NSUDO_COMMAND_LINE, *PNSUDO_COMMAND_LINE;
+
+// 判断命令行是否包含指定的选项
+bool NSudoCommandLineHasOption(
+    _In_ const NSUDO_COMMAND_LINE& CommandLine,
+    _In_ NSudoOptionID ID)
+{
+    return 0 != (CommandLine.OptionMask & (1ULL << static_cast<size_t>(ID)));
+}
+
+// 按照C运行时库的规则读取一个参数到Buffer中，并返回指向Buffer的参数
+std::wstring_view NSudoReadCommandLineArgument(
+    _Inout_ const wchar_t*& Current,
+    _Inout_ std::wstring& Buffer)
+{
+    size_t Start = Buffer.size();
+    bool InQuotes = false;
+
+    for (;;)
+    {
+        bool CopyCharacter = true;
+
+        // 2N个反斜杠 + " ==> N个反斜杠和开始或结束引号
+        // 2N + 1个反斜杠 + " ==> N个反斜杠和字面的 "
+        // N个反斜杠 ==> N个反斜杠
+        size_t BackslashCount = 0;
+        while (L'\\' == *Current)
+        {
+            ++Current;
+            ++BackslashCount;
+        }
+
+        if (L'"' == *Current)
+        {
+            if (0 == BackslashCount % 2)
+            {
+                if (InQuotes && L'"' == Current[1])
+                {
+                    // 引号中的两个引号表示字面的 "
+                    ++Current;
                 }
-                else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Uninstall"))
+                else
                 {
-                    // 如果参数是 /Uninstall 或 -Uninstall，则移除安装到系统的NSudo
-                    ContextMenuManagement.Uninstall();
-
-                    return NSUDO_MESSAGE::SUCCESS;
+                    CopyCharacter = false;
+                    InQuotes = !InQuotes;
                 }
             }
 
-            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+            BackslashCount /= 2;
         }
-    }
 
-    DWORD dwSessionID = (DWORD)-1;
+        Buffer.append(BackslashCount, L'\\');
 
-    // 获取当前进程会话ID
-    if (!NSudoGetCurrentProcessSessionID(&dwSessionID))
-    {
-        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
-    }
+        if (L'\0' == *Current ||
+            (!InQuotes && (L' ' == *Current || L'\t' == *Current)))
+        {
+            break;
+        }
 
-    // 如果未提权或者模拟System权限失败
-    if (!(bElevated && NSudoImpersonateAsSystem()))
-    {
-        return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        if (CopyCharacter)
+        {
+            Buffer.push_back(*Current);
+        }
+
+        ++Current;
     }
 
-    bool bArgErr = false;
+    Buffer.push_back(L'\0');
 
-    M2::CHandle hToken;
-    M2::CHandle hTempToken;
+    return std::wstring_view(
+        Buffer.data() + Start,
+        Buffer.size() - Start - 1);
+}
 
-    // 解析参数列表
+// 根据选项表解析并验证一个选项（不包含前缀），有效时添加到命令行中
+bool NSudoAddCommandLineOption(
+    _In_ std::wstring_view Argument,
+    _Inout_ NSUDO_COMMAND_LINE& CommandLine,
+    _Out_ const NSUDO_OPTION_DEFINITION*& Definition)
+{
+    NSUDO_COMMAND_LINE_OPTION Option;
+    Option.Value = 0;
 
-    enum class NSudoOptionUserValue
-    {
-        Default,
-        TrustedInstaller,
-        System,
-        CurrentUser,
-        CurrentProcess,
-        CurrentProcessDropRight
-    };
+    // 选项名和参数以最先出现的 "=" 或 ":" 分隔，所以参数中可以包含另一个分隔
+    // 符，例如 -CurrentDirectory:C:\A=B
+    size_t Separator = Argument.find_first_of(L"=:");
 
-    enum class NSudoOptionPrivilegesValue
-    {
-        Default,
-        EnableAllPrivileges,
-        DisableAllPrivileges
-    };
+    bool HasParameter = (std::wstring_view::npos != Separator);
 
-    enum class NSudoOptionIntegrityLevelValue
+    std::wstring_view Name = Argument.substr(0, Separator);
+    if (HasParameter)
     {
-        Default,
-        System,
-        High,
-        Medium,
-        Low
-    };
+        Option.Parameter = Argument.substr(Separator + 1);
+    }
 
-    enum class NSudoOptionProcessPriorityValue
+    Definition = g_OptionIndex.Find(Name);
+    if (!Definition)
     {
-        Default,
-        Idle,
-        BelowNormal,
-        Normal,
-        AboveNormal,
-        High,
-        RealTime
-    };
+        return false;
+    }
 
-    enum class NSudoOptionWindowModeValue
+    if (Definition->AllowNameSuffix)
     {
-        Default,
-        Show,
-        Hide,
-        Maximize,
-        Minimize,
-    };
+        // 例如 -Env:KEY=VALUE 的后缀为 "KEY"，参数为 "VALUE"
+        if (!HasParameter || L':' != Argument[Separator])
+        {
+            return false;
+        }
+
+        size_t ValueSeparator = Option.Parameter.find(L'=');
 
-    NSudoOptionUserValue UserMode =
-        NSudoOptionUserValue::Default;
-    NSudoOptionPrivilegesValue PrivilegesMode =
-        NSudoOptionPrivilegesValue::Default;
-    NSudoOptionIntegrityLevelValue IntegrityLevelMode =
-        NSudoOptionIntegrityLevelValue::Default;
-    NSudoOptionProcessPriorityValue ProcessPriorityMode =
-        NSudoOptionProcessPriorityValue::Default;
-    NSudoOptionWindowModeValue WindowMode =
-        NSudoOptionWindowModeValue::Default;
+        Option.NameSuffix = Option.Parameter.substr(0, ValueSeparator);
+        if (Option.NameSuffix.empty())
+        {
+            return false;
+        }
+
+        HasParameter = (std::wstring_view::npos != ValueSeparator);
+        Option.Parameter = Option.Parameter.substr(
+            HasParameter ? ValueSeparator + 1 : Option.Parameter.size());
+    }
 
-    DWORD WaitInterval = 0;
-    std::wstring CurrentDirectory = g_ResourceManagement.AppPath;
-    DWORD ShowWindowMode = SW_SHOWDEFAULT;
-    bool CreateNewConsole = true;
+    Option.Definition = Definition;
 
-    for (auto& OptionAndParameter : OptionsAndParameters)
+    switch (Definition->ParameterType)
     {
-        if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"U"))
+    case NSudoOptionParameterType::None:
+        if (HasParameter)
         {
-            if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"T"))
-            {
-                UserMode = NSudoOptionUserValue::TrustedInstaller;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"S"))
-            {
-                UserMode = NSudoOptionUserValue::System;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"C"))
-            {
-                UserMode = NSudoOptionUserValue::CurrentUser;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"P"))
-            {
-                UserMode = NSudoOptionUserValue::CurrentProcess;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"D"))
-            {
-                UserMode = NSudoOptionUserValue::CurrentProcessDropRight;
-            }
-            else
+            return false;
+        }
+        break;
+    case NSudoOptionParameterType::Optional:
+        break;
+    case NSudoOptionParameterType::Required:
+        // 带后缀时必须有 "=" 但参数可以为空，例如 -Env:KEY= 表示删除环境变量，
+        // 而 -Env:KEY 无效
+        if (Option.NameSuffix.empty() ? Option.Parameter.empty() : !HasParameter)
+        {
+            return false;
+        }
+        break;
+    case NSudoOptionParameterType::Value:
+    {
+        bool Found = false;
+
+        for (size_t i = 0; i < Definition->ValueCount; ++i)
+        {
+            LPCWSTR ValueName = Definition->Values[i].Name;
+
+            if (Option.Parameter.size() == wcslen(ValueName) &&
+                0 == _wcsnicmp(
+                    Option.Parameter.data(),
+                    ValueName,
+                    Option.Parameter.size()))
             {
-                bArgErr = true;
+                Option.Value = Definition->Values[i].Value;
+                Found = true;
                 break;
             }
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"P"))
+
+        if (!Found)
         {
-            if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"E"))
-            {
-                PrivilegesMode = NSudoOptionPrivilegesValue::EnableAllPrivileges;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"D"))
+            // 例如 -P:+SeBackupPrivilege，参数由选项自己解析
+            if (!Definition->ParameterName || Option.Parameter.empty())
             {
-                PrivilegesMode = NSudoOptionPrivilegesValue::DisableAllPrivileges;
-            }
-            else
-            {
-                bArgErr = true;
-                break;
+                return false;
             }
+
+            Option.Value = NSUDO_OPTION_VALUE_PARAMETER;
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"M"))
+
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (NSUDO_MAXIMUM_OPTIONS == CommandLine.OptionCount)
+    {
+        return false;
+    }
+
+    CommandLine.Options[CommandLine.OptionCount++] = Option;
+    CommandLine.OptionMask |= 1ULL << static_cast<size_t>(Definition->ID);
+
+    return true;
+}
+
+/*
+NSudoParseCommandLine函数解析命令行。选项的前缀可以是 "-"、"/" 或 "--"，选项和
+参数的分隔符可以是 "=" 或 ":"。第一个不是选项的参数及其后的内容是要执行的命令
+行，它保持原样。
+The NSudoParseCommandLine function parses the command line. The prefix of the
+options can be "-", "/" or "--", and the separator of the option and parameter
+can be "=" or ":". The first argument which is not an option and the content
+after it are the command line to execute, which is kept as is.
+
+如果ContainsApplicationName为false，则命令行不包含程序名，例如批处理的每一行。
+If ContainsApplicationName is false, the command line does not contain the
+application name, for example each line of the batch.
+*/
+void NSudoParseCommandLine(
+    _In_ LPCWSTR CommandLine,
+    _Out_ NSUDO_COMMAND_LINE& Result,
+    _In_ bool ContainsApplicationName = true)
+{
+    Result.ApplicationName = std::wstring_view();
+    Result.UnresolvedCommandLine.clear();
+    Result.OptionCount = 0;
+    Result.OptionMask = 0;
+    Result.IsValid = true;
+    Result.InvalidArgument = std::wstring_view();
+    Result.InvalidOption = nullptr;
+
+    // 解析后的参数不会比命令行更长，预留空间后Buffer不会重新分配，所以指向它
+    // 的字符串始终有效
+    Result.Buffer.clear();
+    Result.Buffer.reserve(wcslen(CommandLine) + 1);
+
+    const wchar_t* Current = CommandLine;
+
+    if (ContainsApplicationName)
+    {
+        // 程序名必须是合法的文件名，所以只需处理引号
+        size_t Start = Result.Buffer.size();
+        bool InQuotes = false;
+
+        for (; L'\0' != *Current; ++Current)
         {
-            if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"S"))
-            {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::System;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"H"))
-            {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::High;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"M"))
+            if (L'"' == *Current)
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Medium;
+                InQuotes = !InQuotes;
             }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"L"))
+            else if (!InQuotes && (L' ' == *Current || L'\t' == *Current))
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Low;
+                break;
             }
             else
             {
-                bArgErr = true;
-                break;
+                Result.Buffer.push_back(*Current);
             }
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Wait"))
+
+        Result.Buffer.push_back(L'\0');
+
+        Result.ApplicationName = std::wstring_view(
+            Result.Buffer.data() + Start,
+            Result.Buffer.size() - Start - 1);
+    }
+
+    for (;;)
+    {
+        while (L' ' == *Current || L'\t' == *Current)
         {
-            WaitInterval = INFINITE;
+            ++Current;
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Priority"))
+
+        if (L'\0' == *Current)
         {
-            if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Idle"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::Idle;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"BelowNormal"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::BelowNormal;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Normal"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::Normal;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"AboveNormal"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::AboveNormal;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"High"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::High;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"RealTime"))
-            {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::RealTime;
-            }
-            else
-            {
-                bArgErr = true;
-                break;
-            }
+            break;
+        }
+
+        const wchar_t* ArgumentStart = Current;
+
+        std::wstring_view Argument = NSudoReadCommandLineArgument(
+            Current, Result.Buffer);
+
+        size_t OptionPrefixLength = 0;
+        if (0 == Argument.compare(0, 2, L"--"))
+        {
+            OptionPrefixLength = 2;
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"CurrentDirectory"))
+        else if (0 == Argument.compare(0, 1, L"-") ||
+            0 == Argument.compare(0, 1, L"/"))
         {
-            CurrentDirectory = OptionAndParameter.second;
+            OptionPrefixLength = 1;
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"ShowWindowMode"))
+
+        if (0 == OptionPrefixLength)
         {
-            if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Show"))
-            {
-                WindowMode = NSudoOptionWindowModeValue::Show;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Hide"))
-            {
-                WindowMode = NSudoOptionWindowModeValue::Hide;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Maximize"))
-            {
-                WindowMode = NSudoOptionWindowModeValue::Maximize;
-            }
-            else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Minimize"))
-            {
-                WindowMode = NSudoOptionWindowModeValue::Minimize;
-            }
-            else
+            Result.UnresolvedCommandLine = ArgumentStart;
+            break;
+        }
+
+        const NSUDO_OPTION_DEFINITION* Definition = nullptr;
+        if (!NSudoAddCommandLineOption(
+            Argument.substr(OptionPrefixLength), Result, Definition))
+        {
+            // 只记录第一个无效的参数，继续解析以获取要执行的命令行
+            if (Result.IsValid)
             {
-                bArgErr = true;
-                break;
+                Result.IsValid = false;
+                Result.InvalidArgument = Argument;
+                Result.InvalidOption = Definition;
             }
         }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"UseCurrentConsole"))
+    }
+}
+
+// 根据选项表生成选项的用法，例如 "-U:[ T | S | C | P | D ]"
+std::wstring NSudoGetOptionUsage(
+    _In_ const NSUDO_OPTION_DEFINITION& Definition)
+{
+    std::wstring Usage = L"-";
+    Usage += Definition.Name;
+
+    switch (Definition.ParameterType)
+    {
+    case NSudoOptionParameterType::Optional:
+        Usage += L"[:[ ";
+        Usage += Definition.ParameterName;
+        Usage += L" ]]";
+        break;
+    case NSudoOptionParameterType::Required:
+        Usage += L":[ ";
+        Usage += Definition.ParameterName;
+        Usage += L" ]";
+        break;
+    case NSudoOptionParameterType::Value:
+        Usage += L":[ ";
+        for (size_t i = 0; i < Definition.ValueCount; ++i)
         {
-            CreateNewConsole = false;
+            if (0 != i)
+            {
+                Usage += L" | ";
+            }
+            Usage += Definition.Values[i].Name;
         }
-        else
+        if (Definition.ParameterName)
         {
-            bArgErr = true;
-            break;
+            Usage += L" | ";
+            Usage += Definition.ParameterName;
         }
+        Usage += L" ]";
+        break;
+    default:
+        break;
     }
 
-    if (bArgErr || NSudoOptionUserValue::Default == UserMode)
+    return Usage;
+}
+
+// 生成无效命令行的用法提示：选项名有效时只提示该选项，否则列出所有选项
+std::wstring NSudoGetCommandLineUsage(
+    _In_ const NSUDO_COMMAND_LINE& CommandLine)
+{
+    std::wstring Usage;
+
+    if (CommandLine.IsValid)
     {
-        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        return Usage;
     }
 
-    if (NSudoOptionUserValue::TrustedInstaller == UserMode)
+    Usage += CommandLine.InvalidArgument;
+    Usage += L"\r\n\r\n";
+
+    if (CommandLine.InvalidOption)
     {
-        if (!NSudoDuplicateServiceToken(
-            L"TrustedInstaller",
-            MAXIMUM_ALLOWED,
-            nullptr,
-            SecurityIdentification,
-            TokenPrimary,
-            &hToken))
+        Usage += NSudoGetOptionUsage(*CommandLine.InvalidOption);
+        Usage += L"\r\n";
+    }
+    else
+    {
+        for (const auto& Definition : NSudoOptionDefinitions)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            Usage += NSudoGetOptionUsage(Definition);
+            Usage += L"\r\n";
         }
+    }
 
-        if (!SetTokenInformation(
-            hToken,
-            TokenSessionId,
-            (PVOID)&dwSessionID,
-            sizeof(DWORD)))
-        {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
-        }
+    return Usage;
+}
+
+// The process creation options parsed from the command line.
+typedef struct _NSUDO_PROCESS_OPTIONS
+{
+    NSudoOptionUserValue UserMode;
+    NSudoOptionPrivilegesValue PrivilegesMode;
+    // 使用 -P:+Privilege,-Privilege 时按名称启用和禁用的特权，第N位对应LUID为N
+    // 的特权
+    ULONGLONG EnablePrivileges;
+    ULONGLONG DisablePrivileges;
+    NSudoOptionIntegrityLevelValue IntegrityLevelMode;
+    DWORD WaitInterval;
+    std::wstring CurrentDirectory;
+    DWORD ProcessPriority;
+    DWORD ShowWindowMode;
+    bool CreateNewConsole;
+    NSUDO_ENVIRONMENT_VARIABLES EnvironmentVariables;
+    NSUDO_JOB_LIMITS JobLimits;
+    NSUDO_PROCESS_PLACEMENT Placement;
+    NSUDO_PROCESS_QOS QoS;
+    bool RedirectOutput;
+    // 使用 -Resolve 时把命令行开头的文档或者URL解析为其关联程序的命令行，只用于
+    // 图形界面和右键菜单
+    bool ResolveCommandLine;
+    NSudoOptionEngineValue Engine;
+    // 使用 -Session 时的目标会话，由CNSudoBatch按会话展开
+    bool AllSessions;
+    std::vector<DWORD> Sessions;
+    // 使用 -Stats 或者 -StatsFile 时在新进程结束后报告资源使用情况，StatsFile为
+    // 空时写入标准输出
+    bool Stats;
+    std::wstring StatsFile;
+} NSUDO_PROCESS_OPTIONS, *PNSUDO_PROCESS_OPTIONS;
+
+// 获取根据选项对新进程的令牌做的调整，SessionId为(DWORD)-1时不修改会话
+NSUDO_TOKEN_ADJUSTMENTS NSudoGetTokenAdjustments(
+    _In_ const NSUDO_PROCESS_OPTIONS& Options,
+    _In_ DWORD SessionId)
+{
+    NSUDO_TOKEN_ADJUSTMENTS Adjustments;
+
+    Adjustments.SessionId = SessionId;
+    Adjustments.PrivilegesMode = Options.PrivilegesMode;
+    Adjustments.EnablePrivileges = Options.EnablePrivileges;
+    Adjustments.DisablePrivileges = Options.DisablePrivileges;
+    Adjustments.IntegrityLevelMode = Options.IntegrityLevelMode;
+
+    return Adjustments;
+}
+
+// 获取根据选项创建新进程的选项，返回值引用Options中的成员，所以不能超过Options
+// 的生存期
+NSUDO_CREATE_PROCESS_OPTIONS NSudoGetCreateProcessOptions(
+    _In_ const NSUDO_PROCESS_OPTIONS& Options,
+    _In_opt_ const NSUDO_PARENT_PROCESS* ParentProcess)
+{
+    NSUDO_CREATE_PROCESS_OPTIONS CreateOptions;
+
+    CreateOptions.ProcessPriority = Options.ProcessPriority;
+    CreateOptions.ShowWindowMode = Options.ShowWindowMode;
+    CreateOptions.CreateNewConsole = Options.CreateNewConsole;
+    CreateOptions.EnvironmentVariables = &Options.EnvironmentVariables;
+    CreateOptions.JobLimits = &Options.JobLimits;
+    CreateOptions.Placement = &Options.Placement;
+    CreateOptions.QoS = &Options.QoS;
+    CreateOptions.RedirectOutput = Options.RedirectOutput;
+    CreateOptions.ParentProcess = ParentProcess;
+
+    return CreateOptions;
+}
+
+// 解析无符号整数参数，以 "0x" 开头时为十六进制，否则为十进制。参数必须在
+// MinimumValue和MaximumValue之间
+bool NSudoParseNumberParameter(
+    _In_ std::wstring_view Parameter,
+    _In_ ULONGLONG MinimumValue,
+    _In_ ULONGLONG MaximumValue,
+    _Out_ ULONGLONG& Value)
+{
+    ULONGLONG Base = 10;
+
+    Value = 0;
+
+    if (Parameter.size() > 2 &&
+        L'0' == Parameter[0] &&
+        (L'x' == Parameter[1] || L'X' == Parameter[1]))
+    {
+        Base = 16;
+        Parameter.remove_prefix(2);
     }
-    else if (NSudoOptionUserValue::System == UserMode)
+
+    if (Parameter.empty())
     {
-        if (!NSudoDuplicateSystemToken(
-            MAXIMUM_ALLOWED,
-            nullptr,
-            SecurityIdentification,
-            TokenPrimary,
-            &hToken))
-        {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
-        }
+        return false;
     }
-    else if (NSudoOptionUserValue::CurrentUser == UserMode)
+
+    for (wchar_t Character : Parameter)
     {
-        if (!NSudoDuplicateSessionToken(
-            dwSessionID,
-            MAXIMUM_ALLOWED,
-            nullptr,
-            SecurityIdentification,
-            TokenPrimary,
-            &hToken))
+        ULONGLONG Digit = Base;
+        if (Character >= L'0' && Character <= L'9')
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            Digit = static_cast<ULONGLONG>(Character - L'0');
         }
-    }
-    else if (NSudoOptionUserValue::CurrentProcess == UserMode)
-    {
-        if (!DuplicateTokenEx(
-            g_ResourceManagement.OriginalCurrentProcessToken,
-            MAXIMUM_ALLOWED,
-            nullptr,
-            SecurityIdentification,
-            TokenPrimary,
-            &hToken))
+        else if (Character >= L'a' && Character <= L'f')
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            Digit = static_cast<ULONGLONG>(Character - L'a' + 10);
         }
-    }
-    else if (NSudoOptionUserValue::CurrentProcessDropRight == UserMode)
-    {
-        if (!DuplicateTokenEx(
-            g_ResourceManagement.OriginalCurrentProcessToken,
-            MAXIMUM_ALLOWED,
-            nullptr,
-            SecurityIdentification,
-            TokenPrimary,
-            &hTempToken))
+        else if (Character >= L'A' && Character <= L'F')
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            Digit = static_cast<ULONGLONG>(Character - L'A' + 10);
         }
 
-        if (!NSudoCreateLUAToken(&hToken, hTempToken))
+        if (Digit >= Base ||
+            Digit > MaximumValue ||
+            Value > (MaximumValue - Digit) / Base)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return false;
         }
+
+        Value = Value * Base + Digit;
     }
 
-    if (NSudoOptionPrivilegesValue::EnableAllPrivileges == PrivilegesMode)
+    return Value >= MinimumValue;
+}
+
+// 解析以 "," 分隔的ID列表，例如CPU集ID和会话ID
+bool NSudoParseNumberListParameter(
+    _In_ std::wstring_view Parameter,
+    _Out_ std::vector<ULONG>& Numbers)
+{
+    Numbers.clear();
+
+    for (;;)
     {
-        if (!NSudoSetTokenAllPrivileges(hToken, true))
+        size_t Separator = Parameter.find(L',');
+
+        ULONGLONG Number = 0;
+        if (!NSudoParseNumberParameter(
+            Parameter.substr(0, Separator), 0, MAXULONG, Number))
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return false;
         }
-    }
-    else if (NSudoOptionPrivilegesValue::DisableAllPrivileges == PrivilegesMode)
-    {
-        if (!NSudoSetTokenAllPrivileges(hToken, false))
+
+        Numbers.push_back(static_cast<ULONG>(Number));
+
+        if (std::wstring_view::npos == Separator)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return true;
         }
+
+        Parameter.remove_prefix(Separator + 1);
     }
+}
+
+// 解析以 "," 分隔的特权列表，例如 "+SeBackupPrivilege,-SeDebugPrivilege"。
+// "+" 启用特权，"-" 禁用特权，同一个特权以最后一次指定的为准
+bool NSudoParsePrivilegeListParameter(
+    _In_ std::wstring_view Parameter,
+    _Out_ ULONGLONG& EnablePrivileges,
+    _Out_ ULONGLONG& DisablePrivileges)
+{
+    EnablePrivileges = 0;
+    DisablePrivileges = 0;
 
-    if (NSudoOptionIntegrityLevelValue::System == IntegrityLevelMode)
+    for (;;)
     {
-        if (!NSudoSetTokenIntegrityLevel(hToken, SystemLevel))
+        size_t Separator = Parameter.find(L',');
+        std::wstring_view Item = Parameter.substr(0, Separator);
+
+        if (Item.size() < 2 || (L'+' != Item[0] && L'-' != Item[0]))
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return false;
         }
-    }
-    else if (NSudoOptionIntegrityLevelValue::High == IntegrityLevelMode)
-    {
-        if (!NSudoSetTokenIntegrityLevel(hToken, HighLevel))
+
+        bool Enable = (L'+' == Item[0]);
+        Item.remove_prefix(1);
+
+        bool Found = false;
+        for (const auto& Privilege : NSudoPrivilegeNames)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            if (Item.size() == wcslen(Privilege.Name) &&
+                0 == _wcsnicmp(Item.data(), Privilege.Name, Item.size()))
+            {
+                ULONGLONG Mask = 1ULL << Privilege.Value;
+
+                EnablePrivileges = Enable
+                    ? (EnablePrivileges | Mask)
+                    : (EnablePrivileges & ~Mask);
+                DisablePrivileges = Enable
+                    ? (DisablePrivileges & ~Mask)
+                    : (DisablePrivileges | Mask);
+
+                Found = true;
+                break;
+            }
         }
-    }
-    else if (NSudoOptionIntegrityLevelValue::Medium == IntegrityLevelMode)
-    {
-        if (!NSudoSetTokenIntegrityLevel(hToken, MediumLevel))
+        if (!Found)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return false;
         }
-    }
-    else if (NSudoOptionIntegrityLevelValue::Low == IntegrityLevelMode)
-    {
-        if (!NSudoSetTokenIntegrityLevel(hToken, LowLevel))
+
+        if (std::wstring_view::npos == Separator)
         {
-            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            return true;
         }
-    }
-
-    DWORD ProcessPriority = 0;
 
-    if (NSudoOptionProcessPriorityValue::Idle == ProcessPriorityMode)
-    {
-        ProcessPriority = IDLE_PRIORITY_CLASS;
-    }
-    else if (NSudoOptionProcessPriorityValue::BelowNormal == ProcessPriorityMode)
-    {
-        ProcessPriority = BELOW_NORMAL_PRIORITY_CLASS;
-    }
-    else if (NSudoOptionProcessPriorityValue::Normal == ProcessPriorityMode)
-    {
-        ProcessPriority = NORMAL_PRIORITY_CLASS;
+        Parameter.remove_prefix(Separator + 1);
     }
-    else if (NSudoOptionProcessPriorityValue::AboveNormal == ProcessPriorityMode)
+}
+
+// 解析 "KEY=VALUE" 格式的环境变量，没有 "=" 时值为空
+void NSudoParseEnvironmentVariable(
+    _In_ std::wstring_view String,
+    _Inout_ NSUDO_ENVIRONMENT_VARIABLES& EnvironmentVariables)
+{
+    size_t Separator = String.find(L'=');
+    if (std::wstring_view::npos == Separator)
     {
-        ProcessPriority = ABOVE_NORMAL_PRIORITY_CLASS;
+        EnvironmentVariables.emplace_back(String, std::wstring());
     }
-    else if (NSudoOptionProcessPriorityValue::High == ProcessPriorityMode)
+    else
     {
-        ProcessPriority = HIGH_PRIORITY_CLASS;
+        EnvironmentVariables.emplace_back(
+            String.substr(0, Separator),
+            String.substr(Separator + 1));
     }
-    else if (NSudoOptionProcessPriorityValue::RealTime == ProcessPriorityMode)
+}
+
+// 读取环境变量文件，每一行都是 "KEY=VALUE" 格式，跳过空行和以 "#" 开头的行
+bool NSudoReadEnvironmentFile(
+    _In_ const std::wstring& FilePath,
+    _Inout_ NSUDO_ENVIRONMENT_VARIABLES& EnvironmentVariables)
+{
+    std::wstring Content;
+    if (!NSudoReadTextFile(FilePath.c_str(), Content))
     {
-        ProcessPriority = REALTIME_PRIORITY_CLASS;
+        return false;
     }
 
-    if (NSudoOptionWindowModeValue::Show == WindowMode)
+    size_t LineStart = 0;
+
+    while (LineStart <= Content.size())
     {
-        ShowWindowMode = SW_SHOW;
+        size_t LineEnd = Content.find(L'\n', LineStart);
+        if (std::wstring::npos == LineEnd)
+        {
+            LineEnd = Content.size();
+        }
+
+        std::wstring Line = Content.substr(LineStart, LineEnd - LineStart);
+        LineStart = LineEnd + 1;
+
+        size_t First = Line.find_first_not_of(L" \t\r");
+        if (std::wstring::npos == First)
+        {
+            continue;
+        }
+        Line = Line.substr(First, Line.find_last_not_of(L" \t\r") - First + 1);
+
+        if (L'#' == Line[0])
+        {
+            continue;
+        }
+
+        NSudoParseEnvironmentVariable(Line, EnvironmentVariables);
     }
-    else if (NSudoOptionWindowModeValue::Hide == WindowMode)
+
+    return true;
+}
+
+// 解析创建进程的选项，选项按照用户指定的顺序处理，后指定的选项覆盖先指定的
+NSUDO_MESSAGE NSudoParseProcessOptions(
+    _In_ const NSUDO_COMMAND_LINE& CommandLine,
+    _Out_ NSUDO_PROCESS_OPTIONS& Options)
+{
+    bool bArgErr = !CommandLine.IsValid;
+
+    std::wstring EnvironmentFile;
+    NSUDO_ENVIRONMENT_VARIABLES EnvironmentVariables;
+
+    Options.UserMode = NSudoOptionUserValue::Default;
+    Options.PrivilegesMode = NSudoOptionPrivilegesValue::Default;
+    Options.EnablePrivileges = 0;
+    Options.DisablePrivileges = 0;
+    Options.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Default;
+    Options.WaitInterval = 0;
+    Options.CurrentDirectory = g_ResourceManagement.AppPath;
+    Options.ProcessPriority = 0;
+    Options.ShowWindowMode = SW_SHOWDEFAULT;
+    Options.CreateNewConsole = true;
+    Options.EnvironmentVariables.clear();
+    Options.JobLimits = NSUDO_JOB_LIMITS();
+    Options.Placement = NSUDO_PROCESS_PLACEMENT();
+    Options.QoS = NSUDO_PROCESS_QOS();
+    Options.RedirectOutput = false;
+    Options.ResolveCommandLine = false;
+    Options.Engine = NSudoOptionEngineValue::Token;
+    Options.AllSessions = false;
+    Options.Sessions.clear();
+    Options.Stats = false;
+    Options.StatsFile.clear();
+
+    // 以兆字节为单位的内存限制不能超过地址空间
+    const ULONGLONG MaximumMegabytes = static_cast<SIZE_T>(-1) >> 20;
+
+    for (size_t i = 0; !bArgErr && i < CommandLine.OptionCount; ++i)
     {
-        ShowWindowMode = SW_HIDE;
+        const NSUDO_COMMAND_LINE_OPTION& Option = CommandLine.Options[i];
+        ULONGLONG Number = 0;
+
+        switch (Option.Definition->ID)
+        {
+        case NSudoOptionID::User:
+            Options.UserMode =
+                static_cast<NSudoOptionUserValue>(Option.Value);
+            break;
+        case NSudoOptionID::Privileges:
+            if (NSUDO_OPTION_VALUE_PARAMETER == Option.Value)
+            {
+                // 只调整列出的特权，其他特权保持不变
+                Options.PrivilegesMode = NSudoOptionPrivilegesValue::Default;
+                bArgErr = !NSudoParsePrivilegeListParameter(
+                    Option.Parameter,
+                    Options.EnablePrivileges,
+                    Options.DisablePrivileges);
+            }
+            else
+            {
+                Options.PrivilegesMode =
+                    static_cast<NSudoOptionPrivilegesValue>(Option.Value);
+                Options.EnablePrivileges = 0;
+                Options.DisablePrivileges = 0;
+            }
+            break;
+        case NSudoOptionID::IntegrityLevel:
+            Options.IntegrityLevelMode =
+                static_cast<NSudoOptionIntegrityLevelValue>(Option.Value);
+            break;
+        case NSudoOptionID::Priority:
+            Options.ProcessPriority = Option.Value;
+            break;
+        case NSudoOptionID::ShowWindowMode:
+            Options.ShowWindowMode = Option.Value;
+            break;
+        case NSudoOptionID::Wait:
+            Options.WaitInterval = INFINITE;
+            break;
+        case NSudoOptionID::CurrentDirectory:
+            Options.CurrentDirectory = Option.Parameter;
+            break;
+        case NSudoOptionID::UseCurrentConsole:
+            Options.CreateNewConsole = false;
+            break;
+        case NSudoOptionID::Env:
+            // NSudoAddCommandLineOption保证后缀和 "=" 都存在
+            EnvironmentVariables.emplace_back(
+                Option.NameSuffix, Option.Parameter);
+            break;
+        case NSudoOptionID::EnvFile:
+            EnvironmentFile = Option.Parameter;
+            break;
+        case NSudoOptionID::CpuRateLimit:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, 100, Number);
+            Options.JobLimits.CpuRate = static_cast<DWORD>(Number);
+            break;
+        case NSudoOptionID::MemoryLimit:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, MaximumMegabytes, Number);
+            Options.JobLimits.JobMemoryLimit =
+                static_cast<SIZE_T>(Number) << 20;
+            break;
+        case NSudoOptionID::MaxWorkingSet:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, MaximumMegabytes, Number);
+            Options.JobLimits.MaximumWorkingSetSize =
+                static_cast<SIZE_T>(Number) << 20;
+            break;
+        case NSudoOptionID::IoRateLimit:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, MAXDWORD, Number);
+            Options.JobLimits.MaximumIops = static_cast<DWORD>(Number);
+            break;
+        case NSudoOptionID::ActiveProcessLimit:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, MAXDWORD, Number);
+            Options.JobLimits.ActiveProcessLimit = static_cast<DWORD>(Number);
+            break;
+        case NSudoOptionID::Affinity:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 1, static_cast<KAFFINITY>(-1), Number);
+            Options.Placement.HasGroupAffinity = true;
+            Options.Placement.Affinity = static_cast<KAFFINITY>(Number);
+            break;
+        case NSudoOptionID::ProcessorGroup:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 0, MAXWORD, Number);
+            Options.Placement.HasGroupAffinity = true;
+            Options.Placement.ProcessorGroup = static_cast<WORD>(Number);
+            break;
+        case NSudoOptionID::NumaNode:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter, 0, MAXUSHORT, Number);
+            Options.Placement.HasPreferredNode = true;
+            Options.Placement.PreferredNode = static_cast<USHORT>(Number);
+            break;
+        case NSudoOptionID::CpuSets:
+            bArgErr = !NSudoParseNumberListParameter(
+                Option.Parameter, Options.Placement.CpuSets);
+            break;
+        case NSudoOptionID::IoPriority:
+            Options.QoS.IoPriority =
+                static_cast<NSudoIoPriority>(Option.Value);
+            break;
+        case NSudoOptionID::MemoryPriority:
+            bArgErr = !NSudoParseNumberParameter(
+                Option.Parameter,
+                MEMORY_PRIORITY_VERY_LOW,
+                MEMORY_PRIORITY_NORMAL,
+                Number);
+            Options.QoS.MemoryPriority = static_cast<ULONG>(Number);
+            break;
+        case NSudoOptionID::EcoQoS:
+            Options.QoS.EcoQoS = true;
+            break;
+        case NSudoOptionID::RedirectOutput:
+            Options.RedirectOutput = true;
+            break;
+        case NSudoOptionID::Resolve:
+            Options.ResolveCommandLine = true;
+            break;
+        case NSudoOptionID::Engine:
+            Options.Engine =
+                static_cast<NSudoOptionEngineValue>(Option.Value);
+            break;
+        case NSudoOptionID::Session:
+            if (0 == _wcsicmp(Option.Parameter.data(), L"All"))
+            {
+                Options.AllSessions = true;
+            }
+            else
+            {
+                bArgErr = !NSudoParseNumberListParameter(
+                    Option.Parameter, Options.Sessions);
+            }
+            break;
+        case NSudoOptionID::Stats:
+            Options.Stats = true;
+            break;
+        case NSudoOptionID::StatsFile:
+            Options.Stats = true;
+            Options.StatsFile = Option.Parameter;
+            break;
+        default:
+            // 不是创建进程的选项
+            bArgErr = true;
+            break;
+        }
     }
-    else if (NSudoOptionWindowModeValue::Maximize == WindowMode)
+
+    if (bArgErr || NSudoOptionUserValue::Default == Options.UserMode)
     {
-        ShowWindowMode = SW_MAXIMIZE;
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
     }
-    else if (NSudoOptionWindowModeValue::Minimize == WindowMode)
+
+    // 只有等待进程树结束时才能报告资源使用情况
+    if (Options.Stats && INFINITE != Options.WaitInterval)
     {
-        ShowWindowMode = SW_MINIMIZE;
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
     }
 
-    if (UnresolvedCommandLine.empty())
+    // 不等待时NSudo创建进程后立即退出，没有人转发输出
+    if (Options.RedirectOutput && INFINITE != Options.WaitInterval)
     {
         return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
     }
 
-    if (!NSudoCreateProcess(
-        hToken,
-        UnresolvedCommandLine.c_str(),
-        CurrentDirectory.c_str(),
-        WaitInterval,
-        ProcessPriority,
-        ShowWindowMode,
-        CreateNewConsole))
+    // 父进程引擎只用于SYSTEM和TrustedInstaller，并且新进程只能继承父进程的句柄
+    // 和控制台
+    if (NSudoOptionEngineValue::ParentProcess == Options.Engine)
+    {
+        if ((NSudoOptionUserValue::System != Options.UserMode &&
+            NSudoOptionUserValue::TrustedInstaller != Options.UserMode) ||
+            Options.RedirectOutput ||
+            !Options.CreateNewConsole)
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+    }
+
+    // 命令行中的环境变量优先于环境变量文件中的
+    if (!EnvironmentFile.empty())
+    {
+        if (!NSudoReadEnvironmentFile(
+            EnvironmentFile, Options.EnvironmentVariables))
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+    }
+
+    for (auto& EnvironmentVariable : EnvironmentVariables)
+    {
+        if (EnvironmentVariable.first.empty())
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        Options.EnvironmentVariables.push_back(EnvironmentVariable);
+    }
+
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+// 根据选项创建令牌
+// 调用者必须已经模拟为SYSTEM用户。
+NSUDO_MESSAGE NSudoCreateProcessToken(
+    _In_ CNSudoTokenCache* TokenCache,
+    _In_ const NSUDO_PROCESS_OPTIONS& Options,
+    _In_ DWORD dwSessionID,
+    _Outptr_ PHANDLE phToken)
+{
+    if (!NSudoCreateUserToken(
+        TokenCache,
+        Options.UserMode,
+        g_ResourceManagement.OriginalCurrentProcessToken,
+        dwSessionID,
+        NSudoGetTokenAdjustments(Options, static_cast<DWORD>(-1)),
+        phToken))
     {
         return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
 
-    RevertToSelf();
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+// 使用父进程引擎时，根据选项打开新进程的父进程
+// 调用者必须已经模拟为SYSTEM用户。
+NSUDO_MESSAGE NSudoOpenParentProcess(
+    _In_ CNSudoTokenCache* TokenCache,
+    _In_ const NSUDO_PROCESS_OPTIONS& Options,
+    _In_ DWORD dwSessionID,
+    _Out_ PNSUDO_PARENT_PROCESS ParentProcess)
+{
+    ParentProcess->Adjustments = NSudoGetTokenAdjustments(
+        Options, static_cast<DWORD>(-1));
+
+    CNSudoStageScope StageScope(NSudoStage::OpenParentProcess);
+
+    HANDLE hProcess = INVALID_HANDLE_VALUE;
+
+    if (NSudoOptionUserValue::TrustedInstaller == Options.UserMode)
+    {
+        // TrustedInstaller服务进程位于会话0，新进程继承父进程的会话并且创建后无
+        // 法修改，所以只能在会话0中创建
+        if (0 != dwSessionID)
+        {
+            return NSUDO_MESSAGE::PARENT_PROCESS_SESSION_MISMATCH;
+        }
+
+        if (!TokenCache->OpenTrustedInstallerProcess(&hProcess))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+    }
+    else if (NSudoOptionUserValue::System == Options.UserMode)
+    {
+        // 每个会话都有winlogon进程，所以新进程位于指定的会话
+        if (!NSudoOpenWinLogonProcess(
+            dwSessionID, NSUDO_PARENT_PROCESS_ACCESS, &hProcess))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+    }
+    else
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    ParentProcess->ProcessHandle = hProcess;
+
+    StageScope.SetResult(TRUE);
 
     return NSUDO_MESSAGE::SUCCESS;
 }
 
-void NSudoPrintMsg(
-    _In_opt_ HINSTANCE hInstance,
-    _In_opt_ HWND hWnd,
-    _In_ LPCWSTR lpContent)
+/*
+NSudoWriteProcessStats函数以JSON格式把新进程的资源使用情况写入指定的文件；如果
+FilePath为空，则写入标准输出。时间的单位为毫秒，内存和I/O的单位为字节。
+The NSudoWriteProcessStats function writes the resource usage of the new
+process to the specified file in JSON format. If FilePath is empty, it is
+written to the standard output. The times are in milliseconds, and the memory
+and the I/O are in bytes.
+*/
+void NSudoWriteProcessStats(
+    _In_ const NSUDO_PROCESS_STATS& Stats,
+    _In_ DWORD ExitCode,
+    _In_ const std::wstring& FilePath)
 {
-    std::wstring DialogContent =
-        g_ResourceManagement.GetTranslation("NSudo.LogoText") +
-        lpContent +
-        g_ResourceManagement.GetTranslation("NSudo.String.Links");
+    CNSudoJsonWriter Writer;
 
-#if defined(NSUDO_CUI_CONSOLE)
-    UNREFERENCED_PARAMETER(hInstance);
-    UNREFERENCED_PARAMETER(hWnd);
+    Writer.BeginObject();
+    Writer.Key(L"ProcessId");
+    Writer.Number(Stats.ProcessId);
+    Writer.Key(L"ExitCode");
+    if (STILL_ACTIVE == ExitCode)
+    {
+        Writer.Null();
+    }
+    else
+    {
+        Writer.Number(ExitCode);
+    }
+    Writer.Key(L"ProcessTree");
+    Writer.Boolean(Stats.IncludesProcessTree);
+    Writer.Key(L"TotalProcesses");
+    Writer.Number(Stats.TotalProcesses);
+    Writer.Key(L"WallTime");
+    Writer.Number(Stats.WallTime / 10000);
+    Writer.Key(L"UserTime");
+    Writer.Number(Stats.UserTime / 10000);
+    Writer.Key(L"KernelTime");
+    Writer.Number(Stats.KernelTime / 10000);
+    Writer.Key(L"PeakWorkingSet");
+    Writer.Number(Stats.PeakWorkingSet);
+    Writer.Key(L"PeakCommit");
+    Writer.Number(Stats.PeakCommit);
+    Writer.Key(L"ReadBytes");
+    Writer.Number(Stats.ReadTransferCount);
+    Writer.Key(L"WriteBytes");
+    Writer.Number(Stats.WriteTransferCount);
+    Writer.Key(L"ReadOperations");
+    Writer.Number(Stats.ReadOperationCount);
+    Writer.Key(L"WriteOperations");
+    Writer.Number(Stats.WriteOperationCount);
+    Writer.Key(L"PageFaults");
+    Writer.Number(Stats.PageFaultCount);
+    Writer.EndObject();
+
+    std::string Buffer = M2MakeUTF8String(Writer.GetText()) + "\r\n";
+
+    HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    M2::CHandle hFile;
+    if (!FilePath.empty())
+    {
+        hFile = CreateFileW(
+            FilePath.c_str(),
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (hFile.IsInvalid())
+        {
+            return;
+        }
 
-    DWORD NumberOfCharsWritten = 0;
-    WriteConsoleW(
-        GetStdHandle(STD_OUTPUT_HANDLE),
-        DialogContent.c_str(),
-        (DWORD)DialogContent.size(),
-        &NumberOfCharsWritten,
+        hOutput = hFile;
+    }
+
+    DWORD NumberOfBytesWritten = 0;
+    WriteFile(
+        hOutput,
+        Buffer.c_str(),
+        static_cast<DWORD>(Buffer.size()),
+        &NumberOfBytesWritten,
         nullptr);
-#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
-    M2MessageDialog(
-        hInstance,
-        hWnd,
-        MAKEINTRESOURCE(IDI_NSUDO),
-        L"NSudo",
-        DialogContent.c_str());
-#endif
 }
 
-HRESULT NSudoShowAboutDialog(
-    _In_ HWND hwndParent)
+// 解析命令行
+// 如果TokenCache为nullptr，则使用仅在本次调用中有效的令牌缓存；如果SessionID为
+// (DWORD)-1，则使用当前进程的会话ID。如果没有等待进程树结束，则lpExitCode为
+// STILL_ACTIVE。
+NSUDO_MESSAGE NSudoCommandLineParser(
+    _In_ bool bElevated,
+    _In_ bool bEnableContextMenuManagement,
+    _In_ const NSUDO_COMMAND_LINE& CommandLine,
+    _In_opt_ CNSudoTokenCache* TokenCache = nullptr,
+    _In_ DWORD SessionID = (DWORD)-1,
+    _Out_opt_ PDWORD lpExitCode = nullptr)
 {
-    std::wstring DialogContent =
-        g_ResourceManagement.GetTranslation("NSudo.LogoText") +
-        g_ResourceManagement.GetTranslation("NSudo.String.CommandLineHelp") +
-        g_ResourceManagement.GetTranslation("NSudo.String.Links");
+    if (lpExitCode)
+    {
+        *lpExitCode = STILL_ACTIVE;
+    }
 
-    SetLastError(ERROR_SUCCESS);
+    const std::wstring& UnresolvedCommandLine =
+        CommandLine.UnresolvedCommandLine;
 
-#if defined(NSUDO_CUI_CONSOLE)
-    UNREFERENCED_PARAMETER(hwndParent);
+    if (!CommandLine.IsValid)
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    if (1 == CommandLine.OptionCount && UnresolvedCommandLine.empty())
+    {
+        NSudoOptionID OptionID = CommandLine.Options[0].Definition->ID;
+
+        if (NSudoOptionID::Help == OptionID)
+        {
+            // 如果选项名是 "?", "H" 或 "Help"，则显示帮助。
+            return NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP;
+        }
+        else if (NSudoOptionID::Version == OptionID)
+        {
+            // 如果选项名是 "?", "H" 或 "Help"，则显示 NSudo 版本号。
+            return NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION;
+        }
+        else
+        {
+            if (bEnableContextMenuManagement)
+            {
+                CNSudoComInitializer ComInitializer;
+                CNSudoContextMenuManagement ContextMenuManagement;
+
+                if (NSudoOptionID::Install == OptionID)
+                {
+                    // 如果参数是 /Install 或 -Install，则安装NSudo到系统。安装
+                    // 失败时不会留下写入了一半的项，所以无需卸载
+                    ContextMenuManagement.Install();
+
+                    return NSUDO_MESSAGE::SUCCESS;
+                }
+                else if (NSudoOptionID::Uninstall == OptionID)
+                {
+                    // 如果参数是 /Uninstall 或 -Uninstall，则移除安装到系统的NSudo
+                    ContextMenuManagement.Uninstall();
+
+                    return NSUDO_MESSAGE::SUCCESS;
+                }
+            }
+
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+    }
+
+    DWORD dwSessionID = SessionID;
+
+    // 获取当前进程会话ID
+    if ((DWORD)-1 == dwSessionID)
+    {
+        if (!NSudoGetCurrentProcessSessionID(&dwSessionID))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+    }
+
+    CNSudoTokenCache LocalTokenCache;
+    if (!TokenCache)
+    {
+        TokenCache = &LocalTokenCache;
+    }
+
+    // 如果未提权或者模拟System权限失败
+    if (!(bElevated && TokenCache->ImpersonateAsSystem()))
+    {
+        return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+    }
+
+    NSUDO_MESSAGE message = NSUDO_MESSAGE::SUCCESS;
+
+    // 解析参数列表
+    NSUDO_PROCESS_OPTIONS Options;
+    message = NSudoParseProcessOptions(CommandLine, Options);
+    if (NSUDO_MESSAGE::SUCCESS != message)
+    {
+        return message;
+    }
+
+    // 多个会话的创建进程由CNSudoBatch处理
+    if (Options.AllSessions || !Options.Sessions.empty())
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    M2::CHandle hToken;
+    NSUDO_PARENT_PROCESS ParentProcess;
+    const bool UseParentProcess =
+        NSudoOptionEngineValue::ParentProcess == Options.Engine;
+
+    message = UseParentProcess
+        ? NSudoOpenParentProcess(
+            TokenCache, Options, dwSessionID, &ParentProcess)
+        : NSudoCreateProcessToken(
+            TokenCache, Options, dwSessionID, &hToken);
+    if (NSUDO_MESSAGE::SUCCESS != message)
+    {
+        return message;
+    }
+
+    if (UnresolvedCommandLine.empty())
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    // 只有图形界面和右键菜单使用 -Resolve，其他的命令行按CreateProcess的规则处理
+    std::wstring ResolvedCommandLine = UnresolvedCommandLine;
+    if (Options.ResolveCommandLine)
+    {
+        // 以调用者的身份查询关联，使用户自己的文件关联生效
+        RevertToSelf();
+
+        ResolvedCommandLine = NSudoResolveCommandLine(
+            UnresolvedCommandLine, Options.CurrentDirectory.c_str());
+
+        if (!TokenCache->ImpersonateAsSystem())
+        {
+            return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        }
+    }
+
+    DWORD ExitCode = STILL_ACTIVE;
+    NSUDO_PROCESS_STATS Stats;
+
+    if (!NSudoCreateProcess(
+        hToken,
+        ResolvedCommandLine.c_str(),
+        Options.CurrentDirectory.c_str(),
+        Options.WaitInterval,
+        NSudoGetCreateProcessOptions(
+            Options, UseParentProcess ? &ParentProcess : nullptr),
+        &ExitCode,
+        nullptr,
+        Options.Stats ? &Stats : nullptr))
+    {
+        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+    }
+
+    RevertToSelf();
+
+    if (lpExitCode)
+    {
+        *lpExitCode = ExitCode;
+    }
+
+    if (Options.Stats)
+    {
+        NSudoWriteProcessStats(Stats, ExitCode, Options.StatsFile);
+    }
+
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+// NSudo代理的命名管道名
+// The named pipe name of the NSudo broker.
+#define NSUDO_BROKER_PIPE_NAME L"\\\\.\\pipe\\NSudo.Broker"
+
+// The response of the NSudo broker.
+typedef struct _NSUDO_BROKER_RESPONSE
+{
+    DWORD Message;
+    // 使用 -Wait 时为进程树的退出代码，否则为STILL_ACTIVE
+    DWORD ExitCode;
+} NSUDO_BROKER_RESPONSE, *PNSUDO_BROKER_RESPONSE;
+
+/*
+CNSudoBroker类实现了NSudo代理。NSudo代理是一个常驻进程，它只获取一次SYSTEM和
+TrustedInstaller令牌并缓存起来，然后通过命名管道接受其他NSudo进程转发的创建进
+程请求。
+The CNSudoBroker class implements the NSudo broker. The NSudo broker is a
+long-lived process which acquires and caches the SYSTEM and TrustedInstaller
+tokens once, and then accepts the process creation requests forwarded from
+other NSudo processes via a named pipe.
+
+命名管道仅允许SYSTEM和管理员组访问，所以未提权的进程无法使用NSudo代理。
+Only SYSTEM and the Administrators group can access the named pipe, so the
+non-elevated processes cannot use the NSudo broker.
+*/
+class CNSudoBroker
+{
+private:
+    CNSudoTokenCache m_TokenCache;
+
+    // 使用 -KeepAlive 时刷新TrustedInstaller令牌的默认间隔，以秒为单位
+    static const DWORD DefaultKeepAliveInterval = 300;
+
+    static bool ReadRequest(
+        _In_ HANDLE hPipe,
+        _Out_ std::wstring& CommandLine)
+    {
+        // 命令行的最大长度为32767个字符
+        const size_t MaximumCommandLineLength = 32767;
+
+        wchar_t Buffer[2048];
+
+        CommandLine.clear();
+
+        for (;;)
+        {
+            DWORD NumberOfBytesRead = 0;
+            BOOL result = ReadFile(
+                hPipe,
+                Buffer,
+                sizeof(Buffer),
+                &NumberOfBytesRead,
+                nullptr);
+
+            CommandLine.append(Buffer, NumberOfBytesRead / sizeof(wchar_t));
+            if (CommandLine.size() > MaximumCommandLineLength)
+            {
+                return false;
+            }
+
+            if (result)
+            {
+                return true;
+            }
+
+            if (ERROR_MORE_DATA != GetLastError())
+            {
+                return false;
+            }
+        }
+    }
+
+    NSUDO_MESSAGE Execute(
+        _In_ const std::wstring& CommandLine,
+        _In_ DWORD SessionID,
+        _Out_ PDWORD lpExitCode)
+    {
+        *lpExitCode = STILL_ACTIVE;
+
+        NSUDO_COMMAND_LINE ParsedCommandLine;
+        NSudoParseCommandLine(CommandLine.c_str(), ParsedCommandLine);
+
+        if (!CNSudoBroker::CanForward(ParsedCommandLine))
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        ParsedCommandLine.UnresolvedCommandLine =
+            CNSudoShortCutAdapter::Translate(
+                *g_ResourceManagement.GetShortCutList(),
+                ParsedCommandLine.UnresolvedCommandLine);
+
+        return NSudoCommandLineParser(
+            true,
+            false,
+            ParsedCommandLine,
+            &this->m_TokenCache,
+            SessionID,
+            lpExitCode);
+    }
+
+    /*
+    WatchShortCutList函数监视NSudo.json所在的目录，并在NSudo.json被修改后重新加
+    载快捷命令索引，使处理请求时只需在内存中查找快捷命令。
+    The WatchShortCutList function watches the directory of NSudo.json, and
+    reloads the shortcut index after NSudo.json is modified, so handling a
+    request only needs to look up the shortcuts in memory.
+    */
+    static void WatchShortCutList()
+    {
+        HANDLE hChange = FindFirstChangeNotificationW(
+            g_ResourceManagement.AppPath.c_str(),
+            FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME |
+            FILE_NOTIFY_CHANGE_SIZE |
+            FILE_NOTIFY_CHANGE_LAST_WRITE);
+        if (INVALID_HANDLE_VALUE == hChange)
+        {
+            return;
+        }
+
+        // 先开始监视再加载，以免遗漏加载期间的修改
+        g_ResourceManagement.GetShortCutList();
+
+        // 目录中的其他文件被修改时ReloadShortCutList只比较NSudo.json的版本
+        while (WAIT_OBJECT_0 == WaitForSingleObject(hChange, INFINITE))
+        {
+            g_ResourceManagement.ReloadShortCutList();
+
+            if (!FindNextChangeNotification(hChange))
+            {
+                break;
+            }
+        }
+
+        FindCloseChangeNotification(hChange);
+    }
+
+    /*
+    KeepTrustedInstallerAlive函数使TrustedInstaller服务在NSudo代理运行期间保持
+    运行。TrustedInstaller服务空闲几分钟后会自行停止，该函数通过
+    NotifyServiceStatusChangeW得知服务停止后立即在后台重新启动它，并且每隔
+    Interval秒刷新一次缓存的TrustedInstaller令牌，使前台的请求无需等待服务控制
+    管理器。
+    The KeepTrustedInstallerAlive function keeps the TrustedInstaller service
+    running while the NSudo broker runs. The TrustedInstaller service stops
+    itself after a few idle minutes. The function restarts it in the background
+    as soon as NotifyServiceStatusChangeW reports that it stopped, and refreshes
+    the cached TrustedInstaller token every Interval seconds, so the foreground
+    requests do not need to wait for the service control manager.
+
+    该函数在hStopEvent被设置后返回。
+    The function returns after hStopEvent is set.
+    */
+    void KeepTrustedInstallerAlive(
+        _In_ DWORD Interval,
+        _In_ HANDLE hStopEvent)
+    {
+        // 该线程只用于保持服务运行，所以一直模拟SYSTEM用户
+        if (!this->m_TokenCache.ImpersonateAsSystem())
+        {
+            return;
+        }
+
+        // 服务状态改变通知的缓冲区必须在服务句柄关闭前一直有效
+        SERVICE_NOTIFYW NotifyBuffer = { 0 };
+        bool bNotified = false;
+        bool bNotifyPending = false;
+
+        NotifyBuffer.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+        NotifyBuffer.pfnNotifyCallback = NSudoServiceNotifyCallback;
+        NotifyBuffer.pContext = &bNotified;
+
+        M2::CServiceHandle hSCM;
+        M2::CServiceHandle hService;
+
+        hSCM = OpenSCManagerW(nullptr, nullptr, SC_MANAGER_CONNECT);
+        if (hSCM)
+        {
+            hService = OpenServiceW(
+                hSCM, L"TrustedInstaller", SERVICE_QUERY_STATUS);
+        }
+
+        bool bStopped = false;
+
+        while (!bStopped)
+        {
+            ULONGLONG nDeadline =
+                GetTickCount64() + static_cast<ULONGLONG>(Interval) * 1000;
+
+            // 启动失败时等到下一个间隔再重试，以免服务被禁用时反复收到停止
+            // 通知
+            if (this->m_TokenCache.RefreshTrustedInstaller() &&
+                hService &&
+                !bNotifyPending)
+            {
+                bNotified = false;
+                bNotifyPending = (ERROR_SUCCESS == NotifyServiceStatusChangeW(
+                    hService,
+                    SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_STOP_PENDING,
+                    &NotifyBuffer));
+            }
+
+            // 以可警告状态等待，以便执行服务状态改变通知的回调
+            while (!bNotified)
+            {
+                ULONGLONG nCurrentTick = GetTickCount64();
+                if (nCurrentTick >= nDeadline)
+                {
+                    break;
+                }
+
+                if (WAIT_OBJECT_0 == WaitForSingleObjectEx(
+                    hStopEvent,
+                    static_cast<DWORD>(nDeadline - nCurrentTick),
+                    TRUE))
+                {
+                    bStopped = true;
+                    break;
+                }
+            }
+
+            if (bNotified)
+            {
+                bNotifyPending = false;
+            }
+        }
+
+        RevertToSelf();
+    }
+
+    void ServeClient(
+        _In_ HANDLE hClientPipe)
+    {
+        M2::CHandle hPipe(hClientPipe);
+
+        NSUDO_BROKER_RESPONSE Response = { 0 };
+        Response.Message = NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        Response.ExitCode = STILL_ACTIVE;
+
+        std::wstring CommandLine;
+        ULONG ClientProcessId = 0;
+        DWORD ClientSessionId = (DWORD)-1;
+
+        // 在客户端所在的会话中创建进程
+        if (CNSudoBroker::ReadRequest(hPipe, CommandLine) &&
+            GetNamedPipeClientProcessId(hPipe, &ClientProcessId) &&
+            ProcessIdToSessionId(ClientProcessId, &ClientSessionId))
+        {
+            Response.Message = this->Execute(
+                CommandLine, ClientSessionId, &Response.ExitCode);
+        }
+
+        DWORD NumberOfBytesWritten = 0;
+        WriteFile(
+            hPipe,
+            &Response,
+            sizeof(NSUDO_BROKER_RESPONSE),
+            &NumberOfBytesWritten,
+            nullptr);
+
+        FlushFileBuffers(hPipe);
+        DisconnectNamedPipe(hPipe);
+
+        RevertToSelf();
+    }
+
+public:
+    /*
+    CanForward函数判断指定的选项是否可以转发给NSudo代理。只有创建进程的请求可
+    以被转发，使用当前控制台窗口、重定向标准句柄或者报告资源使用情况的请求除外。
+    The CanForward function determines whether the specified options can be
+    forwarded to the NSudo broker. Only the process creation requests can be
+    forwarded, except the requests which use the current console window,
+    redirect the standard handles or report the resource usage.
+
+    -U:P和-U:D使用当前进程的令牌，而NSudo代理只能使用它自己的令牌，所以只有
+    -U:T、-U:S和-U:C的请求可以被转发。
+    -U:P and -U:D use the token of the current process, but the NSudo broker
+    can only use its own token, so only the requests with -U:T, -U:S and -U:C
+    can be forwarded.
+    */
+    static bool CanForward(
+        _In_ const NSUDO_COMMAND_LINE& CommandLine)
+    {
+        for (size_t i = 0; i < CommandLine.OptionCount; ++i)
+        {
+            const NSUDO_COMMAND_LINE_OPTION& Option = CommandLine.Options[i];
+
+            if (NSudoOptionID::User == Option.Definition->ID &&
+                static_cast<DWORD>(NSudoOptionUserValue::TrustedInstaller) !=
+                Option.Value &&
+                static_cast<DWORD>(NSudoOptionUserValue::System) !=
+                Option.Value &&
+                static_cast<DWORD>(NSudoOptionUserValue::CurrentUser) !=
+                Option.Value)
+            {
+                return false;
+            }
+        }
+
+        return CommandLine.IsValid &&
+            NSudoCommandLineHasOption(CommandLine, NSudoOptionID::User) &&
+            !NSudoCommandLineHasOption(
+                CommandLine, NSudoOptionID::UseCurrentConsole) &&
+            !NSudoCommandLineHasOption(
+                CommandLine, NSudoOptionID::RedirectOutput) &&
+            !NSudoCommandLineHasOption(
+                CommandLine, NSudoOptionID::Resolve) &&
+            !NSudoCommandLineHasOption(
+                CommandLine, NSudoOptionID::Stats) &&
+            !NSudoCommandLineHasOption(
+                CommandLine, NSudoOptionID::StatsFile);
+    }
+
+    /*
+    Forward函数把命令行转发给正在运行的NSudo代理。
+    The Forward function forwards the command line to the running NSudo
+    broker.
+
+    如果没有正在运行的NSudo代理，返回值为false，调用者应该自行解析命令行。
+    If there is no running NSudo broker, the return value is false, and the
+    caller should parse the command line by itself.
+    */
+    static bool Forward(
+        _In_ const std::wstring& CommandLine,
+        _Out_ NSUDO_MESSAGE& Message,
+        _Out_ DWORD& ExitCode)
+    {
+        ExitCode = STILL_ACTIVE;
+
+        M2::CHandle hPipe;
+
+        for (;;)
+        {
+            // 不允许NSudo代理模拟客户端
+            hPipe = CreateFileW(
+                NSUDO_BROKER_PIPE_NAME,
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                OPEN_EXISTING,
+                SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION,
+                nullptr);
+            if (!hPipe.IsInvalid())
+            {
+                break;
+            }
+
+            if (ERROR_PIPE_BUSY != GetLastError())
+            {
+                return false;
+            }
+
+            if (!WaitNamedPipeW(NSUDO_BROKER_PIPE_NAME, 1000))
+            {
+                return false;
+            }
+        }
+
+        DWORD PipeMode = PIPE_READMODE_MESSAGE;
+        if (!SetNamedPipeHandleState(hPipe, &PipeMode, nullptr, nullptr))
+        {
+            return false;
+        }
+
+        DWORD NumberOfBytesWritten = 0;
+        if (!WriteFile(
+            hPipe,
+            CommandLine.c_str(),
+            static_cast<DWORD>(CommandLine.size() * sizeof(wchar_t)),
+            &NumberOfBytesWritten,
+            nullptr))
+        {
+            return false;
+        }
+
+        // 请求已经发出，此后的失败不能回退到本地创建进程，否则进程可能被创建
+        // 两次
+        Message = NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+
+        NSUDO_BROKER_RESPONSE Response = { 0 };
+        DWORD NumberOfBytesRead = 0;
+        if (ReadFile(
+            hPipe,
+            &Response,
+            sizeof(NSUDO_BROKER_RESPONSE),
+            &NumberOfBytesRead,
+            nullptr))
+        {
+            if (sizeof(NSUDO_BROKER_RESPONSE) == NumberOfBytesRead)
+            {
+                Message = static_cast<NSUDO_MESSAGE>(Response.Message);
+                ExitCode = Response.ExitCode;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+    IsBrokerCommandLine函数判断指定的选项是否为NSudo代理的选项，即 -Broker 以及
+    可选的 -KeepAlive。
+    The IsBrokerCommandLine function determines whether the specified options
+    are the NSudo broker options, which are -Broker and the optional
+    -KeepAlive.
+    */
+    static bool IsBrokerCommandLine(
+        _In_ const NSUDO_COMMAND_LINE& CommandLine)
+    {
+        if (!CommandLine.IsValid ||
+            0 == CommandLine.OptionCount ||
+            !CommandLine.UnresolvedCommandLine.empty() ||
+            NSudoOptionID::Broker != CommandLine.Options[0].Definition->ID)
+        {
+            return false;
+        }
+
+        for (size_t i = 1; i < CommandLine.OptionCount; ++i)
+        {
+            if (NSudoOptionID::KeepAlive !=
+                CommandLine.Options[i].Definition->ID)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+    ParseKeepAliveInterval函数获取 -KeepAlive 指定的刷新间隔，以秒为单位。没有
+    -KeepAlive 时间隔为0，表示不保持TrustedInstaller服务运行。
+    The ParseKeepAliveInterval function obtains the refresh interval specified
+    by -KeepAlive in seconds. The interval is 0 without -KeepAlive, which means
+    the TrustedInstaller service is not kept running.
+    */
+    static bool ParseKeepAliveInterval(
+        _In_ const NSUDO_COMMAND_LINE& CommandLine,
+        _Out_ DWORD& Interval)
+    {
+        Interval = 0;
+
+        for (size_t i = 0; i < CommandLine.OptionCount; ++i)
+        {
+            const NSUDO_COMMAND_LINE_OPTION& Option = CommandLine.Options[i];
+
+            if (NSudoOptionID::KeepAlive != Option.Definition->ID)
+            {
+                continue;
+            }
+
+            if (Option.Parameter.empty())
+            {
+                Interval = CNSudoBroker::DefaultKeepAliveInterval;
+                continue;
+            }
+
+            ULONGLONG Number = 0;
+            if (!NSudoParseNumberParameter(
+                Option.Parameter, 1, MAXDWORD / 1000, Number))
+            {
+                return false;
+            }
+
+            Interval = static_cast<DWORD>(Number);
+        }
+
+        return true;
+    }
+
+    /*
+    Run函数运行NSudo代理。除非发生错误，否则该函数不会返回。
+    The Run function runs the NSudo broker. The function does not return
+    unless an error occurs.
+
+    KeepAliveInterval不为0时，TrustedInstaller服务在NSudo代理运行期间保持运行，
+    缓存的TrustedInstaller令牌每隔KeepAliveInterval秒刷新一次。
+    If KeepAliveInterval is not 0, the TrustedInstaller service is kept running
+    while the NSudo broker runs, and the cached TrustedInstaller token is
+    refreshed every KeepAliveInterval seconds.
+
+    返回值为Win32错误码。
+    The return value is a Win32 error code.
+    */
+    DWORD Run(
+        _In_ DWORD KeepAliveInterval)
+    {
+        DWORD dwError = ERROR_SUCCESS;
+        PSECURITY_DESCRIPTOR pSecurityDescriptor = nullptr;
+
+        // 仅允许SYSTEM和管理员组访问
+        if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            L"D:P(A;;GA;;;SY)(A;;GA;;;BA)",
+            SDDL_REVISION_1,
+            &pSecurityDescriptor,
+            nullptr))
+        {
+            return GetLastError();
+        }
+
+        SECURITY_ATTRIBUTES SecurityAttributes;
+        SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+        SecurityAttributes.lpSecurityDescriptor = pSecurityDescriptor;
+        SecurityAttributes.bInheritHandle = FALSE;
+
+        // NSudo代理会为每个请求创建环境块
+        NSudoEnableEnvironmentCache();
+
+        // 预先获取令牌，使第一个请求也无需等待
+        if (this->m_TokenCache.ImpersonateAsSystem())
+        {
+            M2::CHandle hToken;
+            this->m_TokenCache.DuplicateSystemToken(&hToken);
+            hToken.Close();
+            this->m_TokenCache.DuplicateTrustedInstallerToken(&hToken);
+
+            RevertToSelf();
+        }
+
+        M2::CThread([]()
+        {
+            CNSudoBroker::WatchShortCutList();
+        });
+
+        // 保持TrustedInstaller服务运行的线程在创建第一个管道实例后才启动，使已
+        // 有NSudo代理在运行时不会启动它，并且在该函数返回前被停止
+        M2::CHandle hKeepAliveStopEvent;
+        M2::CHandle hKeepAliveThread;
+
+        // 如果已有NSudo代理在运行，则创建命名管道会失败
+        DWORD dwOpenMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE;
+
+        for (;;)
+        {
+            M2::CHandle hPipe;
+
+            hPipe = CreateNamedPipeW(
+                NSUDO_BROKER_PIPE_NAME,
+                dwOpenMode,
+                PIPE_TYPE_MESSAGE |
+                PIPE_READMODE_MESSAGE |
+                PIPE_WAIT |
+                PIPE_REJECT_REMOTE_CLIENTS,
+                PIPE_UNLIMITED_INSTANCES,
+                sizeof(NSUDO_BROKER_RESPONSE),
+                4096,
+                0,
+                &SecurityAttributes);
+            if (hPipe.IsInvalid())
+            {
+                dwError = GetLastError();
+                break;
+            }
+
+            dwOpenMode &= ~FILE_FLAG_FIRST_PIPE_INSTANCE;
+
+            if (KeepAliveInterval && hKeepAliveThread.IsInvalid())
+            {
+                HANDLE hStopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+                if (!hStopEvent)
+                {
+                    dwError = GetLastError();
+                    break;
+                }
+
+                hKeepAliveStopEvent = hStopEvent;
+
+                HANDLE hThread = M2::CThread(
+                    [this, KeepAliveInterval, hStopEvent]()
+                {
+                    this->KeepTrustedInstallerAlive(
+                        KeepAliveInterval, hStopEvent);
+                }).Detach();
+                if (!hThread || INVALID_HANDLE_VALUE == hThread)
+                {
+                    dwError = GetLastError();
+                    break;
+                }
+
+                hKeepAliveThread = hThread;
+            }
+
+            if (!ConnectNamedPipe(hPipe, nullptr))
+            {
+                if (ERROR_PIPE_CONNECTED != GetLastError())
+                {
+                    continue;
+                }
+            }
+
+            // 每个客户端使用一个线程，以免等待进程结束的请求阻塞其他请求
+            HANDLE hClientPipe = hPipe.Detach();
+            M2::CThread([this, hClientPipe]()
+            {
+                this->ServeClient(hClientPipe);
+            });
+        }
+
+        if (!hKeepAliveThread.IsInvalid())
+        {
+            SetEvent(hKeepAliveStopEvent);
+            WaitForSingleObjectEx(hKeepAliveThread, INFINITE, FALSE);
+        }
+
+        LocalFree(pSecurityDescriptor);
+
+        return dwError;
+    }
+};
+
+// The result of a command line in the NSudo batch.
+typedef struct _NSUDO_BATCH_RESULT
+{
+    size_t LineNumber;
+    std::wstring CommandLine;
+    // 使用 -Session 时该项的会话，否则为(DWORD)-1，表示当前进程的会话
+    DWORD SessionID;
+    NSUDO_MESSAGE Message;
+    bool Waited;
+    DWORD ExitCode;
+} NSUDO_BATCH_RESULT, *PNSUDO_BATCH_RESULT;
+
+// 批处理中可以共用的令牌的配置：会话、引擎、用户、特权和完整性级别，以及按名称
+// 启用和禁用的特权
+typedef std::tuple<ULONGLONG, ULONGLONG, ULONGLONG> NSUDO_TOKEN_CONFIGURATION;
+
+// A command line in the NSudo batch.
+typedef struct _NSUDO_BATCH_ITEM
+{
+    // 命令行是否以程序名开头，只有NSudo自身的命令行如此
+    bool ContainsApplicationName;
+    NSUDO_PROCESS_OPTIONS Options;
+    NSUDO_TOKEN_CONFIGURATION TokenConfiguration;
+    std::wstring UnresolvedCommandLine;
+    NSUDO_BATCH_RESULT Result;
+} NSUDO_BATCH_ITEM, *PNSUDO_BATCH_ITEM;
+
+/*
+CNSudoBatch类实现了NSudo批处理模式。批处理的每一行都是一个带有自己选项的命令
+行，每种令牌配置只创建一次令牌，然后复制给所有使用该配置的行。
+The CNSudoBatch class implements the NSudo batch mode. Each line of the batch
+is a command line with its own options. The token of each token configuration
+is created only once, and then duplicated for every line which uses that
+configuration.
+
+如果指定了并行数，则批处理的各行被视为互不依赖，并由多个工作线程同时创建进程。
+If the parallelism is specified, the lines of the batch are treated as
+independent of each other, and the processes are created by multiple worker
+threads concurrently.
+
+使用 -Session 的行按目标会话展开为多项，每个会话有自己的令牌和执行结果。
+The lines with -Session are expanded to one item per target session, and each
+session has its own token and result.
+*/
+class CNSudoBatch
+{
+private:
+    CNSudoTokenCache m_TokenCache;
+    DWORD m_SessionID = (DWORD)-1;
+
+    // 令牌配置和对应的令牌（使用父进程引擎时为父进程），在工作线程启动前创建
+    // 完毕，此后只读
+    std::map<NSUDO_TOKEN_CONFIGURATION, M2::CHandle> m_Tokens;
+
+    // 每个工作线程只写入自己领取的项，所以无需加锁
+    std::vector<NSUDO_BATCH_ITEM> m_Items;
+    volatile LONG m_NextItem = 0;
+
+    // 读取批处理内容，如果Source为空则从标准输入读取
+    static bool ReadSource(
+        _In_ const std::wstring& Source,
+        _Out_ std::wstring& Content)
+    {
+        if (Source.empty())
+        {
+            HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+            if (nullptr == hInput || INVALID_HANDLE_VALUE == hInput)
+            {
+                return false;
+            }
+
+            return NSudoReadTextFile(hInput, Content);
+        }
+
+        return NSudoReadTextFile(Source.c_str(), Content);
+    }
+
+    static NSUDO_TOKEN_CONFIGURATION GetTokenConfiguration(
+        _In_ const NSUDO_PROCESS_OPTIONS& Options,
+        _In_ DWORD SessionID)
+    {
+        return NSUDO_TOKEN_CONFIGURATION(
+            (static_cast<ULONGLONG>(SessionID) << 32) |
+            (static_cast<DWORD>(Options.Engine) << 24) |
+            (static_cast<DWORD>(Options.UserMode) << 16) |
+            (static_cast<DWORD>(Options.PrivilegesMode) << 8) |
+            static_cast<DWORD>(Options.IntegrityLevelMode),
+            Options.EnablePrivileges,
+            Options.DisablePrivileges);
+    }
+
+    // 获取所有活动会话的ID
+    static bool EnumerateActiveSessions(
+        _Out_ std::vector<DWORD>& Sessions)
+    {
+        Sessions.clear();
+
+        M2::CWTSMemory<PWTS_SESSION_INFOW> pSessions;
+        DWORD dwSessionCount = 0;
+
+        if (!WTSEnumerateSessionsW(
+            WTS_CURRENT_SERVER_HANDLE,
+            0,
+            1,
+            &pSessions,
+            &dwSessionCount))
+        {
+            return false;
+        }
+
+        for (DWORD i = 0; i < dwSessionCount; ++i)
+        {
+            if (WTSActive == pSessions[i].State)
+            {
+                Sessions.push_back(pSessions[i].SessionId);
+            }
+        }
+
+        return true;
+    }
+
+    // 把批处理内容拆分为各行，跳过空行和注释
+    void AddItems(
+        _In_ const std::wstring& Content)
+    {
+        size_t LineNumber = 0;
+        size_t LineStart = 0;
+
+        while (LineStart <= Content.size())
+        {
+            size_t LineEnd = Content.find(L'\n', LineStart);
+            if (std::wstring::npos == LineEnd)
+            {
+                LineEnd = Content.size();
+            }
+
+            ++LineNumber;
+
+            std::wstring Line = Content.substr(LineStart, LineEnd - LineStart);
+            LineStart = LineEnd + 1;
+
+            // 去掉首尾的空白字符
+            size_t First = Line.find_first_not_of(L" \t\r");
+            if (std::wstring::npos == First)
+            {
+                continue;
+            }
+            Line = Line.substr(First, Line.find_last_not_of(L" \t\r") - First + 1);
+
+            // 跳过注释
+            if (L'#' == Line[0])
+            {
+                continue;
+            }
+
+            this->AddItem(LineNumber, Line, false);
+        }
+    }
+
+    void AddItem(
+        _In_ size_t LineNumber,
+        _In_ const std::wstring& CommandLine,
+        _In_ bool ContainsApplicationName)
+    {
+        NSUDO_BATCH_ITEM Item;
+        Item.ContainsApplicationName = ContainsApplicationName;
+        Item.TokenConfiguration = NSUDO_TOKEN_CONFIGURATION();
+        Item.Result.LineNumber = LineNumber;
+        Item.Result.CommandLine = CommandLine;
+        Item.Result.SessionID = (DWORD)-1;
+        Item.Result.Message = NSUDO_MESSAGE::SUCCESS;
+        Item.Result.Waited = false;
+        Item.Result.ExitCode = STILL_ACTIVE;
+
+        this->m_Items.push_back(Item);
+    }
+
+    // 解析一行的选项
+    NSUDO_MESSAGE Parse(
+        _Inout_ NSUDO_BATCH_ITEM& Item)
+    {
+        NSUDO_COMMAND_LINE CommandLine;
+
+        // 批处理的每一行不包含程序名
+        NSudoParseCommandLine(
+            Item.Result.CommandLine.c_str(),
+            CommandLine,
+            Item.ContainsApplicationName);
+
+        Item.UnresolvedCommandLine = CNSudoShortCutAdapter::Translate(
+            *g_ResourceManagement.GetShortCutList(),
+            CommandLine.UnresolvedCommandLine);
+
+        NSUDO_MESSAGE message = NSudoParseProcessOptions(
+            CommandLine, Item.Options);
+        if (NSUDO_MESSAGE::SUCCESS != message)
+        {
+            return message;
+        }
+
+        // 批处理的汇总已经包含退出代码，并行的项也无法共用标准输出
+        if (Item.Options.Stats)
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        // 解析关联程序需要在工作线程上初始化COM，批处理按CreateProcess的规则处理
+        // 命令行
+        if (Item.Options.ResolveCommandLine)
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        if (Item.UnresolvedCommandLine.empty())
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        return NSUDO_MESSAGE::SUCCESS;
+    }
+
+    // 把使用 -Session 的项按目标会话展开，每个会话一项
+    void ExpandSessions()
+    {
+        std::vector<NSUDO_BATCH_ITEM> Items;
+        Items.reserve(this->m_Items.size());
+
+        for (auto& Item : this->m_Items)
+        {
+            if (NSUDO_MESSAGE::SUCCESS != Item.Result.Message ||
+                !(Item.Options.AllSessions || !Item.Options.Sessions.empty()))
+            {
+                Items.push_back(std::move(Item));
+                continue;
+            }
+
+            std::vector<DWORD> Sessions = Item.Options.Sessions;
+            if (Item.Options.AllSessions &&
+                !CNSudoBatch::EnumerateActiveSessions(Sessions))
+            {
+                Item.Result.Message = NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+                Items.push_back(std::move(Item));
+                continue;
+            }
+
+            for (DWORD SessionID : Sessions)
+            {
+                Items.push_back(Item);
+                Items.back().Result.SessionID = SessionID;
+            }
+        }
+
+        this->m_Items.swap(Items);
+    }
+
+    // 创建该项的令牌配置对应的令牌
+    NSUDO_MESSAGE Prepare(
+        _Inout_ NSUDO_BATCH_ITEM& Item)
+    {
+        NSUDO_MESSAGE message = NSUDO_MESSAGE::SUCCESS;
+
+        DWORD SessionID = Item.Result.SessionID;
+        if ((DWORD)-1 == SessionID)
+        {
+            SessionID = this->m_SessionID;
+        }
+
+        Item.TokenConfiguration =
+            CNSudoBatch::GetTokenConfiguration(Item.Options, SessionID);
+
+        if (this->m_Tokens.end() == this->m_Tokens.find(
+            Item.TokenConfiguration))
+        {
+            M2::CHandle hToken;
+            NSUDO_PARENT_PROCESS ParentProcess;
+
+            if (NSudoOptionEngineValue::ParentProcess == Item.Options.Engine)
+            {
+                message = NSudoOpenParentProcess(
+                    &this->m_TokenCache,
+                    Item.Options,
+                    SessionID,
+                    &ParentProcess);
+                hToken = ParentProcess.ProcessHandle.Detach();
+            }
+            else
+            {
+                message = NSudoCreateProcessToken(
+                    &this->m_TokenCache,
+                    Item.Options,
+                    SessionID,
+                    &hToken);
+            }
+            if (NSUDO_MESSAGE::SUCCESS != message)
+            {
+                return message;
+            }
+
+            this->m_Tokens[Item.TokenConfiguration] = hToken.Detach();
+        }
+
+        return NSUDO_MESSAGE::SUCCESS;
+    }
+
+    // 使用该行的令牌配置对应的令牌（或者父进程）副本创建进程
+    NSUDO_MESSAGE Execute(
+        _Inout_ NSUDO_BATCH_ITEM& Item)
+    {
+        M2::CHandle hToken;
+        NSUDO_PARENT_PROCESS ParentProcess;
+        const bool UseParentProcess =
+            NSudoOptionEngineValue::ParentProcess == Item.Options.Engine;
+
+        HANDLE hSource = this->m_Tokens.find(Item.TokenConfiguration)->second;
+
+        if (UseParentProcess)
+        {
+            HANDLE hProcess = INVALID_HANDLE_VALUE;
+
+            if (!DuplicateHandle(
+                GetCurrentProcess(),
+                hSource,
+                GetCurrentProcess(),
+                &hProcess,
+                0,
+                FALSE,
+                DUPLICATE_SAME_ACCESS))
+            {
+                return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            }
+
+            ParentProcess.ProcessHandle = hProcess;
+            ParentProcess.Adjustments = NSudoGetTokenAdjustments(
+                Item.Options, static_cast<DWORD>(-1));
+        }
+        else if (!DuplicateTokenEx(
+            hSource,
+            MAXIMUM_ALLOWED,
+            nullptr,
+            SecurityIdentification,
+            TokenPrimary,
+            &hToken))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+
+        if (!NSudoCreateProcess(
+            hToken,
+            Item.UnresolvedCommandLine.c_str(),
+            Item.Options.CurrentDirectory.c_str(),
+            Item.Options.WaitInterval,
+            NSudoGetCreateProcessOptions(
+                Item.Options, UseParentProcess ? &ParentProcess : nullptr),
+            &Item.Result.ExitCode))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+
+        Item.Result.Waited = (INFINITE == Item.Options.WaitInterval);
+
+        return NSUDO_MESSAGE::SUCCESS;
+    }
+
+    // 领取并执行尚未执行的项，直到所有项都被领取
+    // 调用者必须已经模拟为SYSTEM用户。
+    void ExecuteItems()
+    {
+        for (;;)
+        {
+            LONG Index = InterlockedIncrement(&this->m_NextItem) - 1;
+            if (static_cast<size_t>(Index) >= this->m_Items.size())
+            {
+                break;
+            }
+
+            NSUDO_BATCH_ITEM& Item = this->m_Items[Index];
+            if (NSUDO_MESSAGE::SUCCESS == Item.Result.Message)
+            {
+                Item.Result.Message = this->Execute(Item);
+            }
+        }
+    }
+
+public:
+    /*
+    IsBatchCommandLine函数判断指定的选项是否为批处理模式的选项。
+    The IsBatchCommandLine function determines whether the specified options
+    are the batch mode options.
+    */
+    static bool IsBatchCommandLine(
+        _In_ const NSUDO_COMMAND_LINE& CommandLine)
+    {
+        return NSudoCommandLineHasOption(CommandLine, NSudoOptionID::Batch);
+    }
+
+    /*
+    Run函数读取并执行批处理。
+    The Run function reads and executes the batch.
+
+    每一行的执行结果不影响返回值，请使用AllSucceeded和WriteSummary获取。
+    The result of each line does not affect the return value, please use
+    AllSucceeded and WriteSummary to get them.
+    */
+    NSUDO_MESSAGE Run(
+        _In_ const NSUDO_COMMAND_LINE& CommandLine)
+    {
+        std::wstring Source;
+        DWORD Parallelism = 1;
+
+        if (!CommandLine.IsValid)
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        for (size_t i = 0; i < CommandLine.OptionCount; ++i)
+        {
+            const NSUDO_COMMAND_LINE_OPTION& Option = CommandLine.Options[i];
+
+            if (NSudoOptionID::Batch == Option.Definition->ID)
+            {
+                // 如果没有指定文件或者文件为 "-"，则从标准输入读取
+                Source = Option.Parameter;
+                if (0 == Source.compare(L"-"))
+                {
+                    Source.clear();
+                }
+            }
+            else if (NSudoOptionID::Parallel == Option.Definition->ID)
+            {
+                // 如果没有指定并行数，则使用逻辑处理器数
+                if (Option.Parameter.empty())
+                {
+                    Parallelism = M2GetNumberOfHardwareThreads();
+                }
+                else
+                {
+                    // 选项的参数以 NULL 结尾
+                    wchar_t* End = nullptr;
+                    Parallelism = wcstoul(Option.Parameter.data(), &End, 10);
+                    if (0 == Parallelism || L'\0' != *End)
+                    {
+                        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+                    }
+                }
+            }
+            else
+            {
+                return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+            }
+        }
+
+        std::wstring Content;
+        if (!CNSudoBatch::ReadSource(Source, Content))
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        this->AddItems(Content);
+
+        return this->RunItems(Parallelism);
+    }
+
+    /*
+    RunCommandLine函数在 -Session 指定的每个会话中执行NSudo自身的命令行，各会话
+    由多个工作线程同时创建进程。
+    The RunCommandLine function executes the command line of NSudo itself in
+    every session specified by -Session, and the processes of the sessions are
+    created by multiple worker threads concurrently.
+
+    每个会话的执行结果不影响返回值，请使用AllSucceeded和WriteSummary获取。
+    The result of each session does not affect the return value, please use
+    AllSucceeded and WriteSummary to get them.
+    */
+    NSUDO_MESSAGE RunCommandLine(
+        _In_ LPCWSTR CommandLine)
+    {
+        this->AddItem(1, CommandLine, true);
+
+        return this->RunItems(M2GetNumberOfHardwareThreads());
+    }
+
+private:
+    // 解析并执行所有项
+    NSUDO_MESSAGE RunItems(
+        _In_ DWORD Parallelism)
+    {
+        if (!NSudoGetCurrentProcessSessionID(&this->m_SessionID))
+        {
+            return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        }
+
+        if (!this->m_TokenCache.ImpersonateAsSystem())
+        {
+            return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        }
+
+        // 每一项都会创建环境块
+        NSudoEnableEnvironmentCache();
+
+        for (auto& Item : this->m_Items)
+        {
+            Item.Result.Message = this->Parse(Item);
+        }
+
+        this->ExpandSessions();
+
+        // 在启动工作线程前创建所有令牌，使工作线程只需读取
+        for (auto& Item : this->m_Items)
+        {
+            if (NSUDO_MESSAGE::SUCCESS == Item.Result.Message)
+            {
+                Item.Result.Message = this->Prepare(Item);
+            }
+        }
+
+        if (Parallelism > this->m_Items.size())
+        {
+            Parallelism = static_cast<DWORD>(this->m_Items.size());
+        }
+
+        // 当前线程也作为一个工作线程
+        std::vector<HANDLE> Workers;
+        for (DWORD i = 1; i < Parallelism; ++i)
+        {
+            HANDLE hWorker = M2::CThread([this]()
+            {
+                // 新线程不会继承当前线程的模拟令牌，如果模拟失败则由其他工作
+                // 线程领取剩余的项。
+                if (this->m_TokenCache.ImpersonateAsSystem())
+                {
+                    this->ExecuteItems();
+
+                    RevertToSelf();
+                }
+            }).Detach();
+            if (hWorker && INVALID_HANDLE_VALUE != hWorker)
+            {
+                Workers.push_back(hWorker);
+            }
+        }
+
+        this->ExecuteItems();
+
+        for (auto& hWorker : Workers)
+        {
+            WaitForSingleObjectEx(hWorker, INFINITE, FALSE);
+            CloseHandle(hWorker);
+        }
+
+        RevertToSelf();
+
+        return NSUDO_MESSAGE::SUCCESS;
+    }
+
+public:
+    /*
+    AllSucceeded函数判断批处理的每一行是否都执行成功。
+    The AllSucceeded function determines whether every line of the batch
+    succeeded.
+    */
+    bool AllSucceeded()
+    {
+        for (auto& Item : this->m_Items)
+        {
+            if (NSUDO_MESSAGE::SUCCESS != Item.Result.Message)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+    WriteSummary函数以JSON格式把每一行的执行结果和退出代码写入标准输出。只有
+    使用"-Wait"参数的行才有退出代码，只有使用"-Session"参数的行才有会话ID。
+    The WriteSummary function writes the result and exit code of each line to
+    the standard output in JSON format. Only the lines with the "-Wait"
+    parameter have the exit code, and only the lines with the "-Session"
+    parameter have the session ID.
+    */
+    void WriteSummary()
+    {
+        CNSudoJsonWriter Writer;
+
+        size_t SucceededCount = 0;
+
+        Writer.BeginObject();
+        Writer.Key(L"Results");
+        Writer.BeginArray();
+
+        for (auto& Item : this->m_Items)
+        {
+            NSUDO_BATCH_RESULT& Result = Item.Result;
+
+            Writer.BeginObject();
+            Writer.Key(L"Line");
+            Writer.Number(Result.LineNumber);
+            Writer.Key(L"CommandLine");
+            Writer.String(Result.CommandLine);
+            if ((DWORD)-1 != Result.SessionID)
+            {
+                Writer.Key(L"Session");
+                Writer.Number(Result.SessionID);
+            }
+            Writer.Key(L"Result");
+            Writer.String(M2MakeUTF16String(
+                NSudoTranslationKeys[static_cast<size_t>(
+                    NSudoMessageTranslationID[Result.Message])]));
+            Writer.Key(L"ExitCode");
+            if (Result.Waited)
+            {
+                Writer.Number(Result.ExitCode);
+            }
+            else
+            {
+                Writer.Null();
+            }
+            Writer.EndObject();
+
+            if (NSUDO_MESSAGE::SUCCESS == Result.Message)
+            {
+                ++SucceededCount;
+            }
+        }
+
+        Writer.EndArray();
+        Writer.Key(L"Total");
+        Writer.Number(this->m_Items.size());
+        Writer.Key(L"Succeeded");
+        Writer.Number(SucceededCount);
+        Writer.Key(L"Failed");
+        Writer.Number(this->m_Items.size() - SucceededCount);
+        Writer.EndObject();
+
+        std::string Buffer = M2MakeUTF8String(Writer.GetText()) + "\r\n";
+
+        DWORD NumberOfBytesWritten = 0;
+        WriteFile(
+            GetStdHandle(STD_OUTPUT_HANDLE),
+            Buffer.c_str(),
+            static_cast<DWORD>(Buffer.size()),
+            &NumberOfBytesWritten,
+            nullptr);
+    }
+};
+
+void NSudoPrintMsg(
+    _In_opt_ HINSTANCE hInstance,
+    _In_opt_ HWND hWnd,
+    _In_ LPCWSTR lpContent)
+{
+    std::wstring DialogContent =
+        std::wstring(NSUDO_LOGO_TEXT) +
+        lpContent +
+        g_ResourceManagement.GetTranslation(
+            NSudoTranslationID::NSudo_String_Links);
+
+#if defined(NSUDO_CUI_CONSOLE)
+    UNREFERENCED_PARAMETER(hInstance);
+    UNREFERENCED_PARAMETER(hWnd);
+
+    DWORD NumberOfCharsWritten = 0;
+    WriteConsoleW(
+        GetStdHandle(STD_OUTPUT_HANDLE),
+        DialogContent.c_str(),
+        (DWORD)DialogContent.size(),
+        &NumberOfCharsWritten,
+        nullptr);
+#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
+    M2MessageDialog(
+        hInstance,
+        hWnd,
+        MAKEINTRESOURCE(IDI_NSUDO),
+        L"NSudo",
+        DialogContent.c_str());
+#endif
+}
+
+HRESULT NSudoShowAboutDialog(
+    _In_ HWND hwndParent)
+{
+    std::wstring DialogContent =
+        std::wstring(NSUDO_LOGO_TEXT) +
+        g_ResourceManagement.GetTranslation(
+            NSudoTranslationID::NSudo_String_CommandLineHelp) +
+        g_ResourceManagement.GetTranslation(
+            NSudoTranslationID::NSudo_String_Links);
+
+    SetLastError(ERROR_SUCCESS);
+
+#if defined(NSUDO_CUI_CONSOLE)
+    UNREFERENCED_PARAMETER(hwndParent);
+
+    DWORD NumberOfCharsWritten = 0;
+    WriteConsoleW(
+        GetStdHandle(STD_OUTPUT_HANDLE),
+        DialogContent.c_str(),
+        (DWORD)DialogContent.size(),
+        &NumberOfCharsWritten,
+        nullptr);
+#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
+    M2MessageDialog(
+        g_ResourceManagement.Instance,
+        hwndParent,
+        MAKEINTRESOURCE(IDI_NSUDO),
+        L"NSudo",
+        DialogContent.c_str());
+#endif
+
+    return M2GetLastError();
+}
+
+#if defined(NSUDO_GUI_WINDOWS)
+
+#include <ShellScalingApi.h>
+
+inline HRESULT GetDpiForMonitorInternal(
+    _In_ HMONITOR hmonitor,
+    _In_ MONITOR_DPI_TYPE dpiType,
+    _Out_ UINT *dpiX,
+    _Out_ UINT *dpiY)
+{
+    HMODULE hModule = nullptr;
+    decltype(GetDpiForMonitor)* pFunc = nullptr;
+    HRESULT hr = E_NOINTERFACE;
+
+    hModule = LoadLibraryW(L"SHCore.dll");
+    if (!hModule) return M2GetLastError();
+
+    pFunc = reinterpret_cast<decltype(pFunc)>(
+        GetProcAddress(hModule, "GetDpiForMonitor"));
+    if (!pFunc) return M2GetLastError();
+
+    hr = pFunc(hmonitor, dpiType, dpiX, dpiY);
+
+    FreeLibrary(hModule);
+
+    return hr;
+}
+
+#pragma comment(lib, "Msimg32.lib")
+
+/*
+NSudoCreatePremultipliedBitmap函数把图标转换为预乘Alpha的32位自上而下的位图，使
+绘制时可以直接使用AlphaBlend。图标的大小必须是Width和Height。没有Alpha通道的图
+标使用其掩码作为Alpha通道。
+The NSudoCreatePremultipliedBitmap function converts the icon to a top-down
+32-bit bitmap with premultiplied alpha, so it can be drawn with AlphaBlend
+directly. The size of the icon must be Width and Height. The icon without the
+alpha channel uses its mask as the alpha channel.
+
+如果函数执行失败，返回值为nullptr。
+If the function fails, the return value is nullptr.
+*/
+HBITMAP NSudoCreatePremultipliedBitmap(
+    _In_ HICON hIcon,
+    _In_ int Width,
+    _In_ int Height)
+{
+    ICONINFO IconInfo = { 0 };
+    if (!GetIconInfo(hIcon, &IconInfo))
+    {
+        return nullptr;
+    }
+
+    // GetIconInfo创建的位图需要由调用者删除
+    auto DeleteIconBitmaps = [&IconInfo]()
+    {
+        if (IconInfo.hbmColor)
+        {
+            DeleteObject(IconInfo.hbmColor);
+        }
+        if (IconInfo.hbmMask)
+        {
+            DeleteObject(IconInfo.hbmMask);
+        }
+    };
+
+    if (!IconInfo.hbmColor)
+    {
+        DeleteIconBitmaps();
+        return nullptr;
+    }
+
+    BITMAPINFO BitmapInfo = { 0 };
+    BitmapInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    BitmapInfo.bmiHeader.biWidth = Width;
+    BitmapInfo.bmiHeader.biHeight = -Height;
+    BitmapInfo.bmiHeader.biPlanes = 1;
+    BitmapInfo.bmiHeader.biBitCount = 32;
+    BitmapInfo.bmiHeader.biCompression = BI_RGB;
+
+    PVOID Bits = nullptr;
+    HBITMAP hBitmap = CreateDIBSection(
+        nullptr, &BitmapInfo, DIB_RGB_COLORS, &Bits, nullptr, 0);
+    if (!hBitmap)
+    {
+        DeleteIconBitmaps();
+        return nullptr;
+    }
+
+    const size_t PixelCount = static_cast<size_t>(Width) * Height;
+    RGBQUAD* Pixels = reinterpret_cast<RGBQUAD*>(Bits);
+    std::vector<RGBQUAD> Mask(PixelCount);
+
+    HDC hdc = GetDC(nullptr);
+    bool Succeeded =
+        Height == GetDIBits(
+            hdc,
+            IconInfo.hbmColor,
+            0,
+            Height,
+            Pixels,
+            &BitmapInfo,
+            DIB_RGB_COLORS) &&
+        Height == GetDIBits(
+            hdc,
+            IconInfo.hbmMask,
+            0,
+            Height,
+            Mask.data(),
+            &BitmapInfo,
+            DIB_RGB_COLORS);
+    ReleaseDC(nullptr, hdc);
+    DeleteIconBitmaps();
+    if (!Succeeded)
+    {
+        DeleteObject(hBitmap);
+        return nullptr;
+    }
+
+    bool HasAlpha = false;
+    for (size_t i = 0; i < PixelCount && !HasAlpha; ++i)
+    {
+        HasAlpha = (0 != Pixels[i].rgbReserved);
+    }
+
+    for (size_t i = 0; i < PixelCount; ++i)
+    {
+        RGBQUAD& Pixel = Pixels[i];
+
+        // 掩码中的白色像素是透明的
+        BYTE Alpha = HasAlpha
+            ? Pixel.rgbReserved
+            : (Mask[i].rgbBlue ? 0 : 255);
+
+        Pixel.rgbBlue = static_cast<BYTE>(Pixel.rgbBlue * Alpha / 255);
+        Pixel.rgbGreen = static_cast<BYTE>(Pixel.rgbGreen * Alpha / 255);
+        Pixel.rgbRed = static_cast<BYTE>(Pixel.rgbRed * Alpha / 255);
+        Pixel.rgbReserved = Alpha;
+    }
+
+    return hBitmap;
+}
+
+#include <atlbase.h>
+#include <atlwin.h>
+
+class CNSudoMainWindow : public ATL::CDialogImpl<CNSudoMainWindow>
+{
+public:
+    enum { IDD = IDD_NSudoDlg };
+
+public:
+    BEGIN_MSG_MAP(CNSudoMainWindow)
+        MESSAGE_HANDLER(WM_CLOSE, OnClose)
+        MESSAGE_HANDLER(WM_INITDIALOG, OnInitDialog)
+        MESSAGE_HANDLER(WM_PAINT, OnPaint)
+        MESSAGE_HANDLER(WM_DPICHANGED, OnDPIChanged)
+        MESSAGE_HANDLER(WM_THEMECHANGED, OnThemeChanged)
+        MESSAGE_HANDLER(WM_SYSCOLORCHANGE, OnThemeChanged)
+
+        COMMAND_ID_HANDLER(IDC_Run, OnRun)
+        COMMAND_ID_HANDLER(IDC_About, OnAbout)
+        COMMAND_ID_HANDLER(IDC_Browse, OnBrowse)
+
+        MESSAGE_HANDLER(WM_DROPFILES, OnDropFiles)
+    END_MSG_MAP()
+
+public:
+    CNSudoMainWindow()
+    {
+        M2EnablePerMonitorDialogScaling();
+
+        ChangeWindowMessageFilter(WM_DROPFILES, MSGFLT_ADD);
+        ChangeWindowMessageFilter(0x0049, MSGFLT_ADD); // WM_COPYGLOBALDATA
+    }
+
+    ~CNSudoMainWindow()
+    {
+        this->FreeIconCache();
+    }
+
+private:
+    HICON m_hNSudoIcon = nullptr;
+
+    // 以当前DPI下的物理大小缓存的已绘制到背景上的图标和用于复制它们的内存设备
+    // 上下文，在DPI、主题或者系统颜色改变时重建
+    HBITMAP m_NSudoIconBitmap = nullptr;
+    SIZE m_NSudoIconSize = { 0 };
+    HBITMAP m_WarningIconBitmap = nullptr;
+    SIZE m_WarningIconSize = { 0 };
+    HDC m_IconBufferDC = nullptr;
+
+    int m_xDPI = USER_DEFAULT_SCREEN_DPI;
+    int m_yDPI = USER_DEFAULT_SCREEN_DPI;
+
+    ATL::CWindow m_hUserName;
+    ATL::CWindow m_hCheckBox;
+    ATL::CWindow m_hszPath;
+
+    LRESULT OnClose(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(uMsg);
+        UNREFERENCED_PARAMETER(wParam);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        this->EndDialog(0);
+        return 0;
+    }
+
+    LRESULT OnInitDialog(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(uMsg);
+        UNREFERENCED_PARAMETER(wParam);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        this->m_hUserName = this->GetDlgItem(IDC_UserName);
+        this->m_hCheckBox = this->GetDlgItem(IDC_Check_EnableAllPrivileges);
+        this->m_hszPath = this->GetDlgItem(IDC_szPath);
+
+        this->SetWindowTextW(NSUDO_VERSION_TEXT);
+
+        struct { NSudoTranslationID ID; ATL::CWindow Control; } x[] =
+        {
+            { NSudoTranslationID::EnableAllPrivileges , this->m_hCheckBox },
+            { NSudoTranslationID::WarningText , this->GetDlgItem(IDC_WARNINGTEXT) },
+            { NSudoTranslationID::SettingsGroupText ,this->GetDlgItem(IDC_SETTINGSGROUPTEXT) },
+            { NSudoTranslationID::Static_User,this->GetDlgItem(IDC_STATIC_USER) },
+            { NSudoTranslationID::Static_Open, this->GetDlgItem(IDC_STATIC_OPEN) },
+            { NSudoTranslationID::Button_About, this->GetDlgItem(IDC_About) },
+            { NSudoTranslationID::Button_Browse, this->GetDlgItem(IDC_Browse) },
+            { NSudoTranslationID::Button_Run, this->GetDlgItem(IDC_Run) }
+        };
+
+        for (size_t i = 0; i < sizeof(x) / sizeof(x[0]); ++i)
+        {
+            x[i].Control.SetWindowTextW(
+                g_ResourceManagement.GetTranslation(x[i].ID));
+        }
+
+        HRESULT hr = E_FAIL;
+
+        hr = GetDpiForMonitorInternal(
+            MonitorFromWindow(this->m_hWnd, MONITOR_DEFAULTTONEAREST),
+            MDT_EFFECTIVE_DPI, (UINT*)&this->m_xDPI, (UINT*)&this->m_yDPI);
+        if (hr != S_OK)
+        {
+            this->m_xDPI = GetDeviceCaps(this->GetDC(), LOGPIXELSX);
+            this->m_yDPI = GetDeviceCaps(this->GetDC(), LOGPIXELSY);
+        }
+
+        this->m_hNSudoIcon = (HICON)LoadImageW(
+            g_ResourceManagement.Instance,
+            MAKEINTRESOURCE(IDI_NSUDO),
+            IMAGE_ICON,
+            256,
+            256,
+            LR_SHARED);
+
+        SendMessageW(this->m_hWnd, WM_SETICON, ICON_SMALL, (LPARAM)this->m_hNSudoIcon);
+        SendMessageW(this->m_hWnd, WM_SETICON, ICON_BIG, (LPARAM)this->m_hNSudoIcon);
+
+        this->BuildIconCache();
+
+        NSudoTranslationID UserNameID[] =
+        {
+            NSudoTranslationID::TI,
+            NSudoTranslationID::System,
+            NSudoTranslationID::CurrentProcess,
+            NSudoTranslationID::CurrentUser
+        };
+        for (size_t i = 0; i < sizeof(UserNameID) / sizeof(*UserNameID); ++i)
+        {
+            LPCWSTR Buffer = g_ResourceManagement.GetTranslation(UserNameID[i]);
+            SendMessageW(this->m_hUserName, CB_INSERTSTRING, 0, (LPARAM)Buffer);
+        }
+
+        //设置默认项"TrustedInstaller"
+        SendMessageW(this->m_hUserName, CB_SETCURSEL, 3, 0);
+
+        std::shared_ptr<const CNSudoShortCutList> ShortCutList =
+            g_ResourceManagement.GetShortCutList();
+        for (size_t i = 0; i < ShortCutList->Count(); ++i)
+        {
+            SendMessageW(
+                this->m_hszPath,
+                CB_INSERTSTRING,
+                0,
+                (LPARAM)ShortCutList->Key(i).data());
+        }
+
+        return TRUE;
+    }
+
+    POINT GetPhysicalPoint(const POINT& LogicalPoint)
+    {
+        POINT PhysicalPoint;
+
+        PhysicalPoint.x = MulDiv(
+            LogicalPoint.x, this->m_xDPI, USER_DEFAULT_SCREEN_DPI);
+        PhysicalPoint.y = MulDiv(
+            LogicalPoint.y, this->m_yDPI, USER_DEFAULT_SCREEN_DPI);
+
+        return PhysicalPoint;
+    }
+
+    SIZE GetPhysicalSize(const SIZE& LogicalSize)
+    {
+        SIZE PhysicalSize;
+
+        PhysicalSize.cx = MulDiv(
+            LogicalSize.cx, this->m_xDPI, USER_DEFAULT_SCREEN_DPI);
+        PhysicalSize.cy = MulDiv(
+            LogicalSize.cy, this->m_yDPI, USER_DEFAULT_SCREEN_DPI);
+
+        return PhysicalSize;
+    }
+
+    // 以当前DPI下的物理大小加载图标，并转换为预乘Alpha的位图
+    HBITMAP LoadIconBitmap(
+        _In_opt_ HINSTANCE hInstance,
+        _In_ LPCWSTR lpIconName,
+        _In_ const SIZE& LogicalSize,
+        _Out_ SIZE& PhysicalSize)
+    {
+        PhysicalSize = this->GetPhysicalSize(LogicalSize);
+
+        HICON hIcon = nullptr;
+        if (FAILED(LoadIconWithScaleDown(
+            hInstance,
+            lpIconName,
+            PhysicalSize.cx,
+            PhysicalSize.cy,
+            &hIcon)))
+        {
+            return nullptr;
+        }
+
+        HBITMAP hBitmap = NSudoCreatePremultipliedBitmap(
+            hIcon, PhysicalSize.cx, PhysicalSize.cy);
+
+        DestroyIcon(hIcon);
+
+        return hBitmap;
+    }
+
+    void FreeIconCache()
+    {
+        if (this->m_NSudoIconBitmap)
+        {
+            DeleteObject(this->m_NSudoIconBitmap);
+            this->m_NSudoIconBitmap = nullptr;
+        }
+
+        if (this->m_WarningIconBitmap)
+        {
+            DeleteObject(this->m_WarningIconBitmap);
+            this->m_WarningIconBitmap = nullptr;
+        }
+
+        if (this->m_IconBufferDC)
+        {
+            DeleteDC(this->m_IconBufferDC);
+            this->m_IconBufferDC = nullptr;
+        }
+    }
+
+    // 使用对话框的背景画刷，使图标周围与对话框一致
+    HBRUSH GetBackgroundBrush(
+        _In_ HDC hdc)
+    {
+        HBRUSH hBackground = reinterpret_cast<HBRUSH>(this->SendMessageW(
+            WM_CTLCOLORDLG,
+            reinterpret_cast<WPARAM>(hdc),
+            reinterpret_cast<LPARAM>(this->m_hWnd)));
+        if (!hBackground)
+        {
+            hBackground = GetSysColorBrush(COLOR_3DFACE);
+        }
+
+        return hBackground;
+    }
+
+    /*
+    ComposeIconBitmap函数创建一个与hdc兼容的位图，并把预乘Alpha的图标绘制到背景
+    上，使绘制时只需一次复制。
+    The ComposeIconBitmap function creates a bitmap compatible with hdc, and
+    draws the premultiplied alpha icon on the background, so painting only
+    needs one copy.
+    */
+    static HBITMAP ComposeIconBitmap(
+        _In_ HDC hdc,
+        _In_ HBRUSH hBackground,
+        _In_ HBITMAP hIconBitmap,
+        _In_ const SIZE& PhysicalSize)
+    {
+        HBITMAP hBuffer = nullptr;
+
+        HDC hdcBuffer = CreateCompatibleDC(hdc);
+        HDC hdcIcon = CreateCompatibleDC(hdc);
+        if (hdcBuffer && hdcIcon)
+        {
+            hBuffer = CreateCompatibleBitmap(
+                hdc, PhysicalSize.cx, PhysicalSize.cy);
+        }
+
+        if (hBuffer)
+        {
+            HGDIOBJ hOldBuffer = SelectObject(hdcBuffer, hBuffer);
+            HGDIOBJ hOldIcon = SelectObject(hdcIcon, hIconBitmap);
+
+            RECT BufferRect = { 0, 0, PhysicalSize.cx, PhysicalSize.cy };
+            FillRect(hdcBuffer, &BufferRect, hBackground);
+
+            BLENDFUNCTION BlendFunction = { AC_SRC_OVER, 0, 255, AC_SRC_ALPHA };
+            AlphaBlend(
+                hdcBuffer,
+                0,
+                0,
+                PhysicalSize.cx,
+                PhysicalSize.cy,
+                hdcIcon,
+                0,
+                0,
+                PhysicalSize.cx,
+                PhysicalSize.cy,
+                BlendFunction);
+
+            SelectObject(hdcIcon, hOldIcon);
+            SelectObject(hdcBuffer, hOldBuffer);
+        }
+
+        if (hdcIcon)
+        {
+            DeleteDC(hdcIcon);
+        }
+        if (hdcBuffer)
+        {
+            DeleteDC(hdcBuffer);
+        }
+
+        return hBuffer;
+    }
+
+    // 加载图标并绘制到背景上
+    HBITMAP BuildIconBitmap(
+        _In_ HDC hdc,
+        _In_ HBRUSH hBackground,
+        _In_opt_ HINSTANCE hInstance,
+        _In_ LPCWSTR lpIconName,
+        _In_ const SIZE& LogicalSize,
+        _Out_ SIZE& PhysicalSize)
+    {
+        HBITMAP hIconBitmap = this->LoadIconBitmap(
+            hInstance, lpIconName, LogicalSize, PhysicalSize);
+        if (!hIconBitmap)
+        {
+            return nullptr;
+        }
+
+        HBITMAP hBitmap = CNSudoMainWindow::ComposeIconBitmap(
+            hdc, hBackground, hIconBitmap, PhysicalSize);
+
+        DeleteObject(hIconBitmap);
+
+        return hBitmap;
+    }
+
+    void BuildIconCache()
+    {
+        this->FreeIconCache();
+
+        HDC hdc = this->GetDC();
+        if (!hdc)
+        {
+            return;
+        }
+
+        HBRUSH hBackground = this->GetBackgroundBrush(hdc);
+
+        this->m_NSudoIconBitmap = this->BuildIconBitmap(
+            hdc,
+            hBackground,
+            g_ResourceManagement.Instance,
+            MAKEINTRESOURCE(IDI_NSUDO),
+            { 64, 64 },
+            this->m_NSudoIconSize);
+        this->m_WarningIconBitmap = this->BuildIconBitmap(
+            hdc,
+            hBackground,
+            nullptr,
+            IDI_WARNING,
+            { 24, 24 },
+            this->m_WarningIconSize);
+        this->m_IconBufferDC = CreateCompatibleDC(hdc);
+
+        this->ReleaseDC(hdc);
+    }
+
+    /*
+    DrawIconBitmap函数把缓存的已绘制到背景上的图标一次复制到窗口，以免闪烁。
+    The DrawIconBitmap function copies the cached icon which is already drawn
+    on the background to the window at once to avoid flicker.
+    */
+    void DrawIconBitmap(
+        _In_ HDC hdc,
+        _In_ const POINT& LogicalPoint,
+        _In_opt_ HBITMAP hBitmap,
+        _In_ const SIZE& PhysicalSize)
+    {
+        if (!hBitmap || !this->m_IconBufferDC)
+        {
+            return;
+        }
+
+        POINT PhysicalPoint = this->GetPhysicalPoint(LogicalPoint);
+
+        HGDIOBJ hOldBitmap = SelectObject(this->m_IconBufferDC, hBitmap);
+
+        BitBlt(
+            hdc,
+            PhysicalPoint.x,
+            PhysicalPoint.y,
+            PhysicalSize.cx,
+            PhysicalSize.cy,
+            this->m_IconBufferDC,
+            0,
+            0,
+            SRCCOPY);
+
+        SelectObject(this->m_IconBufferDC, hOldBitmap);
+    }
+
+    BOOL GetLogicalClientRect(
+        _Out_ RECT& LogicalRect)
+    {
+        BOOL result = GetClientRect(&LogicalRect);
+
+        LogicalRect.left = MulDiv(
+            LogicalRect.left, USER_DEFAULT_SCREEN_DPI, this->m_xDPI);
+        LogicalRect.top = MulDiv(
+            LogicalRect.top, USER_DEFAULT_SCREEN_DPI, this->m_yDPI);
+        LogicalRect.right = MulDiv(
+            LogicalRect.right, USER_DEFAULT_SCREEN_DPI, this->m_xDPI);
+        LogicalRect.bottom = MulDiv
+        (LogicalRect.bottom, USER_DEFAULT_SCREEN_DPI, this->m_yDPI);
+
+        return result;
+    }
+
+    LRESULT OnPaint(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(uMsg);
+        UNREFERENCED_PARAMETER(wParam);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        PAINTSTRUCT ps;
+        HDC hdc = this->BeginPaint(&ps);
+
+        RECT rect = { 0 };
+        this->GetLogicalClientRect(rect);
+
+        this->DrawIconBitmap(
+            hdc,
+            { 16, 16 },
+            this->m_NSudoIconBitmap,
+            this->m_NSudoIconSize);
+        this->DrawIconBitmap(
+            hdc,
+            { 16, (rect.bottom - rect.top) - 40 },
+            this->m_WarningIconBitmap,
+            this->m_WarningIconSize);
+
+        this->EndPaint(&ps);
+
+        return 0;
+    }
+
+    LRESULT OnDPIChanged(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(uMsg);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        this->m_xDPI = LOWORD(wParam);
+        this->m_yDPI = HIWORD(wParam);
+
+        this->BuildIconCache();
+        this->Invalidate();
+
+        return 0;
+    }
+
+    /*
+    OnThemeChanged函数处理WM_THEMECHANGED和WM_SYSCOLORCHANGE。缓存的图标已绘制
+    到对话框的背景上，所以背景改变后需要重建。
+    The OnThemeChanged function handles WM_THEMECHANGED and WM_SYSCOLORCHANGE.
+    The cached icons are already drawn on the background of the dialog, so they
+    need to be rebuilt after the background is changed.
+    */
+    LRESULT OnThemeChanged(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        // 顶层窗口需要把WM_SYSCOLORCHANGE转发给通用控件
+        if (WM_SYSCOLORCHANGE == uMsg)
+        {
+            this->SendMessageToDescendants(uMsg, wParam, lParam, FALSE);
+        }
+
+        this->BuildIconCache();
+        this->Invalidate();
+
+        // 继续默认处理
+        bHandled = FALSE;
+
+        return 0;
+    }
+
+    LRESULT OnRun(
+        WORD wNotifyCode,
+        WORD wID,
+        HWND hWndCtl,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(wNotifyCode);
+        UNREFERENCED_PARAMETER(wID);
+        UNREFERENCED_PARAMETER(hWndCtl);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        std::wstring UserName(MAX_PATH, L'\0');
+        auto UserNameLength = this->m_hUserName.GetWindowTextW(
+            &UserName[0],
+            static_cast<int>(UserName.size()));
+        UserName.resize(UserNameLength);
+
+        bool NeedToEnableAllPrivileges = false;
+        if (BST_CHECKED == SendMessageW(this->m_hCheckBox, BM_GETCHECK, 0, 0))
+        {
+            NeedToEnableAllPrivileges = true;
+        }
+
+        std::wstring RawCommandLine(MAX_PATH, L'\0');
+        auto RawCommandLineLength = this->m_hszPath.GetWindowTextW(
+            &RawCommandLine[0],
+            static_cast<int>(RawCommandLine.size()));
+        RawCommandLine.resize(RawCommandLineLength);
+
+        if (_wcsicmp(L"", RawCommandLine.c_str()) == 0)
+        {
+            std::wstring Buffer = g_ResourceManagement.GetMessageString(
+                NSUDO_MESSAGE::INVALID_TEXTBOX_PARAMETER);
+            NSudoPrintMsg(
+                g_ResourceManagement.Instance,
+                this->m_hWnd,
+                Buffer.c_str());
+        }
+        else
+        {
+            std::wstring CommandLine = L"NSudo";
+
+            // 获取用户令牌
+            if (0 == _wcsicmp(
+                g_ResourceManagement.GetTranslation(
+                    NSudoTranslationID::TI),
+                UserName.c_str()))
+            {
+                CommandLine += L" -U:T";
+            }
+            else if (0 == _wcsicmp(
+                g_ResourceManagement.GetTranslation(
+                    NSudoTranslationID::System),
+                UserName.c_str()))
+            {
+                CommandLine += L" -U:S";
+            }
+            else if (0 == _wcsicmp(
+                g_ResourceManagement.GetTranslation(
+                    NSudoTranslationID::CurrentProcess),
+                UserName.c_str()))
+            {
+                CommandLine += L" -U:P";
+            }
+            else if (0 == _wcsicmp(
+                g_ResourceManagement.GetTranslation(
+                    NSudoTranslationID::CurrentUser),
+                UserName.c_str()))
+            {
+                CommandLine += L" -U:C";
+            }
+
+            // 如果勾选启用全部特权，则尝试对令牌启用全部特权
+            if (NeedToEnableAllPrivileges)
+            {
+                CommandLine += L" -P:E";
+            }
+
+            // 文档和URL以其关联程序启动
+            CommandLine += L" -Resolve";
+
+            CommandLine += L" ";
+            CommandLine += RawCommandLine;
+
+            NSUDO_COMMAND_LINE ParsedCommandLine;
+            NSudoParseCommandLine(CommandLine.c_str(), ParsedCommandLine);
+
+            ParsedCommandLine.UnresolvedCommandLine =
+                CNSudoShortCutAdapter::Translate(
+                    *g_ResourceManagement.GetShortCutList(),
+                    ParsedCommandLine.UnresolvedCommandLine);
+
+            NSUDO_MESSAGE message = NSudoCommandLineParser(
+                true,
+                true,
+                ParsedCommandLine);
+            if (NSUDO_MESSAGE::SUCCESS != message)
+            {
+                std::wstring Buffer = g_ResourceManagement.GetMessageString(
+                    message);
+                NSudoPrintMsg(
+                    g_ResourceManagement.Instance,
+                    this->m_hWnd,
+                    Buffer.c_str());
+            }
+        }
+
+        return 0;
+    }
+
+    LRESULT OnAbout(
+        WORD wNotifyCode,
+        WORD wID,
+        HWND hWndCtl,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(wNotifyCode);
+        UNREFERENCED_PARAMETER(wID);
+        UNREFERENCED_PARAMETER(hWndCtl);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        NSudoShowAboutDialog(this->m_hWnd);
+
+        return 0;
+    }
+
+    LRESULT OnBrowse(
+        WORD wNotifyCode,
+        WORD wID,
+        HWND hWndCtl,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(wNotifyCode);
+        UNREFERENCED_PARAMETER(wID);
+        UNREFERENCED_PARAMETER(hWndCtl);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        std::wstring buffer(MAX_PATH + 2, L'\0');
+
+        buffer[0] = L'\"';
+
+        OPENFILENAME ofn = { 0 };
+
+        ofn.lStructSize = sizeof(OPENFILENAME);
+        ofn.hwndOwner = this->m_hWnd;
+        ofn.nMaxFile = MAX_PATH;
+        ofn.nMaxFileTitle = MAX_PATH;
+        ofn.lpstrFile = &buffer[1];
+        ofn.Flags = OFN_HIDEREADONLY | OFN_CREATEPROMPT;
+
+        GetOpenFileNameW(&ofn);
+
+        buffer.resize(wcslen(buffer.c_str()));
+
+        buffer[buffer.size()] = L'\"';
+
+        if (wcslen(buffer.c_str()) > 2)
+            this->m_hszPath.SetWindowTextW(buffer.c_str());
+
+        return 0;
+    }
+
+    LRESULT OnDropFiles(
+        UINT uMsg,
+        WPARAM wParam,
+        LPARAM lParam,
+        BOOL& bHandled)
+    {
+        UNREFERENCED_PARAMETER(uMsg);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(bHandled);
+
+        std::wstring buffer(MAX_PATH + 2, L'\0');
+
+        buffer[0] = L'\"';
+
+        auto length = DragQueryFileW(
+            (HDROP)wParam, 0, &buffer[1], (int)(buffer.size() - 2));
+        buffer.resize(length + 1);
+
+        if (!(GetFileAttributesW(&buffer[1]) & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            buffer[buffer.size()] = L'\"';
+            this->m_hszPath.SetWindowTextW(buffer.c_str());
+        }
+
+        DragFinish((HDROP)wParam);
+
+        return 0;
+    }
+};
+
+#endif
+
+int NSudoMain()
+{
+    NSUDO_COMMAND_LINE CommandLine;
+    NSudoParseCommandLine(GetCommandLineW(), CommandLine);
+
+    // 没有命令行时无需加载快捷命令列表
+    if (!CommandLine.UnresolvedCommandLine.empty())
+    {
+        CommandLine.UnresolvedCommandLine = CNSudoShortCutAdapter::Translate(
+            *g_ResourceManagement.GetShortCutList(),
+            CommandLine.UnresolvedCommandLine);
+    }
+
+    if (CommandLine.IsValid &&
+        0 == CommandLine.OptionCount &&
+        CommandLine.UnresolvedCommandLine.empty())
+    {
+#if defined(NSUDO_CUI_CONSOLE) || defined(NSUDO_CUI_WINDOWS)
+        NSudoShowAboutDialog(nullptr);
+#elif defined(NSUDO_GUI_WINDOWS)
+        CNSudoComInitializer ComInitializer;
+        CNSudoMainWindow MainWindow;
+        MainWindow.DoModal(nullptr);
+#endif
+        return 0;
+    }
+
+#if defined(NSUDO_CUI_CONSOLE)
+    bool bEnableContextMenuManagement = false;
+#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
+    bool bEnableContextMenuManagement = true;
+#endif
+
+    NSUDO_MESSAGE message = NSUDO_MESSAGE::SUCCESS;
+    DWORD ExitCode = STILL_ACTIVE;
+
+    if (!CommandLine.IsValid)
+    {
+        message = NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+    else if (CNSudoBroker::IsBrokerCommandLine(CommandLine))
+    {
+        // 如果参数是 /Broker 或 -Broker，则作为NSudo代理运行
+        DWORD KeepAliveInterval = 0;
+
+        if (!CNSudoBroker::ParseKeepAliveInterval(
+            CommandLine, KeepAliveInterval))
+        {
+            message = NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+        else if (!g_ResourceManagement.IsElevated)
+        {
+            message = NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        }
+        else
+        {
+            CNSudoBroker Broker;
+            if (ERROR_SUCCESS != Broker.Run(KeepAliveInterval))
+            {
+                message = NSUDO_MESSAGE::BROKER_START_FAILED;
+            }
+        }
+    }
+    else if (CommandLine.UnresolvedCommandLine.empty() &&
+        CNSudoBatch::IsBatchCommandLine(CommandLine))
+    {
+        // 如果参数包含 /Batch 或 -Batch，则逐行创建进程
+        if (!g_ResourceManagement.IsElevated)
+        {
+            message = NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        }
+        else
+        {
+            CNSudoBatch Batch;
+            message = Batch.Run(CommandLine);
+            if (NSUDO_MESSAGE::SUCCESS == message)
+            {
+                // 每一行的执行结果由摘要提供，所以不再显示错误信息
+                Batch.WriteSummary();
+                if (!Batch.AllSucceeded())
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    else if (NSudoCommandLineHasOption(CommandLine, NSudoOptionID::Session))
+    {
+        // 如果参数包含 /Session 或 -Session，则在每个目标会话中创建进程
+        if (!g_ResourceManagement.IsElevated)
+        {
+            message = NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
+        }
+        else
+        {
+            CNSudoBatch Batch;
+            message = Batch.RunCommandLine(GetCommandLineW());
+            if (NSUDO_MESSAGE::SUCCESS == message)
+            {
+                // 每个会话的执行结果由摘要提供，所以不再显示错误信息
+                Batch.WriteSummary();
+                if (!Batch.AllSucceeded())
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    else if (!(CNSudoBroker::CanForward(CommandLine) &&
+        CNSudoBroker::Forward(GetCommandLineW(), message, ExitCode)))
+    {
+        // 如果没有正在运行的NSudo代理，则自行创建进程
+        message = NSudoCommandLineParser(
+            g_ResourceManagement.IsElevated,
+            bEnableContextMenuManagement,
+            CommandLine,
+            nullptr,
+            (DWORD)-1,
+            &ExitCode);
+    }
+
+    if (NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP == message)
+    {
+        NSudoShowAboutDialog(nullptr);
+    }
+    else if (NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION == message)
+    {
+        NSudoPrintMsg(
+            g_ResourceManagement.Instance,
+            nullptr,
+            NSUDO_VERSION_TEXT);
+    }
+    else if (NSUDO_MESSAGE::SUCCESS != message)
+    {
+        std::wstring Buffer = g_ResourceManagement.GetMessageString(
+            message);
+        if (!CommandLine.IsValid)
+        {
+            // 提示无效的参数和根据选项表生成的用法
+            Buffer += L"\r\n\r\n";
+            Buffer += NSudoGetCommandLineUsage(CommandLine);
+        }
+        NSudoPrintMsg(
+            g_ResourceManagement.Instance,
+            nullptr,
+            Buffer.c_str());
+        return -1;
+    }
 
-    DWORD NumberOfCharsWritten = 0;
-    WriteConsoleW(
-        GetStdHandle(STD_OUTPUT_HANDLE),
-        DialogContent.c_str(),
-        (DWORD)DialogContent.size(),
-        &NumberOfCharsWritten,
-        nullptr);
-#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
-    M2MessageDialog(
-        g_ResourceManagement.Instance,
-        hwndParent,
-        MAKEINTRESOURCE(IDI_NSUDO),
-        L"NSudo",
-        DialogContent.c_str());
-#endif
+    // 使用 -Wait 时返回进程树的退出代码
+    if (STILL_ACTIVE != ExitCode)
+    {
+        return static_cast<int>(ExitCode);
+    }
 
-    return M2GetLastError();
+    return 0;
 }
 
-#if defined(NSUDO_GUI_WINDOWS)
+#if defined(NSUDO_BENCHMARK)
 
-#include <ShellScalingApi.h>
+#include <algorithm>
 
-inline HRESULT GetDpiForMonitorInternal(
-    _In_ HMONITOR hmonitor,
-    _In_ MONITOR_DPI_TYPE dpiType,
-    _Out_ UINT *dpiX,
-    _Out_ UINT *dpiY)
+// 基准测试的结果只在NSudoBench中生成，所以只有它链接通用的JSON库
+#include "ThirdParty/json.hpp"
+
+// 使用最近秩法求已排序样本的百分位数
+double NSudoBenchGetPercentile(
+    _In_ const std::vector<double>& SortedSamples,
+    _In_ size_t Percentile)
 {
-    HMODULE hModule = nullptr;
-    decltype(GetDpiForMonitor)* pFunc = nullptr;
-    HRESULT hr = E_NOINTERFACE;
+    if (SortedSamples.empty())
+    {
+        return 0.0;
+    }
 
-    hModule = LoadLibraryW(L"SHCore.dll");
-    if (!hModule) return M2GetLastError();
+    size_t Rank = (Percentile * SortedSamples.size() + 99) / 100;
+    if (Rank < 1)
+    {
+        Rank = 1;
+    }
 
-    pFunc = reinterpret_cast<decltype(pFunc)>(
-        GetProcAddress(hModule, "GetDpiForMonitor"));
-    if (!pFunc) return M2GetLastError();
+    return SortedSamples[Rank - 1];
+}
 
-    hr = pFunc(hmonitor, dpiType, dpiX, dpiY);
+// 原来的UTF-8到UTF-16的转换，用于与ASCII快速路径比较
+std::wstring NSudoBenchReferenceMakeUTF16String(
+    _In_ const std::string& UTF8String)
+{
+    std::wstring UTF16String;
 
-    FreeLibrary(hModule);
+    int UTF16StringLength = MultiByteToWideChar(
+        CP_UTF8,
+        0,
+        UTF8String.data(),
+        (int)UTF8String.size(),
+        nullptr,
+        0);
+    if (UTF16StringLength > 0)
+    {
+        UTF16String.resize(UTF16StringLength);
+        MultiByteToWideChar(
+            CP_UTF8,
+            0,
+            UTF8String.data(),
+            (int)UTF8String.size(),
+            &UTF16String[0],
+            UTF16StringLength);
+    }
 
-    return hr;
+    return UTF16String;
 }
 
-#include <atlbase.h>
-#include <atlwin.h>
-
-class CNSudoMainWindow : public ATL::CDialogImpl<CNSudoMainWindow>
+// 原来的UTF-16到UTF-8的转换，用于与ASCII快速路径比较
+std::string NSudoBenchReferenceMakeUTF8String(
+    _In_ const std::wstring& UTF16String)
 {
-public:
-    enum { IDD = IDD_NSudoDlg };
+    std::string UTF8String;
 
-public:
-    BEGIN_MSG_MAP(CNSudoMainWindow)
-        MESSAGE_HANDLER(WM_CLOSE, OnClose)
-        MESSAGE_HANDLER(WM_INITDIALOG, OnInitDialog)
-        MESSAGE_HANDLER(WM_PAINT, OnPaint)
-        MESSAGE_HANDLER(WM_DPICHANGED, OnDPIChanged)
+    int UTF8StringLength = WideCharToMultiByte(
+        CP_UTF8,
+        0,
+        UTF16String.data(),
+        (int)UTF16String.size(),
+        nullptr,
+        0,
+        nullptr,
+        nullptr);
+    if (UTF8StringLength > 0)
+    {
+        UTF8String.resize(UTF8StringLength);
+        WideCharToMultiByte(
+            CP_UTF8,
+            0,
+            UTF16String.data(),
+            (int)UTF16String.size(),
+            &UTF8String[0],
+            UTF8StringLength,
+            nullptr,
+            nullptr);
+    }
 
-        COMMAND_ID_HANDLER(IDC_Run, OnRun)
-        COMMAND_ID_HANDLER(IDC_About, OnAbout)
-        COMMAND_ID_HANDLER(IDC_Browse, OnBrowse)
+    return UTF8String;
+}
 
-        MESSAGE_HANDLER(WM_DROPFILES, OnDropFiles)
-    END_MSG_MAP()
+/*
+NSudoBenchConversion函数比较原来的UTF转换、M2MakeUTF16String/M2MakeUTF8String和
+追加到复用缓冲区的M2AppendUTF16String/M2AppendUTF8String，并以JSON格式把每次
+转换的平均耗时（纳秒）写入标准输出。
+The NSudoBenchConversion function compares the original UTF conversion,
+M2MakeUTF16String/M2MakeUTF8String and M2AppendUTF16String/M2AppendUTF8String
+which append to a reused buffer, and writes the average time of one conversion
+in nanoseconds to the standard output in JSON format.
+*/
+int NSudoBenchConversion(
+    _In_ size_t Iterations)
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
 
-public:
-    CNSudoMainWindow()
-    {
-        M2EnablePerMonitorDialogScaling();
+    // 每个样本重复转换的次数，使单次转换的耗时可以被测量
+    const size_t Repeats = 10000;
 
-        ChangeWindowMessageFilter(WM_DROPFILES, MSGFLT_ADD);
-        ChangeWindowMessageFilter(0x0049, MSGFLT_ADD); // WM_COPYGLOBALDATA
-    }
+    const double NanosecondsPerConversion =
+        1000000000.0 / static_cast<double>(Frequency.QuadPart) /
+        static_cast<double>(Iterations * Repeats);
 
-    ~CNSudoMainWindow()
+    auto Measure = [&](auto&& Function) -> double
     {
+        LARGE_INTEGER Start;
+        LARGE_INTEGER End;
 
-    }
-
-private:
-    HICON m_hNSudoIcon = nullptr;
-    HICON m_hWarningIcon = nullptr;
+        QueryPerformanceCounter(&Start);
+        for (size_t i = 0; i < Iterations * Repeats; ++i)
+        {
+            Function();
+        }
+        QueryPerformanceCounter(&End);
 
-    int m_xDPI = USER_DEFAULT_SCREEN_DPI;
-    int m_yDPI = USER_DEFAULT_SCREEN_DPI;
+        return (End.QuadPart - Start.QuadPart) * NanosecondsPerConversion;
+    };
 
-    ATL::CWindow m_hUserName;
-    ATL::CWindow m_hCheckBox;
-    ATL::CWindow m_hszPath;
+    // 快捷命令、翻译和右键菜单项中常见的字符串
+    const std::wstring ShortASCII = L"powershell_ise";
+    const std::wstring LongASCII =
+        L"\"C:\\Windows\\System32\\WindowsPowerShell\\v1.0\\powershell.exe\" "
+        L"-NoProfile -ExecutionPolicy Bypass -File \"C:\\Scripts\\Deploy.ps1\"";
+    const std::wstring NonASCII =
+        L"\u547D\u4EE4\u63D0\u793A\u7B26 -U:T -P:E cmd";
 
-    LRESULT OnClose(
-        UINT uMsg,
-        WPARAM wParam,
-        LPARAM lParam,
-        BOOL& bHandled)
+    std::vector<std::pair<const char*, std::wstring>> Inputs =
     {
-        UNREFERENCED_PARAMETER(uMsg);
-        UNREFERENCED_PARAMETER(wParam);
-        UNREFERENCED_PARAMETER(lParam);
-        UNREFERENCED_PARAMETER(bHandled);
+        { "ShortASCII", ShortASCII },
+        { "LongASCII", LongASCII },
+        { "NonASCII", NonASCII }
+    };
 
-        this->EndDialog(0);
-        return 0;
-    }
+    // 防止转换的结果被优化掉
+    volatile size_t Sink = 0;
 
-    LRESULT OnInitDialog(
-        UINT uMsg,
-        WPARAM wParam,
-        LPARAM lParam,
-        BOOL& bHandled)
-    {
-        UNREFERENCED_PARAMETER(uMsg);
-        UNREFERENCED_PARAMETER(wParam);
-        UNREFERENCED_PARAMETER(lParam);
-        UNREFERENCED_PARAMETER(bHandled);
+    nlohmann::json Results;
 
-        this->m_hUserName = this->GetDlgItem(IDC_UserName);
-        this->m_hCheckBox = this->GetDlgItem(IDC_Check_EnableAllPrivileges);
-        this->m_hszPath = this->GetDlgItem(IDC_szPath);
+    for (const auto& Input : Inputs)
+    {
+        const std::wstring& UTF16Input = Input.second;
+        const std::string UTF8Input = M2MakeUTF8String(UTF16Input);
 
-        this->SetWindowTextW(
-            g_ResourceManagement.GetTranslation("NSudo.VersionText").c_str());
+        std::wstring UTF16Buffer;
+        std::string UTF8Buffer;
 
-        struct { const char* ID; ATL::CWindow Control; } x[] =
+        nlohmann::json UTF16JSON;
+        UTF16JSON["Reference"] = Measure([&]()
         {
-            { "EnableAllPrivileges" , this->m_hCheckBox },
-            { "WarningText" , this->GetDlgItem(IDC_WARNINGTEXT) },
-            { "SettingsGroupText" ,this->GetDlgItem(IDC_SETTINGSGROUPTEXT) },
-            { "Static.User",this->GetDlgItem(IDC_STATIC_USER) },
-            { "Static.Open", this->GetDlgItem(IDC_STATIC_OPEN) },
-            { "Button.About", this->GetDlgItem(IDC_About) },
-            { "Button.Browse", this->GetDlgItem(IDC_Browse) },
-            { "Button.Run", this->GetDlgItem(IDC_Run) }
-        };
-
-        for (size_t i = 0; i < sizeof(x) / sizeof(x[0]); ++i)
+            Sink += NSudoBenchReferenceMakeUTF16String(UTF8Input).size();
+        });
+        UTF16JSON["Make"] = Measure([&]()
         {
-            std::wstring Buffer = g_ResourceManagement.GetTranslation(x[i].ID);
-            x[i].Control.SetWindowTextW(Buffer.c_str());
-        }
-
-        HRESULT hr = E_FAIL;
-
-        hr = GetDpiForMonitorInternal(
-            MonitorFromWindow(this->m_hWnd, MONITOR_DEFAULTTONEAREST),
-            MDT_EFFECTIVE_DPI, (UINT*)&this->m_xDPI, (UINT*)&this->m_yDPI);
-        if (hr != S_OK)
+            Sink += M2MakeUTF16String(UTF8Input).size();
+        });
+        UTF16JSON["Append"] = Measure([&]()
         {
-            this->m_xDPI = GetDeviceCaps(this->GetDC(), LOGPIXELSX);
-            this->m_yDPI = GetDeviceCaps(this->GetDC(), LOGPIXELSY);
-        }
-
-        this->m_hNSudoIcon = (HICON)LoadImageW(
-            g_ResourceManagement.Instance,
-            MAKEINTRESOURCE(IDI_NSUDO),
-            IMAGE_ICON,
-            256,
-            256,
-            LR_SHARED);
+            UTF16Buffer.clear();
+            M2AppendUTF16String(
+                UTF16Buffer, UTF8Input.data(), UTF8Input.size());
+            Sink += UTF16Buffer.size();
+        });
+
+        nlohmann::json UTF8JSON;
+        UTF8JSON["Reference"] = Measure([&]()
+        {
+            Sink += NSudoBenchReferenceMakeUTF8String(UTF16Input).size();
+        });
+        UTF8JSON["Make"] = Measure([&]()
+        {
+            Sink += M2MakeUTF8String(UTF16Input).size();
+        });
+        UTF8JSON["Append"] = Measure([&]()
+        {
+            UTF8Buffer.clear();
+            M2AppendUTF8String(
+                UTF8Buffer, UTF16Input.data(), UTF16Input.size());
+            Sink += UTF8Buffer.size();
+        });
+
+        nlohmann::json ResultJSON;
+        ResultJSON["Length"] = UTF16Input.size();
+        ResultJSON["UTF8ToUTF16"] = UTF16JSON;
+        ResultJSON["UTF16ToUTF8"] = UTF8JSON;
+
+        Results[Input.first] = ResultJSON;
+    }
 
-        SendMessageW(this->m_hWnd, WM_SETICON, ICON_SMALL, (LPARAM)this->m_hNSudoIcon);
-        SendMessageW(this->m_hWnd, WM_SETICON, ICON_BIG, (LPARAM)this->m_hNSudoIcon);
+    nlohmann::json Summary;
+    Summary["Version"] = M2MakeUTF8String(NSUDO_VERSION_STRING);
+    Summary["Iterations"] = Iterations * Repeats;
+    Summary["Unit"] = "Nanoseconds";
+    Summary["Results"] = Results;
 
-        this->m_hWarningIcon = (HICON)LoadImageW(
-            nullptr,
-            IDI_WARNING,
-            IMAGE_ICON,
-            0,
-            0,
-            LR_SHARED);
+    std::string Buffer = Summary.dump(2) + "\r\n";
 
-        const char* UserNameID[] = { "TI" ,"System" ,"CurrentProcess" ,"CurrentUser" };
-        for (size_t i = 0; i < sizeof(UserNameID) / sizeof(*UserNameID); ++i)
-        {
-            std::wstring Buffer = g_ResourceManagement.GetTranslation(UserNameID[i]);
-            SendMessageW(this->m_hUserName, CB_INSERTSTRING, 0, (LPARAM)Buffer.c_str());
-        }
+    DWORD NumberOfBytesWritten = 0;
+    WriteFile(
+        GetStdHandle(STD_OUTPUT_HANDLE),
+        Buffer.c_str(),
+        static_cast<DWORD>(Buffer.size()),
+        &NumberOfBytesWritten,
+        nullptr);
 
-        //设置默认项"TrustedInstaller"
-        SendMessageW(this->m_hUserName, CB_SETCURSEL, 3, 0);
+    return 0;
+}
 
-        for (std::pair<std::wstring, std::wstring> Item
-            : g_ResourceManagement.ShortCutList)
-        {
-            SendMessageW(
-                this->m_hszPath,
-                CB_INSERTSTRING,
-                0,
-                (LPARAM)Item.first.c_str());
-        }
+/*
+NSudoBenchLaunch函数按照BenchCommandLine创建一个子进程并等待它退出，子进程的退出
+代码为0时返回true。每次调用都使用新的令牌缓存，使测量包含获取令牌的耗时。
+The NSudoBenchLaunch function launches a child process with BenchCommandLine
+and waits for it, and returns true if the exit code of the child is 0. Each
+call uses a new token cache, so the measurement includes acquiring the tokens.
+*/
+bool NSudoBenchLaunch(
+    _In_ const std::wstring& BenchCommandLine,
+    _In_ DWORD dwSessionID)
+{
+    CNSudoTokenCache TokenCache;
 
-        return TRUE;
-    }
+    NSUDO_COMMAND_LINE CommandLine;
+    NSUDO_PROCESS_OPTIONS Options;
+    M2::CHandle hToken;
+    NSUDO_PARENT_PROCESS ParentProcess;
+    DWORD ExitCode = static_cast<DWORD>(-1);
 
-    POINT GetPhysicalPoint(const POINT& LogicalPoint)
+    if (!TokenCache.ImpersonateAsSystem())
     {
-        POINT PhysicalPoint;
+        return false;
+    }
 
-        PhysicalPoint.x = MulDiv(
-            LogicalPoint.x, this->m_xDPI, USER_DEFAULT_SCREEN_DPI);
-        PhysicalPoint.y = MulDiv(
-            LogicalPoint.y, this->m_yDPI, USER_DEFAULT_SCREEN_DPI);
+    NSudoParseCommandLine(BenchCommandLine.c_str(), CommandLine);
+
+    bool Succeeded =
+        NSUDO_MESSAGE::SUCCESS == NSudoParseProcessOptions(
+            CommandLine, Options);
+
+    const bool UseParentProcess =
+        NSudoOptionEngineValue::ParentProcess == Options.Engine;
+
+    // 基准测试只测量创建进程本身，所以不应用资源限制、处理器位置、调度设置和
+    // 标准句柄的转发
+    NSUDO_CREATE_PROCESS_OPTIONS CreateOptions;
+    CreateOptions.ProcessPriority = Options.ProcessPriority;
+    CreateOptions.ShowWindowMode = Options.ShowWindowMode;
+    CreateOptions.CreateNewConsole = Options.CreateNewConsole;
+    CreateOptions.EnvironmentVariables = &Options.EnvironmentVariables;
+    CreateOptions.ParentProcess = UseParentProcess ? &ParentProcess : nullptr;
+
+    Succeeded =
+        Succeeded &&
+        NSUDO_MESSAGE::SUCCESS == (UseParentProcess
+            ? NSudoOpenParentProcess(
+                &TokenCache, Options, dwSessionID, &ParentProcess)
+            : NSudoCreateProcessToken(
+                &TokenCache, Options, dwSessionID, &hToken)) &&
+        NSudoCreateProcess(
+            hToken,
+            CommandLine.UnresolvedCommandLine.c_str(),
+            Options.CurrentDirectory.c_str(),
+            Options.WaitInterval,
+            CreateOptions,
+            &ExitCode) &&
+        0 == ExitCode;
 
-        return PhysicalPoint;
-    }
+    RevertToSelf();
 
-    SIZE GetPhysicalSize(const SIZE& LogicalSize)
-    {
-        SIZE PhysicalSize;
+    return Succeeded;
+}
 
-        PhysicalSize.cx = MulDiv(
-            LogicalSize.cx, this->m_xDPI, USER_DEFAULT_SCREEN_DPI);
-        PhysicalSize.cy = MulDiv(
-            LogicalSize.cy, this->m_yDPI, USER_DEFAULT_SCREEN_DPI);
+// NSudoBenchLaunchProbe通过标准输出返回给父进程的测量结果
+// The measurement returned to the parent by NSudoBenchLaunchProbe via the
+// standard output.
+typedef struct _NSUDO_BENCH_PROBE_RESULT
+{
+    // 各阶段的耗时（QueryPerformanceCounter的计数）
+    LONGLONG StageTicks[static_cast<size_t>(NSudoStage::Count)];
+    // 从父进程创建本实例前到第一次调用CreateProcessAsUserW的计数
+    LONGLONG FirstCreateProcessTicks;
+} NSUDO_BENCH_PROBE_RESULT, *PNSUDO_BENCH_PROBE_RESULT;
 
-        return PhysicalSize;
-    }
+/*
+NSudoBenchLaunchProbe函数在新的NSudoBench实例中按照命令行中 -LaunchProbe 之后的
+选项创建一次进程，并把NSUDO_BENCH_PROBE_RESULT写入标准输出。StartTick是父进程创
+建本实例前QueryPerformanceCounter的计数，所以Startup阶段包含创建和初始化本实例、
+加载翻译和快捷命令列表的耗时。每次测量都在新的实例中进行，所以令牌、winlogon进程
+和环境块的缓存不会影响下一次测量。
+The NSudoBenchLaunchProbe function launches a process once in a new
+NSudoBench instance with the options after -LaunchProbe in the command line,
+and writes NSUDO_BENCH_PROBE_RESULT to the standard output. StartTick is the
+QueryPerformanceCounter count before the parent creates this instance, so the
+Startup stage includes creating and initializing this instance and loading
+the translations and the shortcut list. Every measurement runs in a new
+instance, so the caches of the tokens, the winlogon processes and the
+environment blocks cannot affect the next measurement.
+
+成功时返回值为0，失败时返回值为-1。
+The return value is 0 if it succeeds, or -1 if it fails.
+*/
+int NSudoBenchLaunchProbe(
+    _In_ LONGLONG StartTick)
+{
+    LARGE_INTEGER EntryTick;
+    QueryPerformanceCounter(&EntryTick);
 
-    BOOL DrawIconWithHighDPISupport(
-        _In_ HDC hdc,
-        _In_ const POINT& LogicalPoint,
-        _In_ HICON hIcon,
-        const SIZE& LogicalSize,
-        _In_ UINT istepIfAniCur,
-        _In_opt_ HBRUSH hbrFlickerFreeDraw,
-        _In_ UINT diFlags)
     {
-        POINT PhysicalPoint = GetPhysicalPoint(LogicalPoint);
-        SIZE PhysicalSize = GetPhysicalSize(LogicalSize);
+        CNSudoStageScope StageScope(NSudoStage::Startup);
 
-        return DrawIconEx(
-            hdc,
-            PhysicalPoint.x,
-            PhysicalPoint.y,
-            hIcon,
-            LogicalSize.cx,
-            LogicalSize.cy,
-            istepIfAniCur,
-            hbrFlickerFreeDraw,
-            diFlags);
+        g_ResourceManagement.GetTranslation(
+            NSudoTranslationID::Message_Success);
+        g_ResourceManagement.GetShortCutList();
+
+        StageScope.SetResult(TRUE);
     }
 
-    BOOL GetLogicalClientRect(
-        _Out_ RECT& LogicalRect)
-    {
-        BOOL result = GetClientRect(&LogicalRect);
+    // 创建和初始化本实例的耗时同样计入启动阶段
+    g_NSudoStageTicks[static_cast<size_t>(NSudoStage::Startup)] +=
+        EntryTick.QuadPart - StartTick;
 
-        LogicalRect.left = MulDiv(
-            LogicalRect.left, USER_DEFAULT_SCREEN_DPI, this->m_xDPI);
-        LogicalRect.top = MulDiv(
-            LogicalRect.top, USER_DEFAULT_SCREEN_DPI, this->m_yDPI);
-        LogicalRect.right = MulDiv(
-            LogicalRect.right, USER_DEFAULT_SCREEN_DPI, this->m_xDPI);
-        LogicalRect.bottom = MulDiv
-        (LogicalRect.bottom, USER_DEFAULT_SCREEN_DPI, this->m_yDPI);
+    LPCWSTR RawCommandLine = GetCommandLineW();
 
-        return result;
+    std::vector<M2_COMMAND_LINE_ARGUMENT> Arguments;
+    std::wstring Buffer;
+    M2SpiltCommandLineView(RawCommandLine, Arguments, Buffer);
+    if (Arguments.size() < 3)
+    {
+        return -1;
     }
 
-    LRESULT OnPaint(
-        UINT uMsg,
-        WPARAM wParam,
-        LPARAM lParam,
-        BOOL& bHandled)
-    {
-        UNREFERENCED_PARAMETER(uMsg);
-        UNREFERENCED_PARAMETER(wParam);
-        UNREFERENCED_PARAMETER(lParam);
-        UNREFERENCED_PARAMETER(bHandled);
+    std::wstring BenchCommandLine = L"NSudoBench ";
+    BenchCommandLine += RawCommandLine + Arguments[2].Offset;
 
-        PAINTSTRUCT ps;
-        HDC hdc = this->BeginPaint(&ps);
+    DWORD dwSessionID = static_cast<DWORD>(-1);
+    if (!NSudoGetCurrentProcessSessionID(&dwSessionID) ||
+        !NSudoBenchLaunch(BenchCommandLine, dwSessionID) ||
+        0 == g_NSudoFirstCreateProcessTick)
+    {
+        return -1;
+    }
 
-        RECT rect = { 0 };
-        this->GetLogicalClientRect(rect);
+    NSUDO_BENCH_PROBE_RESULT Result;
+    memcpy(Result.StageTicks, g_NSudoStageTicks, sizeof(Result.StageTicks));
+    Result.FirstCreateProcessTicks =
+        g_NSudoFirstCreateProcessTick - StartTick;
 
-        DrawIconWithHighDPISupport(
-            hdc,
-            {16, 16},
-            this->m_hNSudoIcon,
-            {64, 64},
-            0,
-            nullptr,
-            DI_NORMAL | DI_COMPAT);
-        DrawIconWithHighDPISupport(
-            hdc,
-            {16, (rect.bottom - rect.top) - 40 },
-            this->m_hWarningIcon,
-            {24, 24},
-            0,
-            nullptr,
-            DI_NORMAL | DI_COMPAT);
+    DWORD NumberOfBytesWritten = 0;
+    if (!WriteFile(
+        GetStdHandle(STD_OUTPUT_HANDLE),
+        &Result,
+        sizeof(NSUDO_BENCH_PROBE_RESULT),
+        &NumberOfBytesWritten,
+        nullptr) ||
+        sizeof(NSUDO_BENCH_PROBE_RESULT) != NumberOfBytesWritten)
+    {
+        return -1;
+    }
 
-        this->EndPaint(&ps);
+    return 0;
+}
 
-        return 0;
+/*
+NSudoBenchRunLaunchProbe函数启动一个NSudoBench实例，使用BenchOptions运行
+NSudoBenchLaunchProbe，并通过管道读取它的测量结果。
+The NSudoBenchRunLaunchProbe function starts an NSudoBench instance which runs
+NSudoBenchLaunchProbe with BenchOptions, and reads its measurement via a pipe.
+*/
+bool NSudoBenchRunLaunchProbe(
+    _In_ const std::wstring& BenchOptions,
+    _Out_ NSUDO_BENCH_PROBE_RESULT& Result)
+{
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    SecurityAttributes.bInheritHandle = TRUE;
+
+    M2::CHandle hReadPipe;
+    M2::CHandle hWritePipe;
+    if (!CreatePipe(&hReadPipe, &hWritePipe, &SecurityAttributes, 0))
+    {
+        return false;
     }
 
-    LRESULT OnDPIChanged(
-        UINT uMsg,
-        WPARAM wParam,
-        LPARAM lParam,
-        BOOL& bHandled)
+    // 只有写入端需要被本实例继承
+    if (!SetHandleInformation(hReadPipe, HANDLE_FLAG_INHERIT, 0))
     {
-        UNREFERENCED_PARAMETER(uMsg);
-        UNREFERENCED_PARAMETER(lParam);
-        UNREFERENCED_PARAMETER(bHandled);
+        return false;
+    }
 
-        this->m_xDPI = LOWORD(wParam);
-        this->m_yDPI = HIWORD(wParam);
+    LARGE_INTEGER Start;
+    QueryPerformanceCounter(&Start);
 
-        return 0;
-    }
+    std::wstring ProbeCommandLine = L"\"";
+    ProbeCommandLine += g_ResourceManagement.ExePath;
+    ProbeCommandLine += L"\" -LaunchProbe:";
+    ProbeCommandLine += std::to_wstring(Start.QuadPart);
+    ProbeCommandLine += L" ";
+    ProbeCommandLine += BenchOptions;
 
-    LRESULT OnRun(
-        WORD wNotifyCode,
-        WORD wID,
-        HWND hWndCtl,
-        BOOL& bHandled)
-    {
-        UNREFERENCED_PARAMETER(wNotifyCode);
-        UNREFERENCED_PARAMETER(wID);
-        UNREFERENCED_PARAMETER(hWndCtl);
-        UNREFERENCED_PARAMETER(bHandled);
+    STARTUPINFOW StartupInfo = { 0 };
+    PROCESS_INFORMATION ProcessInfo = { 0 };
 
-        std::wstring UserName(MAX_PATH, L'\0');
-        auto UserNameLength = this->m_hUserName.GetWindowTextW(
-            &UserName[0],
-            static_cast<int>(UserName.size()));
-        UserName.resize(UserNameLength);
+    StartupInfo.cb = sizeof(STARTUPINFOW);
+    StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    StartupInfo.hStdOutput = hWritePipe;
 
-        bool NeedToEnableAllPrivileges = false;
-        if (BST_CHECKED == SendMessageW(this->m_hCheckBox, BM_GETCHECK, 0, 0))
-        {
-            NeedToEnableAllPrivileges = true;
-        }
+    if (!CreateProcessW(
+        nullptr,
+        &ProbeCommandLine[0],
+        nullptr,
+        nullptr,
+        TRUE,
+        CREATE_NO_WINDOW,
+        nullptr,
+        nullptr,
+        &StartupInfo,
+        &ProcessInfo))
+    {
+        return false;
+    }
 
-        std::wstring RawCommandLine(MAX_PATH, L'\0');
-        auto RawCommandLineLength = this->m_hszPath.GetWindowTextW(
-            &RawCommandLine[0],
-            static_cast<int>(RawCommandLine.size()));
-        RawCommandLine.resize(RawCommandLineLength);
+    // 关闭本进程的写入端，使实例退出后读取到文件结尾
+    hWritePipe.Close();
 
-        if (_wcsicmp(L"", RawCommandLine.c_str()) == 0)
+    DWORD TotalBytesRead = 0;
+    for (;;)
+    {
+        DWORD NumberOfBytesRead = 0;
+        if (TotalBytesRead == sizeof(NSUDO_BENCH_PROBE_RESULT) ||
+            !ReadFile(
+                hReadPipe,
+                reinterpret_cast<PBYTE>(&Result) + TotalBytesRead,
+                sizeof(NSUDO_BENCH_PROBE_RESULT) - TotalBytesRead,
+                &NumberOfBytesRead,
+                nullptr) ||
+            0 == NumberOfBytesRead)
         {
-            std::wstring Buffer = g_ResourceManagement.GetMessageString(
-                NSUDO_MESSAGE::INVALID_TEXTBOX_PARAMETER);
-            NSudoPrintMsg(
-                g_ResourceManagement.Instance,
-                this->m_hWnd,
-                Buffer.c_str());
+            break;
         }
-        else
-        {
-            std::wstring CommandLine = L"NSudo -ShowWindowMode=Hide";
 
-            // 获取用户令牌
-            if (0 == _wcsicmp(
-                g_ResourceManagement.GetTranslation("TI").c_str(),
-                UserName.c_str()))
-            {
-                CommandLine += L" -U:T";
-            }
-            else if (0 == _wcsicmp(
-                g_ResourceManagement.GetTranslation("System").c_str(),
-                UserName.c_str()))
-            {
-                CommandLine += L" -U:S";
-            }
-            else if (0 == _wcsicmp(
-                g_ResourceManagement.GetTranslation("CurrentProcess").c_str(),
-                UserName.c_str()))
-            {
-                CommandLine += L" -U:P";
-            }
-            else if (0 == _wcsicmp(
-                g_ResourceManagement.GetTranslation("CurrentUser").c_str(),
-                UserName.c_str()))
-            {
-                CommandLine += L" -U:C";
-            }
+        TotalBytesRead += NumberOfBytesRead;
+    }
 
-            // 如果勾选启用全部特权，则尝试对令牌启用全部特权
-            if (NeedToEnableAllPrivileges)
-            {
-                CommandLine += L" -P:E";
-            }
+    DWORD ExitCode = static_cast<DWORD>(-1);
+    WaitForSingleObjectEx(ProcessInfo.hProcess, INFINITE, FALSE);
+    GetExitCodeProcess(ProcessInfo.hProcess, &ExitCode);
+    CloseHandle(ProcessInfo.hThread);
+    CloseHandle(ProcessInfo.hProcess);
 
-            CommandLine += L" ";
-            CommandLine += RawCommandLine;
+    return 0 == ExitCode &&
+        sizeof(NSUDO_BENCH_PROBE_RESULT) == TotalBytesRead;
+}
 
-            std::wstring ApplicationName;
-            std::map<std::wstring, std::wstring> OptionsAndParameters;
-            std::wstring UnresolvedCommandLine;
+/*
+NSudoBenchMain函数对每种用户模式重复创建一个立即退出的子进程，并以JSON格式把
+各阶段耗时的p50、p95和p99（微秒）写入标准输出。
+
+The NSudoBenchMain function launches a trivial child process repeatedly for
+each user mode, and writes the p50, p95 and p99 of the time of each stage in
+microseconds to the standard output in JSON format.
+
+用法 Usage: NSudoBench [-Iterations:N] [-Users:TSCPD] [-Conversion]
+
+说明 Remarks:
+每次测量都在一个新的NSudoBench实例中进行，使各种缓存不会影响之后的测量。
+Startup 是启动新的NSudoBench实例并加载翻译和快捷命令列表的耗时。
+StartService 包含在 DuplicateToken 或者 OpenParentProcess 中，Wait 是子进程的运行时
+间，它们都不计入 Total，Total 是单次启动的总耗时。
+System 和 TrustedInstaller 还会以 "S.ParentProcess" 和 "T.ParentProcess" 为名使用
+-Engine:ParentProcess 各测量一次。
+FirstCreateProcess 是从启动该实例到第一次调用 CreateProcessAsUserW 的耗时，包含加
+载DLL等一次性的启动开销。
+Every measurement runs in a new NSudoBench instance, so the caches cannot
+affect the later measurements. Startup is the time to start the new
+NSudoBench instance which loads the translations and the shortcut list.
+StartService is included in DuplicateToken or OpenParentProcess and Wait is
+the lifetime of the child, so both of them are not counted in Total, which is
+the time of one launch.
+System and TrustedInstaller are also measured with -Engine:ParentProcess as
+"S.ParentProcess" and "T.ParentProcess".
+FirstCreateProcess is the time from starting the instance to its first call
+of CreateProcessAsUserW, which includes the one-time startup costs such as
+loading the DLLs.
+使用 -Conversion 时只运行 NSudoBenchConversion 的UTF转换微基准测试，无需管理员权限。
+With -Conversion, only the UTF conversion microbenchmark of
+NSudoBenchConversion runs, which does not need to be elevated.
+*/
+int NSudoBenchMain()
+{
+    std::vector<std::wstring> Arguments = M2SpiltCommandLine(
+        GetCommandLineW());
 
-            M2SpiltCommandLineEx(
-                CommandLine,
-                std::vector<std::wstring>{ L"-", L"/", L"--" },
-                std::vector<std::wstring>{ L"=", L":" },
-                ApplicationName,
-                OptionsAndParameters,
-                UnresolvedCommandLine);
+    size_t Iterations = 100;
+    std::wstring UserModes = L"TSCPD";
+    bool Conversion = false;
 
-            UnresolvedCommandLine =
-                L"cmd /c start \"NSudo.Launcher\" " +
-                CNSudoShortCutAdapter::Translate(
-                    g_ResourceManagement.ShortCutList,
-                    UnresolvedCommandLine);
+    for (size_t i = 1; i < Arguments.size(); ++i)
+    {
+        const std::wstring& Argument = Arguments[i];
 
-            NSUDO_MESSAGE message = NSudoCommandLineParser(
-                true,
-                true,
-                ApplicationName,
-                OptionsAndParameters,
-                UnresolvedCommandLine);
-            if (NSUDO_MESSAGE::SUCCESS != message)
+        if (0 == _wcsicmp(Argument.c_str(), L"-Child"))
+        {
+            // 被测量的子进程，立即退出
+            return 0;
+        }
+        else if (0 == _wcsnicmp(Argument.c_str(), L"-LaunchProbe:", 13))
+        {
+            // 在新的实例中测量一次启动，其后的参数是要创建的进程的选项和命令行
+            return NSudoBenchLaunchProbe(
+                _wcstoi64(Argument.c_str() + 13, nullptr, 10));
+        }
+        else if (0 == _wcsnicmp(Argument.c_str(), L"-Iterations:", 12))
+        {
+            wchar_t* End = nullptr;
+            Iterations = wcstoul(Argument.c_str() + 12, &End, 10);
+            if (0 == Iterations || L'\0' != *End)
             {
-                std::wstring Buffer = g_ResourceManagement.GetMessageString(
-                    message);
-                NSudoPrintMsg(
-                    g_ResourceManagement.Instance,
-                    this->m_hWnd,
-                    Buffer.c_str());
+                return -1;
             }
         }
-
-        return 0;
+        else if (0 == _wcsicmp(Argument.c_str(), L"-Conversion"))
+        {
+            Conversion = true;
+        }
+        else if (0 == _wcsnicmp(Argument.c_str(), L"-Users:", 7))
+        {
+            UserModes = Argument.substr(7);
+            for (wchar_t& UserMode : UserModes)
+            {
+                UserMode = towupper(UserMode);
+                if (nullptr == wcschr(L"TSCPD", UserMode))
+                {
+                    return -1;
+                }
+            }
+        }
+        else
+        {
+            return -1;
+        }
     }
 
-    LRESULT OnAbout(
-        WORD wNotifyCode,
-        WORD wID,
-        HWND hWndCtl,
-        BOOL& bHandled)
+    if (Conversion)
     {
-        UNREFERENCED_PARAMETER(wNotifyCode);
-        UNREFERENCED_PARAMETER(wID);
-        UNREFERENCED_PARAMETER(hWndCtl);
-        UNREFERENCED_PARAMETER(bHandled);
-
-        NSudoShowAboutDialog(this->m_hWnd);
-
-        return 0;
+        return NSudoBenchConversion(Iterations);
     }
 
-    LRESULT OnBrowse(
-        WORD wNotifyCode,
-        WORD wID,
-        HWND hWndCtl,
-        BOOL& bHandled)
+    if (!g_ResourceManagement.IsElevated)
     {
-        UNREFERENCED_PARAMETER(wNotifyCode);
-        UNREFERENCED_PARAMETER(wID);
-        UNREFERENCED_PARAMETER(hWndCtl);
-        UNREFERENCED_PARAMETER(bHandled);
-
-        std::wstring buffer(MAX_PATH + 2, L'\0');
+        NSudoPrintMsg(
+            g_ResourceManagement.Instance,
+            nullptr,
+            g_ResourceManagement.GetMessageString(
+                NSUDO_MESSAGE::PRIVILEGE_NOT_HELD).c_str());
+        return -1;
+    }
 
-        buffer[0] = L'\"';
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
 
-        OPENFILENAME ofn = { 0 };
+    const double MicrosecondsPerTick =
+        1000000.0 / static_cast<double>(Frequency.QuadPart);
 
-        ofn.lStructSize = sizeof(OPENFILENAME);
-        ofn.hwndOwner = this->m_hWnd;
-        ofn.nMaxFile = MAX_PATH;
-        ofn.nMaxFileTitle = MAX_PATH;
-        ofn.lpstrFile = &buffer[1];
-        ofn.Flags = OFN_HIDEREADONLY | OFN_CREATEPROMPT;
+    // System和TrustedInstaller还会使用父进程引擎测量一次，以便与令牌引擎比较
+    std::vector<std::pair<std::string, std::wstring>> Cases;
+    for (wchar_t UserMode : UserModes)
+    {
+        std::string Name = M2MakeUTF8String(std::wstring(1, UserMode));
+        std::wstring Options = L"-U:";
+        Options += UserMode;
 
-        GetOpenFileNameW(&ofn);
+        Cases.emplace_back(Name, Options);
 
-        buffer.resize(wcslen(buffer.c_str()));
+        if (L'S' == UserMode || L'T' == UserMode)
+        {
+            Cases.emplace_back(
+                Name + ".ParentProcess",
+                Options + L" -Engine:ParentProcess");
+        }
+    }
 
-        buffer[buffer.size()] = L'\"';
+    nlohmann::json Results;
 
-        if (wcslen(buffer.c_str()) > 2)
-            this->m_hszPath.SetWindowTextW(buffer.c_str());
+    for (const auto& Case : Cases)
+    {
+        const size_t StageCount = static_cast<size_t>(NSudoStage::Count);
 
-        return 0;
-    }
+        std::vector<double> Samples[StageCount + 1];
+        std::vector<double> FirstCreateProcessSamples;
+        size_t Failures = 0;
 
-    LRESULT OnDropFiles(
-        UINT uMsg,
-        WPARAM wParam,
-        LPARAM lParam,
-        BOOL& bHandled)
-    {
-        UNREFERENCED_PARAMETER(uMsg);
-        UNREFERENCED_PARAMETER(lParam);
-        UNREFERENCED_PARAMETER(bHandled);
+        std::wstring BenchOptions = Case.second;
+        BenchOptions += L" -P:E -M:M -ShowWindowMode:Hide -Wait \"";
+        BenchOptions += g_ResourceManagement.ExePath;
+        BenchOptions += L"\" -Child";
 
-        std::wstring buffer(MAX_PATH + 2, L'\0');
+        for (size_t i = 0; i < Iterations; ++i)
+        {
+            NSUDO_BENCH_PROBE_RESULT Result;
+            if (!NSudoBenchRunLaunchProbe(BenchOptions, Result))
+            {
+                ++Failures;
+                continue;
+            }
 
-        buffer[0] = L'\"';
+            LONGLONG TotalTicks = 0;
+            for (size_t Stage = 0; Stage < StageCount; ++Stage)
+            {
+                Samples[Stage].push_back(
+                    Result.StageTicks[Stage] * MicrosecondsPerTick);
 
-        auto length = DragQueryFileW(
-            (HDROP)wParam, 0, &buffer[1], (int)(buffer.size() - 2));
-        buffer.resize(length + 1);
+                // StartService 已包含在 DuplicateToken 或者 OpenParentProcess 中，
+                // Wait 是子进程的运行时间
+                if (static_cast<size_t>(NSudoStage::StartService) != Stage &&
+                    static_cast<size_t>(NSudoStage::Wait) != Stage)
+                {
+                    TotalTicks += Result.StageTicks[Stage];
+                }
+            }
+            Samples[StageCount].push_back(TotalTicks * MicrosecondsPerTick);
 
-        if (!(GetFileAttributesW(&buffer[1]) & FILE_ATTRIBUTE_DIRECTORY))
-        {
-            buffer[buffer.size()] = L'\"';
-            this->m_hszPath.SetWindowTextW(buffer.c_str());
+            FirstCreateProcessSamples.push_back(
+                Result.FirstCreateProcessTicks * MicrosecondsPerTick);
         }
 
-        DragFinish((HDROP)wParam);
+        nlohmann::json Stages;
 
-        return 0;
-    }
-};
+        for (size_t Stage = 0; Stage <= StageCount; ++Stage)
+        {
+            std::sort(Samples[Stage].begin(), Samples[Stage].end());
 
-#endif
+            nlohmann::json StageJSON;
+            StageJSON["P50"] = NSudoBenchGetPercentile(Samples[Stage], 50);
+            StageJSON["P95"] = NSudoBenchGetPercentile(Samples[Stage], 95);
+            StageJSON["P99"] = NSudoBenchGetPercentile(Samples[Stage], 99);
 
-int NSudoMain()
-{
-    CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+            Stages[(Stage < StageCount) ? NSudoStageNames[Stage] : "Total"] =
+                StageJSON;
+        }
 
-    std::wstring ApplicationName;
-    std::map<std::wstring, std::wstring> OptionsAndParameters;
-    std::wstring UnresolvedCommandLine;
+        std::sort(
+            FirstCreateProcessSamples.begin(),
+            FirstCreateProcessSamples.end());
 
-    M2SpiltCommandLineEx(
-        std::wstring(GetCommandLineW()),
-        std::vector<std::wstring>{ L"-", L"/", L"--" },
-        std::vector<std::wstring>{ L"=", L":" },
-        ApplicationName,
-        OptionsAndParameters,
-        UnresolvedCommandLine);
+        nlohmann::json FirstCreateProcessJSON;
+        FirstCreateProcessJSON["P50"] = NSudoBenchGetPercentile(
+            FirstCreateProcessSamples, 50);
+        FirstCreateProcessJSON["P95"] = NSudoBenchGetPercentile(
+            FirstCreateProcessSamples, 95);
+        FirstCreateProcessJSON["P99"] = NSudoBenchGetPercentile(
+            FirstCreateProcessSamples, 99);
 
-    UnresolvedCommandLine = CNSudoShortCutAdapter::Translate(
-        g_ResourceManagement.ShortCutList,
-        UnresolvedCommandLine);
+        nlohmann::json ResultJSON;
+        ResultJSON["Stages"] = Stages;
+        ResultJSON["FirstCreateProcess"] = FirstCreateProcessJSON;
+        ResultJSON["Failures"] = Failures;
 
-    if (OptionsAndParameters.empty() && UnresolvedCommandLine.empty())
-    {
-#if defined(NSUDO_CUI_CONSOLE) || defined(NSUDO_CUI_WINDOWS)
-        NSudoShowAboutDialog(nullptr);
-#elif defined(NSUDO_GUI_WINDOWS)
-        CNSudoMainWindow MainWindow;
-        MainWindow.DoModal(nullptr);
-#endif
-        return 0;
+        Results[Case.first] = ResultJSON;
     }
 
-#if defined(NSUDO_CUI_CONSOLE)
-    NSUDO_MESSAGE message = NSudoCommandLineParser(
-        g_ResourceManagement.IsElevated,
-        false,
-        ApplicationName,
-        OptionsAndParameters,
-        UnresolvedCommandLine);
-#elif defined(NSUDO_CUI_WINDOWS) || defined(NSUDO_GUI_WINDOWS)
-    NSUDO_MESSAGE message = NSudoCommandLineParser(
-        g_ResourceManagement.IsElevated,
-        true,
-        ApplicationName,
-        OptionsAndParameters,
-        UnresolvedCommandLine);
-#endif
+    nlohmann::json Summary;
+    Summary["Version"] = M2MakeUTF8String(NSUDO_VERSION_STRING);
+    Summary["Iterations"] = Iterations;
+    Summary["Unit"] = "Microseconds";
+    Summary["Results"] = Results;
 
-    if (NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP == message)
-    {
-        NSudoShowAboutDialog(nullptr);
-    }
-    else if (NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION == message)
-    {
-        NSudoPrintMsg(
-            g_ResourceManagement.Instance,
-            nullptr,
-            g_ResourceManagement.GetTranslation("NSudo.VersionText").c_str());
-    }
-    else if (NSUDO_MESSAGE::SUCCESS != message)
-    {
-        std::wstring Buffer = g_ResourceManagement.GetMessageString(
-            message);
-        NSudoPrintMsg(
-            g_ResourceManagement.Instance,
-            nullptr,
-            Buffer.c_str());
-        return -1;
-    }
+    std::string Buffer = Summary.dump(2) + "\r\n";
+
+    DWORD NumberOfBytesWritten = 0;
+    WriteFile(
+        GetStdHandle(STD_OUTPUT_HANDLE),
+        Buffer.c_str(),
+        static_cast<DWORD>(Buffer.size()),
+        &NumberOfBytesWritten,
+        nullptr);
 
     return 0;
 }
 
+#endif
 
 #if defined(NSUDO_CUI_CONSOLE)
 int main()
@@ -2501,5 +6892,16 @@ int WINAPI wWinMain(
     UNREFERENCED_PARAMETER(nShowCmd);
 #endif
 
-    return NSudoMain();
+    // 没有会话监听时ETW事件几乎没有开销，所以发布版本也注册提供程序
+    NSudoTraceLoggingRegister();
+
+#if defined(NSUDO_BENCHMARK)
+    int Result = NSudoBenchMain();
+#else
+    int Result = NSudoMain();
+#endif
+
+    NSudoTraceLoggingUnregister();
+
+    return Result;
 }
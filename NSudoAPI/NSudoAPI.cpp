@@ -0,0 +1,482 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoAPI.cpp
+ * PURPOSE:   Implementation for NSudoAPI
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <new>
+
+#include "NSudoCore.h"
+
+// NSudoAPI中的令牌缓存，即CNSudoTokenCache
+struct _NSUDO_TOKEN_CACHE
+{
+    CNSudoTokenCache TokenCache;
+};
+
+NSUDO_API BOOL WINAPI NSudoCreateTokenCache(
+    _Out_ PNSUDO_TOKEN_CACHE* TokenCache)
+{
+    *TokenCache = new (std::nothrow) NSUDO_TOKEN_CACHE();
+    if (!*TokenCache)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+NSUDO_API VOID WINAPI NSudoCloseTokenCache(
+    _In_ PNSUDO_TOKEN_CACHE TokenCache)
+{
+    delete TokenCache;
+}
+
+/*
+NSudoImpersonateSelfWithDebugPrivilege函数给当前线程分配一个进程令牌的模拟副本，
+并在副本中启用SeDebugPrivilege，以便打开winlogon进程。宿主进程的令牌不会被修改。
+The NSudoImpersonateSelfWithDebugPrivilege function assigns an impersonation
+copy of the process token to the current thread, and enables SeDebugPrivilege
+in the copy for opening the winlogon process. The token of the host process is
+not modified.
+
+如果调用者未提权，SeDebugPrivilege无法启用，此时返回FALSE，错误码为
+ERROR_PRIVILEGE_NOT_HELD，并且当前线程不再模拟。
+If the caller is not elevated, SeDebugPrivilege cannot be enabled. In this
+case the function returns FALSE with ERROR_PRIVILEGE_NOT_HELD, and the current
+thread is not impersonating anymore.
+*/
+static BOOL NSudoImpersonateSelfWithDebugPrivilege()
+{
+    if (!ImpersonateSelf(SecurityImpersonation))
+    {
+        return FALSE;
+    }
+
+    M2::CHandle hThreadToken;
+
+    BOOL result = OpenThreadToken(
+        GetCurrentThread(),
+        TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+        TRUE,
+        &hThreadToken);
+    if (result)
+    {
+        result = NSudoSetTokenPrivilege(
+            hThreadToken,
+            SeDebugPrivilege,
+            true);
+    }
+
+    if (!result)
+    {
+        RevertToSelf();
+        SetLastError(ERROR_PRIVILEGE_NOT_HELD);
+    }
+
+    return result;
+}
+
+/*
+NSudoStartLaunch函数根据启动选项创建新进程，并在新进程恢复运行后立即返回。新进程
+的句柄和进程树交给调用者。
+The NSudoStartLaunch function creates the new process with the launch options,
+and returns right after the new process is resumed. The handle and the process
+tree of the new process are handed over to the caller.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+static BOOL NSudoStartLaunch(
+    _In_ const NSUDO_LAUNCH_OPTIONS& Options,
+    _Out_ PNSUDO_STARTED_PROCESS StartedProcess)
+{
+    StartedProcess->ProcessHandle = nullptr;
+    StartedProcess->ProcessId = 0;
+    StartedProcess->ProcessTree = nullptr;
+
+    if (sizeof(NSUDO_LAUNCH_OPTIONS) != Options.Size ||
+        !Options.CommandLine ||
+        L'\0' == Options.CommandLine[0])
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // CurrentProcess和CurrentProcessDropRight模式使用的令牌需要在模拟前打开
+    M2::CHandle hCurrentProcessToken;
+    if (!OpenProcessToken(
+        GetCurrentProcess(),
+        MAXIMUM_ALLOWED,
+        &hCurrentProcessToken))
+    {
+        return FALSE;
+    }
+
+    DWORD dwSessionID = Options.SessionId;
+    if (MAXDWORD == dwSessionID)
+    {
+        if (!NSudoGetCurrentProcessSessionID(&dwSessionID))
+        {
+            return FALSE;
+        }
+    }
+
+    CNSudoTokenCache LocalTokenCache;
+    CNSudoTokenCache* TokenCache = Options.TokenCache
+        ? &Options.TokenCache->TokenCache
+        : &LocalTokenCache;
+
+    if (!NSudoImpersonateSelfWithDebugPrivilege())
+    {
+        return FALSE;
+    }
+
+    if (!TokenCache->ImpersonateAsSystem())
+    {
+        DWORD dwError = GetLastError();
+        RevertToSelf();
+        SetLastError(dwError);
+        return FALSE;
+    }
+
+    NSUDO_TOKEN_ADJUSTMENTS Adjustments;
+    Adjustments.PrivilegesMode = Options.PrivilegesMode;
+    Adjustments.IntegrityLevelMode = Options.IntegrityLevelMode;
+
+    M2::CHandle hToken;
+
+    BOOL result = NSudoCreateUserToken(
+        TokenCache,
+        Options.UserMode,
+        hCurrentProcessToken,
+        dwSessionID,
+        Adjustments,
+        &hToken);
+    if (result)
+    {
+        NSUDO_CREATE_PROCESS_OPTIONS CreateOptions;
+        CreateOptions.ProcessPriority = Options.ProcessPriority;
+        CreateOptions.ShowWindowMode = Options.ShowWindowMode;
+        CreateOptions.CreateNewConsole = FALSE != Options.CreateNewConsole;
+
+        result = NSudoCreateProcess(
+            hToken,
+            Options.CommandLine,
+            Options.CurrentDirectory,
+            Options.WaitInterval,
+            CreateOptions,
+            nullptr,
+            StartedProcess);
+    }
+
+    // 等待新进程时不需要模拟为SYSTEM用户
+    DWORD dwError = GetLastError();
+    RevertToSelf();
+    SetLastError(dwError);
+
+    return result;
+}
+
+/*
+NSudoLaunch函数是NSudoAPI的入口，它使用与命令行相同的令牌和进程创建逻辑，但是无需
+启动NSudo进程。
+The NSudoLaunch function is the entry of NSudoAPI. It uses the same token and
+process creation logic as the command line without starting an NSudo process.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+NSUDO_API BOOL WINAPI NSudoLaunch(
+    _In_ const NSUDO_LAUNCH_OPTIONS& Options,
+    _Out_opt_ PNSUDO_LAUNCH_RESULT Result)
+{
+    if (Result)
+    {
+        Result->ProcessId = 0;
+        Result->ExitCode = STILL_ACTIVE;
+    }
+
+    NSUDO_STARTED_PROCESS StartedProcess;
+    if (!NSudoStartLaunch(Options, &StartedProcess))
+    {
+        return FALSE;
+    }
+
+    DWORD ProcessId = StartedProcess.ProcessId;
+    DWORD ExitCode = STILL_ACTIVE;
+
+    if (WAIT_FAILED == NSudoWaitStartedProcess(
+        StartedProcess, Options.WaitInterval, &ExitCode))
+    {
+        return FALSE;
+    }
+
+    if (Result)
+    {
+        Result->ProcessId = ProcessId;
+        Result->ExitCode = ExitCode;
+    }
+
+    return TRUE;
+}
+
+/*
+NSudoAPI中的异步启动操作。线程池等待对象等待进程树的CompletedEvent（无法放入作业
+时等待新进程），该事件在完成端口收到JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO时触发，所
+以操作只在作业中没有活动的进程或者超时时完成，不需要轮询。
+The asynchronous launch operation in NSudoAPI. The thread pool wait object
+waits for the CompletedEvent of the process tree (or the new process if it
+cannot be put into a job). The event is set when the completion port receives
+JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO, so the operation completes only when there
+is no active process in the job or the wait times out, without polling.
+*/
+struct _NSUDO_LAUNCH_OPERATION
+{
+    M2::CCriticalSection CriticalSection;
+    PTP_WAIT Wait = nullptr;
+    NSUDO_STARTED_PROCESS StartedProcess = { nullptr, 0, nullptr };
+    PNSUDO_LAUNCH_COMPLETION_ROUTINE CompletionRoutine = nullptr;
+    PVOID Context = nullptr;
+    // 完成例程是否已经被调用或者正在被调用
+    bool Completed = false;
+};
+
+/*
+NSudoCompleteLaunchOperation函数结束异步启动操作并调用完成例程。完成例程只会被调
+用一次，之后的调用不做任何事。
+The NSudoCompleteLaunchOperation function completes the asynchronous launch
+operation and calls the completion routine. The completion routine is called
+only once, and the later calls do nothing.
+*/
+static void NSudoCompleteLaunchOperation(
+    _In_ PNSUDO_LAUNCH_OPERATION Operation,
+    _In_ DWORD ErrorCode)
+{
+    NSUDO_LAUNCH_RESULT Result;
+    Result.ProcessId = Operation->StartedProcess.ProcessId;
+    Result.ExitCode = STILL_ACTIVE;
+
+    if (ERROR_SUCCESS == ErrorCode)
+    {
+        GetExitCodeProcess(
+            Operation->StartedProcess.ProcessHandle,
+            &Result.ExitCode);
+    }
+
+    {
+        M2::AutoCriticalSectionLock Lock(Operation->CriticalSection);
+
+        if (Operation->Completed)
+        {
+            return;
+        }
+
+        Operation->Completed = true;
+
+        SetThreadpoolWait(Operation->Wait, nullptr, nullptr);
+    }
+
+    // 在锁外调用完成例程，使完成例程可以调用NSudoCancelLaunch
+    if (Operation->CompletionRoutine)
+    {
+        Operation->CompletionRoutine(
+            ErrorCode, &Result, Operation->Context);
+    }
+}
+
+static VOID CALLBACK NSudoLaunchOperationWaitCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context,
+    _Inout_ PTP_WAIT Wait,
+    _In_ TP_WAIT_RESULT WaitResult)
+{
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Wait);
+
+    PNSUDO_LAUNCH_OPERATION Operation =
+        reinterpret_cast<PNSUDO_LAUNCH_OPERATION>(Context);
+
+    NSudoCompleteLaunchOperation(
+        Operation,
+        (WAIT_OBJECT_0 == WaitResult) ? ERROR_SUCCESS : ERROR_TIMEOUT);
+}
+
+/*
+NSudoLaunchAsync函数启动新进程，并在线程池中等待进程树结束，不占用调用者的线程。
+The NSudoLaunchAsync function launches the new process, and waits for the
+process tree to end in the thread pool without occupying the thread of the
+caller.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+NSUDO_API BOOL WINAPI NSudoLaunchAsync(
+    _In_ const NSUDO_LAUNCH_OPTIONS& Options,
+    _In_opt_ PNSUDO_LAUNCH_COMPLETION_ROUTINE CompletionRoutine,
+    _In_opt_ PVOID Context,
+    _Out_ PNSUDO_LAUNCH_OPERATION* Operation)
+{
+    *Operation = nullptr;
+
+    PNSUDO_LAUNCH_OPERATION NewOperation =
+        new (std::nothrow) NSUDO_LAUNCH_OPERATION();
+    if (!NewOperation)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    NewOperation->CompletionRoutine = CompletionRoutine;
+    NewOperation->Context = Context;
+
+    NewOperation->Wait = CreateThreadpoolWait(
+        NSudoLaunchOperationWaitCallback, NewOperation, nullptr);
+    if (!NewOperation->Wait)
+    {
+        delete NewOperation;
+        return FALSE;
+    }
+
+    if (!NSudoStartLaunch(Options, &NewOperation->StartedProcess))
+    {
+        DWORD dwError = GetLastError();
+        CloseThreadpoolWait(NewOperation->Wait);
+        delete NewOperation;
+        SetLastError(dwError);
+        return FALSE;
+    }
+
+    HANDLE WaitHandle = NewOperation->StartedProcess.ProcessTree
+        ? NewOperation->StartedProcess.ProcessTree->CompletedEvent
+        : NewOperation->StartedProcess.ProcessHandle;
+
+    if (INFINITE == Options.WaitInterval)
+    {
+        SetThreadpoolWait(NewOperation->Wait, WaitHandle, nullptr);
+    }
+    else
+    {
+        // 负值表示相对时间，单位为100纳秒
+        ULARGE_INTEGER Timeout;
+        Timeout.QuadPart = static_cast<ULONGLONG>(
+            -static_cast<LONGLONG>(Options.WaitInterval) * 10000);
+
+        FILETIME DueTime;
+        DueTime.dwLowDateTime = Timeout.LowPart;
+        DueTime.dwHighDateTime = Timeout.HighPart;
+
+        SetThreadpoolWait(NewOperation->Wait, WaitHandle, &DueTime);
+    }
+
+    *Operation = NewOperation;
+
+    return TRUE;
+}
+
+/*
+NSudoCancelLaunch函数取消异步启动操作，完成例程以ERROR_CANCELLED被调用。如果操作
+已经完成，则不做任何事。
+The NSudoCancelLaunch function cancels the asynchronous launch operation, and
+the completion routine is called with ERROR_CANCELLED. If the operation is
+completed, it does nothing.
+*/
+NSUDO_API VOID WINAPI NSudoCancelLaunch(
+    _In_ PNSUDO_LAUNCH_OPERATION Operation,
+    _In_ BOOL TerminateProcessTree)
+{
+    if (TerminateProcessTree)
+    {
+        bool Completed = false;
+        {
+            M2::AutoCriticalSectionLock Lock(Operation->CriticalSection);
+            Completed = Operation->Completed;
+        }
+
+        if (!Completed)
+        {
+            if (Operation->StartedProcess.ProcessTree)
+            {
+                TerminateJobObject(
+                    Operation->StartedProcess.ProcessTree->JobHandle,
+                    ERROR_CANCELLED);
+            }
+            else
+            {
+                TerminateProcess(
+                    Operation->StartedProcess.ProcessHandle,
+                    ERROR_CANCELLED);
+            }
+        }
+    }
+
+    NSudoCompleteLaunchOperation(Operation, ERROR_CANCELLED);
+}
+
+/*
+NSudoCloseLaunch函数释放异步启动操作。如果操作尚未完成，则先取消它但不结束进程
+树。不能在完成例程中调用此函数。
+The NSudoCloseLaunch function frees the asynchronous launch operation. If the
+operation is not completed, it is cancelled first without terminating the
+process tree. This function cannot be called in the completion routine.
+*/
+NSUDO_API VOID WINAPI NSudoCloseLaunch(
+    _In_ PNSUDO_LAUNCH_OPERATION Operation)
+{
+    NSudoCancelLaunch(Operation, FALSE);
+
+    // 等待正在执行的回调（包括完成例程）返回
+    WaitForThreadpoolWaitCallbacks(Operation->Wait, TRUE);
+    CloseThreadpoolWait(Operation->Wait);
+
+    NSudoCloseStartedProcess(Operation->StartedProcess);
+
+    delete Operation;
+}
+
+/*
+NSudoUninitialize函数结束等待进程树的线程。DllMain持有加载器锁，无法等待线程退
+出，所以宿主需要在卸载NSudoAPI.dll前显式调用此函数。
+The NSudoUninitialize function ends the thread which waits for the process
+trees. DllMain holds the loader lock and cannot wait for the thread to exit,
+so the host needs to call this function explicitly before unloading
+NSudoAPI.dll.
+*/
+NSUDO_API VOID WINAPI NSudoUninitialize()
+{
+    NSudoStopProcessTreeWaiter();
+}
+
+#if defined(NSUDO_SDK_EXPORTS)
+BOOL WINAPI DllMain(
+    _In_ HINSTANCE hinstDLL,
+    _In_ DWORD fdwReason,
+    _In_ LPVOID lpvReserved)
+{
+    UNREFERENCED_PARAMETER(lpvReserved);
+
+    if (DLL_PROCESS_ATTACH == fdwReason)
+    {
+        // NSudoAPI不使用线程的附加和分离通知
+        DisableThreadLibraryCalls(hinstDLL);
+
+        NSudoTraceLoggingRegister();
+    }
+    else if (DLL_PROCESS_DETACH == fdwReason)
+    {
+        NSudoTraceLoggingUnregister();
+    }
+
+    return TRUE;
+}
+#endif
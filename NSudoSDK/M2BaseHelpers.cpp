@@ -84,71 +84,328 @@ ULONGLONG M2GetTickCount()
     return GetTickCount64();
 }
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64)
+
 /**
- * Converts from the UTF-8 string to the UTF-16 string.
+ * Determines whether the processor and the operating system support AVX2.
  *
- * @param UTF8String The UTF-8 string you want to convert.
- * @return A converted UTF-16 string.
+ * @return True if AVX2 is supported.
  */
-std::wstring M2MakeUTF16String(const std::string& UTF8String)
+static bool M2IsAVX2Supported()
 {
-    std::wstring UTF16String;
+    static const bool IsSupported = []() -> bool
+    {
+        int CPUInfo[4] = { 0 };
+
+        __cpuid(CPUInfo, 0);
+        if (CPUInfo[0] < 7)
+            return false;
+
+        // The OSXSAVE and AVX bits, and the YMM state enabled by the OS.
+        __cpuid(CPUInfo, 1);
+        const int OSXSAVEAndAVX = (1 << 27) | (1 << 28);
+        if (OSXSAVEAndAVX != (CPUInfo[2] & OSXSAVEAndAVX))
+            return false;
+        if (0x6 != (_xgetbv(0) & 0x6))
+            return false;
+
+        __cpuidex(CPUInfo, 7, 0);
+        return 0 != (CPUInfo[1] & (1 << 5));
+    }();
+
+    return IsSupported;
+}
+
+#endif
+
+/**
+ * Widens the leading ASCII characters of the UTF-8 string to UTF-16.
+ *
+ * @param Source The UTF-8 string.
+ * @param Length The length of the UTF-8 string in bytes.
+ * @param Destination The buffer which receives at least Length characters.
+ * @return The number of the leading ASCII characters which are widened.
+ */
+static size_t M2WidenASCIIString(
+    _In_reads_(Length) const char* Source,
+    _In_ size_t Length,
+    _Out_writes_(Length) wchar_t* Destination)
+{
+    size_t i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    if (M2IsAVX2Supported())
+    {
+        for (; i + 32 <= Length; i += 32)
+        {
+            __m256i Chunk = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(Source + i));
+            if (_mm256_movemask_epi8(Chunk))
+                break;
+
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(Destination + i),
+                _mm256_cvtepu8_epi16(_mm256_castsi256_si128(Chunk)));
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(Destination + i + 16),
+                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(Chunk, 1)));
+        }
+    }
+
+    const __m128i Zero = _mm_setzero_si128();
+    for (; i + 16 <= Length; i += 16)
+    {
+        __m128i Chunk = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(Source + i));
+        if (_mm_movemask_epi8(Chunk))
+            break;
+
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(Destination + i),
+            _mm_unpacklo_epi8(Chunk, Zero));
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(Destination + i + 8),
+            _mm_unpackhi_epi8(Chunk, Zero));
+    }
+#elif defined(_M_ARM64)
+    for (; i + 16 <= Length; i += 16)
+    {
+        uint8x16_t Chunk = vld1q_u8(
+            reinterpret_cast<const uint8_t*>(Source + i));
+        if (vmaxvq_u8(Chunk) >= 0x80)
+            break;
+
+        vst1q_u16(
+            reinterpret_cast<uint16_t*>(Destination + i),
+            vmovl_u8(vget_low_u8(Chunk)));
+        vst1q_u16(
+            reinterpret_cast<uint16_t*>(Destination + i + 8),
+            vmovl_high_u8(Chunk));
+    }
+#endif
+
+    // The rest of the string, or the chunk which contains the first
+    // non-ASCII byte.
+    for (; i < Length; ++i)
+    {
+        unsigned char Character = static_cast<unsigned char>(Source[i]);
+        if (Character >= 0x80)
+            break;
+
+        Destination[i] = Character;
+    }
+
+    return i;
+}
+
+/**
+ * Narrows the leading ASCII characters of the UTF-16 string to UTF-8.
+ *
+ * @param Source The UTF-16 string.
+ * @param Length The length of the UTF-16 string in characters.
+ * @param Destination The buffer which receives at least Length bytes.
+ * @return The number of the leading ASCII characters which are narrowed.
+ */
+static size_t M2NarrowASCIIString(
+    _In_reads_(Length) const wchar_t* Source,
+    _In_ size_t Length,
+    _Out_writes_(Length) char* Destination)
+{
+    size_t i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    if (M2IsAVX2Supported())
+    {
+        const __m256i NonASCIIMask = _mm256_set1_epi16(
+            static_cast<short>(0xFF80));
+        for (; i + 32 <= Length; i += 32)
+        {
+            __m256i Low = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(Source + i));
+            __m256i High = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(Source + i + 16));
+            if (!_mm256_testz_si256(
+                _mm256_or_si256(Low, High), NonASCIIMask))
+                break;
+
+            // _mm256_packus_epi16 packs each 128-bit lane separately.
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(Destination + i),
+                _mm256_permute4x64_epi64(
+                    _mm256_packus_epi16(Low, High), 0xD8));
+        }
+    }
+
+    const __m128i NonASCIIMask = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i Zero = _mm_setzero_si128();
+    for (; i + 16 <= Length; i += 16)
+    {
+        __m128i Low = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(Source + i));
+        __m128i High = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(Source + i + 8));
+        __m128i NonASCII = _mm_and_si128(
+            _mm_or_si128(Low, High), NonASCIIMask);
+        if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(NonASCII, Zero)))
+            break;
+
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(Destination + i),
+            _mm_packus_epi16(Low, High));
+    }
+#elif defined(_M_ARM64)
+    for (; i + 16 <= Length; i += 16)
+    {
+        uint16x8_t Low = vld1q_u16(
+            reinterpret_cast<const uint16_t*>(Source + i));
+        uint16x8_t High = vld1q_u16(
+            reinterpret_cast<const uint16_t*>(Source + i + 8));
+        if (vmaxvq_u16(vorrq_u16(Low, High)) >= 0x80)
+            break;
+
+        vst1q_u8(
+            reinterpret_cast<uint8_t*>(Destination + i),
+            vcombine_u8(vmovn_u16(Low), vmovn_u16(High)));
+    }
+#endif
 
-    int UTF16StringLength = MultiByteToWideChar(
-        CP_UTF8,
-        0,
-        UTF8String.data(),
-        (int)UTF8String.size(),
-        nullptr,
-        0);
-    if (UTF16StringLength > 0)
+    // The rest of the string, or the chunk which contains the first
+    // non-ASCII character.
+    for (; i < Length; ++i)
     {
-        UTF16String.resize(UTF16StringLength);
-        MultiByteToWideChar(
+        if (Source[i] >= 0x80)
+            break;
+
+        Destination[i] = static_cast<char>(Source[i]);
+    }
+
+    return i;
+}
+
+/**
+ * Appends the UTF-16 string converted from the UTF-8 string.
+ *
+ * @param UTF16String The UTF-16 string to append to.
+ * @param UTF8String The UTF-8 string you want to convert.
+ * @param UTF8StringLength The length of the UTF-8 string in bytes.
+ */
+void M2AppendUTF16String(
+    std::wstring& UTF16String,
+    const char* UTF8String,
+    size_t UTF8StringLength)
+{
+    // A UTF-8 string never has more UTF-16 characters than bytes, so the
+    // conversion needs neither a size query nor another resize.
+    const size_t Offset = UTF16String.size();
+    UTF16String.resize(Offset + UTF8StringLength);
+
+    size_t Converted = M2WidenASCIIString(
+        UTF8String, UTF8StringLength, &UTF16String[Offset]);
+    if (Converted < UTF8StringLength)
+    {
+        // Fall back to the Win32 conversion from the first non-ASCII byte.
+        int Length = MultiByteToWideChar(
             CP_UTF8,
             0,
-            UTF8String.data(),
-            (int)UTF8String.size(),
-            &UTF16String[0],
-            UTF16StringLength);
+            UTF8String + Converted,
+            (int)(UTF8StringLength - Converted),
+            &UTF16String[Offset + Converted],
+            (int)(UTF8StringLength - Converted));
+        if (Length > 0)
+        {
+            Converted += Length;
+        }
     }
 
-    return UTF16String;
+    UTF16String.resize(Offset + Converted);
 }
 
 /**
- * Converts from the UTF-16 string to the UTF-8 string.
+ * Appends the UTF-8 string converted from the UTF-16 string.
  *
+ * @param UTF8String The UTF-8 string to append to.
  * @param UTF16String The UTF-16 string you want to convert.
- * @return A converted UTF-8 string.
+ * @param UTF16StringLength The length of the UTF-16 string in characters.
  */
-std::string M2MakeUTF8String(const std::wstring& UTF16String)
+void M2AppendUTF8String(
+    std::string& UTF8String,
+    const wchar_t* UTF16String,
+    size_t UTF16StringLength)
 {
-    std::string UTF8String;
+    const size_t Offset = UTF8String.size();
+    UTF8String.resize(Offset + UTF16StringLength);
 
-    int UTF8StringLength = WideCharToMultiByte(
-        CP_UTF8,
-        0,
-        UTF16String.data(),
-        (int)UTF16String.size(),
-        nullptr,
-        0,
-        nullptr,
-        nullptr);
-    if (UTF8StringLength > 0)
+    size_t Converted = M2NarrowASCIIString(
+        UTF16String, UTF16StringLength, &UTF8String[Offset]);
+    if (Converted < UTF16StringLength)
     {
-        UTF8String.resize(UTF8StringLength);
-        WideCharToMultiByte(
+        // Fall back to the Win32 conversion from the first non-ASCII
+        // character. A UTF-16 character needs at most 3 bytes in UTF-8.
+        const wchar_t* Remaining = UTF16String + Converted;
+        int RemainingLength = (int)(UTF16StringLength - Converted);
+
+        int Length = WideCharToMultiByte(
             CP_UTF8,
             0,
-            UTF16String.data(),
-            (int)UTF16String.size(),
-            &UTF8String[0],
-            UTF8StringLength,
+            Remaining,
+            RemainingLength,
+            nullptr,
+            0,
             nullptr,
             nullptr);
+        if (Length > 0)
+        {
+            UTF8String.resize(Offset + Converted + Length);
+            WideCharToMultiByte(
+                CP_UTF8,
+                0,
+                Remaining,
+                RemainingLength,
+                &UTF8String[Offset + Converted],
+                Length,
+                nullptr,
+                nullptr);
+            Converted += Length;
+        }
     }
 
+    UTF8String.resize(Offset + Converted);
+}
+
+/**
+ * Converts from the UTF-8 string to the UTF-16 string.
+ *
+ * @param UTF8String The UTF-8 string you want to convert.
+ * @return A converted UTF-16 string.
+ */
+std::wstring M2MakeUTF16String(const std::string& UTF8String)
+{
+    std::wstring UTF16String;
+
+    M2AppendUTF16String(UTF16String, UTF8String.data(), UTF8String.size());
+
+    return UTF16String;
+}
+
+/**
+ * Converts from the UTF-16 string to the UTF-8 string.
+ *
+ * @param UTF16String The UTF-16 string you want to convert.
+ * @return A converted UTF-8 string.
+ */
+std::string M2MakeUTF8String(const std::wstring& UTF16String)
+{
+    std::string UTF8String;
+
+    M2AppendUTF8String(UTF8String, UTF16String.data(), UTF16String.size());
+
     return UTF8String;
 }
 
@@ -206,143 +463,228 @@ std::wstring M2GetCurrentProcessModulePath()
 }
 
 /**
- * Parses a command line string and returns an array of the command line
- * arguments, along with a count of such arguments, in a way that is similar to
- * the standard C run-time.
+ * Parses a command line string in the same way as M2SpiltCommandLine, but
+ * returns views into the command line instead of copying the arguments.
  *
  * @param CommandLine A string that contains the full command line. If this
  *                    parameter is an empty string the function returns an
- *                    array with only one empty string.
- * @return An array of the command line arguments, along with a count of such
- *         arguments.
+ *                    array with only one empty argument.
+ * @param Arguments The command line arguments. The first one is the
+ *                  application name.
+ * @param Buffer The buffer which stores the arguments containing quotes after
+ *               removing the quotes and escapes. It is reserved once, so the
+ *               views into it stay valid until it is modified.
+ * @remark The arguments are valid as long as both the command line and the
+ *         buffer are valid. The caller can reuse Arguments and Buffer for
+ *         multiple command lines to avoid the allocations.
  */
-std::vector<std::wstring> M2SpiltCommandLine(
-    const std::wstring& CommandLine)
+void M2SpiltCommandLineView(
+    std::wstring_view CommandLine,
+    std::vector<M2_COMMAND_LINE_ARGUMENT>& Arguments,
+    std::wstring& Buffer)
 {
-    // Initialize the SplitArguments.
-    std::vector<std::wstring> SplitArguments;
-
-    wchar_t c = L'\0';
-    int copy_character;                   /* 1 = copy char to *args */
-    unsigned numslash;              /* num of backslashes seen */
+    Arguments.clear();
+    Buffer.clear();
 
-    std::wstring Buffer;
+    // An argument never becomes longer after removing the quotes and escapes,
+    // so the buffer is not reallocated and the views into it stay valid.
     Buffer.reserve(CommandLine.size());
 
-    /* first scan the program name, copy it, and count the bytes */
-    wchar_t* p = const_cast<wchar_t*>(CommandLine.c_str());
+    const wchar_t* const Begin = CommandLine.data();
+    const wchar_t* const End = Begin + CommandLine.size();
+    const wchar_t* p = Begin;
+
+    // The command line also ends at the first null character like the
+    // null-terminated string version.
+    auto IsEnd = [End](const wchar_t* Current) -> bool
+    {
+        return Current == End || L'\0' == *Current;
+    };
+
+    auto IsWhitespace = [](const wchar_t* Current) -> bool
+    {
+        return L' ' == *Current || L'\t' == *Current;
+    };
+
+    M2_COMMAND_LINE_ARGUMENT Argument;
 
     // A quoted program name is handled here. The handling is much simpler than
     // for other arguments. Basically, whatever lies between the leading
     // double-quote and next one, or a terminal null character is simply
     // accepted. Fancier handling is not required because the program name must
     // be a legal NTFS/HPFS file name. Note that the double-quote characters are
-    // not copied, nor do they contribute to character_count.
+    // not copied.
     bool InQuotes = false;
-    do
+    bool HasQuotes = false;
+    while (!IsEnd(p) && (InQuotes || !IsWhitespace(p)))
     {
-        if (*p == '"')
+        if (L'"' == *p)
         {
             InQuotes = !InQuotes;
-            c = *p++;
-            continue;
+            HasQuotes = true;
         }
 
-        // Copy character into argument:
-        Buffer.push_back(*p);
-
-        c = *p++;
-    } while (c != '\0' && (InQuotes || (c != ' ' && c != '\t')));
-
-    if (c == '\0')
-    {
-        p--;
+        ++p;
     }
-    else
+
+    Argument.Offset = 0;
+    Argument.Length = static_cast<size_t>(p - Begin);
+    Argument.Value = std::wstring_view(Begin, Argument.Length);
+    if (HasQuotes)
     {
-        Buffer.resize(Buffer.size() - 1);
-    }
+        size_t BufferStart = Buffer.size();
+        for (wchar_t Character : Argument.Value)
+        {
+            if (L'"' != Character)
+            {
+                Buffer.push_back(Character);
+            }
+        }
 
-    // Save te argument.
-    SplitArguments.push_back(Buffer);
+        Argument.Value = std::wstring_view(
+            Buffer.data() + BufferStart,
+            Buffer.size() - BufferStart);
+    }
 
-    InQuotes = false;
+    // Save the argument.
+    Arguments.push_back(Argument);
 
     // Loop on each argument
     for (;;)
     {
-        if (*p)
+        while (!IsEnd(p) && IsWhitespace(p))
         {
-            while (*p == ' ' || *p == '\t')
-                ++p;
+            ++p;
         }
 
         // End of arguments
-        if (*p == '\0')
+        if (IsEnd(p))
+        {
             break;
+        }
 
-        // Initialize the argument buffer.
-        Buffer.clear();
+        const wchar_t* ArgumentStart = p;
 
-        // Loop through scanning one argument:
-        for (;;)
+        // The backslashes are only special before a double-quote, so the
+        // argument without double-quotes can be returned as it is.
+        HasQuotes = false;
+        while (!IsEnd(p) && !IsWhitespace(p))
         {
-            copy_character = 1;
-
-            // Rules: 2N backslashes + " ==> N backslashes and begin/end quote
-            // 2N + 1 backslashes + " ==> N backslashes + literal " N
-            // backslashes ==> N backslashes
-            numslash = 0;
-
-            while (*p == '\\')
+            if (L'"' == *p)
             {
-                // Count number of backslashes for use below
-                ++p;
-                ++numslash;
+                HasQuotes = true;
+                break;
             }
 
-            if (*p == '"')
+            ++p;
+        }
+
+        if (HasQuotes)
+        {
+            p = ArgumentStart;
+            size_t BufferStart = Buffer.size();
+
+            InQuotes = false;
+
+            // Loop through scanning one argument:
+            for (;;)
             {
-                // if 2N backslashes before, start/end quote, otherwise copy
-                // literally:
-                if (numslash % 2 == 0)
+                bool CopyCharacter = true;
+
+                // Rules: 2N backslashes + " ==> N backslashes and begin/end
+                // quote 2N + 1 backslashes + " ==> N backslashes + literal "
+                // N backslashes ==> N backslashes
+                size_t BackslashCount = 0;
+                while (!IsEnd(p) && L'\\' == *p)
                 {
-                    if (InQuotes && p[1] == '"')
-                    {
-                        p++; // Double quote inside quoted string
-                    }
-                    else
+                    // Count number of backslashes for use below
+                    ++p;
+                    ++BackslashCount;
+                }
+
+                if (!IsEnd(p) && L'"' == *p)
+                {
+                    // if 2N backslashes before, start/end quote, otherwise
+                    // copy literally:
+                    if (0 == BackslashCount % 2)
                     {
-                        // Skip first quote char and copy second:
-                        copy_character = 0; // Don't copy quote
-                        InQuotes = !InQuotes;
+                        if (InQuotes && !IsEnd(p + 1) && L'"' == p[1])
+                        {
+                            // Double quote inside quoted string
+                            ++p;
+                        }
+                        else
+                        {
+                            // Skip first quote char and copy second:
+                            CopyCharacter = false;
+                            InQuotes = !InQuotes;
+                        }
                     }
+
+                    BackslashCount /= 2;
                 }
 
-                numslash /= 2;
-            }
+                // Copy slashes:
+                Buffer.append(BackslashCount, L'\\');
 
-            // Copy slashes:
-            while (numslash--)
-            {
-                Buffer.push_back(L'\\');
-            }
+                // If at end of arg, break loop:
+                if (IsEnd(p) || (!InQuotes && IsWhitespace(p)))
+                {
+                    break;
+                }
 
-            // If at end of arg, break loop:
-            if (*p == '\0' || (!InQuotes && (*p == ' ' || *p == '\t')))
-                break;
+                // Copy character into argument:
+                if (CopyCharacter)
+                {
+                    Buffer.push_back(*p);
+                }
 
-            // Copy character into argument:
-            if (copy_character)
-            {
-                Buffer.push_back(*p);
+                ++p;
             }
 
-            ++p;
+            Argument.Value = std::wstring_view(
+                Buffer.data() + BufferStart,
+                Buffer.size() - BufferStart);
+        }
+        else
+        {
+            Argument.Value = std::wstring_view(
+                ArgumentStart,
+                static_cast<size_t>(p - ArgumentStart));
         }
 
-        // Save te argument.
-        SplitArguments.push_back(Buffer);
+        Argument.Offset = static_cast<size_t>(ArgumentStart - Begin);
+        Argument.Length = static_cast<size_t>(p - ArgumentStart);
+
+        // Save the argument.
+        Arguments.push_back(Argument);
+    }
+}
+
+/**
+ * Parses a command line string and returns an array of the command line
+ * arguments, along with a count of such arguments, in a way that is similar to
+ * the standard C run-time.
+ *
+ * @param CommandLine A string that contains the full command line. If this
+ *                    parameter is an empty string the function returns an
+ *                    array with only one empty string.
+ * @return An array of the command line arguments, along with a count of such
+ *         arguments.
+ */
+std::vector<std::wstring> M2SpiltCommandLine(
+    const std::wstring& CommandLine)
+{
+    std::vector<M2_COMMAND_LINE_ARGUMENT> Arguments;
+    std::wstring Buffer;
+    M2SpiltCommandLineView(CommandLine, Arguments, Buffer);
+
+    std::vector<std::wstring> SplitArguments;
+    SplitArguments.reserve(Arguments.size());
+
+    for (const M2_COMMAND_LINE_ARGUMENT& Argument : Arguments)
+    {
+        SplitArguments.emplace_back(Argument.Value);
     }
 
     return SplitArguments;
@@ -373,93 +715,64 @@ void M2SpiltCommandLineEx(
     OptionsAndParameters.clear();
     UnresolvedCommandLine.clear();
 
-    size_t arg_size = 0;
-    for (auto& SplitArgument : M2SpiltCommandLine(CommandLine))
+    std::vector<M2_COMMAND_LINE_ARGUMENT> Arguments;
+    std::wstring Buffer;
+    M2SpiltCommandLineView(CommandLine, Arguments, Buffer);
+
+    // We need to process the application name at the beginning.
+    ApplicationName = Arguments[0].Value;
+
+    for (size_t i = 1; i < Arguments.size(); ++i)
     {
-        // We need to process the application name at the beginning.
-        if (ApplicationName.empty())
-        {
-            // For getting the unresolved command line, we need to cumulate
-            // length which including spaces.
-            arg_size += SplitArgument.size() + 1;
+        std::wstring_view SplitArgument = Arguments[i].Value;
 
-            // Save
-            ApplicationName = SplitArgument;
-        }
-        else
-        {
-            bool IsOption = false;
-            size_t OptionPrefixLength = 0;
+        bool IsOption = false;
+        size_t OptionPrefixLength = 0;
 
-            for (auto& OptionPrefix : OptionPrefixes)
-            {
-                if (0 == _wcsnicmp(
-                    SplitArgument.c_str(),
+        for (auto& OptionPrefix : OptionPrefixes)
+        {
+            if (SplitArgument.size() >= OptionPrefix.size() &&
+                0 == _wcsnicmp(
+                    SplitArgument.data(),
                     OptionPrefix.c_str(),
                     OptionPrefix.size()))
-                {
-                    IsOption = true;
-                    OptionPrefixLength = OptionPrefix.size();
-                }
-            }
-
-            if (IsOption)
             {
-                // For getting the unresolved command line, we need to cumulate
-                // length which including spaces.
-                arg_size += SplitArgument.size() + 1;
-
-                // Get the option name and parameter.
+                IsOption = true;
+                OptionPrefixLength = OptionPrefix.size();
+            }
+        }
 
-                wchar_t* OptionStart = &SplitArgument[0] + OptionPrefixLength;
-                wchar_t* ParameterStart = nullptr;
+        if (!IsOption)
+        {
+            // The unresolved command line starts at the first argument which
+            // is not an option, which is right after the last option.
+            UnresolvedCommandLine = CommandLine.c_str() + Arguments[i].Offset;
 
-                for (auto& OptionParameterSeparator
-                    : OptionParameterSeparators)
-                {
-                    wchar_t* Result = wcsstr(
-                        OptionStart,
-                        OptionParameterSeparator.c_str());
-                    if (nullptr == Result)
-                    {
-                        continue;
-                    }
+            break;
+        }
 
-                    Result[0] = L'\0';
-                    ParameterStart = Result + OptionParameterSeparator.size();
+        // Get the option name and parameter.
 
-                    break;
-                }
+        std::wstring_view Option = SplitArgument.substr(OptionPrefixLength);
+        std::wstring_view Parameter;
 
-                // Save
-                OptionsAndParameters[(OptionStart ? OptionStart : L"")] =
-                    (ParameterStart ? ParameterStart : L"");
-            }
-            else
+        for (auto& OptionParameterSeparator : OptionParameterSeparators)
+        {
+            size_t Separator = Option.find(OptionParameterSeparator);
+            if (std::wstring_view::npos == Separator)
             {
-                // Get the approximate location of the unresolved command line.
-                // We use "(arg_size - 1)" to ensure that the program path
-                // without quotes can also correctly parse.
-                wchar_t* search_start =
-                    const_cast<wchar_t*>(CommandLine.c_str()) + (arg_size - 1);
-
-                // Get the unresolved command line. Search for the beginning of
-                // the first parameter delimiter called space and exclude the
-                // first space by adding 1 to the result.
-                wchar_t* command = wcsstr(search_start, L" ") + 1;
-
-                // Omit the space. (Thanks to wzzw.)
-                while (*command == L' ')
-                {
-                    ++command;
-                }
+                continue;
+            }
 
-                // Save
-                UnresolvedCommandLine = command;
+            Parameter = Option.substr(
+                Separator + OptionParameterSeparator.size());
+            Option = Option.substr(0, Separator);
 
-                break;
-            }
+            break;
         }
+
+        // Save
+        OptionsAndParameters[std::wstring(Option)] = Parameter;
     }
 }
 
@@ -20,6 +20,7 @@
 
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 /**
@@ -437,6 +438,34 @@ CharType M2PathFindFileName(CharType Path)
     return FileName;
 }
 
+/**
+ * Appends the UTF-16 string converted from the UTF-8 string. The leading ASCII
+ * characters are widened with SIMD, and the Win32 conversion is only used from
+ * the first non-ASCII byte.
+ *
+ * @param UTF16String The UTF-16 string to append to.
+ * @param UTF8String The UTF-8 string you want to convert.
+ * @param UTF8StringLength The length of the UTF-8 string in bytes.
+ */
+void M2AppendUTF16String(
+    std::wstring& UTF16String,
+    const char* UTF8String,
+    size_t UTF8StringLength);
+
+/**
+ * Appends the UTF-8 string converted from the UTF-16 string. The leading ASCII
+ * characters are narrowed with SIMD, and the Win32 conversion is only used from
+ * the first non-ASCII character.
+ *
+ * @param UTF8String The UTF-8 string to append to.
+ * @param UTF16String The UTF-16 string you want to convert.
+ * @param UTF16StringLength The length of the UTF-16 string in characters.
+ */
+void M2AppendUTF8String(
+    std::string& UTF8String,
+    const wchar_t* UTF16String,
+    size_t UTF16StringLength);
+
 /**
  * Converts from the UTF-8 string to the UTF-16 string.
  *
@@ -503,6 +532,43 @@ inline HRESULT M2GetProcAddress(
  */
 std::wstring M2GetCurrentProcessModulePath();
 
+/**
+ * An argument of the command line parsed by M2SpiltCommandLineView.
+ */
+typedef struct _M2_COMMAND_LINE_ARGUMENT
+{
+    // The argument without quotes and escapes. It points into the command
+    // line, or into the buffer passed to M2SpiltCommandLineView if the
+    // argument contains quotes.
+    std::wstring_view Value;
+    // The offset of the argument in the command line, in characters.
+    size_t Offset;
+    // The length of the argument in the command line including the quotes
+    // and escapes, in characters.
+    size_t Length;
+} M2_COMMAND_LINE_ARGUMENT, *PM2_COMMAND_LINE_ARGUMENT;
+
+/**
+ * Parses a command line string in the same way as M2SpiltCommandLine, but
+ * returns views into the command line instead of copying the arguments.
+ *
+ * @param CommandLine A string that contains the full command line. If this
+ *                    parameter is an empty string the function returns an
+ *                    array with only one empty argument.
+ * @param Arguments The command line arguments. The first one is the
+ *                  application name.
+ * @param Buffer The buffer which stores the arguments containing quotes after
+ *               removing the quotes and escapes. It is reserved once, so the
+ *               views into it stay valid until it is modified.
+ * @remark The arguments are valid as long as both the command line and the
+ *         buffer are valid. The caller can reuse Arguments and Buffer for
+ *         multiple command lines to avoid the allocations.
+ */
+void M2SpiltCommandLineView(
+    std::wstring_view CommandLine,
+    std::vector<M2_COMMAND_LINE_ARGUMENT>& Arguments,
+    std::wstring& Buffer);
+
 /**
  * Parses a command line string and returns an array of the command line
  * arguments, along with a count of such arguments, in a way that is similar to
@@ -0,0 +1,237 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoAPI.h
+ * PURPOSE:   Definition for the NSudo launch API
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_API_
+#define _NSUDO_API_
+
+/**
+ * The launch API is a C++ API. The options are passed by reference and use
+ * scoped enumerations, so the exports use the C++ linkage and the callers need
+ * to be built with the same compiler.
+ */
+#ifndef __cplusplus
+#error The NSudo launch API requires C++.
+#endif
+
+#include <Windows.h>
+
+/**
+ * NSUDO_SDK_EXPORTS is defined when building NSudoAPI.dll, and the callers
+ * which link to NSudoAPI.dll should define NSUDO_SDK_DLL. The callers which
+ * link to NSudoAPIStatic.lib need to define neither of them.
+ */
+#if defined(NSUDO_SDK_EXPORTS)
+#define NSUDO_API __declspec(dllexport)
+#elif defined(NSUDO_SDK_DLL)
+#define NSUDO_API __declspec(dllimport)
+#else
+#define NSUDO_API
+#endif
+
+/**
+ * The user of the new process.
+ */
+enum class NSudoOptionUserValue
+{
+    Default,
+    TrustedInstaller,
+    System,
+    CurrentUser,
+    CurrentProcess,
+    CurrentProcessDropRight
+};
+
+/**
+ * The privileges of the new process.
+ */
+enum class NSudoOptionPrivilegesValue
+{
+    Default,
+    EnableAllPrivileges,
+    DisableAllPrivileges
+};
+
+/**
+ * The integrity level of the new process.
+ */
+enum class NSudoOptionIntegrityLevelValue
+{
+    Default,
+    System,
+    High,
+    Medium,
+    Low
+};
+
+/**
+ * The cache of the SYSTEM and TrustedInstaller tokens. A long-lived caller
+ * can reuse it across launches, so the tokens are acquired only once.
+ */
+typedef struct _NSUDO_TOKEN_CACHE NSUDO_TOKEN_CACHE, *PNSUDO_TOKEN_CACHE;
+
+/**
+ * The options of NSudoLaunch.
+ */
+typedef struct _NSUDO_LAUNCH_OPTIONS
+{
+    // Must be sizeof(NSUDO_LAUNCH_OPTIONS).
+    DWORD Size;
+    // The command line of the new process. Documents and URLs are launched
+    // via their associated programs.
+    LPCWSTR CommandLine;
+    // The current directory of the new process. If it is nullptr, the current
+    // directory of the caller is used.
+    LPCWSTR CurrentDirectory;
+    NSudoOptionUserValue UserMode;
+    NSudoOptionPrivilegesValue PrivilegesMode;
+    NSudoOptionIntegrityLevelValue IntegrityLevelMode;
+    // The session of the new process. If it is MAXDWORD, the session of the
+    // caller is used.
+    DWORD SessionId;
+    // The milliseconds to wait for the process tree. 0 does not wait.
+    DWORD WaitInterval;
+    // The priority class of the new process. 0 uses the default one.
+    DWORD ProcessPriority;
+    // The SW_* value of the window of the new process.
+    DWORD ShowWindowMode;
+    // Whether the new process has a new console instead of the console of
+    // the caller.
+    BOOL CreateNewConsole;
+    // The token cache to reuse. If it is nullptr, the tokens are acquired
+    // for this launch only.
+    PNSUDO_TOKEN_CACHE TokenCache;
+} NSUDO_LAUNCH_OPTIONS, *PNSUDO_LAUNCH_OPTIONS;
+
+/**
+ * The result of NSudoLaunch.
+ */
+typedef struct _NSUDO_LAUNCH_RESULT
+{
+    // The ID of the new process.
+    DWORD ProcessId;
+    // The exit code of the new process, or STILL_ACTIVE if the process tree
+    // is not waited or it does not end in WaitInterval.
+    DWORD ExitCode;
+} NSUDO_LAUNCH_RESULT, *PNSUDO_LAUNCH_RESULT;
+
+/**
+ * Creates a token cache.
+ *
+ * @param TokenCache The created token cache. Call NSudoCloseTokenCache to
+ *                   free it.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ */
+NSUDO_API BOOL WINAPI NSudoCreateTokenCache(
+    _Out_ PNSUDO_TOKEN_CACHE* TokenCache);
+
+/**
+ * Frees a token cache and the tokens in it.
+ *
+ * @param TokenCache The token cache to free.
+ */
+NSUDO_API VOID WINAPI NSudoCloseTokenCache(
+    _In_ PNSUDO_TOKEN_CACHE TokenCache);
+
+/**
+ * Creates a process with the specified user, privileges and integrity level
+ * in the calling process, without starting NSudo.
+ *
+ * @param Options The launch options.
+ * @param Result The launch result.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ * @remark The caller must be elevated. The function impersonates the SYSTEM
+ *         user on the calling thread and reverts it before returning.
+ *         SeDebugPrivilege is only enabled in the impersonation copy of the
+ *         process token, so the token of the calling process is not changed.
+ */
+NSUDO_API BOOL WINAPI NSudoLaunch(
+    _In_ const NSUDO_LAUNCH_OPTIONS& Options,
+    _Out_opt_ PNSUDO_LAUNCH_RESULT Result);
+
+/**
+ * The asynchronous launch operation created by NSudoLaunchAsync.
+ */
+typedef struct _NSUDO_LAUNCH_OPERATION
+    NSUDO_LAUNCH_OPERATION, *PNSUDO_LAUNCH_OPERATION;
+
+/**
+ * The completion routine of NSudoLaunchAsync.
+ *
+ * @param ErrorCode ERROR_SUCCESS if the process tree ended, ERROR_TIMEOUT if
+ *                  it did not end in WaitInterval, or ERROR_CANCELLED if the
+ *                  operation was cancelled.
+ * @param Result The launch result. The exit code is STILL_ACTIVE unless
+ *               ErrorCode is ERROR_SUCCESS.
+ * @param Context The context passed to NSudoLaunchAsync.
+ * @remark The routine is called once on a thread pool thread, or on the thread
+ *         which calls NSudoCancelLaunch or NSudoCloseLaunch.
+ */
+typedef VOID (CALLBACK* PNSUDO_LAUNCH_COMPLETION_ROUTINE)(
+    _In_ DWORD ErrorCode,
+    _In_ const NSUDO_LAUNCH_RESULT* Result,
+    _In_opt_ PVOID Context);
+
+/**
+ * Launches a process like NSudoLaunch, but waits for the process tree on the
+ * thread pool instead of the calling thread.
+ *
+ * @param Options The launch options. WaitInterval is the timeout of the
+ *                operation, and INFINITE means no timeout.
+ * @param CompletionRoutine The routine to call when the operation completes.
+ * @param Context The context passed to the completion routine.
+ * @param Operation The created operation. Call NSudoCloseLaunch to free it.
+ * @return If the function fails, the return value is FALSE and the completion
+ *         routine is not called. To get extended error information, call
+ *         GetLastError.
+ */
+NSUDO_API BOOL WINAPI NSudoLaunchAsync(
+    _In_ const NSUDO_LAUNCH_OPTIONS& Options,
+    _In_opt_ PNSUDO_LAUNCH_COMPLETION_ROUTINE CompletionRoutine,
+    _In_opt_ PVOID Context,
+    _Out_ PNSUDO_LAUNCH_OPERATION* Operation);
+
+/**
+ * Cancels an asynchronous launch operation. The completion routine is called
+ * with ERROR_CANCELLED if the operation is not completed yet.
+ *
+ * @param Operation The operation to cancel.
+ * @param TerminateProcessTree Whether to terminate the processes in the
+ *                             process tree.
+ */
+NSUDO_API VOID WINAPI NSudoCancelLaunch(
+    _In_ PNSUDO_LAUNCH_OPERATION Operation,
+    _In_ BOOL TerminateProcessTree);
+
+/**
+ * Frees an asynchronous launch operation. The operation is cancelled without
+ * terminating the process tree if it is not completed yet.
+ *
+ * @param Operation The operation to free.
+ * @remark It waits for the running completion routine, so it must not be
+ *         called in the completion routine.
+ */
+NSUDO_API VOID WINAPI NSudoCloseLaunch(
+    _In_ PNSUDO_LAUNCH_OPERATION Operation);
+
+/**
+ * Ends the thread which NSudoAPI creates to wait for the process trees. Call
+ * it after all launch operations are closed and before unloading
+ * NSudoAPI.dll. The thread is created again by the next launch.
+ *
+ * @remark It waits for the thread to exit, so it must not be called in
+ *         DllMain.
+ */
+NSUDO_API VOID WINAPI NSudoUninitialize();
+
+#endif
@@ -0,0 +1,4304 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoCore.cpp
+ * PURPOSE:   Implementation for the NSudo launch core
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <WtsApi32.h>
+#pragma comment(lib,"WtsApi32.lib")
+
+ // 为编译通过而禁用的警告
+#if _MSC_VER >= 1200
+#pragma warning(push)
+#pragma warning(disable:4505) // 未引用的本地函数已移除(等级 4)
+#endif
+
+#include <string>
+#include <string_view>
+
+#include "NSudoCore.h"
+
+// 各阶段在ETW事件和NSudoBench输出中的名称，顺序与NSudoStage一致
+const char* const NSudoStageNames[] =
+{
+    "Startup",
+    "ImpersonateAsSystem",
+    "DuplicateToken",
+    "StartService",
+    "OpenParentProcess",
+    "AdjustToken",
+    "CreateEnvironmentBlock",
+    "CreateProcess",
+    "Wait"
+};
+
+static_assert(
+    _countof(NSudoStageNames) == static_cast<size_t>(NSudoStage::Count),
+    "NSudoStageNames must match NSudoStage.");
+
+#if defined(NSUDO_BENCHMARK)
+
+// 各阶段累计的耗时（QueryPerformanceCounter的计数），由NSudoBench读取和清零
+LONGLONG g_NSudoStageTicks[static_cast<size_t>(NSudoStage::Count)];
+
+// 第一次进入CreateProcess阶段时QueryPerformanceCounter的计数，0表示尚未进入
+LONGLONG g_NSudoFirstCreateProcessTick;
+
+#endif
+
+std::wstring NSudoExpandEnvironmentStrings(
+    const std::wstring& String)
+{
+    std::wstring ExpandedString;
+
+    ExpandedString.resize(static_cast<size_t>(ExpandEnvironmentStringsW(
+        String.c_str(),
+        nullptr,
+        0) - 1));
+
+    ExpandEnvironmentStringsW(
+        String.c_str(),
+        &ExpandedString[0],
+        static_cast<DWORD>(ExpandedString.size() + 1));
+
+    return ExpandedString;
+}
+
+// 特权的名称，无需调用LookupPrivilegeValueW即可得到特权的LUID
+// The names of the privileges, so the LUIDs of the privileges are obtained
+// without calling LookupPrivilegeValueW.
+const NSUDO_PRIVILEGE_NAME_DEFINITION NSudoPrivilegeNames[] =
+{
+    { L"SeCreateTokenPrivilege", SeCreateTokenPrivilege },
+    { L"SeAssignPrimaryTokenPrivilege", SeAssignPrimaryTokenPrivilege },
+    { L"SeLockMemoryPrivilege", SeLockMemoryPrivilege },
+    { L"SeIncreaseQuotaPrivilege", SeIncreaseQuotaPrivilege },
+    { L"SeMachineAccountPrivilege", SeMachineAccountPrivilege },
+    { L"SeTcbPrivilege", SeTcbPrivilege },
+    { L"SeSecurityPrivilege", SeSecurityPrivilege },
+    { L"SeTakeOwnershipPrivilege", SeTakeOwnershipPrivilege },
+    { L"SeLoadDriverPrivilege", SeLoadDriverPrivilege },
+    { L"SeSystemProfilePrivilege", SeSystemProfilePrivilege },
+    { L"SeSystemtimePrivilege", SeSystemtimePrivilege },
+    { L"SeProfileSingleProcessPrivilege", SeProfileSingleProcessPrivilege },
+    { L"SeIncreaseBasePriorityPrivilege", SeIncreaseBasePriorityPrivilege },
+    { L"SeCreatePagefilePrivilege", SeCreatePagefilePrivilege },
+    { L"SeCreatePermanentPrivilege", SeCreatePermanentPrivilege },
+    { L"SeBackupPrivilege", SeBackupPrivilege },
+    { L"SeRestorePrivilege", SeRestorePrivilege },
+    { L"SeShutdownPrivilege", SeShutdownPrivilege },
+    { L"SeDebugPrivilege", SeDebugPrivilege },
+    { L"SeAuditPrivilege", SeAuditPrivilege },
+    { L"SeSystemEnvironmentPrivilege", SeSystemEnvironmentPrivilege },
+    { L"SeChangeNotifyPrivilege", SeChangeNotifyPrivilege },
+    { L"SeRemoteShutdownPrivilege", SeRemoteShutdownPrivilege },
+    { L"SeUndockPrivilege", SeUndockPrivilege },
+    { L"SeSyncAgentPrivilege", SeSyncAgentPrivilege },
+    { L"SeEnableDelegationPrivilege", SeEnableDelegationPrivilege },
+    { L"SeManageVolumePrivilege", SeManageVolumePrivilege },
+    { L"SeImpersonatePrivilege", SeImpersonatePrivilege },
+    { L"SeCreateGlobalPrivilege", SeCreateGlobalPrivilege },
+    { L"SeTrustedCredManAccessPrivilege", SeTrustedCredManAccessPrivilege },
+    { L"SeRelabelPrivilege", SeRelabelPrivilege },
+    { L"SeIncreaseWorkingSetPrivilege", SeIncreaseWorkingSetPrivilege },
+    { L"SeTimeZonePrivilege", SeTimeZonePrivilege },
+    { L"SeCreateSymbolicLinkPrivilege", SeCreateSymbolicLinkPrivilege },
+    {
+        L"SeDelegateSessionUserImpersonatePrivilege",
+        SeDelegateSessionUserImpersonatePrivilege
+    }
+};
+
+// 按名称启用和禁用的特权使用64位的位掩码，第N位对应LUID为N的特权
+static_assert(
+    SeMaxWellKnownPrivilege < 64,
+    "SeMaxWellKnownPrivilege must be less than 64.");
+
+/*
+访问令牌完整性级别定义
+The definitions of the Token Integrity Levels
+*/
+typedef enum _TOKEN_INTEGRITY_LEVELS_LIST
+{
+    // S-1-16-0
+    UntrustedLevel = SECURITY_MANDATORY_UNTRUSTED_RID,
+
+    // S-1-16-4096
+    LowLevel = SECURITY_MANDATORY_LOW_RID,
+
+    // S-1-16-8192
+    MediumLevel = SECURITY_MANDATORY_MEDIUM_RID,
+
+    // S-1-16-8448
+    MediumPlusLevel = SECURITY_MANDATORY_MEDIUM_PLUS_RID,
+
+    // S-1-16-12288
+    HighLevel = SECURITY_MANDATORY_HIGH_RID,
+
+    // S-1-16-16384
+    SystemLevel = SECURITY_MANDATORY_SYSTEM_RID,
+
+    // S-1-16-20480
+    ProtectedLevel = SECURITY_MANDATORY_PROTECTED_PROCESS_RID
+} TOKEN_INTEGRITY_LEVELS_LIST, *PTOKEN_INTEGRITY_LEVELS_LIST;
+
+// SECURITY_NT_AUTHORITY
+SID_IDENTIFIER_AUTHORITY SIA_NT = SECURITY_NT_AUTHORITY;
+
+// SECURITY_MANDATORY_LABEL_AUTHORITY
+SID_IDENTIFIER_AUTHORITY SIA_IL = SECURITY_MANDATORY_LABEL_AUTHORITY;
+
+/*
+   NSudoServiceNotifyCallback函数是NotifyServiceStatusChangeW的回调函数，用于
+   标记服务状态已经改变。
+   The NSudoServiceNotifyCallback function is the callback function of
+   NotifyServiceStatusChangeW, which is used to mark that the service status
+   has been changed.
+   */
+VOID CALLBACK NSudoServiceNotifyCallback(
+    _In_ PVOID pParameter)
+{
+    PSERVICE_NOTIFYW pNotifyBuffer = reinterpret_cast<PSERVICE_NOTIFYW>(
+        pParameter);
+
+    *reinterpret_cast<bool*>(pNotifyBuffer->pContext) = true;
+}
+
+/*
+   NSudoStartService函数通过服务名启动服务并返回服务状态。
+   The NSudoStartService function starts a service and return service status
+   via service name.
+
+   该函数优先使用NotifyServiceStatusChangeW等待服务状态改变，如果系统不支持则
+   回退到轮询。
+   The function prefers to use NotifyServiceStatusChangeW to wait for the
+   service status change, and falls back to polling if the system does not
+   support it.
+
+   如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+   If the function fails, the return value is NULL. To get extended error
+   information, call GetLastError.
+   */
+BOOL WINAPI NSudoStartService(
+    _In_ LPCWSTR lpServiceName,
+    _Out_ LPSERVICE_STATUS_PROCESS lpServiceStatus)
+{
+    CNSudoStageScope StageScope(NSudoStage::StartService);
+
+    // 服务状态改变通知的缓冲区必须在服务句柄关闭前一直有效
+    SERVICE_NOTIFYW NotifyBuffer = { 0 };
+    bool bNotified = false;
+    bool bNotifyPending = false;
+    bool bNotifySupported = true;
+
+    M2::CServiceHandle hSCM;
+    M2::CServiceHandle hService;
+
+    DWORD nBytesNeeded = 0;
+    DWORD nOldCheckPoint = 0;
+    ULONGLONG nCurrentTick = 0;
+    ULONGLONG nLastTick = 0;
+    bool bStartServiceWCalled = false;
+    bool bWaitStarted = false;
+    bool bSucceed = false;
+
+    NotifyBuffer.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+    NotifyBuffer.pfnNotifyCallback = NSudoServiceNotifyCallback;
+    NotifyBuffer.pContext = &bNotified;
+
+    hSCM = OpenSCManagerW(
+        nullptr,
+        nullptr,
+        SC_MANAGER_CONNECT);
+    if (!hSCM) goto FuncEnd;
+
+    hService = OpenServiceW(
+        hSCM,
+        lpServiceName,
+        SERVICE_QUERY_STATUS | SERVICE_START);
+    if (!hService) goto FuncEnd;
+
+    while (QueryServiceStatusEx(
+        hService,
+        SC_STATUS_PROCESS_INFO,
+        (LPBYTE)lpServiceStatus,
+        sizeof(SERVICE_STATUS_PROCESS),
+        &nBytesNeeded))
+    {
+        if (SERVICE_STOPPED == lpServiceStatus->dwCurrentState)
+        {
+            if (bStartServiceWCalled)
+            {
+                break;
+            }
+
+            bStartServiceWCalled = true;
+            if (!StartServiceW(hService, 0, nullptr))
+            {
+                if (ERROR_SERVICE_ALREADY_RUNNING != GetLastError())
+                {
+                    break;
+                }
+            }
+        }
+        else if (
+            SERVICE_STOP_PENDING == lpServiceStatus->dwCurrentState ||
+            SERVICE_START_PENDING == lpServiceStatus->dwCurrentState)
+        {
+            nCurrentTick = GetTickCount64();
+
+            // 如果校验点增加则重新计时，否则检测是否超时
+            if (!bWaitStarted ||
+                lpServiceStatus->dwCheckPoint > nOldCheckPoint)
+            {
+                bWaitStarted = true;
+                nLastTick = nCurrentTick;
+                nOldCheckPoint = lpServiceStatus->dwCheckPoint;
+            }
+            else if (nCurrentTick - nLastTick > lpServiceStatus->dwWaitHint)
+            {
+                SetLastError(ERROR_TIMEOUT);
+                break;
+            }
+
+            // 等待时间不超过等待提示，但至少250ms（借鉴.Net服务操作类的实现）
+            ULONGLONG nWaitTime = lpServiceStatus->dwWaitHint;
+            if (nWaitTime < 250)
+            {
+                nWaitTime = 250;
+            }
+            nWaitTime -= (nCurrentTick - nLastTick < nWaitTime)
+                ? (nCurrentTick - nLastTick)
+                : nWaitTime;
+
+            if (bNotifySupported && !bNotifyPending)
+            {
+                bNotified = false;
+                bNotifyPending = (ERROR_SUCCESS == NotifyServiceStatusChangeW(
+                    hService,
+                    SERVICE_NOTIFY_STOPPED |
+                    SERVICE_NOTIFY_RUNNING |
+                    SERVICE_NOTIFY_PAUSED |
+                    SERVICE_NOTIFY_CONTINUE_PENDING |
+                    SERVICE_NOTIFY_PAUSE_PENDING,
+                    &NotifyBuffer));
+                bNotifySupported = bNotifyPending;
+            }
+
+            if (bNotifyPending)
+            {
+                // 以可警告状态等待，以便执行服务状态改变通知的回调
+                ULONGLONG nDeadline = nCurrentTick + nWaitTime;
+                while (!bNotified)
+                {
+                    nCurrentTick = GetTickCount64();
+                    if (nCurrentTick >= nDeadline)
+                    {
+                        break;
+                    }
+
+                    SleepEx(static_cast<DWORD>(nDeadline - nCurrentTick), TRUE);
+                }
+
+                if (bNotified)
+                {
+                    bNotifyPending = false;
+                }
+            }
+            else
+            {
+                // 系统不支持服务状态改变通知，回退到轮询
+                SleepEx(250, FALSE);
+            }
+        }
+        else
+        {
+            bSucceed = true;
+            break;
+        }
+    }
+
+    StageScope.SetResult(bSucceed);
+
+    // 如果服务启动失败则清空状态信息
+    if (!bSucceed)
+        memset(lpServiceStatus, 0, sizeof(SERVICE_STATUS_PROCESS));
+
+FuncEnd:
+
+    if (bNotifyPending)
+    {
+        // 关闭服务句柄以取消通知，然后执行可能已经排队的回调，以免回调在函数
+        // 返回后访问已经失效的缓冲区
+        DWORD dwLastError = GetLastError();
+        hService.Close();
+        SleepEx(0, TRUE);
+        SetLastError(dwLastError);
+    }
+
+    return bSucceed;
+}
+
+/*
+NSudoGetCurrentProcessSessionID获取当前进程的会话ID。
+The NSudoGetCurrentProcessSessionID function obtains the Session ID of the
+current process.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoGetCurrentProcessSessionID(
+    _Out_ PDWORD SessionID)
+{
+    BOOL result = FALSE;
+    M2::CHandle hToken;
+    DWORD ReturnLength = 0;
+
+    result = OpenProcessToken(
+        GetCurrentProcess(),
+        MAXIMUM_ALLOWED,
+        &hToken);
+    if (result)
+    {
+        result = GetTokenInformation(
+            hToken,
+            TokenSessionId,
+            SessionID,
+            sizeof(DWORD),
+            &ReturnLength);
+    }
+
+    return result;
+}
+
+/*
+NSudoSetTokenPrivilege函数启用或禁用指定的访问令牌的指定特权。启用或禁用一
+个访问令牌的特权需要TOKEN_ADJUST_PRIVILEGES访问权限。
+The NSudoSetTokenPrivilege function enables or disables the specified
+privilege in the specified access token. Enabling or disabling privileges
+in an access token requires TOKEN_ADJUST_PRIVILEGES access.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoSetTokenPrivilege(
+    _In_ HANDLE hExistingToken,
+    _In_ TOKEN_PRIVILEGES_LIST Privilege,
+    _In_ bool bEnable)
+{
+    TOKEN_PRIVILEGES TP;
+
+    TP.PrivilegeCount = 1;
+    TP.Privileges[0].Luid.LowPart = Privilege;
+    TP.Privileges[0].Attributes = (DWORD)(bEnable ? SE_PRIVILEGE_ENABLED : 0);
+
+    // 设置进程特权
+    AdjustTokenPrivileges(hExistingToken, FALSE, &TP, 0, nullptr, nullptr);
+    return (GetLastError() == ERROR_SUCCESS);
+}
+
+// 有Count个子授权的SID，内存布局与SID相同，用于无需分配内存的常用SID
+// The SID with Count sub-authorities, which has the same memory layout as SID.
+// It is used for the well-known SIDs which do not need to be allocated.
+template<BYTE Count>
+struct NSUDO_STATIC_SID
+{
+    BYTE Revision;
+    BYTE SubAuthorityCount;
+    SID_IDENTIFIER_AUTHORITY IdentifierAuthority;
+    DWORD SubAuthority[Count];
+};
+
+// BUILTIN\Administrators (S-1-5-32-544)
+NSUDO_STATIC_SID<2> g_NSudoAdministratorsSid =
+{
+    SID_REVISION,
+    2,
+    SECURITY_NT_AUTHORITY,
+    { SECURITY_BUILTIN_DOMAIN_RID, DOMAIN_ALIAS_RID_ADMINS }
+};
+
+/*
+CNSudoTokenBuilder类一次应用对访问令牌的所有调整（会话、特权和完整性级别）。令牌
+信息直接查询到可复用的小缓冲区中，只有缓冲区不足时才获取大小并分配堆内存，所以
+大多数情况下每种信息只调用一次GetTokenInformation。常用的SID是无需分配的常量。
+The CNSudoTokenBuilder class applies all adjustments of an access token (the
+session, the privileges and the integrity level) in one pass. The token
+information is queried into a reusable small buffer directly, and the size is
+obtained and the heap memory is allocated only if the buffer is not large
+enough, so GetTokenInformation is called only once for each information class
+in most cases. The well-known SIDs are constants which are not allocated.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+class CNSudoTokenBuilder : M2::CDisableObjectCopying
+{
+private:
+    // 大多数令牌信息（例如SYSTEM令牌的特权列表）都能放入这个缓冲区
+    alignas(8) BYTE m_Arena[2048];
+    size_t m_ArenaUsed = 0;
+
+    // m_Arena不足时分配的堆内存，在Reset或者析构时释放
+    std::vector<PVOID> m_HeapBlocks;
+
+    static size_t AlignSize(
+        _In_ size_t Size)
+    {
+        return (Size + 7) & ~static_cast<size_t>(7);
+    }
+
+    // 获取令牌拥有的特权的位掩码，第N位对应LUID为N的特权
+    static ULONGLONG GetPrivilegeMask(
+        _In_ PTOKEN_PRIVILEGES Privileges)
+    {
+        ULONGLONG Mask = 0;
+
+        for (DWORD i = 0; i < Privileges->PrivilegeCount; ++i)
+        {
+            const LUID& Luid = Privileges->Privileges[i].Luid;
+            if (0 == Luid.HighPart && Luid.LowPart < 64)
+            {
+                Mask |= 1ULL << Luid.LowPart;
+            }
+        }
+
+        return Mask;
+    }
+
+public:
+    ~CNSudoTokenBuilder()
+    {
+        this->Reset();
+    }
+
+    // 释放分配的所有缓冲区，之前返回的指针随之失效
+    void Reset()
+    {
+        this->m_ArenaUsed = 0;
+
+        for (PVOID Block : this->m_HeapBlocks)
+        {
+            free(Block);
+        }
+        this->m_HeapBlocks.clear();
+    }
+
+    // 分配按8字节对齐的缓冲区，m_Arena不足时分配堆内存
+    PVOID Allocate(
+        _In_ size_t Size)
+    {
+        size_t AlignedSize = CNSudoTokenBuilder::AlignSize(Size);
+
+        if (AlignedSize <= sizeof(this->m_Arena) - this->m_ArenaUsed)
+        {
+            PVOID Block = this->m_Arena + this->m_ArenaUsed;
+            this->m_ArenaUsed += AlignedSize;
+            return Block;
+        }
+
+        PVOID Block = malloc(Size);
+        if (!Block)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return nullptr;
+        }
+
+        this->m_HeapBlocks.push_back(Block);
+
+        return Block;
+    }
+
+    // 查询令牌信息，先直接查询到m_Arena的剩余空间，不足时再分配需要的大小
+    PVOID QueryInformation(
+        _In_ HANDLE TokenHandle,
+        _In_ TOKEN_INFORMATION_CLASS TokenInformationClass)
+    {
+        PVOID Buffer = this->m_Arena + this->m_ArenaUsed;
+        DWORD Length = 0;
+
+        if (GetTokenInformation(
+            TokenHandle,
+            TokenInformationClass,
+            Buffer,
+            static_cast<DWORD>(sizeof(this->m_Arena) - this->m_ArenaUsed),
+            &Length))
+        {
+            this->m_ArenaUsed += CNSudoTokenBuilder::AlignSize(Length);
+            return Buffer;
+        }
+
+        if (ERROR_INSUFFICIENT_BUFFER != GetLastError())
+        {
+            return nullptr;
+        }
+
+        Buffer = this->Allocate(Length);
+        if (!Buffer ||
+            !GetTokenInformation(
+                TokenHandle,
+                TokenInformationClass,
+                Buffer,
+                Length,
+                &Length))
+        {
+            return nullptr;
+        }
+
+        return Buffer;
+    }
+
+    // 设置令牌的完整性标签。S-1-16-RID只有一个子授权，所以直接在栈上构造
+    static BOOL SetIntegrityLevel(
+        _In_ HANDLE TokenHandle,
+        _In_ DWORD IntegrityLevel)
+    {
+        NSUDO_STATIC_SID<1> Sid =
+        {
+            SID_REVISION,
+            1,
+            SECURITY_MANDATORY_LABEL_AUTHORITY,
+            { IntegrityLevel }
+        };
+
+        TOKEN_MANDATORY_LABEL TML;
+        TML.Label.Attributes = SE_GROUP_INTEGRITY;
+        TML.Label.Sid = &Sid;
+
+        return SetTokenInformation(
+            TokenHandle, TokenIntegrityLevel, &TML, sizeof(TML));
+    }
+
+    // 启用或禁用令牌的特权。只按名称调整时直接构造特权列表，无需查询令牌
+    BOOL AdjustPrivileges(
+        _In_ HANDLE TokenHandle,
+        _In_ NSudoOptionPrivilegesValue PrivilegesMode,
+        _In_ ULONGLONG EnablePrivileges,
+        _In_ ULONGLONG DisablePrivileges)
+    {
+        PTOKEN_PRIVILEGES Privileges = nullptr;
+
+        if (NSudoOptionPrivilegesValue::Default != PrivilegesMode)
+        {
+            Privileges = reinterpret_cast<PTOKEN_PRIVILEGES>(
+                this->QueryInformation(TokenHandle, TokenPrivileges));
+            if (!Privileges)
+            {
+                return FALSE;
+            }
+
+            if (EnablePrivileges & ~CNSudoTokenBuilder::GetPrivilegeMask(
+                Privileges))
+            {
+                SetLastError(ERROR_NOT_ALL_ASSIGNED);
+                return FALSE;
+            }
+
+            for (DWORD i = 0; i < Privileges->PrivilegeCount; ++i)
+            {
+                LUID_AND_ATTRIBUTES& Privilege = Privileges->Privileges[i];
+
+                ULONGLONG Mask = 0;
+                if (0 == Privilege.Luid.HighPart &&
+                    Privilege.Luid.LowPart < 64)
+                {
+                    Mask = 1ULL << Privilege.Luid.LowPart;
+                }
+
+                bool Enable =
+                    NSudoOptionPrivilegesValue::EnableAllPrivileges ==
+                    PrivilegesMode;
+                if (EnablePrivileges & Mask)
+                {
+                    Enable = true;
+                }
+                else if (DisablePrivileges & Mask)
+                {
+                    Enable = false;
+                }
+
+                Privilege.Attributes = Enable ? SE_PRIVILEGE_ENABLED : 0;
+            }
+        }
+        else if (EnablePrivileges | DisablePrivileges)
+        {
+            ULONGLONG Mask = EnablePrivileges | DisablePrivileges;
+
+            DWORD Count = 0;
+            for (ULONGLONG Rest = Mask; Rest; Rest &= Rest - 1)
+            {
+                ++Count;
+            }
+
+            Privileges = reinterpret_cast<PTOKEN_PRIVILEGES>(this->Allocate(
+                FIELD_OFFSET(TOKEN_PRIVILEGES, Privileges) +
+                Count * sizeof(LUID_AND_ATTRIBUTES)));
+            if (!Privileges)
+            {
+                return FALSE;
+            }
+
+            Privileges->PrivilegeCount = 0;
+            for (DWORD Value = 0; Value < 64; ++Value)
+            {
+                if (0 == (Mask & (1ULL << Value)))
+                {
+                    continue;
+                }
+
+                LUID_AND_ATTRIBUTES& Privilege =
+                    Privileges->Privileges[Privileges->PrivilegeCount++];
+                Privilege.Luid.LowPart = Value;
+                Privilege.Luid.HighPart = 0;
+                Privilege.Attributes =
+                    (EnablePrivileges & (1ULL << Value))
+                    ? SE_PRIVILEGE_ENABLED
+                    : 0;
+            }
+        }
+        else
+        {
+            return TRUE;
+        }
+
+        AdjustTokenPrivileges(TokenHandle, FALSE, Privileges, 0, nullptr, nullptr);
+        if (ERROR_NOT_ALL_ASSIGNED == GetLastError() &&
+            NSudoOptionPrivilegesValue::Default == PrivilegesMode)
+        {
+            // 禁用令牌没有的特权不算失败，只有令牌没有要启用的特权时才失败
+            PTOKEN_PRIVILEGES HeldPrivileges =
+                reinterpret_cast<PTOKEN_PRIVILEGES>(
+                    this->QueryInformation(TokenHandle, TokenPrivileges));
+            if (!HeldPrivileges)
+            {
+                return FALSE;
+            }
+
+            if (EnablePrivileges & ~CNSudoTokenBuilder::GetPrivilegeMask(
+                HeldPrivileges))
+            {
+                SetLastError(ERROR_NOT_ALL_ASSIGNED);
+                return FALSE;
+            }
+
+            SetLastError(ERROR_SUCCESS);
+        }
+
+        return (GetLastError() == ERROR_SUCCESS);
+    }
+
+    // 一次应用对令牌的所有调整
+    BOOL Apply(
+        _In_ HANDLE TokenHandle,
+        _In_ const NSUDO_TOKEN_ADJUSTMENTS& Adjustments)
+    {
+        this->Reset();
+
+        if (static_cast<DWORD>(-1) != Adjustments.SessionId)
+        {
+            DWORD SessionId = Adjustments.SessionId;
+            if (!SetTokenInformation(
+                TokenHandle,
+                TokenSessionId,
+                &SessionId,
+                sizeof(DWORD)))
+            {
+                return FALSE;
+            }
+        }
+
+        if (!this->AdjustPrivileges(
+            TokenHandle,
+            Adjustments.PrivilegesMode,
+            Adjustments.EnablePrivileges,
+            Adjustments.DisablePrivileges))
+        {
+            return FALSE;
+        }
+
+        DWORD IntegrityLevel = 0;
+        switch (Adjustments.IntegrityLevelMode)
+        {
+        case NSudoOptionIntegrityLevelValue::System:
+            IntegrityLevel = SystemLevel;
+            break;
+        case NSudoOptionIntegrityLevelValue::High:
+            IntegrityLevel = HighLevel;
+            break;
+        case NSudoOptionIntegrityLevelValue::Medium:
+            IntegrityLevel = MediumLevel;
+            break;
+        case NSudoOptionIntegrityLevelValue::Low:
+            IntegrityLevel = LowLevel;
+            break;
+        default:
+            return TRUE;
+        }
+
+        return CNSudoTokenBuilder::SetIntegrityLevel(
+            TokenHandle, IntegrityLevel);
+    }
+
+    // 从一个现有的访问令牌创建一个新的LUA访问令牌
+    BOOL CreateLUAToken(
+        _Out_ PHANDLE TokenHandle,
+        _In_ HANDLE ExistingTokenHandle)
+    {
+        this->Reset();
+
+        M2::CHandle hToken;
+
+        // 创建受限令牌并设置令牌完整性
+        if (!CreateRestrictedToken(
+            ExistingTokenHandle,
+            LUA_TOKEN,
+            0, nullptr,
+            0, nullptr,
+            0, nullptr,
+            &hToken) ||
+            !CNSudoTokenBuilder::SetIntegrityLevel(hToken, MediumLevel))
+        {
+            return FALSE;
+        }
+
+        // 设置令牌Owner为当前用户
+        PTOKEN_USER pTokenUser = reinterpret_cast<PTOKEN_USER>(
+            this->QueryInformation(hToken, TokenUser));
+        if (!pTokenUser)
+        {
+            return FALSE;
+        }
+
+        TOKEN_OWNER Owner;
+        Owner.Owner = pTokenUser->User.Sid;
+        if (!SetTokenInformation(
+            hToken, TokenOwner, &Owner, sizeof(TOKEN_OWNER)))
+        {
+            return FALSE;
+        }
+
+        PTOKEN_DEFAULT_DACL pTokenDacl = reinterpret_cast<PTOKEN_DEFAULT_DACL>(
+            this->QueryInformation(hToken, TokenDefaultDacl));
+        if (!pTokenDacl)
+        {
+            return FALSE;
+        }
+
+        // 新的默认DACL允许当前用户完全控制，并包含原DACL中除管理员组以外的ACE
+        PACL DefaultDacl = pTokenDacl->DefaultDacl;
+
+        DWORD Length = DefaultDacl->AclSize;
+        Length += GetLengthSid(pTokenUser->User.Sid);
+        Length += sizeof(ACCESS_ALLOWED_ACE);
+
+        TOKEN_DEFAULT_DACL NewTokenDacl;
+        NewTokenDacl.DefaultDacl = reinterpret_cast<PACL>(
+            this->Allocate(Length));
+        if (!NewTokenDacl.DefaultDacl ||
+            !InitializeAcl(
+                NewTokenDacl.DefaultDacl,
+                Length,
+                DefaultDacl->AclRevision) ||
+            !AddAccessAllowedAce(
+                NewTokenDacl.DefaultDacl,
+                DefaultDacl->AclRevision,
+                GENERIC_ALL,
+                pTokenUser->User.Sid))
+        {
+            return FALSE;
+        }
+
+        PACCESS_ALLOWED_ACE pTempAce = nullptr;
+        for (ULONG i = 0; GetAce(DefaultDacl, i, (PVOID*)&pTempAce); ++i)
+        {
+            if (EqualSid(&g_NSudoAdministratorsSid, &pTempAce->SidStart))
+            {
+                continue;
+            }
+
+            AddAce(
+                NewTokenDacl.DefaultDacl,
+                DefaultDacl->AclRevision,
+                0,
+                pTempAce,
+                pTempAce->Header.AceSize);
+        }
+
+        // 设置令牌DACL并开启LUA虚拟化
+        BOOL EnableTokenVirtualization = TRUE;
+        if (!SetTokenInformation(
+            hToken,
+            TokenDefaultDacl,
+            &NewTokenDacl,
+            Length + sizeof(TOKEN_DEFAULT_DACL)) ||
+            !SetTokenInformation(
+                hToken,
+                TokenVirtualizationEnabled,
+                &EnableTokenVirtualization,
+                sizeof(BOOL)))
+        {
+            return FALSE;
+        }
+
+        *TokenHandle = hToken.Detach();
+
+        return TRUE;
+    }
+};
+
+/*
+NSudoSetTokenAllPrivileges函数启用或禁用指定的访问令牌的所有特权。启用或禁
+用一个访问令牌的特权需要TOKEN_ADJUST_PRIVILEGES访问权限。
+The NSudoSetTokenAllPrivileges function enables or disables all privileges
+in the specified access token. Enabling or disabling privileges in an
+access token requires TOKEN_ADJUST_PRIVILEGES access.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoSetTokenAllPrivileges(
+    _In_ HANDLE hExistingToken,
+    _In_ bool bEnable)
+{
+    CNSudoTokenBuilder Builder;
+
+    return Builder.AdjustPrivileges(
+        hExistingToken,
+        bEnable
+        ? NSudoOptionPrivilegesValue::EnableAllPrivileges
+        : NSudoOptionPrivilegesValue::DisableAllPrivileges,
+        0,
+        0);
+}
+
+/*
+NSudoSetTokenIntegrityLevel函数为指定的访问令牌设置完整性标签。
+The NSudoSetTokenIntegrityLevel function sets the integrity level for the
+specified access token.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoSetTokenIntegrityLevel(
+    _In_ HANDLE TokenHandle,
+    _In_ TOKEN_INTEGRITY_LEVELS_LIST IL)
+{
+    return CNSudoTokenBuilder::SetIntegrityLevel(TokenHandle, IL);
+}
+
+/*
+NSudoCreateLUAToken函数从一个现有的访问令牌创建一个新的LUA访问令牌。
+The NSudoCreateLUAToken function creates a new LUA access token from an
+existing access token.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoCreateLUAToken(
+    _Out_ PHANDLE TokenHandle,
+    _In_ HANDLE ExistingTokenHandle)
+{
+    CNSudoTokenBuilder Builder;
+
+    return Builder.CreateLUAToken(TokenHandle, ExistingTokenHandle);
+}
+
+/*
+NSudoDuplicateProcessToken函数根据进程ID获取一个进程令牌的副本。
+The NSudoDuplicateProcessToken function obtains a copy of process token via
+Process ID.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoDuplicateProcessToken(
+    _In_ DWORD dwProcessID,
+    _In_ DWORD dwDesiredAccess,
+    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
+    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+    _In_ TOKEN_TYPE TokenType,
+    _Outptr_ PHANDLE phToken)
+{
+    BOOL result = FALSE;
+
+    M2::CHandle hProcess;
+    M2::CHandle hToken;
+
+    // 打开进程对象
+    hProcess = OpenProcess(MAXIMUM_ALLOWED, FALSE, dwProcessID);
+    if (hProcess)
+    {
+        // 打开进程令牌
+        result = OpenProcessToken(hProcess, MAXIMUM_ALLOWED, &hToken);
+        if (result)
+        {
+            // 复制令牌
+            result = DuplicateTokenEx(
+                hToken,
+                dwDesiredAccess,
+                lpTokenAttributes,
+                ImpersonationLevel,
+                TokenType,
+                phToken);
+        }
+    }
+
+    return result;
+}
+
+// The cached information of the winlogon process.
+typedef struct _NSUDO_WINLOGON_PROCESS_INFO
+{
+    DWORD ProcessID;
+    FILETIME CreationTime;
+} NSUDO_WINLOGON_PROCESS_INFO, *PNSUDO_WINLOGON_PROCESS_INFO;
+
+/*
+CNSudoWinLogonProcessCache类按会话缓存winlogon进程的PID和创建时间。使用缓存前
+会比较进程创建时间，以检测PID是否已被其他进程复用。
+The CNSudoWinLogonProcessCache class caches the PID and creation time of the
+winlogon process per session. The process creation time is compared before
+using the cache for detecting whether the PID has been reused by another
+process.
+*/
+class CNSudoWinLogonProcessCache
+{
+private:
+    M2::CCriticalSection m_CriticalSection;
+    std::map<DWORD, NSUDO_WINLOGON_PROCESS_INFO> m_ProcessInfos;
+
+    static BOOL GetProcessCreationTime(
+        _In_ HANDLE hProcess,
+        _Out_ PFILETIME lpCreationTime)
+    {
+        FILETIME ExitTime, KernelTime, UserTime;
+
+        return GetProcessTimes(
+            hProcess,
+            lpCreationTime,
+            &ExitTime,
+            &KernelTime,
+            &UserTime);
+    }
+
+    static DWORD FindProcess(
+        _In_ PWTS_PROCESS_INFOW pProcesses,
+        _In_ DWORD dwProcessCount,
+        _In_ DWORD dwSessionID)
+    {
+        for (DWORD i = 0; i < dwProcessCount; ++i)
+        {
+            PWTS_PROCESS_INFOW pProcess = &pProcesses[i];
+
+            if (pProcess->SessionId != dwSessionID) continue;
+            if (pProcess->pProcessName == nullptr) continue;
+
+            if (_wcsicmp(L"winlogon.exe", pProcess->pProcessName) == 0)
+            {
+                return pProcess->ProcessId;
+            }
+        }
+
+        return (DWORD)-1;
+    }
+
+    // 遍历指定会话的进程寻找winlogon进程并获取PID
+    static DWORD QueryProcessID(
+        _In_ DWORD dwSessionID)
+    {
+        DWORD dwWinLogonPID = (DWORD)-1;
+
+        decltype(WTSEnumerateProcessesExW)* pWTSEnumerateProcessesExW = nullptr;
+        decltype(WTSFreeMemoryExW)* pWTSFreeMemoryExW = nullptr;
+
+        // WtsApi32.dll是延迟加载的，此时可能还没有被加载，所以不能使用
+        // GetModuleHandleW。加载失败时（例如不支持LOAD_LIBRARY_SEARCH_SYSTEM32
+        // 的系统）使用WTSEnumerateProcessesW
+        static HMODULE hModule = LoadLibraryExW(
+            L"WtsApi32.dll",
+            nullptr,
+            LOAD_LIBRARY_SEARCH_SYSTEM32);
+
+        // WTSEnumerateProcessesExW仅枚举指定会话的进程，但是仅在Windows 7及之
+        // 后版本可用
+        if (hModule &&
+            SUCCEEDED(M2GetProcAddress(
+                pWTSEnumerateProcessesExW,
+                hModule,
+                "WTSEnumerateProcessesExW")) &&
+            SUCCEEDED(M2GetProcAddress(
+                pWTSFreeMemoryExW,
+                hModule,
+                "WTSFreeMemoryExW")))
+        {
+            DWORD dwLevel = 0;
+            PWTS_PROCESS_INFOW pProcesses = nullptr;
+            DWORD dwProcessCount = 0;
+
+            if (pWTSEnumerateProcessesExW(
+                WTS_CURRENT_SERVER_HANDLE,
+                &dwLevel,
+                dwSessionID,
+                reinterpret_cast<LPWSTR*>(&pProcesses),
+                &dwProcessCount))
+            {
+                dwWinLogonPID = FindProcess(
+                    pProcesses, dwProcessCount, dwSessionID);
+
+                pWTSFreeMemoryExW(
+                    WTSTypeProcessInfoLevel0,
+                    pProcesses,
+                    dwProcessCount);
+            }
+        }
+        else
+        {
+            M2::CWTSMemory<PWTS_PROCESS_INFOW> pProcesses;
+            DWORD dwProcessCount = 0;
+
+            if (WTSEnumerateProcessesW(
+                WTS_CURRENT_SERVER_HANDLE,
+                0,
+                1,
+                &pProcesses,
+                &dwProcessCount))
+            {
+                dwWinLogonPID = FindProcess(
+                    pProcesses, dwProcessCount, dwSessionID);
+            }
+        }
+
+        return dwWinLogonPID;
+    }
+
+public:
+    /*
+    OpenProcess函数打开指定会话的winlogon进程。
+    The OpenProcess function opens the winlogon process of the specified
+    session.
+
+    如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+    If the function fails, the return value is NULL. To get extended error
+    information, call GetLastError.
+    */
+    BOOL OpenProcess(
+        _In_ DWORD dwSessionID,
+        _In_ DWORD dwDesiredAccess,
+        _Outptr_ PHANDLE phProcess)
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        FILETIME CreationTime;
+
+        auto iterator = this->m_ProcessInfos.find(dwSessionID);
+        if (iterator != this->m_ProcessInfos.end())
+        {
+            HANDLE hProcess = ::OpenProcess(
+                dwDesiredAccess, FALSE, iterator->second.ProcessID);
+            if (hProcess)
+            {
+                // 如果创建时间一致，则该PID没有被其他进程复用
+                if (GetProcessCreationTime(hProcess, &CreationTime) &&
+                    0 == CompareFileTime(
+                        &CreationTime, &iterator->second.CreationTime))
+                {
+                    *phProcess = hProcess;
+                    return TRUE;
+                }
+
+                CloseHandle(hProcess);
+            }
+
+            this->m_ProcessInfos.erase(iterator);
+        }
+
+        DWORD dwWinLogonPID = QueryProcessID(dwSessionID);
+
+        // 如果没找到进程，则返回错误
+        if (dwWinLogonPID == (DWORD)-1)
+        {
+            SetLastError(ERROR_NOT_FOUND);
+            return FALSE;
+        }
+
+        HANDLE hProcess = ::OpenProcess(dwDesiredAccess, FALSE, dwWinLogonPID);
+        if (!hProcess)
+        {
+            return FALSE;
+        }
+
+        if (GetProcessCreationTime(hProcess, &CreationTime))
+        {
+            NSUDO_WINLOGON_PROCESS_INFO& ProcessInfo =
+                this->m_ProcessInfos[dwSessionID];
+
+            ProcessInfo.ProcessID = dwWinLogonPID;
+            ProcessInfo.CreationTime = CreationTime;
+        }
+
+        *phProcess = hProcess;
+        return TRUE;
+    }
+};
+
+// 在第一次使用时构造，使加载NSudoAPI.dll时不执行任何初始化
+static CNSudoWinLogonProcessCache& NSudoGetWinLogonProcessCache()
+{
+    static CNSudoWinLogonProcessCache WinLogonProcessCache;
+    return WinLogonProcessCache;
+}
+
+/*
+NSudoOpenWinLogonProcess函数打开指定会话的winlogon进程，进程的PID按会话缓存。
+The NSudoOpenWinLogonProcess function opens the winlogon process of the
+specified session, and the PID of the process is cached per session.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoOpenWinLogonProcess(
+    _In_ DWORD dwSessionID,
+    _In_ DWORD dwDesiredAccess,
+    _Outptr_ PHANDLE phProcess)
+{
+    return NSudoGetWinLogonProcessCache().OpenProcess(
+        dwSessionID, dwDesiredAccess, phProcess);
+}
+
+/*
+NSudoDuplicateSystemToken函数获取一个当前会话SYSTEM用户令牌的副本。
+The NSudoDuplicateSystemToken function obtains a copy of current session
+SYSTEM user token.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoDuplicateSystemToken(
+    _In_ DWORD dwDesiredAccess,
+    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
+    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+    _In_ TOKEN_TYPE TokenType,
+    _Outptr_ PHANDLE phToken)
+{
+    BOOL result = FALSE;
+    DWORD dwSessionID = (DWORD)-1;
+    M2::CHandle hProcess;
+    M2::CHandle hToken;
+
+    do
+    {
+        // 获取当前进程令牌会话ID
+        result = NSudoGetCurrentProcessSessionID(&dwSessionID);
+        if (!result) break;
+
+        // 打开当前会话的winlogon进程
+        result = NSudoOpenWinLogonProcess(
+            dwSessionID, MAXIMUM_ALLOWED, &hProcess);
+        if (!result) break;
+
+        // 打开进程令牌
+        result = OpenProcessToken(hProcess, MAXIMUM_ALLOWED, &hToken);
+        if (!result) break;
+
+        // 复制令牌
+        result = DuplicateTokenEx(
+            hToken,
+            dwDesiredAccess,
+            lpTokenAttributes,
+            ImpersonationLevel,
+            TokenType,
+            phToken);
+
+    } while (false);
+
+    return result;
+}
+
+/*
+NSudoDuplicateServiceToken函数根据服务名获取一个服务进程令牌的副本。
+The NSudoDuplicateServiceToken function obtains a copy of service process
+token via service name.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoDuplicateServiceToken(
+    _In_ LPCWSTR lpServiceName,
+    _In_ DWORD dwDesiredAccess,
+    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
+    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+    _In_ TOKEN_TYPE TokenType,
+    _Outptr_ PHANDLE phToken)
+{
+    BOOL result = FALSE;
+    SERVICE_STATUS_PROCESS ssStatus;
+
+    // 启动服务
+    result = NSudoStartService(lpServiceName, &ssStatus);
+    if (result)
+    {
+        // 复制进程令牌
+        result = NSudoDuplicateProcessToken(
+            ssStatus.dwProcessId,
+            dwDesiredAccess,
+            lpTokenAttributes,
+            ImpersonationLevel,
+            TokenType,
+            phToken);
+    }
+
+    return result;
+}
+
+/*
+NSudoDuplicateSessionToken函数根据会话ID获取一个服务进程令牌的副本。
+The NSudoDuplicateSessionToken function obtains a copy of Session token via
+Session ID.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoDuplicateSessionToken(
+    _In_ DWORD dwSessionID,
+    _In_ DWORD dwDesiredAccess,
+    _In_opt_ LPSECURITY_ATTRIBUTES lpTokenAttributes,
+    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+    _In_ TOKEN_TYPE TokenType,
+    _Outptr_ PHANDLE phToken)
+{
+    BOOL result = FALSE;
+    M2::CHandle hToken;
+
+    // 打开会话令牌
+    result = WTSQueryUserToken(dwSessionID, &hToken);
+    if (result)
+    {
+        // 复制令牌
+        result = DuplicateTokenEx(
+            hToken,
+            dwDesiredAccess,
+            lpTokenAttributes,
+            ImpersonationLevel,
+            TokenType,
+            phToken);
+    }
+
+    return result;
+}
+
+/*
+NSudoImpersonateAsSystem函数给当前线程分配一个SYSTEM用户模拟令牌。该函数还
+可以使当前线程停止使用模拟令牌。
+The NSudoImpersonateAsSystem function assigns an SYSTEM user impersonation
+token to the current thread. The function can also cause the current thread
+to stop using an impersonation token.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL WINAPI NSudoImpersonateAsSystem()
+{
+    BOOL result = FALSE;
+    M2::CHandle hToken;
+
+    // 获取当前会话SYSTEM用户令牌副本
+    result = NSudoDuplicateSystemToken(
+        MAXIMUM_ALLOWED,
+        nullptr,
+        SecurityImpersonation,
+        TokenImpersonation,
+        &hToken);
+    if (result)
+    {
+        // 启用令牌全部特权
+        result = NSudoSetTokenAllPrivileges(hToken, true);
+        if (result)
+        {
+            // 模拟令牌
+            result = SetThreadToken(nullptr, hToken);
+        }
+    }
+
+    return result;
+}
+
+/*
+CNSudoTokenCache类缓存SYSTEM模拟令牌、SYSTEM和TrustedInstaller主令牌以及
+TrustedInstaller服务进程句柄，以便多次创建进程时复用。缓存的令牌失效时会被重新获
+取。
+The CNSudoTokenCache class caches the SYSTEM impersonation token, the SYSTEM
+primary token, the TrustedInstaller primary token and the handle of the
+TrustedInstaller service process for reusing them in multiple process
+creations. The cached token will be acquired again when it becomes invalid.
+
+该类的所有成员函数都返回缓存令牌的副本，调用者可以随意修改返回的令牌。
+All member functions of this class return a copy of the cached token, so the
+caller can modify the returned token freely.
+*/
+BOOL CNSudoTokenCache::AcquireSystemToken(
+    _Outptr_ PHANDLE phToken)
+{
+    return NSudoDuplicateSystemToken(
+        MAXIMUM_ALLOWED,
+        nullptr,
+        SecurityIdentification,
+        TokenPrimary,
+        phToken);
+}
+
+template<typename TAcquireFunction>
+BOOL CNSudoTokenCache::DuplicateCachedToken(
+    _Inout_ M2::CHandle& CachedToken,
+    _In_ TAcquireFunction&& AcquireFunction,
+    _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+    _In_ TOKEN_TYPE TokenType,
+    _Outptr_ PHANDLE phToken)
+{
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        if (!CachedToken.IsInvalid())
+        {
+            if (DuplicateTokenEx(
+                CachedToken,
+                MAXIMUM_ALLOWED,
+                nullptr,
+                ImpersonationLevel,
+                TokenType,
+                phToken))
+            {
+                return TRUE;
+            }
+
+            // 缓存的令牌已不可用，重新获取
+            CachedToken.Close();
+        }
+    }
+
+    // 获取令牌时可能需要等待服务启动，所以不持有锁，以免阻塞使用其他缓存
+    // 令牌的线程
+    HANDLE hToken = INVALID_HANDLE_VALUE;
+    if (!AcquireFunction(&hToken))
+    {
+        return FALSE;
+    }
+
+    M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+    CachedToken = hToken;
+
+    return DuplicateTokenEx(
+        CachedToken,
+        MAXIMUM_ALLOWED,
+        nullptr,
+        ImpersonationLevel,
+        TokenType,
+        phToken);
+}
+
+/*
+ImpersonateAsSystem函数给当前线程分配一个启用全部特权的SYSTEM用户模拟令
+牌。
+The ImpersonateAsSystem function assigns an SYSTEM user impersonation token
+with all privileges enabled to the current thread.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL CNSudoTokenCache::ImpersonateAsSystem()
+{
+    CNSudoStageScope StageScope(NSudoStage::ImpersonateAsSystem);
+
+    M2::CHandle hToken;
+
+    BOOL result = this->DuplicateCachedToken(
+        this->m_SystemImpersonationToken,
+        [this](PHANDLE phToken) -> BOOL
+        {
+            M2::CHandle hSystemToken;
+
+            // 模拟令牌和主令牌来自同一个SYSTEM令牌，以免重复查找winlogon
+            // 进程
+            if (!this->DuplicateCachedToken(
+                this->m_SystemToken,
+                CNSudoTokenCache::AcquireSystemToken,
+                SecurityImpersonation,
+                TokenImpersonation,
+                &hSystemToken))
+            {
+                return FALSE;
+            }
+
+            if (!NSudoSetTokenAllPrivileges(hSystemToken, true))
+            {
+                return FALSE;
+            }
+
+            *phToken = hSystemToken.Detach();
+            return TRUE;
+        },
+        SecurityImpersonation,
+        TokenImpersonation,
+        &hToken);
+    if (result)
+    {
+        result = SetThreadToken(nullptr, hToken);
+    }
+
+    StageScope.SetResult(result);
+
+    return result;
+}
+
+/*
+DuplicateSystemToken函数获取一个当前会话SYSTEM用户主令牌的副本。
+The DuplicateSystemToken function obtains a copy of current session SYSTEM
+user primary token.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL CNSudoTokenCache::DuplicateSystemToken(
+    _Outptr_ PHANDLE phToken)
+{
+    return this->DuplicateCachedToken(
+        this->m_SystemToken,
+        CNSudoTokenCache::AcquireSystemToken,
+        SecurityIdentification,
+        TokenPrimary,
+        phToken);
+}
+
+/*
+DuplicateTrustedInstallerToken函数获取一个TrustedInstaller主令牌的副本。
+调用该函数前当前线程必须模拟SYSTEM用户。
+The DuplicateTrustedInstallerToken function obtains a copy of the
+TrustedInstaller primary token. The current thread must impersonate the
+SYSTEM user before calling this function.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL CNSudoTokenCache::DuplicateTrustedInstallerToken(
+    _Outptr_ PHANDLE phToken)
+{
+    return this->DuplicateCachedToken(
+        this->m_TrustedInstallerToken,
+        [](PHANDLE phCachedToken) -> BOOL
+        {
+            return NSudoDuplicateServiceToken(
+                L"TrustedInstaller",
+                MAXIMUM_ALLOWED,
+                nullptr,
+                SecurityIdentification,
+                TokenPrimary,
+                phCachedToken);
+        },
+        SecurityIdentification,
+        TokenPrimary,
+        phToken);
+}
+
+/*
+OpenTrustedInstallerProcess函数获取一个TrustedInstaller服务进程句柄的副本，
+用于父进程引擎。调用该函数前当前线程必须模拟SYSTEM用户。
+The OpenTrustedInstallerProcess function obtains a copy of the handle of
+the TrustedInstaller service process for the parent process engine. The
+current thread must impersonate the SYSTEM user before calling this
+function.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL CNSudoTokenCache::OpenTrustedInstallerProcess(
+    _Outptr_ PHANDLE phProcess)
+{
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        // 服务空闲一段时间后会停止，此时需要重新启动服务
+        if (!this->m_TrustedInstallerProcess.IsInvalid())
+        {
+            if (WAIT_TIMEOUT == WaitForSingleObjectEx(
+                this->m_TrustedInstallerProcess, 0, FALSE))
+            {
+                return DuplicateHandle(
+                    GetCurrentProcess(),
+                    this->m_TrustedInstallerProcess,
+                    GetCurrentProcess(),
+                    phProcess,
+                    0,
+                    FALSE,
+                    DUPLICATE_SAME_ACCESS);
+            }
+
+            this->m_TrustedInstallerProcess.Close();
+        }
+    }
+
+    // 与RefreshTrustedInstaller相同，等待服务启动时不持有锁
+    SERVICE_STATUS_PROCESS ssStatus;
+    if (!NSudoStartService(L"TrustedInstaller", &ssStatus))
+    {
+        return FALSE;
+    }
+
+    HANDLE hProcess = ::OpenProcess(
+        NSUDO_PARENT_PROCESS_ACCESS, FALSE, ssStatus.dwProcessId);
+    if (!hProcess)
+    {
+        return FALSE;
+    }
+
+    M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+    this->m_TrustedInstallerProcess = hProcess;
+
+    return DuplicateHandle(
+        GetCurrentProcess(),
+        this->m_TrustedInstallerProcess,
+        GetCurrentProcess(),
+        phProcess,
+        0,
+        FALSE,
+        DUPLICATE_SAME_ACCESS);
+}
+
+/*
+RefreshTrustedInstaller函数启动TrustedInstaller服务，并用新的服务进程替换缓
+存的TrustedInstaller令牌和进程句柄。等待服务启动时不持有锁，所以其他线程仍
+可使用之前缓存的令牌。调用该函数前当前线程必须模拟SYSTEM用户。
+The RefreshTrustedInstaller function starts the TrustedInstaller service,
+and replaces the cached TrustedInstaller token and process handle with the
+ones of the new service process. The lock is not held while waiting for
+the service to start, so other threads can still use the previously cached
+token. The current thread must impersonate the SYSTEM user before calling
+this function.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+BOOL CNSudoTokenCache::RefreshTrustedInstaller()
+{
+    SERVICE_STATUS_PROCESS ssStatus;
+    if (!NSudoStartService(L"TrustedInstaller", &ssStatus))
+    {
+        return FALSE;
+    }
+
+    M2::CHandle hToken;
+    if (!NSudoDuplicateProcessToken(
+        ssStatus.dwProcessId,
+        MAXIMUM_ALLOWED,
+        nullptr,
+        SecurityIdentification,
+        TokenPrimary,
+        &hToken))
+    {
+        return FALSE;
+    }
+
+    HANDLE hProcess = ::OpenProcess(
+        NSUDO_PARENT_PROCESS_ACCESS, FALSE, ssStatus.dwProcessId);
+    if (!hProcess)
+    {
+        return FALSE;
+    }
+
+    M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+    this->m_TrustedInstallerToken = hToken.Detach();
+    this->m_TrustedInstallerProcess = hProcess;
+
+    return TRUE;
+}
+
+/*
+Invalidate函数丢弃所有缓存的令牌。
+The Invalidate function discards all cached tokens.
+*/
+void CNSudoTokenCache::Invalidate()
+{
+    M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+    this->m_SystemImpersonationToken.Close();
+    this->m_SystemToken.Close();
+    this->m_TrustedInstallerToken.Close();
+    this->m_TrustedInstallerProcess.Close();
+}
+
+#include <Userenv.h>
+#pragma comment(lib, "Userenv.lib")
+
+#include <sddl.h>
+
+/*
+CNSudoEnvironmentCache类按令牌的登录会话缓存环境块。当系统或者用户的环境变量发
+生变化时，缓存的环境块会被丢弃。
+The CNSudoEnvironmentCache class caches the environment blocks per logon
+session of the token. The cached environment blocks are discarded when the
+system or user environment variables are changed.
+
+缓存需要监视环境变量的注册表项，只有多次创建进程的NSudo代理和批处理才值得这样做，
+所以缓存默认不启用，此时每次都直接创建环境块。
+The cache needs to watch the registry keys of the environment variables, which
+is only worth it for the NSudo broker and the batch mode which create many
+processes, so the cache is disabled by default and the environment block is
+created directly every time.
+*/
+class CNSudoEnvironmentCache
+{
+private:
+    M2::CCriticalSection m_CriticalSection;
+
+    // 令牌的登录会话ID和对应的环境块
+    std::map<ULONGLONG, std::wstring> m_EnvironmentBlocks;
+
+    M2::CHKey m_SystemEnvironmentKey;
+    M2::CHKey m_UserEnvironmentKey;
+    HANDLE m_ChangeEvent = nullptr;
+    bool m_Enabled = false;
+    bool m_Initialized = false;
+
+    static DWORD RegisterChangeNotification(
+        _In_ HKEY hKey,
+        _In_ HANDLE hEvent)
+    {
+        // REG_NOTIFY_THREAD_AGNOSTIC仅在Windows 8及之后版本可用，在此之前调用
+        // 线程退出时通知会被取消并触发事件，只会导致缓存被提前丢弃
+        DWORD dwError = RegNotifyChangeKeyValue(
+            hKey,
+            TRUE,
+            REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC,
+            hEvent,
+            TRUE);
+        if (ERROR_INVALID_PARAMETER == dwError)
+        {
+            dwError = RegNotifyChangeKeyValue(
+                hKey,
+                TRUE,
+                REG_NOTIFY_CHANGE_LAST_SET,
+                hEvent,
+                TRUE);
+        }
+
+        return dwError;
+    }
+
+    // 注册环境变量的更改通知，失败时不使用缓存
+    bool RegisterChangeNotifications()
+    {
+        if (ERROR_SUCCESS != CNSudoEnvironmentCache::RegisterChangeNotification(
+            this->m_SystemEnvironmentKey, this->m_ChangeEvent))
+        {
+            return false;
+        }
+
+        if (!this->m_UserEnvironmentKey.IsInvalid())
+        {
+            if (ERROR_SUCCESS != CNSudoEnvironmentCache::RegisterChangeNotification(
+                this->m_UserEnvironmentKey, this->m_ChangeEvent))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // 打开系统和令牌用户的环境变量注册表项
+    // 调用者可能正在模拟其他用户，所以不能使用HKEY_CURRENT_USER。
+    bool Initialize(
+        _In_ HANDLE hToken)
+    {
+        if (ERROR_SUCCESS != RegOpenKeyExW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Control\\Session Manager\\Environment",
+            0,
+            KEY_NOTIFY,
+            &this->m_SystemEnvironmentKey))
+        {
+            return false;
+        }
+
+        CNSudoTokenBuilder Builder;
+        PTOKEN_USER pTokenUser = reinterpret_cast<PTOKEN_USER>(
+            Builder.QueryInformation(hToken, TokenUser));
+        LPWSTR StringSid = nullptr;
+
+        if (pTokenUser &&
+            ConvertSidToStringSidW(pTokenUser->User.Sid, &StringSid))
+        {
+            std::wstring UserEnvironmentKeyPath = StringSid;
+            UserEnvironmentKeyPath += L"\\Environment";
+
+            LocalFree(StringSid);
+
+            // 用户配置文件可能未加载，此时只监视系统环境变量
+            RegOpenKeyExW(
+                HKEY_USERS,
+                UserEnvironmentKeyPath.c_str(),
+                0,
+                KEY_NOTIFY,
+                &this->m_UserEnvironmentKey);
+        }
+
+        this->m_ChangeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (!this->m_ChangeEvent)
+        {
+            return false;
+        }
+
+        return this->RegisterChangeNotifications();
+    }
+
+    static bool CreateEnvironmentBlockString(
+        _In_ HANDLE hToken,
+        _Out_ std::wstring& EnvironmentBlock)
+    {
+        LPVOID lpEnvironment = nullptr;
+
+        if (!CreateEnvironmentBlock(&lpEnvironment, hToken, TRUE))
+        {
+            return false;
+        }
+
+        // 环境块以两个连续的空字符结尾
+        const wchar_t* End = reinterpret_cast<const wchar_t*>(lpEnvironment);
+        while (End[0] || End[1])
+        {
+            ++End;
+        }
+
+        EnvironmentBlock.assign(
+            reinterpret_cast<const wchar_t*>(lpEnvironment),
+            End + 2);
+
+        DestroyEnvironmentBlock(lpEnvironment);
+
+        return true;
+    }
+
+public:
+    ~CNSudoEnvironmentCache()
+    {
+        if (this->m_ChangeEvent)
+        {
+            CloseHandle(this->m_ChangeEvent);
+        }
+    }
+
+    /*
+    Enable函数启用缓存，环境变量的注册表项在第一次获取环境块时开始被监视。
+    The Enable function enables the cache. The registry keys of the environment
+    variables start to be watched when the environment block is retrieved for
+    the first time.
+    */
+    void Enable()
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        this->m_Enabled = true;
+    }
+
+    /*
+    GetEnvironmentBlock函数获取指定令牌的环境块。
+    The GetEnvironmentBlock function retrieves the environment block of the
+    specified token.
+    */
+    bool GetEnvironmentBlock(
+        _In_ HANDLE hToken,
+        _Out_ std::wstring& EnvironmentBlock)
+    {
+        TOKEN_STATISTICS TokenStatistics;
+        DWORD ReturnLength = 0;
+
+        if (!GetTokenInformation(
+            hToken,
+            TokenStatistics,
+            &TokenStatistics,
+            sizeof(TOKEN_STATISTICS),
+            &ReturnLength))
+        {
+            return CNSudoEnvironmentCache::CreateEnvironmentBlockString(
+                hToken, EnvironmentBlock);
+        }
+
+        ULONGLONG AuthenticationId =
+            (static_cast<ULONGLONG>(
+                TokenStatistics.AuthenticationId.HighPart) << 32) |
+            TokenStatistics.AuthenticationId.LowPart;
+
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        if (!this->m_Enabled)
+        {
+            return CNSudoEnvironmentCache::CreateEnvironmentBlockString(
+                hToken, EnvironmentBlock);
+        }
+
+        if (!this->m_Initialized)
+        {
+            this->m_Initialized = true;
+
+            if (!this->Initialize(hToken))
+            {
+                if (this->m_ChangeEvent)
+                {
+                    CloseHandle(this->m_ChangeEvent);
+                    this->m_ChangeEvent = nullptr;
+                }
+            }
+        }
+
+        // 如果无法监视环境变量的更改，则不使用缓存
+        if (!this->m_ChangeEvent)
+        {
+            return CNSudoEnvironmentCache::CreateEnvironmentBlockString(
+                hToken, EnvironmentBlock);
+        }
+
+        // 环境变量已经更改，丢弃缓存并重新注册通知
+        if (WAIT_OBJECT_0 == WaitForSingleObjectEx(
+            this->m_ChangeEvent, 0, FALSE))
+        {
+            this->m_EnvironmentBlocks.clear();
+
+            if (!this->RegisterChangeNotifications())
+            {
+                CloseHandle(this->m_ChangeEvent);
+                this->m_ChangeEvent = nullptr;
+
+                return CNSudoEnvironmentCache::CreateEnvironmentBlockString(
+                    hToken, EnvironmentBlock);
+            }
+        }
+
+        auto iterator = this->m_EnvironmentBlocks.find(AuthenticationId);
+        if (iterator == this->m_EnvironmentBlocks.end())
+        {
+            std::wstring NewEnvironmentBlock;
+            if (!CNSudoEnvironmentCache::CreateEnvironmentBlockString(
+                hToken, NewEnvironmentBlock))
+            {
+                return false;
+            }
+
+            iterator = this->m_EnvironmentBlocks.emplace(
+                AuthenticationId, NewEnvironmentBlock).first;
+        }
+
+        EnvironmentBlock = iterator->second;
+
+        return true;
+    }
+};
+
+// 在第一次使用时构造，使加载NSudoAPI.dll时不执行任何初始化
+static CNSudoEnvironmentCache& NSudoGetEnvironmentCache()
+{
+    static CNSudoEnvironmentCache EnvironmentCache;
+    return EnvironmentCache;
+}
+
+/*
+NSudoEnableEnvironmentCache函数启用环境块的缓存，用于多次创建进程的NSudo代理和
+批处理。
+The NSudoEnableEnvironmentCache function enables the cache of the environment
+blocks, which is used by the NSudo broker and the batch mode which create many
+processes.
+*/
+void NSudoEnableEnvironmentCache()
+{
+    NSudoGetEnvironmentCache().Enable();
+}
+
+/*
+NSudoMergeEnvironmentBlock函数把环境变量合并到环境块中。同名的环境变量会被替
+换，值为空的环境变量会被删除。
+The NSudoMergeEnvironmentBlock function merges the environment variables into
+the environment block. The environment variables with the same name are
+replaced, and the environment variables with empty values are removed.
+*/
+void NSudoMergeEnvironmentBlock(
+    _Inout_ std::wstring& EnvironmentBlock,
+    _In_ const NSUDO_ENVIRONMENT_VARIABLES& EnvironmentVariables)
+{
+    std::vector<std::wstring> Variables;
+
+    for (size_t Start = 0; Start < EnvironmentBlock.size();)
+    {
+        size_t End = EnvironmentBlock.find(L'\0', Start);
+        if (std::wstring::npos == End || End == Start)
+        {
+            break;
+        }
+
+        Variables.push_back(EnvironmentBlock.substr(Start, End - Start));
+        Start = End + 1;
+    }
+
+    for (auto& EnvironmentVariable : EnvironmentVariables)
+    {
+        const std::wstring& Name = EnvironmentVariable.first;
+
+        // 以 "=" 开头的是类似 "=C:" 的隐藏变量，所以从第二个字符开始查找
+        for (auto iterator = Variables.begin(); iterator != Variables.end();)
+        {
+            size_t Separator = iterator->find(L'=', 1);
+            if (Separator == Name.size() &&
+                0 == _wcsnicmp(iterator->c_str(), Name.c_str(), Name.size()))
+            {
+                iterator = Variables.erase(iterator);
+            }
+            else
+            {
+                ++iterator;
+            }
+        }
+
+        if (!EnvironmentVariable.second.empty())
+        {
+            Variables.push_back(Name + L"=" + EnvironmentVariable.second);
+        }
+    }
+
+    // 空的环境块也需要以两个空字符结尾
+    EnvironmentBlock.clear();
+    for (auto& Variable : Variables)
+    {
+        EnvironmentBlock.append(Variable);
+        EnvironmentBlock.push_back(L'\0');
+    }
+    if (Variables.empty())
+    {
+        EnvironmentBlock.push_back(L'\0');
+    }
+    EnvironmentBlock.push_back(L'\0');
+}
+
+// 获取要创建的进程使用的环境块，它基于当前进程令牌的环境块
+bool NSudoGetCreateProcessEnvironmentBlock(
+    _In_opt_ const NSUDO_ENVIRONMENT_VARIABLES* EnvironmentVariables,
+    _Out_ std::wstring& EnvironmentBlock)
+{
+    CNSudoStageScope StageScope(NSudoStage::CreateEnvironmentBlock);
+
+    M2::CHandle hCurrentToken;
+    if (!OpenProcessToken(
+        GetCurrentProcess(),
+        MAXIMUM_ALLOWED,
+        &hCurrentToken))
+    {
+        return false;
+    }
+
+    // 环境块按令牌缓存，以免每次都读取用户配置文件
+    if (!NSudoGetEnvironmentCache().GetEnvironmentBlock(
+        hCurrentToken, EnvironmentBlock))
+    {
+        return false;
+    }
+
+    if (EnvironmentVariables)
+    {
+        NSudoMergeEnvironmentBlock(EnvironmentBlock, *EnvironmentVariables);
+    }
+
+    StageScope.SetResult(TRUE);
+
+    return true;
+}
+
+/*
+CNSudoProcessTreeWaiter类把进程放入带完成端口的作业中，以便等待整个进程树结束。
+所有作业共用一个完成端口和一个等待线程。
+The CNSudoProcessTreeWaiter class puts the processes into the jobs with a
+completion port, so that the whole process tree can be waited. All jobs share
+one completion port and one waiter thread.
+
+作业只用于判断等待何时结束，退出代码始终是新进程自身的退出代码，与进程树中的其
+他进程何时退出无关。
+The job is only used to decide when the wait ends. The exit code is always the
+exit code of the new process itself, regardless of when the other processes in
+the process tree exit.
+*/
+class CNSudoProcessTreeWaiter
+{
+private:
+    M2::CCriticalSection m_CriticalSection;
+    HANDLE m_CompletionPort = nullptr;
+    HANDLE m_WaiterThread = nullptr;
+    ULONG_PTR m_NextKey = 1;
+    std::map<ULONG_PTR, PNSUDO_PROCESS_TREE> m_Trees;
+
+    // 处理完成端口收到的作业消息，直到收到退出消息
+    void WaiterThread()
+    {
+        for (;;)
+        {
+            DWORD MessageID = 0;
+            ULONG_PTR Key = 0;
+            LPOVERLAPPED lpOverlapped = nullptr;
+
+            if (!GetQueuedCompletionStatus(
+                this->m_CompletionPort,
+                &MessageID,
+                &Key,
+                &lpOverlapped,
+                INFINITE))
+            {
+                break;
+            }
+
+            // 键为0的消息表示退出
+            if (0 == Key)
+            {
+                break;
+            }
+
+            // 只需要知道作业中何时没有活动的进程
+            if (JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO != MessageID)
+            {
+                continue;
+            }
+
+            M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+            // 已经释放的进程树的消息会被忽略
+            auto Iterator = this->m_Trees.find(Key);
+            if (this->m_Trees.end() == Iterator)
+            {
+                continue;
+            }
+
+            SetEvent(Iterator->second->CompletedEvent);
+        }
+    }
+
+    // 创建完成端口和等待线程，调用者必须持有锁
+    bool Initialize()
+    {
+        if (this->m_WaiterThread)
+        {
+            return true;
+        }
+
+        if (!this->m_CompletionPort)
+        {
+            this->m_CompletionPort = CreateIoCompletionPort(
+                INVALID_HANDLE_VALUE, nullptr, 0, 1);
+            if (!this->m_CompletionPort)
+            {
+                return false;
+            }
+        }
+
+        HANDLE hThread = M2::CThread([this]()
+        {
+            this->WaiterThread();
+        }).Detach();
+        if (!hThread || INVALID_HANDLE_VALUE == hThread)
+        {
+            return false;
+        }
+
+        this->m_WaiterThread = hThread;
+
+        return true;
+    }
+
+    static void Free(
+        _In_ PNSUDO_PROCESS_TREE Tree)
+    {
+        if (Tree->CompletedEvent)
+        {
+            CloseHandle(Tree->CompletedEvent);
+        }
+
+        if (Tree->JobHandle)
+        {
+            CloseHandle(Tree->JobHandle);
+        }
+
+        delete Tree;
+    }
+
+public:
+    // 在DLL_PROCESS_DETACH中等待线程会因为加载器锁而死锁，所以析构函数不等待。
+    // 如果没有调用Uninitialize，等待线程可能仍在使用完成端口和进程树，所以把它
+    // 们留给系统回收
+    ~CNSudoProcessTreeWaiter()
+    {
+        if (this->m_WaiterThread)
+        {
+            return;
+        }
+
+        for (auto& Tree : this->m_Trees)
+        {
+            CNSudoProcessTreeWaiter::Free(Tree.second);
+        }
+
+        if (this->m_CompletionPort)
+        {
+            CloseHandle(this->m_CompletionPort);
+        }
+    }
+
+    /*
+    Uninitialize函数通知等待线程退出并等待它结束。之后调用Track时会重新创建等待
+    线程。不能在DllMain中调用此函数。
+    The Uninitialize function tells the waiter thread to exit and waits for it
+    to end. The waiter thread is created again when Track is called later. This
+    function cannot be called in DllMain.
+    */
+    void Uninitialize()
+    {
+        HANDLE hThread = nullptr;
+
+        {
+            M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+            hThread = this->m_WaiterThread;
+            this->m_WaiterThread = nullptr;
+        }
+
+        // 等待线程处理消息时需要获取锁，所以在锁外等待
+        if (hThread)
+        {
+            PostQueuedCompletionStatus(this->m_CompletionPort, 0, 0, nullptr);
+            WaitForSingleObjectEx(hThread, INFINITE, FALSE);
+            CloseHandle(hThread);
+        }
+    }
+
+    /*
+    Track函数把一个挂起的进程放入新的作业中。进程必须在恢复运行前放入作业，
+    否则它创建的子进程可能不在作业中。
+    The Track function puts a suspended process into a new job. The process
+    must be put into the job before it is resumed, otherwise the child
+    processes created by it may be outside the job.
+
+    如果函数执行失败，返回值为nullptr，调用者应该只等待该进程。
+    If the function fails, the return value is nullptr, and the caller should
+    wait for the process only.
+    */
+    PNSUDO_PROCESS_TREE Track(
+        _In_ HANDLE hProcess)
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        if (!this->Initialize())
+        {
+            return nullptr;
+        }
+
+        PNSUDO_PROCESS_TREE Tree = new NSUDO_PROCESS_TREE();
+        Tree->Key = this->m_NextKey++;
+        Tree->JobHandle = CreateJobObjectW(nullptr, nullptr);
+        Tree->CompletedEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        JOBOBJECT_ASSOCIATE_COMPLETION_PORT AssociateCompletionPort;
+        AssociateCompletionPort.CompletionKey =
+            reinterpret_cast<PVOID>(Tree->Key);
+        AssociateCompletionPort.CompletionPort = this->m_CompletionPort;
+
+        // 如果当前进程所在的作业不允许嵌套（Windows 8以前），则无法放入作业
+        if (!(Tree->JobHandle &&
+            Tree->CompletedEvent &&
+            SetInformationJobObject(
+                Tree->JobHandle,
+                JobObjectAssociateCompletionPortInformation,
+                &AssociateCompletionPort,
+                sizeof(JOBOBJECT_ASSOCIATE_COMPLETION_PORT)) &&
+            AssignProcessToJobObject(Tree->JobHandle, hProcess)))
+        {
+            CNSudoProcessTreeWaiter::Free(Tree);
+            return nullptr;
+        }
+
+        this->m_Trees[Tree->Key] = Tree;
+
+        return Tree;
+    }
+
+    /*
+    Wait函数等待进程树结束，即作业中没有活动的进程。
+    The Wait function waits for the process tree to end, which means there is
+    no active process in the job.
+
+    返回值与WaitForSingleObjectEx相同。
+    The return value is the same as WaitForSingleObjectEx.
+    */
+    DWORD Wait(
+        _In_ PNSUDO_PROCESS_TREE Tree,
+        _In_ DWORD WaitInterval)
+    {
+        return WaitForSingleObjectEx(
+            Tree->CompletedEvent, WaitInterval, FALSE);
+    }
+
+    /*
+    Release函数停止跟踪进程树。作业中的进程不会被结束。
+    The Release function stops tracking the process tree. The processes in the
+    job are not terminated.
+    */
+    void Release(
+        _In_ PNSUDO_PROCESS_TREE Tree)
+    {
+        M2::AutoCriticalSectionLock Lock(this->m_CriticalSection);
+
+        this->m_Trees.erase(Tree->Key);
+
+        CNSudoProcessTreeWaiter::Free(Tree);
+    }
+};
+
+// 在第一次使用时构造，使加载NSudoAPI.dll时不执行任何初始化
+static CNSudoProcessTreeWaiter& NSudoGetProcessTreeWaiter()
+{
+    static CNSudoProcessTreeWaiter ProcessTreeWaiter;
+    return ProcessTreeWaiter;
+}
+
+/*
+NSudoStopProcessTreeWaiter函数结束等待进程树的线程。卸载NSudoAPI.dll前需要调用
+此函数，之后创建进程时会重新创建该线程。
+The NSudoStopProcessTreeWaiter function ends the thread which waits for the
+process trees. It needs to be called before unloading NSudoAPI.dll, and the
+thread is created again when a process is created later.
+*/
+void NSudoStopProcessTreeWaiter()
+{
+    NSudoGetProcessTreeWaiter().Uninitialize();
+}
+
+#include <Psapi.h>
+#pragma comment(lib, "Psapi.lib")
+
+/*
+NSudoQueryProcessStats函数获取新进程的资源使用情况。如果新进程在作业中，则CPU时
+间、I/O、页面错误和峰值提交内存使用作业的统计信息，即整个进程树的。
+The NSudoQueryProcessStats function obtains the resource usage of the new
+process. If the new process is in a job, the CPU times, the I/O, the page
+faults and the peak commit use the accounting of the job, which covers the
+whole process tree.
+*/
+void NSudoQueryProcessStats(
+    _In_ const NSUDO_STARTED_PROCESS& StartedProcess,
+    _Out_ PNSUDO_PROCESS_STATS Stats)
+{
+    *Stats = NSUDO_PROCESS_STATS();
+    Stats->ProcessId = StartedProcess.ProcessId;
+    Stats->TotalProcesses = 1;
+
+    auto ToULONGLONG = [](const FILETIME& Time) -> ULONGLONG
+    {
+        ULARGE_INTEGER Value;
+        Value.LowPart = Time.dwLowDateTime;
+        Value.HighPart = Time.dwHighDateTime;
+        return Value.QuadPart;
+    };
+
+    FILETIME CreationTime, ExitTime, KernelTime, UserTime;
+    if (GetProcessTimes(
+        StartedProcess.ProcessHandle,
+        &CreationTime,
+        &ExitTime,
+        &KernelTime,
+        &UserTime))
+    {
+        // 进程树中的其他进程可能比新进程退出得晚，所以使用当前时间
+        FILETIME CurrentTime;
+        GetSystemTimeAsFileTime(&CurrentTime);
+
+        Stats->WallTime = ToULONGLONG(CurrentTime) - ToULONGLONG(CreationTime);
+        Stats->UserTime = ToULONGLONG(UserTime);
+        Stats->KernelTime = ToULONGLONG(KernelTime);
+    }
+
+    PROCESS_MEMORY_COUNTERS MemoryCounters = { 0 };
+    MemoryCounters.cb = sizeof(PROCESS_MEMORY_COUNTERS);
+    if (GetProcessMemoryInfo(
+        StartedProcess.ProcessHandle,
+        &MemoryCounters,
+        sizeof(PROCESS_MEMORY_COUNTERS)))
+    {
+        Stats->PeakWorkingSet = MemoryCounters.PeakWorkingSetSize;
+        Stats->PeakCommit = MemoryCounters.PeakPagefileUsage;
+        Stats->PageFaultCount = MemoryCounters.PageFaultCount;
+    }
+
+    IO_COUNTERS IoCounters = { 0 };
+    if (GetProcessIoCounters(StartedProcess.ProcessHandle, &IoCounters))
+    {
+        Stats->ReadOperationCount = IoCounters.ReadOperationCount;
+        Stats->WriteOperationCount = IoCounters.WriteOperationCount;
+        Stats->ReadTransferCount = IoCounters.ReadTransferCount;
+        Stats->WriteTransferCount = IoCounters.WriteTransferCount;
+    }
+
+    if (!StartedProcess.ProcessTree)
+    {
+        return;
+    }
+
+    HANDLE hJob = StartedProcess.ProcessTree->JobHandle;
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION AccountingInformation;
+    if (!QueryInformationJobObject(
+        hJob,
+        JobObjectBasicAndIoAccountingInformation,
+        &AccountingInformation,
+        sizeof(JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION),
+        nullptr))
+    {
+        return;
+    }
+
+    const JOBOBJECT_BASIC_ACCOUNTING_INFORMATION& BasicInfo =
+        AccountingInformation.BasicInfo;
+    const IO_COUNTERS& IoInfo = AccountingInformation.IoInfo;
+
+    Stats->IncludesProcessTree = true;
+    Stats->TotalProcesses = BasicInfo.TotalProcesses;
+    Stats->UserTime = BasicInfo.TotalUserTime.QuadPart;
+    Stats->KernelTime = BasicInfo.TotalKernelTime.QuadPart;
+    Stats->PageFaultCount = BasicInfo.TotalPageFaultCount;
+    Stats->ReadOperationCount = IoInfo.ReadOperationCount;
+    Stats->WriteOperationCount = IoInfo.WriteOperationCount;
+    Stats->ReadTransferCount = IoInfo.ReadTransferCount;
+    Stats->WriteTransferCount = IoInfo.WriteTransferCount;
+
+    // 作业的峰值提交内存在没有内存限制时也会被统计
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION LimitInformation;
+    if (QueryInformationJobObject(
+        hJob,
+        JobObjectExtendedLimitInformation,
+        &LimitInformation,
+        sizeof(JOBOBJECT_EXTENDED_LIMIT_INFORMATION),
+        nullptr))
+    {
+        Stats->PeakCommit = LimitInformation.PeakJobMemoryUsed;
+    }
+}
+
+/*
+NSudoCloseStartedProcess函数停止跟踪新进程的进程树并关闭新进程的句柄。新进程不
+会被结束。
+The NSudoCloseStartedProcess function stops tracking the process tree of the
+new process and closes the handle of the new process. The new process is not
+terminated.
+*/
+void NSudoCloseStartedProcess(
+    _Inout_ NSUDO_STARTED_PROCESS& StartedProcess)
+{
+    if (StartedProcess.ProcessTree)
+    {
+        NSudoGetProcessTreeWaiter().Release(StartedProcess.ProcessTree);
+        StartedProcess.ProcessTree = nullptr;
+    }
+
+    if (StartedProcess.ProcessHandle)
+    {
+        CloseHandle(StartedProcess.ProcessHandle);
+        StartedProcess.ProcessHandle = nullptr;
+    }
+}
+
+/*
+NSudoWaitStartedProcess函数等待新进程的进程树结束，然后关闭新进程。退出代码为新
+进程的退出代码，如果进程树尚未结束，则为STILL_ACTIVE。如果指定了Stats，则在关闭
+前获取资源使用情况。
+The NSudoWaitStartedProcess function waits for the process tree of the new
+process to end, and then closes the new process. The exit code is the exit code
+of the new process, or STILL_ACTIVE if the process tree has not ended. If Stats
+is specified, the resource usage is obtained before closing.
+
+返回值与WaitForSingleObjectEx相同。
+The return value is the same as WaitForSingleObjectEx.
+*/
+DWORD NSudoWaitStartedProcess(
+    _Inout_ NSUDO_STARTED_PROCESS& StartedProcess,
+    _In_ DWORD WaitInterval,
+    _Out_opt_ PDWORD lpExitCode,
+    _Out_opt_ PNSUDO_PROCESS_STATS Stats)
+{
+    DWORD WaitResult = WAIT_OBJECT_0;
+    DWORD ExitCode = STILL_ACTIVE;
+
+    if (StartedProcess.ProcessTree)
+    {
+        WaitResult = NSudoGetProcessTreeWaiter().Wait(
+            StartedProcess.ProcessTree, WaitInterval);
+    }
+    else
+    {
+        // 无法放入作业时只等待新进程
+        WaitResult = WaitForSingleObjectEx(
+            StartedProcess.ProcessHandle, WaitInterval, FALSE);
+    }
+
+    // 进程树结束时新进程一定已经退出
+    if (WAIT_OBJECT_0 == WaitResult)
+    {
+        GetExitCodeProcess(StartedProcess.ProcessHandle, &ExitCode);
+    }
+
+    if (lpExitCode)
+    {
+        *lpExitCode = ExitCode;
+    }
+
+    if (Stats)
+    {
+        NSudoQueryProcessStats(StartedProcess, Stats);
+    }
+
+    NSudoCloseStartedProcess(StartedProcess);
+
+    return WaitResult;
+}
+
+// 判断是否指定了任何资源限制
+bool NSudoHasJobLimits(
+    _In_ const NSUDO_JOB_LIMITS& Limits)
+{
+    return 0 != Limits.CpuRate ||
+        0 != Limits.JobMemoryLimit ||
+        0 != Limits.MaximumWorkingSetSize ||
+        0 != Limits.MaximumIops ||
+        0 != Limits.ActiveProcessLimit;
+}
+
+/*
+NSudoSetJobLimits函数对作业设置资源限制。CPU占用率限制需要Windows 8及之后版本，
+I/O速率限制需要Windows 10及之后版本。
+The NSudoSetJobLimits function sets the resource limits to a job. The CPU rate
+limit requires Windows 8 or later, and the I/O rate limit requires Windows 10
+or later.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoSetJobLimits(
+    _In_ HANDLE hJob,
+    _In_ const NSUDO_JOB_LIMITS& Limits)
+{
+    if (0 != Limits.JobMemoryLimit ||
+        0 != Limits.MaximumWorkingSetSize ||
+        0 != Limits.ActiveProcessLimit)
+    {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION LimitInformation = { 0 };
+        JOBOBJECT_BASIC_LIMIT_INFORMATION& BasicLimitInformation =
+            LimitInformation.BasicLimitInformation;
+
+        if (0 != Limits.JobMemoryLimit)
+        {
+            BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+            LimitInformation.JobMemoryLimit = Limits.JobMemoryLimit;
+        }
+
+        if (0 != Limits.MaximumWorkingSetSize)
+        {
+            // 最小工作集不能为0，也不能超过最大工作集
+            const SIZE_T MinimumWorkingSetSize = 1024 * 1024;
+
+            BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_WORKINGSET;
+            BasicLimitInformation.MaximumWorkingSetSize =
+                Limits.MaximumWorkingSetSize;
+            BasicLimitInformation.MinimumWorkingSetSize =
+                (Limits.MaximumWorkingSetSize < MinimumWorkingSetSize)
+                ? Limits.MaximumWorkingSetSize
+                : MinimumWorkingSetSize;
+        }
+
+        if (0 != Limits.ActiveProcessLimit)
+        {
+            BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+            BasicLimitInformation.ActiveProcessLimit =
+                Limits.ActiveProcessLimit;
+        }
+
+        if (!SetInformationJobObject(
+            hJob,
+            JobObjectExtendedLimitInformation,
+            &LimitInformation,
+            sizeof(JOBOBJECT_EXTENDED_LIMIT_INFORMATION)))
+        {
+            return FALSE;
+        }
+    }
+
+    if (0 != Limits.CpuRate)
+    {
+        // CpuRate的单位为万分之一
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION CpuRateInformation = { 0 };
+        CpuRateInformation.ControlFlags =
+            JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+            JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+        CpuRateInformation.CpuRate = Limits.CpuRate * 100;
+
+        if (!SetInformationJobObject(
+            hJob,
+            JobObjectCpuRateControlInformation,
+            &CpuRateInformation,
+            sizeof(JOBOBJECT_CPU_RATE_CONTROL_INFORMATION)))
+        {
+            return FALSE;
+        }
+    }
+
+    if (0 != Limits.MaximumIops)
+    {
+        decltype(SetIoRateControlInformationJobObject)*
+            pSetIoRateControlInformationJobObject = nullptr;
+
+        HMODULE hModule = GetModuleHandleW(L"kernel32.dll");
+
+        // SetIoRateControlInformationJobObject仅在Windows 10及之后版本可用
+        if (!(hModule && SUCCEEDED(M2GetProcAddress(
+            pSetIoRateControlInformationJobObject,
+            hModule,
+            "SetIoRateControlInformationJobObject"))))
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+
+        // VolumeName为nullptr时限制对所有卷生效
+        JOBOBJECT_IO_RATE_CONTROL_INFORMATION IoRateInformation = { 0 };
+        IoRateInformation.MaxIops = Limits.MaximumIops;
+        IoRateInformation.VolumeName = nullptr;
+        IoRateInformation.ControlFlags = JOB_OBJECT_IO_RATE_CONTROL_ENABLE;
+
+        DWORD dwError = pSetIoRateControlInformationJobObject(
+            hJob, &IoRateInformation);
+        if (ERROR_SUCCESS != dwError)
+        {
+            SetLastError(dwError);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+NSudoSetProcessJobLimits函数对挂起的进程设置资源限制。如果hJob为nullptr，则创
+建一个新的作业并把进程放入其中；关闭作业句柄后限制在作业中的进程结束前仍然有效。
+The NSudoSetProcessJobLimits function sets the resource limits to a suspended
+process. If hJob is nullptr, a new job is created and the process is put into
+it; the limits remain effective until the processes in the job end after the
+job handle is closed.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoSetProcessJobLimits(
+    _In_ HANDLE hProcess,
+    _In_opt_ HANDLE hJob,
+    _In_ const NSUDO_JOB_LIMITS& Limits)
+{
+    if (hJob)
+    {
+        return NSudoSetJobLimits(hJob, Limits);
+    }
+
+    M2::CHandle hNewJob(CreateJobObjectW(nullptr, nullptr));
+    if (!hNewJob)
+    {
+        return FALSE;
+    }
+
+    // 先设置限制再放入进程，使限制从进程的第一条指令开始生效
+    return NSudoSetJobLimits(hNewJob, Limits) &&
+        AssignProcessToJobObject(hNewJob, hProcess);
+}
+
+/*
+CNSudoProcThreadAttributeList类封装了创建进程使用的进程和线程属性列表。属性的值
+在列表销毁前必须一直有效。
+The CNSudoProcThreadAttributeList class wraps the process and thread attribute
+list used for creating a process. The values of the attributes must remain
+valid until the list is destroyed.
+*/
+class CNSudoProcThreadAttributeList : M2::CDisableObjectCopying
+{
+private:
+    std::vector<BYTE> m_Buffer;
+    bool m_Initialized = false;
+
+public:
+    ~CNSudoProcThreadAttributeList()
+    {
+        if (this->m_Initialized)
+        {
+            DeleteProcThreadAttributeList(this->Get());
+        }
+    }
+
+    /*
+    Initialize函数初始化一个可以容纳指定数目属性的列表。
+    The Initialize function initializes a list which can hold the specified
+    number of attributes.
+
+    如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+    If the function fails, the return value is FALSE. To get extended error
+    information, call GetLastError.
+    */
+    BOOL Initialize(
+        _In_ DWORD AttributeCount)
+    {
+        SIZE_T Size = 0;
+        InitializeProcThreadAttributeList(nullptr, AttributeCount, 0, &Size);
+        if (0 == Size)
+        {
+            return FALSE;
+        }
+
+        this->m_Buffer.resize(Size);
+
+        this->m_Initialized = FALSE != InitializeProcThreadAttributeList(
+            this->Get(), AttributeCount, 0, &Size);
+
+        return this->m_Initialized;
+    }
+
+    /*
+    Update函数向列表添加一个属性。
+    The Update function adds an attribute to the list.
+
+    如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+    If the function fails, the return value is FALSE. To get extended error
+    information, call GetLastError.
+    */
+    BOOL Update(
+        _In_ DWORD_PTR Attribute,
+        _In_ PVOID lpValue,
+        _In_ SIZE_T cbSize)
+    {
+        return UpdateProcThreadAttribute(
+            this->Get(), 0, Attribute, lpValue, cbSize, nullptr, nullptr);
+    }
+
+    LPPROC_THREAD_ATTRIBUTE_LIST Get()
+    {
+        return reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(
+            this->m_Buffer.data());
+    }
+};
+
+/*
+NSudoSetProcessDefaultCpuSets函数设置挂起的进程默认的CPU集。该函数需要Windows 10
+及之后版本。
+The NSudoSetProcessDefaultCpuSets function sets the default CPU sets of a
+suspended process. The function requires Windows 10 or later.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoSetProcessDefaultCpuSets(
+    _In_ HANDLE hProcess,
+    _In_ const std::vector<ULONG>& CpuSets)
+{
+    decltype(SetProcessDefaultCpuSets)* pSetProcessDefaultCpuSets = nullptr;
+
+    HMODULE hModule = GetModuleHandleW(L"kernel32.dll");
+
+    if (!(hModule && SUCCEEDED(M2GetProcAddress(
+        pSetProcessDefaultCpuSets,
+        hModule,
+        "SetProcessDefaultCpuSets"))))
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    return pSetProcessDefaultCpuSets(
+        hProcess,
+        CpuSets.data(),
+        static_cast<ULONG>(CpuSets.size()));
+}
+
+/*
+NSudoHasProcessQoS函数判断是否指定了进程的调度设置。
+The NSudoHasProcessQoS function determines whether any scheduling setting of
+the process is specified.
+*/
+bool NSudoHasProcessQoS(
+    _In_ const NSUDO_PROCESS_QOS& QoS)
+{
+    return
+        NSudoIoPriority::Default != QoS.IoPriority ||
+        0 != QoS.MemoryPriority ||
+        QoS.EcoQoS;
+}
+
+/*
+NSudoSetProcessQoS函数设置进程的I/O优先级、内存优先级和EcoQoS。
+The NSudoSetProcessQoS function sets the I/O priority, the memory priority
+and the EcoQoS of a process.
+
+I/O优先级通过NtSetInformationProcess设置。内存优先级需要Windows 8及之后版本，
+EcoQoS需要Windows 10 1709及之后版本。
+The I/O priority is set via NtSetInformationProcess. The memory priority
+requires Windows 8 or later and the EcoQoS requires Windows 10 1709 or later.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoSetProcessQoS(
+    _In_ HANDLE hProcess,
+    _In_ const NSUDO_PROCESS_QOS& QoS)
+{
+    if (NSudoIoPriority::Default != QoS.IoPriority)
+    {
+        // ProcessIoPriority不在Windows SDK中定义
+        const ULONG ProcessIoPriority = 33;
+
+        typedef LONG(NTAPI* PNtSetInformationProcess)(
+            HANDLE ProcessHandle,
+            ULONG ProcessInformationClass,
+            PVOID ProcessInformation,
+            ULONG ProcessInformationLength);
+        typedef ULONG(NTAPI* PRtlNtStatusToDosError)(
+            LONG Status);
+
+        PNtSetInformationProcess pNtSetInformationProcess = nullptr;
+        PRtlNtStatusToDosError pRtlNtStatusToDosError = nullptr;
+
+        HMODULE hModule = GetModuleHandleW(L"ntdll.dll");
+
+        if (!(hModule && SUCCEEDED(M2GetProcAddress(
+            pNtSetInformationProcess,
+            hModule,
+            "NtSetInformationProcess")) && SUCCEEDED(M2GetProcAddress(
+                pRtlNtStatusToDosError,
+                hModule,
+                "RtlNtStatusToDosError"))))
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+
+        ULONG IoPriority = static_cast<ULONG>(QoS.IoPriority);
+
+        LONG Status = pNtSetInformationProcess(
+            hProcess,
+            ProcessIoPriority,
+            &IoPriority,
+            sizeof(ULONG));
+        if (Status < 0)
+        {
+            SetLastError(pRtlNtStatusToDosError(Status));
+            return FALSE;
+        }
+    }
+
+    if (0 != QoS.MemoryPriority || QoS.EcoQoS)
+    {
+        decltype(SetProcessInformation)* pSetProcessInformation = nullptr;
+
+        HMODULE hModule = GetModuleHandleW(L"kernel32.dll");
+
+        // SetProcessInformation仅在Windows 8及之后版本可用
+        if (!(hModule && SUCCEEDED(M2GetProcAddress(
+            pSetProcessInformation,
+            hModule,
+            "SetProcessInformation"))))
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+
+        if (0 != QoS.MemoryPriority)
+        {
+            MEMORY_PRIORITY_INFORMATION MemoryPriorityInformation = { 0 };
+            MemoryPriorityInformation.MemoryPriority = QoS.MemoryPriority;
+
+            if (!pSetProcessInformation(
+                hProcess,
+                ProcessMemoryPriority,
+                &MemoryPriorityInformation,
+                sizeof(MEMORY_PRIORITY_INFORMATION)))
+            {
+                return FALSE;
+            }
+        }
+
+        if (QoS.EcoQoS)
+        {
+            PROCESS_POWER_THROTTLING_STATE PowerThrottling = { 0 };
+            PowerThrottling.Version = PROCESS_POWER_THROTTLING_CURRENT_VERSION;
+            PowerThrottling.ControlMask =
+                PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+            PowerThrottling.StateMask =
+                PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+
+            if (!pSetProcessInformation(
+                hProcess,
+                ProcessPowerThrottling,
+                &PowerThrottling,
+                sizeof(PROCESS_POWER_THROTTLING_STATE)))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+#include <Shlwapi.h>
+#pragma comment(lib, "Shlwapi.lib")
+
+/*
+NSudoGetAssociatedCommand函数获取文件扩展名或者URL协议关联的打开命令，命令中的环
+境变量会被展开。
+The NSudoGetAssociatedCommand function gets the open command associated with
+a file name extension or a URL protocol, and the environment variables in the
+command are expanded.
+
+如果没有关联的打开命令（例如通过DelegateExecute或者DDE打开），返回值为false。
+If there is no associated open command (e.g. it is opened via DelegateExecute
+or DDE), the return value is false.
+*/
+bool NSudoGetAssociatedCommand(
+    _In_ LPCWSTR lpAssociation,
+    _Out_ std::wstring& Command)
+{
+    const ASSOCF Flags = ASSOCF_NOTRUNCATE | ASSOCF_INIT_IGNOREUNKNOWN;
+
+    Command.clear();
+
+    CNSudoComInitializer ComInitializer;
+
+    DWORD Length = 0;
+    if (S_FALSE != AssocQueryStringW(
+        Flags,
+        ASSOCSTR_COMMAND,
+        lpAssociation,
+        L"open",
+        nullptr,
+        &Length) || Length <= 1)
+    {
+        return false;
+    }
+
+    Command.resize(Length);
+    if (S_OK != AssocQueryStringW(
+        Flags,
+        ASSOCSTR_COMMAND,
+        lpAssociation,
+        L"open",
+        &Command[0],
+        &Length))
+    {
+        Command.clear();
+        return false;
+    }
+
+    Command.resize(wcslen(Command.c_str()));
+    Command = NSudoExpandEnvironmentStrings(Command);
+
+    return !Command.empty();
+}
+
+/*
+NSudoResolveCommandLine函数把以文档或者URL开头的命令行解析为其关联程序的命令行，
+使只有目标进程以提权的令牌创建。可执行文件和找不到的目标保持不变，由
+CreateProcess处理。只有没有关联的打开命令的目标才通过 "cmd /c start" 启动。
+The NSudoResolveCommandLine function resolves a command line which starts with
+a document or a URL to the command line of its associated program, so that
+only the target process is created with the elevated token. The executables
+and the targets which cannot be found are unchanged and handled by
+CreateProcess. Only the targets without an associated open command are
+launched via "cmd /c start".
+
+相对路径的目标只在lpCurrentDirectory中查找，即新进程的当前目录，而不是调用者的当
+前目录。lpCurrentDirectory为nullptr时与CreateProcess一样使用调用者的当前目录。
+The relative targets are only searched in lpCurrentDirectory, which is the
+current directory of the new process instead of the one of the caller. If
+lpCurrentDirectory is nullptr, the current directory of the caller is used like
+CreateProcess.
+
+命令行中的环境变量不会被展开，只有查找目标时使用展开后的目标。
+The environment variables in the command line are not expanded, and only the
+lookup of the target uses the expanded target.
+*/
+std::wstring NSudoResolveCommandLine(
+    _In_ const std::wstring& CommandLine,
+    _In_opt_ LPCWSTR lpCurrentDirectory)
+{
+    std::wstring_view Remaining = CommandLine;
+
+    while (!Remaining.empty() && iswspace(Remaining.front()))
+    {
+        Remaining.remove_prefix(1);
+    }
+
+    // 拆分出目标和参数
+    std::wstring Target;
+    if (!Remaining.empty() && L'"' == Remaining.front())
+    {
+        size_t End = Remaining.find(L'"', 1);
+        Target = Remaining.substr(1, End - 1);
+        Remaining.remove_prefix(
+            std::wstring_view::npos == End ? Remaining.size() : End + 1);
+    }
+    else
+    {
+        size_t End = 0;
+        while (End < Remaining.size() && !iswspace(Remaining[End]))
+        {
+            ++End;
+        }
+        Target = Remaining.substr(0, End);
+        Remaining.remove_prefix(End);
+    }
+
+    while (!Remaining.empty() && iswspace(Remaining.front()))
+    {
+        Remaining.remove_prefix(1);
+    }
+
+    if (Target.empty())
+    {
+        return CommandLine;
+    }
+
+    Target = NSudoExpandEnvironmentStrings(Target);
+
+    std::wstring Association;
+    std::wstring TargetPath;
+
+    // 单个字符的协议视为驱动器号
+    size_t SchemeEnd = Target.find(L"://");
+    if (std::wstring::npos != SchemeEnd && SchemeEnd > 1)
+    {
+        Association = Target.substr(0, SchemeEnd);
+        TargetPath = Target;
+    }
+    else
+    {
+        TargetPath.resize(MAX_PATH);
+
+        DWORD Length = SearchPathW(
+            lpCurrentDirectory,
+            Target.c_str(),
+            L".exe",
+            static_cast<DWORD>(TargetPath.size()),
+            &TargetPath[0],
+            nullptr);
+        if (Length >= TargetPath.size())
+        {
+            TargetPath.resize(Length);
+
+            Length = SearchPathW(
+                lpCurrentDirectory,
+                Target.c_str(),
+                L".exe",
+                static_cast<DWORD>(TargetPath.size()),
+                &TargetPath[0],
+                nullptr);
+        }
+        if (0 == Length || Length >= TargetPath.size())
+        {
+            return CommandLine;
+        }
+
+        TargetPath.resize(Length);
+
+        Association = PathFindExtensionW(TargetPath.c_str());
+
+        const wchar_t* ExecutableExtensions[] =
+        {
+            L".exe", L".com", L".bat", L".cmd"
+        };
+
+        for (const wchar_t* Extension : ExecutableExtensions)
+        {
+            if (0 == _wcsicmp(Extension, Association.c_str()))
+            {
+                return CommandLine;
+            }
+        }
+    }
+
+    std::wstring Command;
+    if (Association.empty() ||
+        !NSudoGetAssociatedCommand(Association.c_str(), Command))
+    {
+        return L"cmd /c start \"NSudo.Launcher\" " + CommandLine;
+    }
+
+    // 展开关联命令中的 "%1"、"%L" 和 "%*"，其他的占位符被忽略
+    std::wstring ResolvedCommandLine;
+    bool HasTarget = false;
+
+    for (size_t i = 0; i < Command.size(); ++i)
+    {
+        if (L'%' != Command[i] || i + 1 == Command.size())
+        {
+            ResolvedCommandLine.push_back(Command[i]);
+            continue;
+        }
+
+        wchar_t Placeholder = Command[++i];
+        if (L'1' == Placeholder || L'L' == Placeholder || L'l' == Placeholder)
+        {
+            bool Quoted = !ResolvedCommandLine.empty() &&
+                L'"' == ResolvedCommandLine.back();
+
+            if (!Quoted)
+            {
+                ResolvedCommandLine.push_back(L'"');
+            }
+            ResolvedCommandLine.append(TargetPath);
+            if (!Quoted)
+            {
+                ResolvedCommandLine.push_back(L'"');
+            }
+
+            HasTarget = true;
+        }
+        else if (L'*' == Placeholder)
+        {
+            ResolvedCommandLine.append(Remaining);
+        }
+        else if (L'%' == Placeholder)
+        {
+            ResolvedCommandLine.push_back(L'%');
+        }
+        else if (!iswalnum(Placeholder) && L'~' != Placeholder)
+        {
+            ResolvedCommandLine.push_back(L'%');
+            ResolvedCommandLine.push_back(Placeholder);
+        }
+    }
+
+    if (!HasTarget)
+    {
+        ResolvedCommandLine.append(L" \"");
+        ResolvedCommandLine.append(TargetPath);
+        ResolvedCommandLine.push_back(L'"');
+    }
+
+    return ResolvedCommandLine;
+}
+
+/*
+CNSudoStandardRedirection类通过重叠I/O的命名管道把新进程的标准输入、输出和错误
+重定向到NSudo自身的标准句柄。新进程的输出在到达时就被转发，不会全部缓存在内存中。
+The CNSudoStandardRedirection class redirects the standard input, output and
+error of the new process to the standard handles of NSudo via named pipes with
+overlapped I/O. The output of the new process is relayed as it arrives and is
+never buffered as a whole in memory.
+*/
+class CNSudoStandardRedirection : M2::CDisableObjectCopying
+{
+private:
+    static const DWORD BufferSize = 4096;
+
+    // NSudo一侧的管道句柄
+    M2::CHandle m_Input;
+    M2::CHandle m_Output;
+    M2::CHandle m_Error;
+
+    // 新进程一侧的可继承的管道句柄
+    M2::CHandle m_ChildInput;
+    M2::CHandle m_ChildOutput;
+    M2::CHandle m_ChildError;
+
+    M2::CHandle m_InputThread;
+    // 通知转发线程停止转发标准输入
+    M2::CHandle m_InputStopEvent;
+
+    /*
+    CreatePipe函数创建一个只接受本机连接的命名管道，NSudo一侧使用重叠I/O，新进程
+    一侧的句柄可被继承。
+    The CreatePipe function creates a named pipe which only accepts local
+    connections. The NSudo side uses overlapped I/O and the handle of the new
+    process side is inheritable.
+
+    如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+    If the function fails, the return value is FALSE. To get extended error
+    information, call GetLastError.
+    */
+    static BOOL CreatePipe(
+        _In_ bool Inbound,
+        _Out_ M2::CHandle& ServerHandle,
+        _Out_ M2::CHandle& ClientHandle)
+    {
+        static volatile LONG SerialNumber = 0;
+
+        std::wstring PipeName = M2FormatString(
+            L"\\\\.\\pipe\\NSudo.Redirection.%lu.%ld",
+            GetCurrentProcessId(),
+            InterlockedIncrement(&SerialNumber));
+
+        // 只允许一个实例，防止其他进程抢先创建同名的管道
+        ServerHandle = CreateNamedPipeW(
+            PipeName.c_str(),
+            (Inbound ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) |
+            FILE_FLAG_FIRST_PIPE_INSTANCE |
+            FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE |
+            PIPE_READMODE_BYTE |
+            PIPE_WAIT |
+            PIPE_REJECT_REMOTE_CLIENTS,
+            1,
+            BufferSize,
+            BufferSize,
+            0,
+            nullptr);
+        if (ServerHandle.IsInvalid())
+        {
+            return FALSE;
+        }
+
+        SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+        SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+        SecurityAttributes.bInheritHandle = TRUE;
+
+        ClientHandle = CreateFileW(
+            PipeName.c_str(),
+            Inbound
+            ? (GENERIC_WRITE | FILE_READ_ATTRIBUTES)
+            : (GENERIC_READ | FILE_WRITE_ATTRIBUTES),
+            0,
+            &SecurityAttributes,
+            OPEN_EXISTING,
+            0,
+            nullptr);
+
+        return !ClientHandle.IsInvalid();
+    }
+
+    /*
+    WritePipe函数把数据写入管道，同时等待停止事件。新进程不读取标准输入时写入会一
+    直挂起，此时写入操作会被取消。
+    The WritePipe function writes the data to the pipe and waits for the stop
+    event at the same time. The write operation hangs if the new process does
+    not read its standard input, and it is cancelled in that case.
+
+    如果写入失败或者被要求停止，返回值为false。
+    If the write operation fails or the stop is requested, the return value is
+    false.
+    */
+    static bool WritePipe(
+        _In_ HANDLE hPipe,
+        _In_ HANDLE hStopEvent,
+        _Inout_ OVERLAPPED& Overlapped,
+        _In_ LPCVOID Buffer,
+        _In_ DWORD NumberOfBytesToWrite)
+    {
+        DWORD NumberOfBytesWritten = 0;
+
+        if (!WriteFile(
+            hPipe,
+            Buffer,
+            NumberOfBytesToWrite,
+            nullptr,
+            &Overlapped) && ERROR_IO_PENDING != GetLastError())
+        {
+            return false;
+        }
+
+        HANDLE Handles[] = { Overlapped.hEvent, hStopEvent };
+        if (WAIT_OBJECT_0 != WaitForMultipleObjects(
+            2, Handles, FALSE, INFINITE))
+        {
+            CancelIoEx(hPipe, &Overlapped);
+        }
+
+        return FALSE != GetOverlappedResult(
+            hPipe,
+            &Overlapped,
+            &NumberOfBytesWritten,
+            TRUE);
+    }
+
+    /*
+    ForwardConsoleInput函数转发控制台的输入。控制台输入缓冲区与其他进程共用，并且
+    控制台的读取操作不一定能被取消，所以只在输入句柄被设置时读取已有的输入记录，并
+    同时等待停止事件。
+    The ForwardConsoleInput function forwards the console input. The console
+    input buffer is shared with other processes, and the read operation of the
+    console cannot always be cancelled, so the function only reads the input
+    records which are already there when the input handle is signaled, and
+    waits for the stop event at the same time.
+
+    只转发按键的字符，并按照控制台模式模拟行输入：ENABLE_LINE_INPUT时按回车后才转
+    发一行，支持退格，行首的Ctrl+Z表示输入结束；ENABLE_ECHO_INPUT时回显输入。字符
+    按照控制台的输入代码页编码，与ReadFile读取控制台时一致。
+    Only the characters of the keys are forwarded, and the line input is
+    emulated with the console mode: with ENABLE_LINE_INPUT a line is forwarded
+    after Enter is pressed, Backspace is supported and Ctrl+Z at the start of
+    a line ends the input; with ENABLE_ECHO_INPUT the input is echoed. The
+    characters are encoded with the input code page of the console, which is
+    the same as reading the console with ReadFile.
+    */
+    static void ForwardConsoleInput(
+        _In_ HANDLE hPipe,
+        _In_ HANDLE hStopEvent,
+        _In_ HANDLE hInput,
+        _In_ DWORD dwConsoleMode,
+        _Inout_ OVERLAPPED& Overlapped)
+    {
+        const bool LineInput = 0 != (dwConsoleMode & ENABLE_LINE_INPUT);
+
+        HANDLE hEcho = nullptr;
+        if (LineInput && (dwConsoleMode & ENABLE_ECHO_INPUT))
+        {
+            HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+
+            DWORD dwOutputMode = 0;
+            if (GetConsoleMode(hOutput, &dwOutputMode))
+            {
+                hEcho = hOutput;
+            }
+        }
+
+        std::wstring Line;
+        bool EndOfInput = false;
+
+        while (!EndOfInput)
+        {
+            HANDLE Handles[] = { hStopEvent, hInput };
+            if (WAIT_OBJECT_0 + 1 != WaitForMultipleObjects(
+                2, Handles, FALSE, INFINITE))
+            {
+                break;
+            }
+
+            // 记录可能已经被共用控制台的其他进程读取，只读取仍然存在的记录，
+            // 所以ReadConsoleInputW不会阻塞
+            INPUT_RECORD Records[64];
+            DWORD NumberOfEvents = 0;
+            if (!PeekConsoleInputW(
+                hInput, Records, _countof(Records), &NumberOfEvents))
+            {
+                break;
+            }
+            if (0 == NumberOfEvents)
+            {
+                continue;
+            }
+            if (!ReadConsoleInputW(
+                hInput, Records, NumberOfEvents, &NumberOfEvents))
+            {
+                break;
+            }
+
+            std::wstring Text;
+            std::wstring Echo;
+
+            for (DWORD i = 0; i < NumberOfEvents && !EndOfInput; ++i)
+            {
+                const KEY_EVENT_RECORD& KeyEvent = Records[i].Event.KeyEvent;
+
+                // 只处理带字符的按下事件，其他的事件（例如鼠标和焦点）被丢弃
+                if (KEY_EVENT != Records[i].EventType ||
+                    !KeyEvent.bKeyDown ||
+                    L'\0' == KeyEvent.uChar.UnicodeChar)
+                {
+                    continue;
+                }
+
+                wchar_t Character = KeyEvent.uChar.UnicodeChar;
+
+                for (WORD Repeat = 0;
+                    Repeat < KeyEvent.wRepeatCount && !EndOfInput;
+                    ++Repeat)
+                {
+                    if (!LineInput)
+                    {
+                        Text.push_back(Character);
+                    }
+                    else if (L'\r' == Character)
+                    {
+                        Line.append(L"\r\n");
+                        Text.append(Line);
+                        Line.clear();
+                        Echo.append(L"\r\n");
+                    }
+                    else if (L'\b' == Character)
+                    {
+                        if (!Line.empty())
+                        {
+                            Line.pop_back();
+                            Echo.append(L"\b \b");
+                        }
+                    }
+                    else if (L'\x1A' == Character && Line.empty())
+                    {
+                        EndOfInput = true;
+                    }
+                    else
+                    {
+                        Line.push_back(Character);
+                        Echo.push_back(Character);
+                    }
+                }
+            }
+
+            if (hEcho && !Echo.empty())
+            {
+                DWORD NumberOfCharsWritten = 0;
+                WriteConsoleW(
+                    hEcho,
+                    Echo.c_str(),
+                    static_cast<DWORD>(Echo.size()),
+                    &NumberOfCharsWritten,
+                    nullptr);
+            }
+
+            if (Text.empty())
+            {
+                continue;
+            }
+
+            UINT CodePage = GetConsoleCP();
+
+            int Length = WideCharToMultiByte(
+                CodePage,
+                0,
+                Text.c_str(),
+                static_cast<int>(Text.size()),
+                nullptr,
+                0,
+                nullptr,
+                nullptr);
+            if (Length <= 0)
+            {
+                continue;
+            }
+
+            std::string Buffer(static_cast<size_t>(Length), '\0');
+            WideCharToMultiByte(
+                CodePage,
+                0,
+                Text.c_str(),
+                static_cast<int>(Text.size()),
+                &Buffer[0],
+                Length,
+                nullptr,
+                nullptr);
+
+            if (!CNSudoStandardRedirection::WritePipe(
+                hPipe,
+                hStopEvent,
+                Overlapped,
+                Buffer.data(),
+                static_cast<DWORD>(Buffer.size())))
+            {
+                break;
+            }
+        }
+    }
+
+    /*
+    ForwardInput函数把NSudo的标准输入转发给新进程，直到标准输入结束、新进程关闭了
+    它的标准输入或者停止事件被设置。该函数会关闭管道句柄，使新进程读取到文件结尾。
+    The ForwardInput function forwards the standard input of NSudo to the new
+    process until the standard input ends, the new process closes its standard
+    input or the stop event is set. The function closes the pipe handle, so the
+    new process reads the end of file.
+
+    控制台由ForwardConsoleInput处理。管道和文件使用阻塞的ReadFile读取，StopInput
+    通过CancelSynchronousIo取消读取。
+    The console is handled by ForwardConsoleInput. The pipes and the files are
+    read with the blocking ReadFile, and StopInput cancels the read operation
+    via CancelSynchronousIo.
+    */
+    static void ForwardInput(
+        _In_ HANDLE hPipe,
+        _In_ HANDLE hStopEvent)
+    {
+        HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+
+        DWORD dwConsoleMode = 0;
+        bool IsConsole = (FILE_TYPE_CHAR == GetFileType(hInput) &&
+            GetConsoleMode(hInput, &dwConsoleMode));
+
+        OVERLAPPED Overlapped = { 0 };
+        Overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (Overlapped.hEvent)
+        {
+            if (IsConsole)
+            {
+                CNSudoStandardRedirection::ForwardConsoleInput(
+                    hPipe, hStopEvent, hInput, dwConsoleMode, Overlapped);
+            }
+            else
+            {
+                BYTE Buffer[BufferSize];
+                DWORD NumberOfBytesRead = 0;
+
+                for (;;)
+                {
+                    if (!ReadFile(
+                        hInput,
+                        Buffer,
+                        BufferSize,
+                        &NumberOfBytesRead,
+                        nullptr) || 0 == NumberOfBytesRead)
+                    {
+                        break;
+                    }
+
+                    // 等待读取时可能已经被要求停止，此时丢弃读取到的内容
+                    if (WAIT_OBJECT_0 == WaitForSingleObjectEx(
+                        hStopEvent, 0, FALSE))
+                    {
+                        break;
+                    }
+
+                    if (!CNSudoStandardRedirection::WritePipe(
+                        hPipe,
+                        hStopEvent,
+                        Overlapped,
+                        Buffer,
+                        NumberOfBytesRead))
+                    {
+                        break;
+                    }
+                }
+            }
+
+            CloseHandle(Overlapped.hEvent);
+        }
+
+        CloseHandle(hPipe);
+    }
+
+    /*
+    StopInput函数停止转发标准输入并等待转发线程退出。转发控制台输入的线程在停止事
+    件被设置后退出，读取管道和文件的阻塞操作通过CancelSynchronousIo取消。
+    The StopInput function stops forwarding the standard input and waits for
+    the forwarding thread to exit. The thread which forwards the console input
+    exits after the stop event is set, and the blocking read operation of the
+    pipes and the files is cancelled via CancelSynchronousIo.
+    */
+    void StopInput()
+    {
+        if (this->m_InputThread.IsInvalid())
+        {
+            return;
+        }
+
+        SetEvent(this->m_InputStopEvent);
+
+        while (WAIT_TIMEOUT == WaitForSingleObjectEx(
+            this->m_InputThread, 50, FALSE))
+        {
+            // 线程可能尚未开始读取，所以需要重复取消
+            CancelSynchronousIo(this->m_InputThread);
+        }
+
+        this->m_InputThread.Close();
+    }
+
+    /*
+    BeginRead函数开始一个重叠的读取操作，完成时事件被设置。如果管道已经被关闭，返
+    回值为false。
+    The BeginRead function begins an overlapped read operation and the event
+    is set when it completes. If the pipe has been closed, the return value is
+    false.
+    */
+    static bool BeginRead(
+        _In_ HANDLE hPipe,
+        _Inout_ OVERLAPPED& Overlapped,
+        _Out_ PBYTE Buffer)
+    {
+        HANDLE hEvent = Overlapped.hEvent;
+
+        Overlapped = { 0 };
+        Overlapped.hEvent = hEvent;
+
+        // 同步完成时事件同样会被设置，所以两种情况都通过事件处理
+        return ReadFile(hPipe, Buffer, BufferSize, nullptr, &Overlapped) ||
+            ERROR_IO_PENDING == GetLastError();
+    }
+
+public:
+    ~CNSudoStandardRedirection()
+    {
+        this->StopInput();
+    }
+
+    /*
+    Create函数创建重定向使用的管道。
+    The Create function creates the pipes used by the redirection.
+
+    如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+    If the function fails, the return value is FALSE. To get extended error
+    information, call GetLastError.
+    */
+    BOOL Create()
+    {
+        return
+            CreatePipe(false, this->m_Input, this->m_ChildInput) &&
+            CreatePipe(true, this->m_Output, this->m_ChildOutput) &&
+            CreatePipe(true, this->m_Error, this->m_ChildError);
+    }
+
+    /*
+    GetChildHandles函数获取新进程需要继承的句柄，并把它们设置为新进程的标准句柄。
+    The GetChildHandles function gets the handles which the new process needs
+    to inherit and sets them as the standard handles of the new process.
+    */
+    void GetChildHandles(
+        _Inout_ STARTUPINFOW& StartupInfo,
+        _Out_ HANDLE (&Handles)[3])
+    {
+        StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+        StartupInfo.hStdInput = this->m_ChildInput;
+        StartupInfo.hStdOutput = this->m_ChildOutput;
+        StartupInfo.hStdError = this->m_ChildError;
+
+        Handles[0] = this->m_ChildInput;
+        Handles[1] = this->m_ChildOutput;
+        Handles[2] = this->m_ChildError;
+    }
+
+    /*
+    Start函数在新进程创建后关闭NSudo持有的新进程一侧的句柄，并开始转发标准输入。
+    The Start function closes the handles of the new process side held by
+    NSudo after the new process is created, and starts to forward the standard
+    input.
+    */
+    void Start()
+    {
+        // 只有所有写入端都被关闭后读取端才会收到文件结尾
+        this->m_ChildInput.Close();
+        this->m_ChildOutput.Close();
+        this->m_ChildError.Close();
+
+        HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+        if (!hInput || INVALID_HANDLE_VALUE == hInput)
+        {
+            // 没有标准输入时新进程直接读取到文件结尾
+            this->m_Input.Close();
+            return;
+        }
+
+        HANDLE hStopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!hStopEvent)
+        {
+            this->m_Input.Close();
+            return;
+        }
+
+        this->m_InputStopEvent = hStopEvent;
+
+        // 转发线程拥有管道句柄，所以它不会访问这个对象
+        HANDLE hPipe = this->m_Input.Detach();
+
+        HANDLE hThread = M2::CThread([hPipe, hStopEvent]()
+        {
+            CNSudoStandardRedirection::ForwardInput(hPipe, hStopEvent);
+        }).Detach();
+        if (!hThread || INVALID_HANDLE_VALUE == hThread)
+        {
+            CloseHandle(hPipe);
+            return;
+        }
+
+        this->m_InputThread = hThread;
+    }
+
+    /*
+    Relay函数把新进程的标准输出和错误转发给NSudo的标准输出和错误，直到新进程及其
+    子进程都关闭了它们，或者hCompleted被设置（进程树结束）或等待超时。之后只转发
+    管道中已有的输出，所以不在进程树中但继承了这些句柄的进程不会使NSudo一直等待。
+    The Relay function relays the standard output and error of the new process
+    to the standard output and error of NSudo until the new process and its
+    child processes close them, hCompleted is set (the process tree ends) or
+    the wait times out. After that, only the output already in the pipes is
+    relayed, so the processes outside the process tree which inherit these
+    handles cannot keep NSudo waiting.
+    */
+    void Relay(
+        _In_ HANDLE hCompleted,
+        _In_ DWORD WaitInterval)
+    {
+        ULONGLONG Deadline = (INFINITE == WaitInterval)
+            ? MAXULONGLONG
+            : GetTickCount64() + WaitInterval;
+        bool Draining = false;
+
+        HANDLE Pipes[] = { this->m_Output, this->m_Error };
+        HANDLE Targets[] =
+        {
+            GetStdHandle(STD_OUTPUT_HANDLE),
+            GetStdHandle(STD_ERROR_HANDLE)
+        };
+
+        OVERLAPPED Overlapped[2] = { 0 };
+        std::vector<BYTE> Buffers[2];
+        bool Active[2] = { false, false };
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            Overlapped[i].hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            if (Overlapped[i].hEvent)
+            {
+                Buffers[i].resize(BufferSize);
+                Active[i] = BeginRead(
+                    Pipes[i], Overlapped[i], Buffers[i].data());
+            }
+        }
+
+        for (;;)
+        {
+            HANDLE Events[3] = { nullptr, nullptr, nullptr };
+            size_t Indexes[2] = { 0, 0 };
+            DWORD EventCount = 0;
+
+            for (size_t i = 0; i < 2; ++i)
+            {
+                if (Active[i])
+                {
+                    Events[EventCount] = Overlapped[i].hEvent;
+                    Indexes[EventCount] = i;
+                    ++EventCount;
+                }
+            }
+
+            if (0 == EventCount)
+            {
+                break;
+            }
+
+            DWORD Timeout = 0;
+            if (!Draining)
+            {
+                Events[EventCount] = hCompleted;
+
+                ULONGLONG CurrentTick = GetTickCount64();
+                if (MAXULONGLONG == Deadline)
+                {
+                    Timeout = INFINITE;
+                }
+                else if (Deadline > CurrentTick)
+                {
+                    Timeout = static_cast<DWORD>(Deadline - CurrentTick);
+                }
+            }
+
+            DWORD WaitResult = WaitForMultipleObjects(
+                Draining ? EventCount : EventCount + 1,
+                Events,
+                FALSE,
+                Timeout);
+            if (!Draining && (
+                WAIT_OBJECT_0 + EventCount == WaitResult ||
+                WAIT_TIMEOUT == WaitResult))
+            {
+                // 进程树已经结束或者等待超时，转发完管道中已有的输出后退出
+                Draining = true;
+                continue;
+            }
+            if (WaitResult >= WAIT_OBJECT_0 + EventCount)
+            {
+                break;
+            }
+
+            size_t i = Indexes[WaitResult - WAIT_OBJECT_0];
+
+            DWORD NumberOfBytesRead = 0;
+            if (!GetOverlappedResult(
+                Pipes[i],
+                &Overlapped[i],
+                &NumberOfBytesRead,
+                FALSE))
+            {
+                // ERROR_BROKEN_PIPE表示所有写入端都已被关闭
+                Active[i] = false;
+                continue;
+            }
+
+            // 即使无法写入目标句柄也继续读取，防止新进程因为管道已满而阻塞
+            if (Targets[i] && INVALID_HANDLE_VALUE != Targets[i])
+            {
+                DWORD NumberOfBytesWritten = 0;
+                WriteFile(
+                    Targets[i],
+                    Buffers[i].data(),
+                    NumberOfBytesRead,
+                    &NumberOfBytesWritten,
+                    nullptr);
+            }
+
+            Active[i] = BeginRead(
+                Pipes[i], Overlapped[i], Buffers[i].data());
+        }
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            // 缓冲区释放前必须取消未完成的读取操作
+            if (Active[i])
+            {
+                DWORD NumberOfBytesRead = 0;
+                CancelIoEx(Pipes[i], &Overlapped[i]);
+                GetOverlappedResult(
+                    Pipes[i], &Overlapped[i], &NumberOfBytesRead, TRUE);
+            }
+
+            if (Overlapped[i].hEvent)
+            {
+                CloseHandle(Overlapped[i].hEvent);
+            }
+        }
+
+        // 新进程已关闭输出，停止等待NSudo的标准输入
+        this->StopInput();
+    }
+};
+
+// 一次应用对令牌的会话、特权和完整性级别的调整
+// Applies the adjustments of the session, the privileges and the integrity
+// level of the token in one pass.
+BOOL NSudoAdjustProcessToken(
+    _In_ HANDLE hToken,
+    _In_ const NSUDO_TOKEN_ADJUSTMENTS& Adjustments)
+{
+    CNSudoStageScope StageScope(NSudoStage::AdjustToken);
+
+    CNSudoTokenBuilder Builder;
+    if (!Builder.Apply(hToken, Adjustments))
+    {
+        return FALSE;
+    }
+
+    StageScope.SetResult(TRUE);
+
+    return TRUE;
+}
+
+/*
+NSudoCreateUserToken函数复制指定用户的主令牌，然后一次调整令牌的会话、特权和完整
+性级别。Adjustments中的会话被忽略，令牌的会话由用户模式决定。调用该函数前当前线
+程必须模拟SYSTEM用户。
+The NSudoCreateUserToken function duplicates the primary token of the
+specified user, and then adjusts the session, the privileges and the integrity
+level of the token in one pass. The session in Adjustments is ignored, and the
+session of the token is decided by the user mode. The current thread must
+impersonate the SYSTEM user before calling this function.
+
+hCurrentProcessToken是CurrentProcess和CurrentProcessDropRight模式使用的令牌，
+调用者需要在模拟前打开它。
+hCurrentProcessToken is the token used by the CurrentProcess and
+CurrentProcessDropRight modes, and the caller needs to open it before
+impersonating.
+
+如果函数执行失败，返回值为FALSE。调用GetLastError可获取详细错误码。
+If the function fails, the return value is FALSE. To get extended error
+information, call GetLastError.
+*/
+BOOL NSudoCreateUserToken(
+    _In_ CNSudoTokenCache* TokenCache,
+    _In_ NSudoOptionUserValue UserMode,
+    _In_opt_ HANDLE hCurrentProcessToken,
+    _In_ DWORD dwSessionID,
+    _In_ const NSUDO_TOKEN_ADJUSTMENTS& Adjustments,
+    _Outptr_ PHANDLE phToken)
+{
+    M2::CHandle hToken;
+    M2::CHandle hTempToken;
+
+    // 复制的令牌需要设置的会话，(DWORD)-1表示不修改。会话令牌已经位于目标会话
+    DWORD TokenSessionId = static_cast<DWORD>(-1);
+
+    {
+        CNSudoStageScope StageScope(NSudoStage::DuplicateToken);
+
+        if (NSudoOptionUserValue::TrustedInstaller == UserMode)
+        {
+            if (!TokenCache->DuplicateTrustedInstallerToken(&hToken))
+            {
+                return FALSE;
+            }
+
+            TokenSessionId = dwSessionID;
+        }
+        else if (NSudoOptionUserValue::System == UserMode)
+        {
+            if (!TokenCache->DuplicateSystemToken(&hToken))
+            {
+                return FALSE;
+            }
+
+            // 缓存的令牌可能来自其他会话（例如通过NSudo代理创建进程时）
+            TokenSessionId = dwSessionID;
+        }
+        else if (NSudoOptionUserValue::CurrentUser == UserMode)
+        {
+            if (!NSudoDuplicateSessionToken(
+                dwSessionID,
+                MAXIMUM_ALLOWED,
+                nullptr,
+                SecurityIdentification,
+                TokenPrimary,
+                &hToken))
+            {
+                return FALSE;
+            }
+        }
+        else if (NSudoOptionUserValue::CurrentProcess == UserMode)
+        {
+            if (!DuplicateTokenEx(
+                hCurrentProcessToken,
+                MAXIMUM_ALLOWED,
+                nullptr,
+                SecurityIdentification,
+                TokenPrimary,
+                &hToken))
+            {
+                return FALSE;
+            }
+
+            // 使用 -Session 时新进程位于目标会话而不是当前进程的会话
+            TokenSessionId = dwSessionID;
+        }
+        else if (NSudoOptionUserValue::CurrentProcessDropRight == UserMode)
+        {
+            if (!DuplicateTokenEx(
+                hCurrentProcessToken,
+                MAXIMUM_ALLOWED,
+                nullptr,
+                SecurityIdentification,
+                TokenPrimary,
+                &hTempToken))
+            {
+                return FALSE;
+            }
+
+            if (!NSudoCreateLUAToken(&hToken, hTempToken))
+            {
+                return FALSE;
+            }
+
+            TokenSessionId = dwSessionID;
+        }
+
+        StageScope.SetResult(TRUE);
+    }
+
+    // 会话、特权和完整性级别在复制令牌后一次调整
+    NSUDO_TOKEN_ADJUSTMENTS TokenAdjustments = Adjustments;
+    TokenAdjustments.SessionId = TokenSessionId;
+
+    if (!NSudoAdjustProcessToken(hToken, TokenAdjustments))
+    {
+        return FALSE;
+    }
+
+    *phToken = hToken.Detach();
+
+    return TRUE;
+}
+
+/*
+NSudoCreateProcess函数创建一个新进程和对应的主线程
+The NSudoCreateProcess function creates a new process and its primary thread.
+
+如果需要等待，则等待新进程和它创建的所有子进程结束，退出代码为新进程的退出代码。
+If the wait interval is not zero, the function waits for the new process and
+all child processes created by it, and the exit code is the exit code of the
+new process.
+
+如果指定了资源限制，则在新进程恢复运行前把限制应用到它所在的作业；如果无法应用
+限制，则结束新进程并返回失败。
+If the resource limits are specified, they are applied to the job of the new
+process before it is resumed; if they cannot be applied, the new process is
+terminated and the function fails.
+
+处理器组、关联掩码和首选NUMA节点通过进程和线程属性列表在创建进程时指定，CPU集
+在新进程恢复运行前设置。如果新进程的主处理器组不是指定的处理器组，则只有初始线程
+使用指定的关联掩码。
+The processor group, the affinity mask and the preferred NUMA node are
+specified via the process and thread attribute list when creating the process,
+and the CPU sets are set before the new process is resumed. If the primary
+group of the new process is not the specified processor group, only the initial
+thread uses the specified affinity mask.
+
+I/O优先级、内存优先级和EcoQoS同样在新进程恢复运行前设置。
+The I/O priority, the memory priority and the EcoQoS are also set before the
+new process is resumed.
+
+如果重定向了标准句柄，新进程只继承重定向使用的管道句柄，并且函数在转发完新进程
+的输出后才返回。
+If the standard handles are redirected, the new process only inherits the pipe
+handles used by the redirection, and the function returns after the output of
+the new process is relayed.
+
+如果指定了ParentProcess，则忽略hToken，新进程以ParentProcess为父进程并继承它的令
+牌和会话，令牌的调整在新进程恢复运行前应用到新进程自己的令牌上。
+If ParentProcess is specified, hToken is ignored, and the new process is
+created as a child of ParentProcess which inherits its token and session. The
+token adjustments are applied to the token of the new process itself before it
+is resumed.
+
+如果指定了StartedProcess，函数在新进程恢复运行后立即返回，新进程的句柄和进程树
+交给调用者，调用者需要调用NSudoWaitStartedProcess或者NSudoCloseStartedProcess。
+此时WaitInterval和lpExitCode被忽略，并且不能重定向标准句柄。重定向标准句柄时
+WaitInterval也不能为0。
+If StartedProcess is specified, the function returns right after the new
+process is resumed, and the handle and the process tree of the new process are
+handed over to the caller, which needs to call NSudoWaitStartedProcess or
+NSudoCloseStartedProcess. WaitInterval and lpExitCode are ignored in this
+case, and the standard handles cannot be redirected. WaitInterval cannot be 0
+either when the standard handles are redirected.
+
+如果指定了Stats，则在等待结束后获取新进程的资源使用情况。
+If Stats is specified, the resource usage of the new process is obtained after
+the wait ends.
+
+如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
+If the function fails, the return value is NULL. To get extended error
+information, call GetLastError.
+*/
+bool NSudoCreateProcess(
+    _In_opt_ HANDLE hToken,
+    _In_ LPCWSTR lpCommandLine,
+    _In_opt_ LPCWSTR lpCurrentDirectory,
+    _In_ DWORD WaitInterval,
+    _In_ const NSUDO_CREATE_PROCESS_OPTIONS& Options,
+    _Out_opt_ PDWORD lpExitCode,
+    _Out_opt_ PNSUDO_STARTED_PROCESS StartedProcess,
+    _Out_opt_ PNSUDO_PROCESS_STATS Stats)
+{
+    // 转发标准句柄需要在返回前等待进程树结束，所以无法把新进程交给调用者，也
+    // 不能在不等待时使用
+    if (Options.RedirectOutput && (StartedProcess || 0 == WaitInterval))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    DWORD dwCreationFlags = CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT;
+
+    if (Options.CreateNewConsole)
+    {
+        // 重定向标准句柄时新的控制台窗口没有内容，所以不显示它
+        dwCreationFlags |= Options.RedirectOutput ? CREATE_NO_WINDOW : CREATE_NEW_CONSOLE;
+    }
+
+    STARTUPINFOEXW StartupInfo = { 0 };
+    PROCESS_INFORMATION ProcessInfo = { 0 };
+
+    StartupInfo.StartupInfo.cb = sizeof(STARTUPINFOEXW);
+
+    StartupInfo.StartupInfo.lpDesktop = const_cast<LPWSTR>(L"WinSta0\\Default");
+
+    StartupInfo.StartupInfo.dwFlags |= STARTF_USESHOWWINDOW;
+    StartupInfo.StartupInfo.wShowWindow = static_cast<WORD>(Options.ShowWindowMode);
+
+    std::wstring EnvironmentBlock;
+    PNSUDO_PROCESS_TREE ProcessTree = nullptr;
+
+    // 属性的值在创建进程前必须一直有效
+    CNSudoProcThreadAttributeList AttributeList;
+    GROUP_AFFINITY GroupAffinity = { 0 };
+    USHORT PreferredNode = 0;
+    HANDLE InheritedHandles[3] = { nullptr, nullptr, nullptr };
+    HANDLE hParentProcess = nullptr;
+
+    CNSudoStandardRedirection Redirection;
+
+    DWORD AttributeCount = 0;
+    if (Options.Placement && Options.Placement->HasGroupAffinity)
+    {
+        ++AttributeCount;
+
+        GroupAffinity.Group = Options.Placement->ProcessorGroup;
+        GroupAffinity.Mask = Options.Placement->Affinity;
+
+        // 未指定关联掩码时使用处理器组内的所有处理器
+        if (0 == GroupAffinity.Mask)
+        {
+            DWORD ProcessorCount = GetActiveProcessorCount(GroupAffinity.Group);
+            GroupAffinity.Mask =
+                (ProcessorCount >= sizeof(KAFFINITY) * 8)
+                ? static_cast<KAFFINITY>(-1)
+                : ((static_cast<KAFFINITY>(1) << ProcessorCount) - 1);
+        }
+    }
+    if (Options.Placement && Options.Placement->HasPreferredNode)
+    {
+        ++AttributeCount;
+
+        PreferredNode = Options.Placement->PreferredNode;
+    }
+
+    if (Options.ParentProcess)
+    {
+        ++AttributeCount;
+
+        hParentProcess = Options.ParentProcess->ProcessHandle;
+    }
+
+    BOOL result = TRUE;
+
+    if (Options.RedirectOutput)
+    {
+        ++AttributeCount;
+
+        result = Redirection.Create();
+        if (result)
+        {
+            Redirection.GetChildHandles(
+                StartupInfo.StartupInfo, InheritedHandles);
+        }
+    }
+
+    if (result && 0 != AttributeCount)
+    {
+        result = AttributeList.Initialize(AttributeCount);
+
+        if (result && Options.Placement && Options.Placement->HasGroupAffinity)
+        {
+            result = AttributeList.Update(
+                PROC_THREAD_ATTRIBUTE_GROUP_AFFINITY,
+                &GroupAffinity,
+                sizeof(GROUP_AFFINITY));
+        }
+
+        if (result && Options.Placement && Options.Placement->HasPreferredNode)
+        {
+            result = AttributeList.Update(
+                PROC_THREAD_ATTRIBUTE_PREFERRED_NODE,
+                &PreferredNode,
+                sizeof(USHORT));
+        }
+
+        // 显式指定继承的句柄，防止其他可继承的句柄泄漏到新进程
+        if (result && Options.RedirectOutput)
+        {
+            result = AttributeList.Update(
+                PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                InheritedHandles,
+                sizeof(InheritedHandles));
+        }
+
+        if (result && Options.ParentProcess)
+        {
+            result = AttributeList.Update(
+                PROC_THREAD_ATTRIBUTE_PARENT_PROCESS,
+                &hParentProcess,
+                sizeof(HANDLE));
+        }
+
+        if (result)
+        {
+            StartupInfo.lpAttributeList = AttributeList.Get();
+            dwCreationFlags |= EXTENDED_STARTUPINFO_PRESENT;
+        }
+    }
+
+    if (result && !NSudoGetCreateProcessEnvironmentBlock(
+        Options.EnvironmentVariables, EnvironmentBlock))
+    {
+        result = FALSE;
+    }
+
+    std::wstring ExpandedCommandLine;
+    if (result)
+    {
+        ExpandedCommandLine = NSudoExpandEnvironmentStrings(lpCommandLine);
+    }
+
+    if (result)
+    {
+        {
+            CNSudoStageScope StageScope(NSudoStage::CreateProcess);
+
+            // 未指定令牌时新进程继承父进程的令牌
+            result = CreateProcessAsUserW(
+                Options.ParentProcess ? nullptr : hToken,
+                nullptr,
+                &ExpandedCommandLine[0],
+                nullptr,
+                nullptr,
+                Options.RedirectOutput ? TRUE : FALSE,
+                dwCreationFlags,
+                &EnvironmentBlock[0],
+                lpCurrentDirectory,
+                &StartupInfo.StartupInfo,
+                &ProcessInfo);
+
+            if (result)
+            {
+                StageScope.SetProcessId(ProcessInfo.dwProcessId);
+
+                // 在进程恢复运行前放入作业，使它创建的子进程也在作业中
+                if (0 != WaitInterval || StartedProcess)
+                {
+                    ProcessTree = NSudoGetProcessTreeWaiter().Track(
+                        ProcessInfo.hProcess);
+                }
+
+                // 进程仍处于挂起状态，所以限制对它的第一条指令就已生效
+                if (Options.JobLimits && NSudoHasJobLimits(*Options.JobLimits))
+                {
+                    result = NSudoSetProcessJobLimits(
+                        ProcessInfo.hProcess,
+                        ProcessTree ? ProcessTree->JobHandle : nullptr,
+                        *Options.JobLimits);
+                }
+
+                // 属性只设置初始线程的关联，进程的关联掩码决定之后创建的线程和
+                // 子进程使用的处理器。SetProcessAffinityMask总是作用于进程的主
+                // 处理器组，所以只在主处理器组就是指定的处理器组时调用，否则只
+                // 有初始线程使用指定的关联掩码
+                if (result && Options.Placement && Options.Placement->HasGroupAffinity)
+                {
+                    USHORT ProcessGroup = 0;
+                    USHORT ProcessGroupCount = 1;
+                    if (GetProcessGroupAffinity(
+                        ProcessInfo.hProcess,
+                        &ProcessGroupCount,
+                        &ProcessGroup) &&
+                        1 == ProcessGroupCount &&
+                        GroupAffinity.Group == ProcessGroup)
+                    {
+                        result = SetProcessAffinityMask(
+                            ProcessInfo.hProcess, GroupAffinity.Mask);
+                    }
+                }
+
+                if (result && Options.Placement && !Options.Placement->CpuSets.empty())
+                {
+                    result = NSudoSetProcessDefaultCpuSets(
+                        ProcessInfo.hProcess, Options.Placement->CpuSets);
+                }
+
+                if (result && Options.QoS && NSudoHasProcessQoS(*Options.QoS))
+                {
+                    result = NSudoSetProcessQoS(ProcessInfo.hProcess, *Options.QoS);
+                }
+
+                // 新进程的令牌是父进程令牌的副本，调整它不影响父进程
+                if (result && Options.ParentProcess)
+                {
+                    M2::CHandle hProcessToken;
+
+                    result = OpenProcessToken(
+                        ProcessInfo.hProcess,
+                        MAXIMUM_ALLOWED,
+                        &hProcessToken) &&
+                        NSudoAdjustProcessToken(
+                            hProcessToken,
+                            Options.ParentProcess->Adjustments);
+                }
+
+                if (result)
+                {
+                    SetPriorityClass(ProcessInfo.hProcess, Options.ProcessPriority);
+
+                    if (Options.RedirectOutput)
+                    {
+                        Redirection.Start();
+                    }
+
+                    ResumeThread(ProcessInfo.hThread);
+                }
+                else
+                {
+                    // 不允许进程在没有资源限制、指定的放置、调度设置或者令牌调整
+                    // 的情况下运行
+                    DWORD dwError = GetLastError();
+
+                    TerminateProcess(ProcessInfo.hProcess, dwError);
+
+                    if (ProcessTree)
+                    {
+                        NSudoGetProcessTreeWaiter().Release(ProcessTree);
+                    }
+
+                    CloseHandle(ProcessInfo.hProcess);
+                    CloseHandle(ProcessInfo.hThread);
+
+                    SetLastError(dwError);
+                }
+            }
+
+            StageScope.SetResult(result);
+        }
+
+        if (result)
+        {
+            CloseHandle(ProcessInfo.hThread);
+
+            NSUDO_STARTED_PROCESS Started;
+            Started.ProcessHandle = ProcessInfo.hProcess;
+            Started.ProcessId = ProcessInfo.dwProcessId;
+            Started.ProcessTree = ProcessTree;
+
+            if (StartedProcess)
+            {
+                *StartedProcess = Started;
+            }
+            else
+            {
+                CNSudoStageScope StageScope(NSudoStage::Wait);
+                StageScope.SetProcessId(ProcessInfo.dwProcessId);
+
+                // 转发输出直到进程树结束，之后的等待会立即返回
+                if (Options.RedirectOutput)
+                {
+                    Redirection.Relay(
+                        ProcessTree
+                        ? ProcessTree->CompletedEvent
+                        : ProcessInfo.hProcess,
+                        WaitInterval);
+                }
+
+                // 如果进程尚未结束，则退出代码为STILL_ACTIVE
+                DWORD WaitResult = NSudoWaitStartedProcess(
+                    Started, WaitInterval, lpExitCode, Stats);
+
+                StageScope.SetResult(WAIT_FAILED != WaitResult);
+            }
+        }
+    }
+
+    //返回结果
+    return result;
+}
+
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
@@ -0,0 +1,640 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoCore.h
+ * PURPOSE:   Definition for the NSudo launch core
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_CORE_
+#define _NSUDO_CORE_
+
+#include <Windows.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "M2BaseHelpers.h"
+#include "NSudoTraceLogging.h"
+#include "NSudoAPI.h"
+
+/**
+ * The stages of creating a process, which are used by the ETW events and to
+ * measure the time spent in each stage.
+ */
+enum class NSudoStage
+{
+    Startup,
+    ImpersonateAsSystem,
+    DuplicateToken,
+    StartService,
+    OpenParentProcess,
+    AdjustToken,
+    CreateEnvironmentBlock,
+    CreateProcess,
+    Wait,
+
+    Count
+};
+
+/**
+ * The names of the stages in the ETW events and the NSudoBench output, in the
+ * same order as NSudoStage.
+ */
+extern const char* const NSudoStageNames[];
+
+#if defined(NSUDO_BENCHMARK)
+
+/**
+ * The accumulated time of each stage in QueryPerformanceCounter ticks, which
+ * is read and reset by NSudoBench.
+ */
+extern LONGLONG g_NSudoStageTicks[static_cast<size_t>(NSudoStage::Count)];
+
+/**
+ * The QueryPerformanceCounter tick when the CreateProcess stage is entered for
+ * the first time, or 0 if it is not entered yet.
+ */
+extern LONGLONG g_NSudoFirstCreateProcessTick;
+
+#endif
+
+/**
+ * The scope which writes the start and stop ETW events of a stage, and
+ * NSudoBench also measures the time of the stage. SetResult must be called
+ * when the stage succeeds, otherwise the stop event records a failure with the
+ * last error at that time.
+ */
+class CNSudoStageScope : public CNSudoTraceActivity
+{
+#if defined(NSUDO_BENCHMARK)
+private:
+    NSudoStage m_Stage;
+    LARGE_INTEGER m_Start;
+#endif
+
+public:
+    /**
+     * Starts the stage.
+     *
+     * @param Stage The stage.
+     */
+    CNSudoStageScope(
+        _In_ NSudoStage Stage) :
+        CNSudoTraceActivity(NSudoStageNames[static_cast<size_t>(Stage)])
+    {
+#if defined(NSUDO_BENCHMARK)
+        this->m_Stage = Stage;
+        QueryPerformanceCounter(&this->m_Start);
+
+        if (NSudoStage::CreateProcess == Stage &&
+            0 == g_NSudoFirstCreateProcessTick)
+        {
+            g_NSudoFirstCreateProcessTick = this->m_Start.QuadPart;
+        }
+#endif
+    }
+
+#if defined(NSUDO_BENCHMARK)
+    /**
+     * Stops the stage and accumulates the time of it.
+     */
+    ~CNSudoStageScope()
+    {
+        LARGE_INTEGER End;
+        QueryPerformanceCounter(&End);
+
+        g_NSudoStageTicks[static_cast<size_t>(this->m_Stage)] +=
+            End.QuadPart - this->m_Start.QuadPart;
+    }
+#endif
+};
+
+/**
+ * The definitions of the Token Privileges.
+ */
+typedef enum _TOKEN_PRIVILEGES_LIST
+{
+    SeMinWellKnownPrivilege = 2,
+    SeCreateTokenPrivilege = 2,
+    SeAssignPrimaryTokenPrivilege,
+    SeLockMemoryPrivilege,
+    SeIncreaseQuotaPrivilege,
+    SeMachineAccountPrivilege,
+    SeTcbPrivilege,
+    SeSecurityPrivilege,
+    SeTakeOwnershipPrivilege,
+    SeLoadDriverPrivilege,
+    SeSystemProfilePrivilege,
+    SeSystemtimePrivilege,
+    SeProfileSingleProcessPrivilege,
+    SeIncreaseBasePriorityPrivilege,
+    SeCreatePagefilePrivilege,
+    SeCreatePermanentPrivilege,
+    SeBackupPrivilege,
+    SeRestorePrivilege,
+    SeShutdownPrivilege,
+    SeDebugPrivilege,
+    SeAuditPrivilege,
+    SeSystemEnvironmentPrivilege,
+    SeChangeNotifyPrivilege,
+    SeRemoteShutdownPrivilege,
+    SeUndockPrivilege,
+    SeSyncAgentPrivilege,
+    SeEnableDelegationPrivilege,
+    SeManageVolumePrivilege,
+    SeImpersonatePrivilege,
+    SeCreateGlobalPrivilege,
+    SeTrustedCredManAccessPrivilege,
+    SeRelabelPrivilege,
+    SeIncreaseWorkingSetPrivilege,
+    SeTimeZonePrivilege,
+    SeCreateSymbolicLinkPrivilege,
+    SeDelegateSessionUserImpersonatePrivilege,
+    SeMaxWellKnownPrivilege = SeDelegateSessionUserImpersonatePrivilege
+} TOKEN_PRIVILEGES_LIST, *PTOKEN_PRIVILEGES_LIST;
+
+/**
+ * The privilege name definition.
+ */
+typedef struct _NSUDO_PRIVILEGE_NAME_DEFINITION
+{
+    LPCWSTR Name;
+    TOKEN_PRIVILEGES_LIST Value;
+} NSUDO_PRIVILEGE_NAME_DEFINITION, *PNSUDO_PRIVILEGE_NAME_DEFINITION;
+
+/**
+ * The names of the privileges, so the LUIDs of the privileges are obtained
+ * without calling LookupPrivilegeValueW.
+ */
+extern const NSUDO_PRIVILEGE_NAME_DEFINITION NSudoPrivilegeNames[
+    SeMaxWellKnownPrivilege - SeMinWellKnownPrivilege + 1];
+
+/**
+ * The adjustments of an access token, which are applied in one pass.
+ */
+typedef struct _NSUDO_TOKEN_ADJUSTMENTS
+{
+    // 令牌的会话ID，(DWORD)-1表示不修改
+    DWORD SessionId = static_cast<DWORD>(-1);
+    NSudoOptionPrivilegesValue PrivilegesMode =
+        NSudoOptionPrivilegesValue::Default;
+    // 在PrivilegesMode之后按名称启用和禁用的特权，第N位对应LUID为N的特权
+    ULONGLONG EnablePrivileges = 0;
+    ULONGLONG DisablePrivileges = 0;
+    NSudoOptionIntegrityLevelValue IntegrityLevelMode =
+        NSudoOptionIntegrityLevelValue::Default;
+} NSUDO_TOKEN_ADJUSTMENTS, *PNSUDO_TOKEN_ADJUSTMENTS;
+
+/**
+ * The access rights to open the parent process for the parent process engine.
+ * SYNCHRONIZE is used to detect whether the cached process has exited.
+ */
+#define NSUDO_PARENT_PROCESS_ACCESS \
+    (PROCESS_CREATE_PROCESS | PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE)
+
+/**
+ * The cache of the SYSTEM impersonation token, the SYSTEM primary token, the
+ * TrustedInstaller primary token and the handle of the TrustedInstaller
+ * service process, which are reused in multiple process creations. The cached
+ * token is acquired again when it becomes invalid.
+ *
+ * All member functions return a copy of the cached token, so the caller can
+ * modify the returned token freely.
+ */
+class CNSudoTokenCache
+{
+private:
+    M2::CCriticalSection m_CriticalSection;
+
+    M2::CHandle m_SystemImpersonationToken;
+    M2::CHandle m_SystemToken;
+    M2::CHandle m_TrustedInstallerToken;
+    M2::CHandle m_TrustedInstallerProcess;
+
+    static BOOL AcquireSystemToken(
+        _Outptr_ PHANDLE phToken);
+
+    template<typename TAcquireFunction>
+    BOOL DuplicateCachedToken(
+        _Inout_ M2::CHandle& CachedToken,
+        _In_ TAcquireFunction&& AcquireFunction,
+        _In_ SECURITY_IMPERSONATION_LEVEL ImpersonationLevel,
+        _In_ TOKEN_TYPE TokenType,
+        _Outptr_ PHANDLE phToken);
+
+public:
+    /**
+     * Assigns a SYSTEM user impersonation token with all privileges enabled
+     * to the current thread.
+     *
+     * @return If the function fails, the return value is FALSE. To get
+     *         extended error information, call GetLastError.
+     */
+    BOOL ImpersonateAsSystem();
+
+    /**
+     * Obtains a copy of the SYSTEM user primary token of the current session.
+     *
+     * @param phToken The copy of the token.
+     * @return If the function fails, the return value is FALSE. To get
+     *         extended error information, call GetLastError.
+     */
+    BOOL DuplicateSystemToken(
+        _Outptr_ PHANDLE phToken);
+
+    /**
+     * Obtains a copy of the TrustedInstaller primary token.
+     *
+     * @param phToken The copy of the token.
+     * @return If the function fails, the return value is FALSE. To get
+     *         extended error information, call GetLastError.
+     * @remark The current thread must impersonate the SYSTEM user.
+     */
+    BOOL DuplicateTrustedInstallerToken(
+        _Outptr_ PHANDLE phToken);
+
+    /**
+     * Obtains a copy of the handle of the TrustedInstaller service process
+     * for the parent process engine.
+     *
+     * @param phProcess The copy of the handle.
+     * @return If the function fails, the return value is FALSE. To get
+     *         extended error information, call GetLastError.
+     * @remark The current thread must impersonate the SYSTEM user.
+     */
+    BOOL OpenTrustedInstallerProcess(
+        _Outptr_ PHANDLE phProcess);
+
+    /**
+     * Starts the TrustedInstaller service, and replaces the cached
+     * TrustedInstaller token and process handle with the ones of the new
+     * service process.
+     *
+     * @return If the function fails, the return value is FALSE. To get
+     *         extended error information, call GetLastError.
+     * @remark The current thread must impersonate the SYSTEM user.
+     */
+    BOOL RefreshTrustedInstaller();
+
+    /**
+     * Discards all cached tokens.
+     */
+    void Invalidate();
+};
+
+/**
+ * The environment variables which override the environment block.
+ */
+typedef std::vector<std::pair<std::wstring, std::wstring>>
+NSUDO_ENVIRONMENT_VARIABLES, *PNSUDO_ENVIRONMENT_VARIABLES;
+
+/**
+ * The process tree in a job, which is tracked by the process tree waiter.
+ */
+typedef struct _NSUDO_PROCESS_TREE
+{
+    ULONG_PTR Key;
+    HANDLE JobHandle;
+    // 作业中没有活动的进程时触发
+    HANDLE CompletedEvent;
+} NSUDO_PROCESS_TREE, *PNSUDO_PROCESS_TREE;
+
+/**
+ * The new process which is resumed but not waited yet.
+ */
+typedef struct _NSUDO_STARTED_PROCESS
+{
+    HANDLE ProcessHandle;
+    DWORD ProcessId;
+    // 新进程所在的进程树，无法放入作业时为nullptr
+    PNSUDO_PROCESS_TREE ProcessTree;
+} NSUDO_STARTED_PROCESS, *PNSUDO_STARTED_PROCESS;
+
+/**
+ * The resource usage of the new process when it ends. The unit of the times is
+ * 100 nanoseconds.
+ */
+typedef struct _NSUDO_PROCESS_STATS
+{
+    DWORD ProcessId;
+    // 以下的累计值是否包含整个进程树，否则只包含新进程
+    bool IncludesProcessTree;
+    // 进程树中曾经存在过的进程数
+    DWORD TotalProcesses;
+    ULONGLONG WallTime;
+    ULONGLONG UserTime;
+    ULONGLONG KernelTime;
+    // 峰值工作集只能获取新进程的
+    SIZE_T PeakWorkingSet;
+    SIZE_T PeakCommit;
+    ULONGLONG ReadOperationCount;
+    ULONGLONG WriteOperationCount;
+    ULONGLONG ReadTransferCount;
+    ULONGLONG WriteTransferCount;
+    DWORD PageFaultCount;
+} NSUDO_PROCESS_STATS, *PNSUDO_PROCESS_STATS;
+
+/**
+ * The resource limits of the job. The items whose values are 0 are not
+ * limited.
+ */
+typedef struct _NSUDO_JOB_LIMITS
+{
+    // CPU占用率的上限，单位为百分比（1-100）
+    DWORD CpuRate;
+    // 作业中所有进程提交的内存的上限，单位为字节
+    SIZE_T JobMemoryLimit;
+    // 每个进程的最大工作集，单位为字节
+    SIZE_T MaximumWorkingSetSize;
+    // 每秒I/O操作数的上限
+    DWORD MaximumIops;
+    // 同时运行的进程数的上限
+    DWORD ActiveProcessLimit;
+} NSUDO_JOB_LIMITS, *PNSUDO_JOB_LIMITS;
+
+/**
+ * The placement of the process on the processors and the NUMA nodes. The
+ * items which are not specified are decided by the scheduler.
+ */
+typedef struct _NSUDO_PROCESS_PLACEMENT
+{
+    // 是否指定了处理器组或者关联掩码
+    bool HasGroupAffinity;
+    // 处理器组，未指定时为0
+    WORD ProcessorGroup;
+    // 处理器组内的关联掩码，未指定时为组内的所有处理器。进程的主处理器组不是
+    // ProcessorGroup时只应用于初始线程
+    KAFFINITY Affinity;
+    // 是否指定了首选的NUMA节点
+    bool HasPreferredNode;
+    USHORT PreferredNode;
+    // 进程默认的CPU集ID
+    std::vector<ULONG> CpuSets;
+} NSUDO_PROCESS_PLACEMENT, *PNSUDO_PROCESS_PLACEMENT;
+
+/**
+ * The I/O priority of the process, which has the same values as the
+ * IO_PRIORITY_HINT of the kernel.
+ */
+enum class NSudoIoPriority : DWORD
+{
+    VeryLow = 0,
+    Low = 1,
+    Normal = 2,
+
+    Default = MAXDWORD
+};
+
+/**
+ * The scheduling settings of the process other than the priority class. The
+ * items which are not specified keep the defaults of the system.
+ */
+typedef struct _NSUDO_PROCESS_QOS
+{
+    NSudoIoPriority IoPriority = NSudoIoPriority::Default;
+    // MEMORY_PRIORITY_VERY_LOW到MEMORY_PRIORITY_NORMAL，为0时不设置
+    ULONG MemoryPriority = 0;
+    // 是否启用EcoQoS（执行速度的电源限制）
+    bool EcoQoS = false;
+} NSUDO_PROCESS_QOS, *PNSUDO_PROCESS_QOS;
+
+/**
+ * The parameters of the parent process engine.
+ */
+typedef struct _NSUDO_PARENT_PROCESS
+{
+    // 新进程继承其令牌的进程，需要NSUDO_PARENT_PROCESS_ACCESS访问权限
+    M2::CHandle ProcessHandle;
+    // 在新进程恢复运行前对新进程的令牌做的调整
+    NSUDO_TOKEN_ADJUSTMENTS Adjustments;
+} NSUDO_PARENT_PROCESS, *PNSUDO_PARENT_PROCESS;
+
+/**
+ * The options of creating a process, which is the internal counterpart of
+ * NSUDO_LAUNCH_OPTIONS. The optional settings which are nullptr are not
+ * applied.
+ */
+typedef struct _NSUDO_CREATE_PROCESS_OPTIONS
+{
+    // 新进程的优先级类
+    DWORD ProcessPriority = 0;
+    // 新进程窗口的SW_*值
+    DWORD ShowWindowMode = SW_SHOWDEFAULT;
+    // 新进程是否使用新控制台
+    bool CreateNewConsole = true;
+    // 覆盖环境块的环境变量
+    const NSUDO_ENVIRONMENT_VARIABLES* EnvironmentVariables = nullptr;
+    // 新进程所在作业的资源限制
+    const NSUDO_JOB_LIMITS* JobLimits = nullptr;
+    // 新进程的处理器位置
+    const NSUDO_PROCESS_PLACEMENT* Placement = nullptr;
+    // 新进程的调度设置
+    const NSUDO_PROCESS_QOS* QoS = nullptr;
+    // 是否转发新进程的标准句柄，此时WaitInterval不能为0
+    bool RedirectOutput = false;
+    // 如果指定，新进程作为它的子进程创建并继承它的令牌和会话
+    const NSUDO_PARENT_PROCESS* ParentProcess = nullptr;
+} NSUDO_CREATE_PROCESS_OPTIONS, *PNSUDO_CREATE_PROCESS_OPTIONS;
+
+/**
+ * Initializes the current thread as a COM single-threaded apartment in the
+ * scope. Only the paths of the GUI, the context menu management and getting
+ * the file associations need COM, so the command line paths do not load and
+ * initialize COM.
+ */
+class CNSudoComInitializer : M2::CDisableObjectCopying
+{
+private:
+    HRESULT m_hr;
+
+public:
+    CNSudoComInitializer()
+    {
+        this->m_hr = CoInitializeEx(
+            nullptr,
+            COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+    }
+
+    ~CNSudoComInitializer()
+    {
+        // 线程已经以其他并发模型初始化时返回RPC_E_CHANGED_MODE，此时无需反初始化
+        if (SUCCEEDED(this->m_hr))
+        {
+            CoUninitialize();
+        }
+    }
+};
+
+/**
+ * The callback function of NotifyServiceStatusChangeW, which marks that the
+ * service status has been changed.
+ *
+ * @param pParameter The SERVICE_NOTIFYW whose pContext points to a bool.
+ */
+VOID CALLBACK NSudoServiceNotifyCallback(
+    _In_ PVOID pParameter);
+
+/**
+ * Obtains the session ID of the current process.
+ *
+ * @param SessionID The session ID.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ */
+BOOL WINAPI NSudoGetCurrentProcessSessionID(
+    _Out_ PDWORD SessionID);
+
+/**
+ * Enables or disables the specified privilege in the specified access token.
+ *
+ * @param hExistingToken The access token, which needs the
+ *                       TOKEN_ADJUST_PRIVILEGES access right.
+ * @param Privilege The privilege.
+ * @param bEnable Whether to enable the privilege.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ */
+BOOL WINAPI NSudoSetTokenPrivilege(
+    _In_ HANDLE hExistingToken,
+    _In_ TOKEN_PRIVILEGES_LIST Privilege,
+    _In_ bool bEnable);
+
+/**
+ * Opens the winlogon process of the specified session. The PID of the process
+ * is cached per session.
+ *
+ * @param dwSessionID The session ID.
+ * @param dwDesiredAccess The access rights of the process handle.
+ * @param phProcess The process handle.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ */
+BOOL NSudoOpenWinLogonProcess(
+    _In_ DWORD dwSessionID,
+    _In_ DWORD dwDesiredAccess,
+    _Outptr_ PHANDLE phProcess);
+
+/**
+ * Enables the cache of the environment blocks. It is only worth it for the
+ * callers which create many processes, because the registry keys of the
+ * environment variables need to be watched.
+ */
+void NSudoEnableEnvironmentCache();
+
+/**
+ * Ends the thread which waits for the process trees. The thread is created
+ * again when a process tree is waited later.
+ *
+ * @remark It must not be called in DllMain.
+ */
+void NSudoStopProcessTreeWaiter();
+
+/**
+ * Stops tracking the process tree of the new process and closes the handle of
+ * the new process. The new process is not terminated.
+ *
+ * @param StartedProcess The new process.
+ */
+void NSudoCloseStartedProcess(
+    _Inout_ NSUDO_STARTED_PROCESS& StartedProcess);
+
+/**
+ * Waits for the process tree of the new process to end, and then closes the
+ * new process.
+ *
+ * @param StartedProcess The new process.
+ * @param WaitInterval The milliseconds to wait.
+ * @param lpExitCode The exit code of the new process, or STILL_ACTIVE if the
+ *                   process tree has not ended.
+ * @param Stats The resource usage of the new process, which is obtained before
+ *              closing.
+ * @return The same as WaitForSingleObjectEx.
+ */
+DWORD NSudoWaitStartedProcess(
+    _Inout_ NSUDO_STARTED_PROCESS& StartedProcess,
+    _In_ DWORD WaitInterval,
+    _Out_opt_ PDWORD lpExitCode,
+    _Out_opt_ PNSUDO_PROCESS_STATS Stats = nullptr);
+
+/**
+ * Duplicates the primary token of the specified user, and then adjusts the
+ * session, the privileges and the integrity level of the token in one pass.
+ *
+ * @param TokenCache The token cache.
+ * @param UserMode The user of the token.
+ * @param hCurrentProcessToken The token used by the CurrentProcess and
+ *                             CurrentProcessDropRight modes, which needs to
+ *                             be opened before impersonating.
+ * @param dwSessionID The session of the new process.
+ * @param Adjustments The adjustments of the token. The session in it is
+ *                    ignored, because it is decided by the user mode.
+ * @param phToken The created token.
+ * @return If the function fails, the return value is FALSE. To get extended
+ *         error information, call GetLastError.
+ * @remark The current thread must impersonate the SYSTEM user.
+ */
+BOOL NSudoCreateUserToken(
+    _In_ CNSudoTokenCache* TokenCache,
+    _In_ NSudoOptionUserValue UserMode,
+    _In_opt_ HANDLE hCurrentProcessToken,
+    _In_ DWORD dwSessionID,
+    _In_ const NSUDO_TOKEN_ADJUSTMENTS& Adjustments,
+    _Outptr_ PHANDLE phToken);
+
+/**
+ * Resolves a command line which starts with a document or a URL to the command
+ * line of its associated program. The executables and the targets which cannot
+ * be found are unchanged. The targets without an associated open command are
+ * launched via "cmd /c start".
+ *
+ * @param CommandLine The command line.
+ * @param lpCurrentDirectory The current directory of the new process, which is
+ *                           the only directory to search the relative target
+ *                           in. nullptr means the current directory of the
+ *                           caller.
+ * @return The resolved command line.
+ * @remark It initializes COM on the calling thread to query the associations,
+ *         so it is only used by the GUI and the context menu.
+ */
+std::wstring NSudoResolveCommandLine(
+    _In_ const std::wstring& CommandLine,
+    _In_opt_ LPCWSTR lpCurrentDirectory);
+
+/**
+ * Creates a new process and its primary thread. If the wait interval is not
+ * zero, the function waits for the new process and all child processes created
+ * by it.
+ *
+ * @param hToken The primary token of the new process. It is ignored if
+ *               Options.ParentProcess is specified.
+ * @param lpCommandLine The command line. The environment variables in it are
+ *                      expanded.
+ * @param lpCurrentDirectory The current directory of the new process.
+ * @param WaitInterval The milliseconds to wait for the process tree.
+ * @param Options The options of the new process.
+ * @param lpExitCode The exit code of the new process.
+ * @param StartedProcess If it is specified, the function returns right after
+ *                       the new process is resumed, and the caller needs to
+ *                       call NSudoWaitStartedProcess or
+ *                       NSudoCloseStartedProcess.
+ * @param Stats The resource usage of the new process after the wait ends.
+ * @return If the function fails, the return value is false. To get extended
+ *         error information, call GetLastError.
+ */
+bool NSudoCreateProcess(
+    _In_opt_ HANDLE hToken,
+    _In_ LPCWSTR lpCommandLine,
+    _In_opt_ LPCWSTR lpCurrentDirectory,
+    _In_ DWORD WaitInterval,
+    _In_ const NSUDO_CREATE_PROCESS_OPTIONS& Options,
+    _Out_opt_ PDWORD lpExitCode = nullptr,
+    _Out_opt_ PNSUDO_STARTED_PROCESS StartedProcess = nullptr,
+    _Out_opt_ PNSUDO_PROCESS_STATS Stats = nullptr);
+
+#endif // _NSUDO_CORE_
@@ -0,0 +1,39 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoTraceLogging.cpp
+ * PURPOSE:   Implementation for the NSudo TraceLogging provider
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include "NSudoTraceLogging.h"
+
+// {0A1B9E5D-3C4F-4E7B-8D2A-6F5E1C9B7A34}
+TRACELOGGING_DEFINE_PROVIDER(
+    g_NSudoTraceLoggingProvider,
+    "M2-Team.NSudo",
+    (0x0a1b9e5d, 0x3c4f, 0x4e7b, 0x8d, 0x2a, 0x6f, 0x5e, 0x1c, 0x9b, 0x7a, 0x34));
+
+/**
+ * Registers the TraceLogging provider of NSudo.
+ *
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark The events are written only when a session is listening, so the
+ *         provider can stay registered in the release builds.
+ */
+HRESULT NSudoTraceLoggingRegister()
+{
+    return TraceLoggingRegister(g_NSudoTraceLoggingProvider);
+}
+
+/**
+ * Unregisters the TraceLogging provider of NSudo.
+ */
+void NSudoTraceLoggingUnregister()
+{
+    TraceLoggingUnregister(g_NSudoTraceLoggingProvider);
+}
@@ -0,0 +1,171 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoTraceLogging.h
+ * PURPOSE:   Definition for the NSudo TraceLogging provider
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_TRACE_LOGGING_
+#define _NSUDO_TRACE_LOGGING_
+
+#include <Windows.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+#include "M2BaseHelpers.h"
+
+/**
+ * The TraceLogging provider of NSudo, the name is "M2-Team.NSudo" and the
+ * GUID is {0A1B9E5D-3C4F-4E7B-8D2A-6F5E1C9B7A34}.
+ */
+TRACELOGGING_DECLARE_PROVIDER(g_NSudoTraceLoggingProvider);
+
+/**
+ * Registers the TraceLogging provider of NSudo.
+ *
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark The events are written only when a session is listening, so the
+ *         provider can stay registered in the release builds.
+ */
+HRESULT NSudoTraceLoggingRegister();
+
+/**
+ * Unregisters the TraceLogging provider of NSudo.
+ */
+void NSudoTraceLoggingUnregister();
+
+/**
+ * The activity which writes a start event when it is constructed and a stop
+ * event when it is destructed. The stop event carries the Win32 error code
+ * and the process ID if it is set.
+ */
+class CNSudoTraceActivity : M2::CDisableObjectCopying
+{
+private:
+    LPCSTR m_Name;
+    bool m_Enabled;
+    bool m_HasResult = false;
+    DWORD m_Error = ERROR_SUCCESS;
+    DWORD m_ProcessId = 0;
+    GUID m_ActivityId = { 0 };
+    GUID m_RelatedActivityId = { 0 };
+
+public:
+    /**
+     * Starts the activity.
+     *
+     * @param Name The name of the activity, it must be a static string.
+     */
+    CNSudoTraceActivity(
+        _In_ LPCSTR Name) :
+        m_Name(Name),
+        m_Enabled(TraceLoggingProviderEnabled(
+            g_NSudoTraceLoggingProvider,
+            WINEVENT_LEVEL_INFO,
+            0))
+    {
+        // 没有会话监听时不创建活动ID，使开销接近于零
+        if (!this->m_Enabled)
+        {
+            return;
+        }
+
+        DWORD LastError = GetLastError();
+
+        EventActivityIdControl(
+            EVENT_ACTIVITY_CTRL_CREATE_ID,
+            &this->m_ActivityId);
+
+        // 保存当前线程的活动ID作为父活动，使嵌套的活动可以关联
+        EventActivityIdControl(
+            EVENT_ACTIVITY_CTRL_GET_ID,
+            &this->m_RelatedActivityId);
+        EventActivityIdControl(
+            EVENT_ACTIVITY_CTRL_SET_ID,
+            &this->m_ActivityId);
+
+        TraceLoggingWriteActivity(
+            g_NSudoTraceLoggingProvider,
+            "Stage",
+            &this->m_ActivityId,
+            &this->m_RelatedActivityId,
+            TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+            TraceLoggingOpcode(WINEVENT_OPCODE_START),
+            TraceLoggingString(this->m_Name, "Name"));
+
+        SetLastError(LastError);
+    }
+
+    /**
+     * Stops the activity. If the result is not set, the activity is treated
+     * as failed with the last error of the calling thread, which covers the
+     * early returns of the error paths.
+     */
+    ~CNSudoTraceActivity()
+    {
+        if (!this->m_Enabled)
+        {
+            return;
+        }
+
+        DWORD LastError = GetLastError();
+
+        if (!this->m_HasResult)
+        {
+            this->SetResult(FALSE);
+        }
+
+        TraceLoggingWriteActivity(
+            g_NSudoTraceLoggingProvider,
+            "Stage",
+            &this->m_ActivityId,
+            nullptr,
+            TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+            TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+            TraceLoggingString(this->m_Name, "Name"),
+            TraceLoggingBool(ERROR_SUCCESS == this->m_Error, "Succeeded"),
+            TraceLoggingWinError(this->m_Error, "Error"),
+            TraceLoggingUInt32(this->m_ProcessId, "ProcessId"));
+
+        EventActivityIdControl(
+            EVENT_ACTIVITY_CTRL_SET_ID,
+            &this->m_RelatedActivityId);
+
+        SetLastError(LastError);
+    }
+
+    /**
+     * Sets the result of the activity.
+     *
+     * @param Succeeded Whether the activity succeeded. If it is false, the
+     *                  last error of the calling thread is recorded.
+     */
+    void SetResult(
+        _In_ BOOL Succeeded)
+    {
+        this->m_HasResult = true;
+        this->m_Error = Succeeded ? ERROR_SUCCESS : GetLastError();
+        if (!Succeeded && ERROR_SUCCESS == this->m_Error)
+        {
+            this->m_Error = ERROR_GEN_FAILURE;
+        }
+    }
+
+    /**
+     * Sets the ID of the process which is created in the activity.
+     *
+     * @param ProcessId The process ID.
+     */
+    void SetProcessId(
+        _In_ DWORD ProcessId)
+    {
+        this->m_ProcessId = ProcessId;
+    }
+};
+
+#endif // _NSUDO_TRACE_LOGGING_